@@ -25,12 +25,19 @@
 static const char *funcs[] = {
 	"put",
 	"get",
+	"mget",
 	"cursor_push",
 	"cursor_pop",
 	"cursor_append",
 	"node_alloc",
 	"node_new",
 	"clone_subnodes",
+	"node_slot",
+	"node_slot_search",
+	"node_add_subnode",
+	"node_del_subnode",
+	"node_resize",
+	"node_shrink",
 	"seek",
 	"first",
 	"last",
@@ -41,18 +48,38 @@ static const char *funcs[] = {
 	"cursor_append_sym",
 	"cursor_load_root",
 	"node_read",
+	"node_fnext_alloc",
+	"node_discard",
 	"node_free",
+	"node_reclaim",
+	"node_unlink",
+	"node_retire",
+	"node_replace",
+	"node_remove",
+	"node_obsolete",
 	"memnode",
 	"tr_reset",
 	"tr_free",
 	"rollback",
-	"node_to_buf",
+	"node_subnodes",
+	"node_write",
 	"node_calc_disksize",
+	"mark_dirty",
+	"subtree_write",
+	"commit_worker",
+	"commit_parallel",
 	"do_commit",
 	"commit",
 	"do_del",
 	"del",
 	"subnode",
+	"node_strip",
+	"merge_val",
+	"merge_link",
+	"merge_restore",
+	"merge",
+	"vacuum_load",
+	"vacuum",
 	NULL
 };
 
@@ -66,6 +93,8 @@ static const char *incs[] = {
 	"impl/tr.c",
 	"impl/del.c",
 	"impl/subnode.h",
+	"impl/merge.c",
+	"impl/vacuum.c",
 	NULL
 };
 
@@ -85,23 +114,24 @@ str2upper(const char *lower)
 }
 
 static void
-print_block(const char *name, int dbfile)
+print_block(const char *name, int dbfile, int ref32)
 {
 	size_t i;
 	const char *func;
 	char *func_upper;
+	char sfx[32];
 
-	printf("#define TKVDB_MEMNODE_TYPE tkvdb_memnode_%s%s\n",
-		name, dbfile ? "": "_nodb");
-	printf("#define TKVDB_MEMNODE_TYPE_COMMON tkvdb_memnode_%s%s_common\n",
-		name, dbfile ? "": "_nodb");
-	printf("#define TKVDB_MEMNODE_TYPE_LEAF tkvdb_memnode_%s%s_leaf\n",
-		name, dbfile ? "": "_nodb");
+	snprintf(sfx, sizeof(sfx), "%s%s%s", name, dbfile ? "": "_nodb",
+		ref32 ? "_ref32" : "");
+
+	printf("#define TKVDB_MEMNODE_TYPE tkvdb_memnode_%s\n", sfx);
+	printf("#define TKVDB_MEMNODE_TYPE_COMMON tkvdb_memnode_%s_common\n",
+		sfx);
 	for (i=0; funcs[i]; i++) {
 		func = funcs[i];
 		func_upper = str2upper(func);
-		printf("#define TKVDB_IMPL_%s tkvdb_%s_%s%s\n",
-			func_upper, func, name, dbfile ? "": "_nodb");
+		printf("#define TKVDB_IMPL_%s tkvdb_%s_%s\n",
+			func_upper, func, sfx);
 		free(func_upper);
 	}
 
@@ -111,6 +141,9 @@ print_block(const char *name, int dbfile)
 	if (!dbfile) {
 		printf("\n#define TKVDB_PARAMS_NODBFILE\n\n");
 	}
+	if (ref32) {
+		printf("\n#define TKVDB_PARAMS_REF32\n\n");
+	}
 
 	for (i=0; incs[i]; i++) {
 		printf("#include \"%s\"\n", incs[i]);
@@ -121,17 +154,14 @@ print_block(const char *name, int dbfile)
 	printf("#define TKVDB_TRIGGER\n");
 
 	printf("#undef TKVDB_IMPL_PUT\n");
-	printf("#define TKVDB_IMPL_PUT tkvdb_put_%s%sx\n",
-		name, dbfile ? "": "_nodb");
+	printf("#define TKVDB_IMPL_PUT tkvdb_put_%sx\n", sfx);
 	printf("#include \"impl/put.c\"\n");
 
 	printf("#undef TKVDB_IMPL_DEL\n");
 	printf("#undef TKVDB_IMPL_DO_DEL\n");
 
-	printf("#define TKVDB_IMPL_DEL tkvdb_del_%s%sx\n",
-		name, dbfile ? "": "_nodb");
-	printf("#define TKVDB_IMPL_DO_DEL tkvdb_do_del_%s%sx\n",
-		name, dbfile ? "": "_nodb");
+	printf("#define TKVDB_IMPL_DEL tkvdb_del_%sx\n", sfx);
+	printf("#define TKVDB_IMPL_DO_DEL tkvdb_do_del_%sx\n", sfx);
 
 	printf("#include \"impl/del.c\"\n");
 
@@ -152,12 +182,26 @@ print_block(const char *name, int dbfile)
 	if (!dbfile) {
 		printf("\n#undef TKVDB_PARAMS_NODBFILE\n\n");
 	}
+	if (ref32) {
+		printf("\n#undef TKVDB_PARAMS_REF32\n\n");
+	}
+	printf("#undef TKVDB_REF\n");
+	printf("#undef TKVDB_REF_NODE\n");
+	printf("#undef TKVDB_NODE_REF\n");
+	printf("#undef TKVDB_NODE_VAL_PAD\n");
+	printf("#undef TKVDB_NODE_PVM_SIZE\n");
+	printf("#undef TKVDB_NODE_SUBNODES\n");
+	printf("#undef TKVDB_NODE_SYMS\n");
+	printf("#undef TKVDB_NODE_NEXT\n");
+	printf("#undef TKVDB_NODE_FNEXT\n");
+	printf("#undef TKVDB_FNEXT_SIZE\n");
+	printf("#undef TKVDB_SUBNODES_SIZE\n");
+	printf("#undef TKVDB_SUBNODE_LOAD\n");
 	printf("#undef TKVDB_SUBNODE_NEXT\n");
 	printf("#undef TKVDB_SUBNODE_SEARCH\n\n");
 
 	printf("#undef TKVDB_MEMNODE_TYPE\n");
-	printf("#undef TKVDB_MEMNODE_TYPE_COMMON\n");
-	printf("#undef TKVDB_MEMNODE_TYPE_LEAF\n\n\n");
+	printf("#undef TKVDB_MEMNODE_TYPE_COMMON\n\n\n");
 }
 
 int
@@ -171,12 +215,16 @@ main(int argc, char *argv[])
 		" * PLEASE DON'T EDIT THIS FILE DIRECTLY\n */\n",
 		argv[0],
 		ctime(&curr_time));
-	print_block("alignval", 1);
-	print_block("generic", 1);
+	print_block("alignval", 1, 0);
+	print_block("generic", 1, 0);
 
 	/* RAM-only database, without underlying file */
-	print_block("alignval", 0);
-	print_block("generic", 0);
+	print_block("alignval", 0, 0);
+	print_block("generic", 0, 0);
+
+	/* RAM-only, nodes in preallocated buffer, 32-bit references */
+	print_block("alignval", 0, 1);
+	print_block("generic", 0, 1);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,332 @@
+/* calculate words frequency using many threads */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <locale.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "tkvdb.h"
+
+#define MAX_THREADS 256
+
+static int nthreads = 4;
+static int lower = 0;
+
+/* part of text and words counted by one thread */
+struct part
+{
+	const char *text;
+	size_t size;
+
+	tkvdb_tr *tr;
+	/* transaction merged to 'tr' */
+	tkvdb_tr *merge;
+
+	int ok;
+};
+
+/* counters are summed on merge */
+static TKVDB_RES
+sum(tkvdb_datum *val, const tkvdb_datum *src_val, void *userdata)
+{
+	uint64_t a, b;
+
+	(void)userdata;
+
+	memcpy(&a, val->data, sizeof(uint64_t));
+	memcpy(&b, src_val->data, sizeof(uint64_t));
+	a += b;
+	memcpy(val->data, &a, sizeof(uint64_t));
+
+	return TKVDB_OK;
+}
+
+static int
+add_word(tkvdb_tr *tr, wchar_t *word, size_t wordlen)
+{
+	TKVDB_RES rc;
+	tkvdb_datum dtk, dtv, one;
+	uint64_t one64 = 1;
+
+	/* append zero terminator */
+	word[wordlen] = L'\0';
+
+	dtk.data = word;
+	dtk.size = (wordlen + 1) * sizeof(wchar_t);
+
+	rc = tr->get(tr, &dtk, &dtv);
+	if (rc == TKVDB_OK) {
+		/* found, increment words counter */
+		memcpy(&one64, dtv.data, sizeof(uint64_t));
+		one64++;
+		memcpy(dtv.data, &one64, sizeof(uint64_t));
+		return 1;
+	} else if ((rc != TKVDB_NOT_FOUND) && (rc != TKVDB_EMPTY)) {
+		fprintf(stderr, "get() failed with code %d\n", rc);
+		return 0;
+	}
+
+	one.data = &one64;
+	one.size = sizeof(one64);
+
+	rc = tr->put(tr, &dtk, &one);
+	if (rc != TKVDB_OK) {
+		fprintf(stderr, "put() failed with code %d\n", rc);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* count words in part of text */
+static void *
+count_words(void *arg)
+{
+	struct part *p = arg;
+	wchar_t word[256];
+	size_t wordlen = 0, pos = 0, n;
+	mbstate_t mbs;
+
+	memset(&mbs, 0, sizeof(mbs));
+
+	for (;;) {
+		wchar_t sym;
+		int addword = 0, end = 0;
+
+		if (pos >= p->size) {
+			end = 1;
+			sym = L' ';
+		} else {
+			n = mbrtowc(&sym, p->text + pos, p->size - pos, &mbs);
+			if ((n == (size_t)-1) || (n == (size_t)-2)) {
+				/* invalid character, try to recover */
+				memset(&mbs, 0, sizeof(mbs));
+				pos++;
+				continue;
+			}
+			pos += (n == 0) ? 1 : n;
+		}
+
+		if (iswspace(sym) || iswpunct(sym) || (sym == L'\0')) {
+			if (wordlen) {
+				addword = 1;
+			}
+		} else {
+			word[wordlen] = lower ? (wchar_t)towlower(sym) : sym;
+			wordlen++;
+
+			if (wordlen >= (sizeof(word) / sizeof(wchar_t) - 1)) {
+				/* word is too big, add it */
+				addword = 1;
+			}
+		}
+
+		if (addword) {
+			if (!add_word(p->tr, word, wordlen)) {
+				return NULL;
+			}
+			wordlen = 0;
+		}
+
+		if (end) {
+			break;
+		}
+	}
+
+	p->ok = 1;
+	return NULL;
+}
+
+/* merge transaction of other thread */
+static void *
+merge_words(void *arg)
+{
+	struct part *p = arg;
+	TKVDB_RES rc;
+
+	rc = tkvdb_tr_merge(p->tr, p->merge, &sum, NULL);
+	if (rc != TKVDB_OK) {
+		fprintf(stderr, "tkvdb_tr_merge() failed with code %d\n", rc);
+		p->ok = 0;
+	}
+
+	return NULL;
+}
+
+/* read whole stdin */
+static char *
+read_input(size_t *size)
+{
+	char *buf = NULL, *tmp;
+	size_t allocated = 0, n;
+
+	*size = 0;
+	for (;;) {
+		if ((allocated - *size) < 4096) {
+			allocated = allocated * 2 + 4096;
+			tmp = realloc(buf, allocated);
+			if (!tmp) {
+				free(buf);
+				return NULL;
+			}
+			buf = tmp;
+		}
+
+		n = fread(buf + *size, 1, allocated - *size, stdin);
+		if (n == 0) {
+			break;
+		}
+		*size += n;
+	}
+
+	return buf;
+}
+
+static void
+print_usage(char *progname)
+{
+	fprintf(stderr, "Usage:\n %s [-l] [-t threads] < file.txt\n",
+		progname);
+	fprintf(stderr, " %s -h\n", progname);
+	fprintf(stderr, "    -l - convert letters to lowercase\n");
+	fprintf(stderr, "    threads - number of threads (default %d)\n",
+		nthreads);
+	fprintf(stderr, "    -h - print this message\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct part parts[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	tkvdb_params *params;
+	tkvdb_cursor *c;
+	TKVDB_RES rc;
+	char *text;
+	size_t size, start, end;
+	int i, step, opt, ret = EXIT_FAILURE;
+
+	while ((opt = getopt(argc, argv, "hlt:")) != -1) {
+		switch (opt) {
+			case 'l':
+				lower = 1;
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+
+			case 'h':
+			default:
+				print_usage(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if ((nthreads < 1) || (nthreads > MAX_THREADS)) {
+		print_usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	setlocale(LC_ALL, "");
+
+	text = read_input(&size);
+	if (!text) {
+		fprintf(stderr, "Can't read input: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* each thread has its own transaction, so no locks are needed */
+	params = tkvdb_params_create();
+	if (!params) {
+		fprintf(stderr, "Can't create transaction parameters\n");
+		free(text);
+		return EXIT_FAILURE;
+	}
+	/* nodes are moved between transactions on merge */
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 1);
+	tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, sizeof(uint64_t));
+
+	/* split text on whitespace (it never occurs inside of multibyte
+	   character) */
+	start = 0;
+	for (i=0; i<nthreads; i++) {
+		end = (i == (nthreads - 1)) ? size : size / nthreads * (i + 1);
+		if (end < start) {
+			end = start;
+		}
+		while ((end < size) && (text[end] != ' ')
+			&& (text[end] != '\n')) {
+			end++;
+		}
+
+		parts[i].text = text + start;
+		parts[i].size = end - start;
+		parts[i].ok = 0;
+		parts[i].tr = tkvdb_tr_create(NULL, params);
+		if (!parts[i].tr) {
+			fprintf(stderr, "Can't create transaction\n");
+			return EXIT_FAILURE;
+		}
+		parts[i].tr->begin(parts[i].tr);
+
+		start = end;
+	}
+	tkvdb_params_free(params);
+
+	for (i=0; i<nthreads; i++) {
+		pthread_create(&threads[i], NULL, &count_words, &parts[i]);
+	}
+	for (i=0; i<nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		if (!parts[i].ok) {
+			fprintf(stderr, "Aborting\n");
+			goto done;
+		}
+	}
+
+	/* merge pairs of transactions in parallel until one is left */
+	for (step=1; step<nthreads; step*=2) {
+		for (i=0; (i + step)<nthreads; i+=step*2) {
+			parts[i].merge = parts[i + step].tr;
+			pthread_create(&threads[i], NULL, &merge_words,
+				&parts[i]);
+		}
+		for (i=0; (i + step)<nthreads; i+=step*2) {
+			pthread_join(threads[i], NULL);
+			if (!parts[i].ok) {
+				fprintf(stderr, "Aborting\n");
+				goto done;
+			}
+		}
+	}
+
+	/* now iterate over merged key-value pairs using cursor */
+	c = tkvdb_cursor_create(parts[0].tr);
+	if (!c) {
+		fprintf(stderr, "Can't create cursor\n");
+		goto done;
+	}
+
+	for (rc = c->first(c); rc == TKVDB_OK; rc = c->next(c)) {
+		uint64_t cnt;
+
+		memcpy(&cnt, c->val(c), sizeof(uint64_t));
+		printf("%10"PRIu64"  %ls\n", cnt, (wchar_t *)c->key(c));
+	}
+	c->free(c);
+
+	ret = EXIT_SUCCESS;
+
+done:
+	for (i=0; i<nthreads; i++) {
+		parts[i].tr->free(parts[i].tr);
+	}
+	free(text);
+
+	return ret;
+}
@@ -62,21 +62,20 @@ add_word(tkvdb_tr *tr, tkvdb_datum *dtk)
 	}
 
 	if (rc == TKVDB_OK) {
-		/* found, increment words counter */
-		uint64_t *nwords;
-
-		nwords = (uint64_t *)dtv.data;
-		(*nwords)++;
-		return 1;
-
+		/* found, increment words counter and put it back
+		 * (value of the same size is updated in place) */
+		memcpy(&one64, dtv.data, sizeof(uint64_t));
+		one64++;
 	} else if ((rc != TKVDB_NOT_FOUND) && (rc != TKVDB_EMPTY)) {
 		fprintf(stderr, "get() failed with code %d\n", rc);
 		return 0;
-	}
-
-	/* not found, try to add new word */
-	if (verbose > 1) {
-		fprintf(stderr, "Adding word '%ls'\n", (wchar_t *)dtk->data);
+	} else {
+		/* not found, try to add new word */
+		if (verbose > 1) {
+			fprintf(stderr, "Adding word '%ls'\n",
+				(wchar_t *)dtk->data);
+		}
+		nwords_db++;
 	}
 
 	rc = tr->put(tr, dtk, &one);
@@ -101,15 +100,61 @@ add_word(tkvdb_tr *tr, tkvdb_datum *dtk)
 		return 0;
 	}
 
-	nwords_db++;
 	return 1;
 }
 
+/* the same with asynchronous commit, full buffer is written to disk in
+ * background */
+static int
+add_word_async(tkvdb_async *a, tkvdb_datum *dtk)
+{
+	TKVDB_RES rc;
+	tkvdb_datum dtv, one;
+	uint64_t one64 = 1;
+
+	one.data = &one64;
+	one.size = sizeof(one64);
+
+	nwords_total++;
+
+	/* words from buffer which is being written are found too */
+	rc = tkvdb_async_get(a, dtk, &dtv);
+	if (rc == TKVDB_OK) {
+		memcpy(&one64, dtv.data, sizeof(uint64_t));
+		one64++;
+	} else if (rc != TKVDB_NOT_FOUND) {
+		fprintf(stderr, "tkvdb_async_get() failed with code %d\n", rc);
+		return 0;
+	} else {
+		nwords_db++;
+	}
+
+	/* waits only if previous buffer is still being written */
+	rc = tkvdb_async_put(a, dtk, &one);
+	if (rc != TKVDB_OK) {
+		fprintf(stderr, "tkvdb_async_put() failed with code %d\n", rc);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* called from writer thread */
+static void
+async_done(TKVDB_RES rc, void *userdata)
+{
+	(void)userdata;
+
+	if (verbose) {
+		fprintf(stderr, "Buffer written to disk, code %d\n", rc);
+	}
+}
+
 static void
 print_usage(char *progname)
 {
 	fprintf(stderr,
-		"Usage:\n %s [-f db_file] [-l] [-s size] [-v verbosity] "
+		"Usage:\n %s [-a] [-f db_file] [-l] [-s size] [-v verbosity] "
 		"< file.txt\n",
 		progname);
 	fprintf(stderr, " %s -h\n", progname);
@@ -117,6 +162,7 @@ print_usage(char *progname)
 		db_file);
 	fprintf(stderr, "    size - size of transaction buffer (default %zu,"
 		" min %d)\n", trsize, MIN_TR_SIZE);
+	fprintf(stderr, "    -a - asynchronous commit\n");
 	fprintf(stderr, "    -l - convert letters to lowercase\n");
 	fprintf(stderr, "    verbosity - level of debug messages"
 		" (default %d)\n", verbose);
@@ -131,13 +177,17 @@ main(int argc, char *argv[])
 	TKVDB_RES rc;
 	tkvdb_params *params;
 	tkvdb_cursor *c;
+	tkvdb_async *a = NULL;
 
 	wchar_t word[256];
 	size_t wordlen = 0;
-	int lower = 0, opt;
+	int lower = 0, async = 0, opt;
 
-	while ((opt = getopt(argc, argv, "f:hls:v:")) != -1) {
+	while ((opt = getopt(argc, argv, "af:hls:v:")) != -1) {
 		switch (opt) {
+			case 'a':
+				async = 1;
+				break;
 			case 'f':
 				db_file = optarg;
 				break;
@@ -182,6 +232,18 @@ main(int argc, char *argv[])
 	/* align values */
 	tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, sizeof(uint64_t));
 
+	if (async) {
+		/* two buffers of 'trsize', one is filled while other
+		 * is written */
+		a = tkvdb_async_open(db_file, params, &async_done, NULL);
+		if (!a) {
+			fprintf(stderr, "Can't open db file '%s': %s\n",
+				db_file, strerror(errno));
+			tkvdb_params_free(params);
+			return EXIT_FAILURE;
+		}
+	}
+
 	/* open database */
 	db = tkvdb_open(db_file, params);
 	tkvdb_params_free(params);
@@ -243,7 +305,7 @@ main(int argc, char *argv[])
 			dtk.data = word;
 			dtk.size = (wordlen + 1) * sizeof(wchar_t);
 
-			if (!add_word(tr, &dtk)) {
+			if (a ? !add_word_async(a, &dtk) : !add_word(tr, &dtk)) {
 				fprintf(stderr, "Aborting\n");
 				return EXIT_FAILURE;
 			}
@@ -262,7 +324,14 @@ main(int argc, char *argv[])
 		}
 	}
 
-	rc = tr->commit(tr);
+	if (a) {
+		/* write rest of words and wait */
+		rc = tkvdb_async_close(a);
+		/* transaction was started on empty file */
+		tr->rollback(tr);
+	} else {
+		rc = tr->commit(tr);
+	}
 	if (rc != TKVDB_OK) {
 		fprintf(stderr, "commit() failed with code %d\n", rc);
 
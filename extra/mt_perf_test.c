@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tkvdb.h"
+
+/* scaling of concurrent transaction (TKVDB_PARAM_TR_CONCURRENT) */
+
+/* total number of keys */
+static size_t nkeys = 4000000;
+/* benchmark with 1 .. maxthreads threads */
+static size_t maxthreads = 8;
+
+struct thread_arg
+{
+	tkvdb_tr *tr;
+	size_t id;
+	size_t nthreads;
+	int get;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* random 8-byte key for item i */
+static uint64_t
+mkkey(size_t i)
+{
+	uint64_t x = i + 1;
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+
+	return x;
+}
+
+static void *
+worker(void *p)
+{
+	struct thread_arg *arg = p;
+	tkvdb_datum dtk, dtv;
+	uint64_t key;
+	size_t i;
+
+	dtk.data = &key;
+	dtk.size = sizeof(key);
+
+	/* each thread works with every nthreads-th key */
+	for (i=arg->id; i<nkeys; i+=arg->nthreads) {
+		key = mkkey(i);
+		if (arg->get) {
+			assert(arg->tr->get(arg->tr, &dtk, &dtv) == TKVDB_OK);
+		} else {
+			dtv.data = &i;
+			dtv.size = sizeof(i);
+			assert(arg->tr->put(arg->tr, &dtk, &dtv) == TKVDB_OK);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+run(size_t nthreads, int concurrent, double *puts, double *gets)
+{
+	tkvdb_params *params;
+	tkvdb_tr *tr;
+	pthread_t *threads;
+	struct thread_arg *args;
+	double start;
+	size_t i;
+	int get;
+
+	params = tkvdb_params_create();
+	assert(params);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_CONCURRENT, concurrent);
+	tr = tkvdb_tr_create(NULL, params);
+	assert(tr);
+	tkvdb_params_free(params);
+	assert(tr->begin(tr) == TKVDB_OK);
+
+	threads = malloc(nthreads * sizeof(pthread_t));
+	args = malloc(nthreads * sizeof(struct thread_arg));
+	assert(threads && args);
+
+	for (get=0; get<=1; get++) {
+		start = now();
+		for (i=0; i<nthreads; i++) {
+			args[i].tr = tr;
+			args[i].id = i;
+			args[i].nthreads = nthreads;
+			args[i].get = get;
+			assert(pthread_create(&threads[i], NULL, &worker,
+				&args[i]) == 0);
+		}
+		for (i=0; i<nthreads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+
+		if (get) {
+			*gets = (double)nkeys / (now() - start);
+		} else {
+			*puts = (double)nkeys / (now() - start);
+		}
+	}
+
+	free(args);
+	free(threads);
+	tr->free(tr);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n;
+	double puts, gets;
+
+	if (argc > 1) {
+		maxthreads = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nkeys = atoi(argv[2]);
+	}
+
+	printf("# threads, puts per second, gets per second\n");
+
+	/* baseline: one thread, no locks */
+	run(1, 0, &puts, &gets);
+	printf("# single-threaded transaction: %f, %f\n", puts, gets);
+
+	for (n=1; n<=maxthreads; n++) {
+		run(n, 1, &puts, &gets);
+		printf("%lu, %f, %f\n", n, puts, gets);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -4,6 +4,7 @@
 #include <alloca.h>
 #include <time.h>
 #include <signal.h>
+#include <string.h>
 
 #include "tkvdb.h"
 
@@ -19,6 +20,9 @@ static size_t step = 10000;
 /* number of read iterations  */
 size_t nreads = 500;
 
+/* keys looked up by one mget() call */
+#define MGET_BATCH 256
+
 static void
 ctrl_c_handler(int s)
 {
@@ -103,8 +107,311 @@ lookups_per_sec(size_t keylen, size_t keys, size_t niters,
 	tr->free(tr);
 }
 
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* point lookups of existing keys in random order with get() and mget(),
+ * trie should be much larger than CPU caches */
+static void
+mget_per_sec(size_t keys)
+{
+	tkvdb_params *params;
+	tkvdb_datum dtk[MGET_BATCH], dtv[MGET_BATCH];
+	TKVDB_RES res[MGET_BATCH];
+	tkvdb_tr *tr;
+	uint64_t *data, *order;
+	size_t i, j, nfound;
+	double tm_get, tm_mget, start;
+
+	data = malloc(keys * sizeof(uint64_t));
+	order = malloc(keys * sizeof(uint64_t));
+	assert(data && order);
+
+	for (i=0; i<keys; i++) {
+		data[i] = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 16)
+			^ rand();
+	}
+
+	params = tkvdb_params_create();
+	assert(params);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 0);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, trsize);
+	tr = tkvdb_tr_create(NULL, params);
+	assert(tr);
+	tkvdb_params_free(params);
+
+	assert(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<keys; i++) {
+		dtk[0].data = &data[i];
+		dtk[0].size = sizeof(uint64_t);
+		assert(tr->put(tr, &dtk[0], &dtk[0]) == TKVDB_OK);
+	}
+
+	/* lookup order */
+	for (i=0; i<keys; i++) {
+		order[i] = data[(size_t)rand() % keys];
+	}
+
+	nfound = 0;
+	start = now();
+	for (i=0; i<keys; i++) {
+		dtk[0].data = &order[i];
+		dtk[0].size = sizeof(uint64_t);
+		if (tr->get(tr, &dtk[0], &dtv[0]) == TKVDB_OK) {
+			nfound++;
+		}
+	}
+	tm_get = now() - start;
+	assert(nfound == keys);
+
+	nfound = 0;
+	start = now();
+	for (i=0; i<keys; i+=MGET_BATCH) {
+		size_t n = (keys - i) < MGET_BATCH ? (keys - i) : MGET_BATCH;
+
+		for (j=0; j<n; j++) {
+			dtk[j].data = &order[i + j];
+			dtk[j].size = sizeof(uint64_t);
+		}
+		tr->mget(tr, dtk, dtv, res, n);
+		for (j=0; j<n; j++) {
+			if (res[j] == TKVDB_OK) {
+				nfound++;
+			}
+		}
+	}
+	tm_mget = now() - start;
+	assert(nfound == keys);
+
+	printf("%lu keys, %lu bytes, get(): %f, mget(): %f lookups/sec\n",
+		(unsigned long)keys, (unsigned long)tr->mem(tr),
+		(double)keys / tm_get, (double)keys / tm_mget);
+
+	tr->free(tr);
+	free(order);
+	free(data);
+}
+
+/* bytes written to disk per key with one-key commits, database file only
+ * and with write-ahead log */
+static void
+wal_bytes_per_key(size_t keys)
+{
+	const char fn[] = "perf_test_wal.tkv";
+	const char wal_fn[] = "perf_test_wal.tkv-wal";
+	const size_t limits[] = {0, 1024 * 1024};
+	tkvdb_params *params;
+	tkvdb_datum dtk;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	uint64_t key, db_bytes, wal_bytes;
+	size_t i, l;
+	double start, tm;
+
+	for (l=0; l<sizeof(limits) / sizeof(limits[0]); l++) {
+		remove(fn);
+		remove(wal_fn);
+
+		params = tkvdb_params_create();
+		assert(params);
+		tkvdb_param_set(params, TKVDB_PARAM_WAL_LIMIT, limits[l]);
+		db = tkvdb_open(fn, params);
+		assert(db);
+		tr = tkvdb_tr_create(db, params);
+		assert(tr);
+		tkvdb_params_free(params);
+
+		start = now();
+		for (i=0; i<keys; i++) {
+			key = ((uint64_t)rand() << 33)
+				^ ((uint64_t)rand() << 16) ^ rand();
+			dtk.data = &key;
+			dtk.size = sizeof(key);
+			assert(tr->begin(tr) == TKVDB_OK);
+			assert(tr->put(tr, &dtk, &dtk) == TKVDB_OK);
+			assert(tr->commit(tr) == TKVDB_OK);
+		}
+		tm = now() - start;
+
+		tkvdb_write_info(db, &db_bytes, &wal_bytes);
+		printf("wal limit %lu: %lu keys, %f bytes/key "
+			"(database %f, log %f), %f commits/sec\n",
+			(unsigned long)limits[l], (unsigned long)keys,
+			(double)(db_bytes + wal_bytes) / keys,
+			(double)db_bytes / keys, (double)wal_bytes / keys,
+			(double)keys / tm);
+
+		tr->free(tr);
+		tkvdb_close(db);
+	}
+
+	remove(fn);
+	remove(wal_fn);
+}
+
+/* file size and random lookups in database file with and without
+ * compression, values are compressible text. 'frames' and 'cache' are
+ * sizes of frame cache and nodes cache (0 - default) */
+static void
+compress_ratio(size_t keys, size_t frames, size_t cache)
+{
+	const char fn[] = "perf_test_compress.tkv";
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	uint64_t key, db_bytes, wal_bytes;
+	char val[128];
+	size_t i, nfound;
+	int compress;
+	double start, tm;
+
+	for (compress=0; compress<=1; compress++) {
+		remove(fn);
+
+		params = tkvdb_params_create();
+		assert(params);
+		tkvdb_param_set(params, TKVDB_PARAM_COMPRESS, compress);
+		if (frames > 0) {
+			tkvdb_param_set(params, TKVDB_PARAM_FRAME_CACHE,
+				frames);
+		}
+		tkvdb_param_set(params, TKVDB_PARAM_CACHE_SIZE, cache);
+		db = tkvdb_open(fn, params);
+		assert(db);
+		tr = tkvdb_tr_create(db, params);
+		assert(tr);
+
+		srand(1);
+		start = now();
+		assert(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<keys; i++) {
+			key = ((uint64_t)rand() << 33)
+				^ ((uint64_t)rand() << 16) ^ rand();
+			dtk.data = &key;
+			dtk.size = sizeof(key);
+			dtv.data = val;
+			dtv.size = sprintf(val, "{\"id\": %lu, \"name\": "
+				"\"user%lu\", \"status\": \"active\", "
+				"\"score\": %d}", (unsigned long)i,
+				(unsigned long)i, rand() % 100);
+			assert(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			if ((i % 10000) == 9999) {
+				assert(tr->commit(tr) == TKVDB_OK);
+				assert(tr->begin(tr) == TKVDB_OK);
+			}
+		}
+		assert(tr->commit(tr) == TKVDB_OK);
+		tm = now() - start;
+
+		tkvdb_write_info(db, &db_bytes, &wal_bytes);
+		tr->free(tr);
+		tkvdb_close(db);
+
+		/* reopen, nodes are read from file */
+		db = tkvdb_open(fn, params);
+		assert(db);
+		tr = tkvdb_tr_create(db, params);
+		assert(tr);
+		tkvdb_params_free(params);
+
+		srand(1);
+		nfound = 0;
+		start = now();
+		assert(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<keys; i++) {
+			key = ((uint64_t)rand() << 33)
+				^ ((uint64_t)rand() << 16) ^ rand();
+			rand();
+			dtk.data = &key;
+			dtk.size = sizeof(key);
+			if (tr->get(tr, &dtk, &dtv) == TKVDB_OK) {
+				nfound++;
+			}
+			if ((i % 1000) == 999) {
+				/* don't keep loaded nodes */
+				tr->rollback(tr);
+				assert(tr->begin(tr) == TKVDB_OK);
+			}
+		}
+		tr->rollback(tr);
+		assert(nfound == keys);
+
+		printf("compress %d: %lu keys, %lu bytes written, "
+			"%f puts/sec, %f us/get\n", compress,
+			(unsigned long)keys, (unsigned long)db_bytes,
+			(double)keys / tm, (now() - start) * 1e6 / keys);
+
+		tr->free(tr);
+		tkvdb_close(db);
+	}
+
+	remove(fn);
+}
+
+/* time of one large commit to new database file with 1, 2, 4, ... up to
+ * 'maxthreads' commit threads (TKVDB_PARAM_COMMIT_THREADS) */
+static void
+commit_per_threads(size_t keys, size_t maxthreads)
+{
+	const char fn[] = "perf_test_commit.tkv";
+	tkvdb_params *params;
+	tkvdb_datum dtk;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	uint64_t key, db_bytes, wal_bytes;
+	size_t i, threads;
+	double start, tm;
+
+	for (threads=1; threads<=maxthreads; threads*=2) {
+		remove(fn);
+
+		params = tkvdb_params_create();
+		assert(params);
+		tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 1);
+		tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, trsize);
+		tkvdb_param_set(params, TKVDB_PARAM_COMMIT_THREADS, threads);
+		db = tkvdb_open(fn, params);
+		assert(db);
+		tr = tkvdb_tr_create(db, params);
+		assert(tr);
+		tkvdb_params_free(params);
+
+		srand(1);
+		assert(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<keys; i++) {
+			key = ((uint64_t)rand() << 33)
+				^ ((uint64_t)rand() << 16) ^ rand();
+			dtk.data = &key;
+			dtk.size = sizeof(key);
+			assert(tr->put(tr, &dtk, &dtk) == TKVDB_OK);
+		}
+
+		start = now();
+		assert(tr->commit(tr) == TKVDB_OK);
+		tm = now() - start;
+
+		tkvdb_write_info(db, &db_bytes, &wal_bytes);
+		printf("commit threads %lu: %lu keys, %lu bytes, "
+			"%f sec, %f MB/sec\n", (unsigned long)threads,
+			(unsigned long)keys, (unsigned long)db_bytes, tm,
+			(double)db_bytes / tm / (1024 * 1024));
+
+		tr->free(tr);
+		tkvdb_close(db);
+	}
+
+	remove(fn);
+}
+
 int
-main()
+main(int argc, char *argv[])
 {
 	struct sigaction sig;
 
@@ -113,6 +420,26 @@ main()
 	sig.sa_flags = 0;
 	sigaction(SIGINT, &sig, NULL);
 
+	if ((argc > 1) && (strcmp(argv[1], "mget") == 0)) {
+		mget_per_sec((argc > 2) ? (size_t)atoll(argv[2]) : 10000000);
+		return EXIT_SUCCESS;
+	}
+	if ((argc > 1) && (strcmp(argv[1], "wal") == 0)) {
+		wal_bytes_per_key((argc > 2) ? (size_t)atoll(argv[2]) : 100000);
+		return EXIT_SUCCESS;
+	}
+	if ((argc > 1) && (strcmp(argv[1], "compress") == 0)) {
+		compress_ratio((argc > 2) ? (size_t)atoll(argv[2]) : 1000000,
+			(argc > 3) ? (size_t)atoll(argv[3]) : 0,
+			(argc > 4) ? (size_t)atoll(argv[4]) : 0);
+		return EXIT_SUCCESS;
+	}
+	if ((argc > 1) && (strcmp(argv[1], "commit") == 0)) {
+		commit_per_threads((argc > 2) ? (size_t)atoll(argv[2]) : 1000000,
+			(argc > 3) ? (size_t)atoll(argv[3]) : 8);
+		return EXIT_SUCCESS;
+	}
+
 	for (; nkeys<nitemsmax; nkeys+=step) {
 		double tm4_put, tm4_get, tm16_put, tm16_get;
 		lookups_per_sec(4, nkeys, nreads, &tm4_put, &tm4_get);
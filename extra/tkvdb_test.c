@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <search.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <ctype.h>
 #include <time.h>
@@ -646,182 +650,2833 @@ test_ram_mem(void)
 	TEST_CHECK(memram < memdb);
 }
 
-/* basic triggers test */
-struct basic_trigger_data
+/* deleted and replaced nodes are reused inside transaction */
+static void
+test_arena_reuse_tr(int dynalloc)
 {
-	size_t inserts;
-	size_t updates;
-};
+	tkvdb_params *params;
+	tkvdb_tr *tr;
+	int i, j;
+	char strkey[20];
+	size_t mem_first = 0;
 
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, dynalloc);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, 256 * 1024);
 
-static TKVDB_RES
-trigger_basic(tkvdb_trigger_info *info)
-{
-	struct basic_trigger_data *data = info->userdata;
+	tr = tkvdb_tr_create(NULL, params);
+	TEST_CHECK(tr != NULL);
+	tkvdb_params_free(params);
 
-	switch (info->type) {
-		case TKVDB_TRIGGER_UPDATE:
-			data->updates++;
-			break;
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
 
-		case TKVDB_TRIGGER_INSERT_NEWROOT:
-		case TKVDB_TRIGGER_INSERT_NEWNODE:
-		case TKVDB_TRIGGER_INSERT_SUBKEY:
-		case TKVDB_TRIGGER_INSERT_SHORTER:
-		case TKVDB_TRIGGER_INSERT_LONGER:
-		case TKVDB_TRIGGER_INSERT_SPLIT:
-			data->inserts++;
-			break;
-			break;
+	/* much more nodes than fits into limit are created and freed */
+	for (j=0; j<50; j++) {
+		for (i=0; i<1000; i++) {
+			tkvdb_datum key, val;
 
-		default:
-			break;
+			snprintf(strkey, sizeof(strkey), "%d", i);
+			key.data = strkey;
+			key.size = strlen(strkey);
+			val.data = strkey;
+			val.size = (j % 8) + 1;
+			TEST_CHECK(tr->put(tr, &key, &val) == TKVDB_OK);
+		}
+		for (i=0; i<1000; i+=2) {
+			tkvdb_datum key;
+
+			snprintf(strkey, sizeof(strkey), "%d", i);
+			key.data = strkey;
+			key.size = strlen(strkey);
+			TEST_CHECK(tr->del(tr, &key, 0) == TKVDB_OK);
+		}
+		if (j == 0) {
+			mem_first = tr->mem(tr);
+		}
 	}
 
-	return TKVDB_OK;
+	TEST_CHECK(tr->mem(tr) <= mem_first * 2);
+
+	/* everything is released on rollback */
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	TEST_CHECK(tr->mem(tr) == 0);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<1000; i++) {
+		tkvdb_datum key, val;
+
+		snprintf(strkey, sizeof(strkey), "%d", i);
+		key.data = strkey;
+		key.size = strlen(strkey);
+		val.data = &i;
+		val.size = sizeof(int);
+		TEST_CHECK(tr->put(tr, &key, &val) == TKVDB_OK);
+	}
+	for (i=0; i<1000; i++) {
+		tkvdb_datum key, val;
+
+		snprintf(strkey, sizeof(strkey), "%d", i);
+		key.data = strkey;
+		key.size = strlen(strkey);
+		TEST_CHECK(tr->get(tr, &key, &val) == TKVDB_OK);
+		TEST_CHECK(val.size == sizeof(int));
+		TEST_CHECK(memcmp(val.data, &i, sizeof(int)) == 0);
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
 }
 
-void
-test_triggers_basic(void)
+/* value bigger than the biggest class is freed after chunks have grown
+ * (chunk has room for it) */
+static void
+test_arena_huge(void)
 {
 	tkvdb_tr *tr;
-	int i;
-	tkvdb_triggers *trg;
-	struct basic_trigger_data userdata1, userdata2, userdata3;
-	TKVDB_RES r;
+	tkvdb_datum key, val;
+	char strkey[20], *big;
+	size_t big_size = 70000;
+	int i, j;
 
-	userdata1.inserts = userdata1.updates = 0;
-	userdata2.inserts = userdata2.updates = 0;
-	userdata3.inserts = userdata3.updates = 0;
+	big = malloc(big_size);
+	TEST_CHECK(big != NULL);
+	memset(big, 'h', big_size);
 
 	tr = tkvdb_tr_create(NULL, NULL);
 	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
 
-	trg = tkvdb_triggers_create(128);
-	TEST_CHECK(trg != NULL);
+	for (i=0; i<20000; i++) {
+		snprintf(strkey, sizeof(strkey), "%d", i);
+		key.data = strkey;
+		key.size = strlen(strkey);
+		val.data = &i;
+		val.size = sizeof(int);
+		TEST_CHECK(tr->put(tr, &key, &val) == TKVDB_OK);
+	}
 
-	r = tkvdb_triggers_add(trg, &trigger_basic, sizeof(uint64_t),
-		&userdata1);
-	TEST_CHECK(r == TKVDB_OK);
+	key.data = "big";
+	key.size = 3;
+	for (j=0; j<3; j++) {
+		/* replaced, then deleted */
+		val.data = big;
+		val.size = big_size - j;
+		TEST_CHECK(tr->put(tr, &key, &val) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->get(tr, &key, &val) == TKVDB_OK);
+	TEST_CHECK(val.size == big_size - 2);
+	TEST_CHECK(tr->del(tr, &key, 0) == TKVDB_OK);
+	TEST_CHECK(tr->get(tr, &key, &val) == TKVDB_NOT_FOUND);
 
-	r = tkvdb_triggers_add(trg, &trigger_basic, sizeof(uint64_t),
-		&userdata2);
-	TEST_CHECK(r == TKVDB_OK);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	tr->free(tr);
+	free(big);
+}
 
-	r = tkvdb_triggers_add(trg, &trigger_basic, sizeof(uint64_t),
-		&userdata3);
-	TEST_CHECK(r == TKVDB_OK);
+void
+test_arena(void)
+{
+	test_arena_reuse_tr(1);
+	test_arena_reuse_tr(0);
+	test_arena_huge();
+}
+
+/* RAM-only transaction with 32-bit references to nodes */
+static size_t
+test_ref32_tr(int dynalloc, int alignval)
+{
+	tkvdb_params *params;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	int i, n;
+	char strkey[20];
+	size_t mem;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, dynalloc);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, 64 * 1024 * 1024);
+	tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, alignval);
+
+	tr = tkvdb_tr_create(NULL, params);
+	TEST_CHECK(tr != NULL);
+	tkvdb_params_free(params);
 
 	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
 	for (i=0; i<N; i++) {
 		tkvdb_datum key, val;
 
-		key.data = kvs_unsorted[i].key;
-		key.size = kvs_unsorted[i].klen;
-		val.data = kvs_unsorted[i].val;
-		val.size = kvs_unsorted[i].vlen;
+		snprintf(strkey, sizeof(strkey), "%08d", i);
+		key.data = strkey;
+		key.size = strlen(strkey);
+		val.data = &i;
+		val.size = sizeof(int);
+		TEST_CHECK(tr->put(tr, &key, &val) == TKVDB_OK);
+	}
+	mem = tr->mem(tr);
 
-		/* 1 insert and 2 updates for each key */
-		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
+	/* delete every third key */
+	for (i=0; i<N; i+=3) {
+		tkvdb_datum key;
 
-		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
-		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
+		snprintf(strkey, sizeof(strkey), "%08d", i);
+		key.data = strkey;
+		key.size = strlen(strkey);
+		TEST_CHECK(tr->del(tr, &key, 0) == TKVDB_OK);
 	}
-	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
-	tr->free(tr);
-	tkvdb_triggers_free(trg);
-
-	TEST_CHECK(userdata1.inserts + userdata1.updates == (N + N * 2));
-	TEST_CHECK(userdata2.inserts + userdata2.updates == (N + N * 2));
-	TEST_CHECK(userdata3.inserts + userdata3.updates == (N + N * 2));
-	TEST_CHECK(userdata1.inserts == userdata2.inserts);
-	TEST_CHECK(userdata2.inserts == userdata3.inserts);
-}
 
+	for (i=0; i<N; i++) {
+		tkvdb_datum key, val;
+		TKVDB_RES r;
 
-static TKVDB_RES
-trigger_nth(tkvdb_trigger_info *info)
-{
-	size_t i;
+		snprintf(strkey, sizeof(strkey), "%08d", i);
+		key.data = strkey;
+		key.size = strlen(strkey);
+		r = tr->get(tr, &key, &val);
+		if ((i % 3) == 0) {
+			TEST_CHECK(r == TKVDB_NOT_FOUND);
+		} else {
+			TEST_CHECK(r == TKVDB_OK);
+			TEST_CHECK(memcmp(val.data, &i, sizeof(int)) == 0);
+		}
+	}
 
-	switch (info->type) {
-		case TKVDB_TRIGGER_UPDATE:
-			break;
-		case TKVDB_TRIGGER_INSERT_NEWROOT:
-			*((uint64_t *)info->newroot) = 1;
+	/* keys are sorted */
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	TEST_CHECK(c->first(c) == TKVDB_OK);
+	n = 0;
+	do {
+		i = n + 1 + n / 2;
+		snprintf(strkey, sizeof(strkey), "%08d", i);
+		TEST_CHECK(c->keysize(c) == strlen(strkey));
+		TEST_CHECK(memcmp(c->key(c), strkey, c->keysize(c)) == 0);
+		n++;
+	} while (c->next(c) == TKVDB_OK);
+	TEST_CHECK(n == (N - (N + 2) / 3));
+	c->free(c);
 
-			break;
-		case TKVDB_TRIGGER_INSERT_NEWNODE:
-			*((uint64_t *)info->subnode1) = 1;
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	tr->free(tr);
 
-			for (i=0; i<info->stack->size; i++) {
-				*((uint64_t *)info->stack->meta[i]) += 1;
-			}
+	return mem;
+}
 
-			break;
-		case TKVDB_TRIGGER_INSERT_SUBKEY:
-			*((uint64_t *)info->newroot) += 1;
+void
+test_ref32(void)
+{
+	size_t mem_ptr, mem_ref32;
 
-			for (i=0; i<info->stack->size; i++) {
-				*((uint64_t *)info->stack->meta[i]) += 1;
-			}
+	/* with dynamic allocation nodes are referenced by pointers */
+	mem_ptr = test_ref32_tr(1, 0);
+	mem_ref32 = test_ref32_tr(0, 0);
+	TEST_CHECK(mem_ref32 < mem_ptr);
 
-			break;
-		case TKVDB_TRIGGER_INSERT_SHORTER:
-			*((uint64_t *)info->newroot) =
-			*((uint64_t *)info->subnode1) + 1;
+	test_ref32_tr(0, VAL_ALIGNMENT);
+}
 
-			for (i=0; i<info->stack->size; i++) {
-				*((uint64_t *)info->stack->meta[i]) += 1;
-			}
+/* basic triggers test */
+struct basic_trigger_data
+{
+	size_t inserts;
+	size_t updates;
+};
 
-			break;
-		case TKVDB_TRIGGER_INSERT_LONGER:
-			*((uint64_t *)info->newroot) += 1;
-			*((uint64_t *)info->subnode1) = 1;
 
-			for (i=0; i<info->stack->size; i++) {
-				*((uint64_t *)info->stack->meta[i]) += 1;
-			}
+/* commit should write only changed nodes and their parents */
+void
+test_dirty_commit(void)
+{
+	const char fn[] = "dirty_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	struct stat st;
+	off_t size_full, size_ro, size_upd;
+	size_t i;
+	int n;
 
-			break;
-		case TKVDB_TRIGGER_INSERT_SPLIT:
-			*((uint64_t *)info->newroot) =
-				*((uint64_t *)info->subnode1) + 1;
-			*((uint64_t *)info->subnode2) = 1;
+	remove(fn);
 
-			for (i=0; i<info->stack->size; i++) {
-				*((uint64_t *)info->stack->meta[i]) += 1;
-			}
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
 
-			break;
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum dtk, dtv;
 
-		case TKVDB_TRIGGER_DELETE_ROOT:
-			break;
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		dtv.data = kvs[i].val;
+		dtv.size = kvs[i].vlen;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st) == 0);
+	size_full = st.st_size;
 
-		case TKVDB_TRIGGER_DELETE_PREFIX:
-			break;
+	/* read all keys and commit, file should not grow */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	n = 0;
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			n++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+	TEST_CHECK(n == N);
+	c->free(c);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st) == 0);
+	size_ro = st.st_size;
+	TEST_CHECK(size_ro == size_full);
 
-		case TKVDB_TRIGGER_DELETE_LEAF:
-			for (i=0; i<(info->stack->size - 1); i++) {
-				*((uint64_t *)info->stack->meta[i]) -= 1;
-			}
-			break;
+	/* update one value in place */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum dtk, dtv;
 
-		case TKVDB_TRIGGER_DELETE_INTNODE:
-			for (i=0; i<info->stack->size; i++) {
-				*((uint64_t *)info->stack->meta[i]) -= 1;
-			}
-			break;
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	{
+		tkvdb_datum dtk, dtv;
+		char newval[VLEN];
+
+		memcpy(newval, kvs[0].val, kvs[0].vlen);
+		newval[0] ^= 1;
+		dtk.data = kvs[0].key;
+		dtk.size = kvs[0].klen;
+		dtv.data = newval;
+		dtv.size = kvs[0].vlen;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	TEST_CHECK(stat(fn, &st) == 0);
+	size_upd = st.st_size;
+	TEST_CHECK(size_upd > size_ro);
+	TEST_CHECK((size_upd - size_ro) < (size_full / 10));
 
-		default:
-			break;
+	/* check data */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum dtk, dtv;
+
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.size == kvs[i].vlen);
+		if (i == 0) {
+			TEST_CHECK(((char *)dtv.data)[0]
+				== (kvs[i].val[0] ^ 1));
+			TEST_CHECK(memcmp((char *)dtv.data + 1,
+				kvs[i].val + 1, dtv.size - 1) == 0);
+		} else {
+			TEST_CHECK(memcmp(dtv.data, kvs[i].val,
+				dtv.size) == 0);
+		}
 	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
 
-	return TKVDB_OK;
+	tr->free(tr);
+	tkvdb_close(db);
+	remove(fn);
 }
 
-#define TKVDB_TRG_GET_NTH_REALLOC_KEY(K, LEN, A)                      \
+/* key of test_disk_subnodes(): symbol 'b' of root and rest of key */
+static void
+disk_subnodes_key(tkvdb_datum *key, unsigned char *buf, int b,
+	const char *rest)
+{
+	buf[0] = b;
+	memcpy(buf + 1, rest, strlen(rest));
+	key->data = buf;
+	key->size = strlen(rest) + 1;
+}
+
+static void
+disk_subnodes_put(tkvdb_tr *tr, int from, int to, const char *rest)
+{
+	unsigned char buf[8];
+	tkvdb_datum key;
+	int b;
+
+	for (b=from; b<=to; b++) {
+		disk_subnodes_key(&key, buf, b, rest);
+		TEST_CHECK(tr->put(tr, &key, &key) == TKVDB_OK);
+	}
+}
+
+static size_t
+disk_subnodes_check(tkvdb_tr *tr, int from, int to, const char *rest,
+	TKVDB_RES res)
+{
+	unsigned char buf[8];
+	tkvdb_datum key, val;
+	int b;
+
+	for (b=from; b<=to; b++) {
+		disk_subnodes_key(&key, buf, b, rest);
+		TEST_CHECK(tr->get(tr, &key, &val) == res);
+		if (res == TKVDB_OK) {
+			TEST_CHECK(val.size == key.size);
+			TEST_CHECK(memcmp(val.data, buf, key.size) == 0);
+		}
+	}
+
+	return (res == TKVDB_OK) ? (size_t)(to - from + 1) : 0;
+}
+
+/* positions of subnodes in file are allocated only for nodes loaded from
+ * disk and are kept when such nodes are copied, resized or split */
+void
+test_disk_subnodes(void)
+{
+	const char fn[] = "disk_subnodes_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr, *ramtr;
+	tkvdb_params *params;
+	tkvdb_cursor *c;
+	size_t mem_db, mem_ram, n;
+
+	remove(fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 1);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	ramtr = tkvdb_tr_create(NULL, params);
+	TEST_CHECK(ramtr != NULL);
+	tkvdb_params_free(params);
+
+	/* new nodes of disk-backed transaction are almost the same as
+	 * nodes of RAM-only transaction, root of class 256 has no array
+	 * with positions of subnodes */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	disk_subnodes_put(tr, 1, 49, "");
+	mem_db = tr->mem(tr);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	TEST_CHECK(ramtr->begin(ramtr) == TKVDB_OK);
+	disk_subnodes_put(ramtr, 1, 49, "");
+	mem_ram = ramtr->mem(ramtr);
+	TEST_CHECK(ramtr->rollback(ramtr) == TKVDB_OK);
+	ramtr->free(ramtr);
+
+	TEST_CHECK(mem_db > mem_ram);
+	TEST_CHECK(mem_db < (mem_ram + 256 * sizeof(uint64_t)));
+
+	/* root of class 48 with small subtrees */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	disk_subnodes_put(tr, 1, 40, "abc");
+	disk_subnodes_put(tr, 1, 40, "axy");
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* update nodes loaded from disk */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	/* root grows to class 256 */
+	disk_subnodes_put(tr, 41, 60, "q");
+	/* split of prefix */
+	disk_subnodes_put(tr, 1, 10, "z");
+	/* value in inner node */
+	disk_subnodes_put(tr, 11, 20, "a");
+	/* split of leaf */
+	disk_subnodes_put(tr, 31, 35, "ab");
+	for (n=21; n<=30; n++) {
+		unsigned char buf[8];
+		tkvdb_datum key;
+
+		disk_subnodes_key(&key, buf, (int)n, "abc");
+		TEST_CHECK(tr->del(tr, &key, 0) == TKVDB_OK);
+	}
+	disk_subnodes_check(tr, 21, 30, "abc", TKVDB_NOT_FOUND);
+	disk_subnodes_check(tr, 1, 40, "axy", TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* check data */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	n = 0;
+	n += disk_subnodes_check(tr, 1, 20, "abc", TKVDB_OK);
+	n += disk_subnodes_check(tr, 21, 30, "abc", TKVDB_NOT_FOUND);
+	n += disk_subnodes_check(tr, 31, 40, "abc", TKVDB_OK);
+	n += disk_subnodes_check(tr, 1, 40, "axy", TKVDB_OK);
+	n += disk_subnodes_check(tr, 41, 60, "q", TKVDB_OK);
+	n += disk_subnodes_check(tr, 1, 10, "z", TKVDB_OK);
+	n += disk_subnodes_check(tr, 11, 20, "a", TKVDB_OK);
+	n += disk_subnodes_check(tr, 31, 35, "ab", TKVDB_OK);
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	TEST_CHECK(c->first(c) == TKVDB_OK);
+	do {
+		n--;
+	} while (c->next(c) == TKVDB_OK);
+	TEST_CHECK(n == 0);
+	c->free(c);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	tkvdb_close(db);
+	remove(fn);
+}
+
+#define WRITE_BUF_KEYS 3000
+
+/* value of key 'i', every 7th value is bigger than write buffer */
+static size_t
+write_buf_val(unsigned int i, unsigned int gen, uint8_t *val)
+{
+	size_t j, size;
+
+	size = ((i % 7) == 0) ? 10000 : (i % 50);
+	for (j=0; j<size; j++) {
+		val[j] = (uint8_t)(i * 31 + j + gen);
+	}
+	return size;
+}
+
+static void
+write_buf_put(tkvdb_tr *tr, unsigned int i, unsigned int gen)
+{
+	static uint8_t val[10000];
+	char key[32];
+	tkvdb_datum dtk, dtv;
+
+	if (i < 256) {
+		/* node with all 256 subnodes */
+		key[0] = 'w';
+		key[1] = (char)i;
+		dtk.size = 2;
+	} else {
+		dtk.size = sprintf(key, "%u", i);
+	}
+	dtk.data = key;
+	dtv.data = val;
+	dtv.size = write_buf_val(i, gen, val);
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+}
+
+static void
+write_buf_check(tkvdb_tr *tr, unsigned int gen)
+{
+	static uint8_t val[10000];
+	char key[32];
+	tkvdb_datum dtk, dtv;
+	unsigned int i, g;
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<WRITE_BUF_KEYS; i++) {
+		size_t size;
+
+		if (i < 256) {
+			key[0] = 'w';
+			key[1] = (char)i;
+			dtk.size = 2;
+		} else {
+			dtk.size = sprintf(key, "%u", i);
+		}
+		dtk.data = key;
+
+		/* odd keys are updated */
+		g = (i % 2) ? gen : 0;
+		size = write_buf_val(i, g, val);
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.size == size);
+		TEST_CHECK((dtv.size == size)
+			&& (memcmp(dtv.data, val, size) == 0));
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+}
+
+/* commit of transaction bigger than write buffer */
+void
+test_write_buf(void)
+{
+	const char fn[] = "write_buf_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	unsigned int i;
+	int align;
+
+	for (align=0; align<=8; align+=8) {
+		remove(fn);
+
+		params = tkvdb_params_create();
+		TEST_CHECK(params != NULL);
+		/* minimal buffer */
+		tkvdb_param_set(params, TKVDB_PARAM_WRITE_BUF_LIMIT, 0);
+		tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, align);
+
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, params);
+		TEST_CHECK(tr != NULL);
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<WRITE_BUF_KEYS; i++) {
+			write_buf_put(tr, i, 0);
+		}
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+		/* only part of tree is rewritten */
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=1; i<WRITE_BUF_KEYS; i+=2) {
+			write_buf_put(tr, i, 1);
+		}
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+		write_buf_check(tr, 1);
+
+		tr->free(tr);
+		tkvdb_close(db);
+
+		/* reopen with default buffer */
+		db = tkvdb_open(fn, NULL);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, params);
+		TEST_CHECK(tr != NULL);
+		write_buf_check(tr, 1);
+
+		tr->free(tr);
+		tkvdb_close(db);
+		tkvdb_params_free(params);
+	}
+
+	remove(fn);
+}
+
+#define COMMIT_THREADS_KEYS 100000
+
+/* fill database with random keys and update part of them */
+static void
+commit_threads_fill(const char *fn, int nthreads)
+{
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	uint64_t key, val;
+	static uint8_t big[20000];
+	unsigned int i, j, seed = 42;
+
+	remove(fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_COMMIT_THREADS, nthreads);
+	tkvdb_param_set(params, TKVDB_PARAM_WRITE_BUF_LIMIT, 16 * 1024);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+
+	for (j=0; j<3; j++) {
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<COMMIT_THREADS_KEYS; i++) {
+			seed = seed * 1103515245 + 12345;
+			key = seed % (COMMIT_THREADS_KEYS * 2);
+			val = key + j;
+			dtk.data = &key;
+			dtk.size = sizeof(key);
+			dtv.data = &val;
+			dtv.size = sizeof(val);
+			if ((i % 10000) == 0) {
+				/* value bigger than write buffer */
+				memset(big, (int)val, sizeof(big));
+				dtv.data = big;
+				dtv.size = sizeof(big);
+			}
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	}
+
+	/* transaction without changes */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	key = 1;
+	dtk.data = &key;
+	dtk.size = sizeof(key);
+	tr->get(tr, &dtk, &dtv);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+}
+
+static uint8_t *
+commit_threads_read(const char *fn, size_t *size)
+{
+	FILE *f;
+	uint8_t *buf;
+
+	f = fopen(fn, "rb");
+	TEST_CHECK(f != NULL);
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(*size);
+	TEST_CHECK(buf != NULL);
+	TEST_CHECK(fread(buf, 1, *size, f) == *size);
+	fclose(f);
+
+	return buf;
+}
+
+/* subtrees of root are written by many threads, file should be the same as
+ * written by one thread */
+void
+test_commit_threads(void)
+{
+	const char fn1[] = "commit_threads1.tkv", fn4[] = "commit_threads4.tkv";
+	uint8_t *buf1, *buf4;
+	size_t size1, size4;
+
+	commit_threads_fill(fn1, 1);
+	commit_threads_fill(fn4, 4);
+
+	buf1 = commit_threads_read(fn1, &size1);
+	buf4 = commit_threads_read(fn4, &size4);
+	TEST_CHECK(size1 > 0);
+	TEST_CHECK(size1 == size4);
+	TEST_CHECK((size1 == size4) && (memcmp(buf1, buf4, size1) == 0));
+
+	free(buf1);
+	free(buf4);
+	remove(fn1);
+	remove(fn4);
+}
+
+#define ASYNC_KEYS 20000
+#define ASYNC_ROUNDS 3
+
+static void
+async_done(TKVDB_RES r, void *userdata)
+{
+	size_t *ncommits = userdata;
+
+	TEST_CHECK(r == TKVDB_OK);
+	(*ncommits)++;
+}
+
+/* counters are incremented while buffers are committed in background,
+ * get() must see values from buffer which is being written */
+void
+test_async(void)
+{
+	const char fn[] = "async_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_async *a;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	char key[32];
+	uint64_t cnt;
+	size_t ncommits = 0;
+	unsigned int i, round;
+	TKVDB_RES rc;
+
+	remove(fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 0);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, 64 * 1024);
+	tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, sizeof(uint64_t));
+
+	a = tkvdb_async_open(fn, params, &async_done, &ncommits);
+	TEST_CHECK(a != NULL);
+
+	for (round=0; round<ASYNC_ROUNDS; round++) {
+		for (i=0; i<ASYNC_KEYS; i++) {
+			dtk.data = key;
+			dtk.size = sprintf(key, "a%u", i * 2654435761u);
+
+			rc = tkvdb_async_get(a, &dtk, &dtv);
+			if (round == 0) {
+				TEST_CHECK(rc == TKVDB_NOT_FOUND);
+				cnt = 1;
+			} else {
+				TEST_CHECK(rc == TKVDB_OK);
+				TEST_CHECK(dtv.size == sizeof(uint64_t));
+				memcpy(&cnt, dtv.data, sizeof(uint64_t));
+				TEST_CHECK(cnt == round);
+				cnt++;
+			}
+
+			dtv.data = &cnt;
+			dtv.size = sizeof(uint64_t);
+			TEST_CHECK(tkvdb_async_put(a, &dtk, &dtv) == TKVDB_OK);
+		}
+	}
+
+	TEST_CHECK(tkvdb_async_close(a) == TKVDB_OK);
+	/* buffers were handed off many times */
+	TEST_CHECK(ncommits > 2);
+
+	/* check with ordinary transaction */
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<ASYNC_KEYS; i++) {
+		dtk.data = key;
+		dtk.size = sprintf(key, "a%u", i * 2654435761u);
+
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.size == sizeof(uint64_t));
+		memcpy(&cnt, dtv.data, sizeof(uint64_t));
+		TEST_CHECK(cnt == ASYNC_ROUNDS);
+	}
+	tr->free(tr);
+	tkvdb_close(db);
+
+	tkvdb_params_free(params);
+	remove(fn);
+}
+
+#define ASYNC_RETRY_KEYS 200
+
+static void
+async_retry_put(tkvdb_async *a, unsigned int from, unsigned int to)
+{
+	tkvdb_datum dtk, dtv;
+	char key[32];
+	unsigned int i;
+
+	for (i=from; i<to; i++) {
+		dtk.data = key;
+		dtk.size = sprintf(key, "retry-%u", i);
+		dtv = dtk;
+		TEST_CHECK(tkvdb_async_put(a, &dtk, &dtv) == TKVDB_OK);
+	}
+}
+
+/* commit of handed off buffer fails when file can't grow, buffer is kept
+ * and written again by next hand-off */
+void
+test_async_retry(void)
+{
+	const char fn[] = "async_retry_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_async *a;
+	tkvdb_datum dtk, dtv;
+	struct rlimit lim, old;
+	struct stat st;
+	char key[32];
+	unsigned int i;
+
+	remove(fn);
+
+	a = tkvdb_async_open(fn, NULL, NULL, NULL);
+	TEST_CHECK(a != NULL);
+	async_retry_put(a, 0, ASYNC_RETRY_KEYS / 2);
+	TEST_CHECK(tkvdb_async_commit(a) == TKVDB_OK);
+	TEST_CHECK(tkvdb_async_wait(a) == TKVDB_OK);
+
+	/* writes after current end of file fail */
+	TEST_CHECK(stat(fn, &st) == 0);
+	TEST_CHECK(getrlimit(RLIMIT_FSIZE, &old) == 0);
+	lim = old;
+	lim.rlim_cur = st.st_size;
+	signal(SIGXFSZ, SIG_IGN);
+	TEST_CHECK(setrlimit(RLIMIT_FSIZE, &lim) == 0);
+
+	async_retry_put(a, ASYNC_RETRY_KEYS / 2, ASYNC_RETRY_KEYS);
+	TEST_CHECK(tkvdb_async_commit(a) == TKVDB_OK);
+	TEST_CHECK(tkvdb_async_wait(a) == TKVDB_IO_ERROR);
+
+	/* failed buffer is still seen */
+	dtk.data = key;
+	dtk.size = sprintf(key, "retry-%u", ASYNC_RETRY_KEYS - 1);
+	TEST_CHECK(tkvdb_async_get(a, &dtk, &dtv) == TKVDB_OK);
+
+	TEST_CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+	TEST_CHECK(tkvdb_async_commit(a) == TKVDB_IO_ERROR);
+	TEST_CHECK(tkvdb_async_wait(a) == TKVDB_OK);
+	TEST_CHECK(tkvdb_async_close(a) == TKVDB_OK);
+
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<ASYNC_RETRY_KEYS; i++) {
+		dtk.data = key;
+		dtk.size = sprintf(key, "retry-%u", i);
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	tr->free(tr);
+	tkvdb_close(db);
+
+	remove(fn);
+}
+
+#define DURABILITY_COMMITS 50
+
+/* data is the same with any durability level, unsynced commits are
+ * synced on close */
+void
+test_durability(void)
+{
+	const char fn[] = "durability_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	char key[32];
+	unsigned int i, j;
+	int dur;
+
+	for (dur=TKVDB_DURABILITY_NONE; dur<=TKVDB_DURABILITY_PERIODIC;
+		dur++) {
+
+		remove(fn);
+
+		params = tkvdb_params_create();
+		TEST_CHECK(params != NULL);
+		tkvdb_param_set(params, TKVDB_PARAM_DURABILITY, dur);
+		tkvdb_param_set(params, TKVDB_PARAM_SYNC_INTERVAL, 5);
+		tkvdb_param_set(params, TKVDB_PARAM_SYNC_BYTES, 4096);
+
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, params);
+		TEST_CHECK(tr != NULL);
+
+		for (i=0; i<DURABILITY_COMMITS; i++) {
+			TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			for (j=0; j<=i; j++) {
+				dtk.data = key;
+				dtk.size = sprintf(key, "d%03u-%03u", i, j);
+				dtv.data = &i;
+				dtv.size = sizeof(i);
+				TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			}
+			TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+		}
+
+		/* bulk loader is synced in the same way */
+		if (dur == TKVDB_DURABILITY_COMMIT) {
+			tkvdb_loader *ldr = tkvdb_loader_create(db);
+
+			TEST_CHECK(ldr != NULL);
+			for (i=0; i<DURABILITY_COMMITS; i++) {
+				for (j=0; j<=i; j++) {
+					dtk.data = key;
+					dtk.size = sprintf(key, "d%03u-%03u", i, j);
+					dtv.data = &i;
+					dtv.size = sizeof(i);
+					TEST_CHECK(tkvdb_loader_add(ldr,
+						&dtk, &dtv) == TKVDB_OK);
+				}
+			}
+			TEST_CHECK(tkvdb_loader_finish(ldr) == TKVDB_OK);
+			tkvdb_loader_free(ldr);
+		}
+
+		tr->free(tr);
+		TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+		db = tkvdb_open(fn, NULL);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, NULL);
+		TEST_CHECK(tr != NULL);
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<DURABILITY_COMMITS; i++) {
+			for (j=0; j<=i; j++) {
+				dtk.data = key;
+				dtk.size = sprintf(key, "d%03u-%03u", i, j);
+				TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+				TEST_CHECK(dtv.size == sizeof(i));
+				TEST_CHECK(memcmp(dtv.data, &i, sizeof(i)) == 0);
+			}
+		}
+		tr->free(tr);
+		tkvdb_close(db);
+		tkvdb_params_free(params);
+	}
+
+	remove(fn);
+}
+
+/* write-ahead log */
+#define WAL_COMMITS 100
+#define WAL_LIMIT (64 * 1024)
+
+static off_t
+wal_file_size(const char *fn)
+{
+	struct stat st;
+
+	if (stat(fn, &st) != 0) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+static void
+wal_check(const char *fn, tkvdb_params *params, unsigned int n)
+{
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_datum dtk, dtv;
+	char key[32];
+	unsigned int i;
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+
+	/* first key is deleted */
+	dtk.data = key;
+	dtk.size = sprintf(key, "w%05u", 0);
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_NOT_FOUND);
+
+	for (i=1; i<n; i++) {
+		dtk.size = sprintf(key, "w%05u", i);
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.size == sizeof(i));
+		TEST_CHECK(memcmp(dtv.data, &i, sizeof(i)) == 0);
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+}
+
+void
+test_wal(void)
+{
+	const char fn[] = "wal_test.tkv", wal_fn[] = "wal_test.tkv-wal";
+	const char torn[] = "\001\010\000\000\000";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	char key[32];
+	unsigned int i, n;
+	uint64_t db_bytes, wal_bytes;
+	off_t wal_size, stale_size;
+	uint8_t *stale, *big;
+	FILE *f;
+
+	remove(fn);
+	remove(wal_fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_WAL_LIMIT, WAL_LIMIT);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+
+	/* small commits are appended to log */
+	dtk.data = key;
+	for (i=0; i<WAL_COMMITS; i++) {
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		dtk.size = sprintf(key, "w%05u", i);
+		dtv.data = &i;
+		dtv.size = sizeof(i);
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.size = sprintf(key, "w%05u", 0);
+	TEST_CHECK(tr->del(tr, &dtk, 0) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_write_info(db, &db_bytes, &wal_bytes) == TKVDB_OK);
+	TEST_CHECK(db_bytes == 0);
+	TEST_CHECK(wal_bytes > 0);
+	TEST_CHECK(wal_file_size(wal_fn) == (off_t)wal_bytes);
+
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+	/* log is replayed on begin() */
+	wal_check(fn, params, WAL_COMMITS);
+
+	/* incomplete record of interrupted commit is dropped */
+	wal_size = wal_file_size(wal_fn);
+	f = fopen(wal_fn, "ab");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fwrite(torn, 1, sizeof(torn), f) == sizeof(torn));
+	fclose(f);
+	wal_check(fn, params, WAL_COMMITS);
+	TEST_CHECK(wal_file_size(wal_fn) == wal_size);
+
+	/* log is merged into database file when it grows over limit */
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+
+	n = WAL_COMMITS * 50;
+	dtk.data = key;
+	for (i=WAL_COMMITS; i<n; i++) {
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		dtk.size = sprintf(key, "w%05u", i);
+		dtv.data = &i;
+		dtv.size = sizeof(i);
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_write_info(db, &db_bytes, &wal_bytes) == TKVDB_OK);
+	TEST_CHECK(db_bytes > 0);
+	TEST_CHECK(wal_file_size(wal_fn) <= WAL_LIMIT);
+
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+	wal_check(fn, params, n);
+
+	/* log left by checkpoint which was interrupted before truncation
+	 * of log is not replayed over newer data */
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	dtk.data = key;
+	dtk.size = sprintf(key, "w%05u", 1);
+	i = 1;
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	stale_size = wal_file_size(wal_fn);
+	TEST_CHECK(stale_size > 0);
+	stale = malloc(stale_size);
+	TEST_CHECK(stale != NULL);
+	f = fopen(wal_fn, "rb");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fread(stale, 1, stale_size, f) == (size_t)stale_size);
+	fclose(f);
+
+	/* value bigger than log forces checkpoint */
+	big = calloc(1, WAL_LIMIT);
+	TEST_CHECK(big != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	i = 0;
+	dtv.data = &i;
+	dtv.size = sizeof(i);
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	dtk.size = sprintf(key, "w%05u", n);
+	dtv.data = big;
+	dtv.size = WAL_LIMIT;
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	TEST_CHECK(wal_file_size(wal_fn) == 0);
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+	f = fopen(wal_fn, "wb");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fwrite(stale, 1, stale_size, f) == (size_t)stale_size);
+	fclose(f);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.size = sprintf(key, "w%05u", 1);
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(dtv.size == sizeof(i));
+	TEST_CHECK(memcmp(dtv.data, &i, sizeof(i)) == 0);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	TEST_CHECK(wal_file_size(wal_fn) == 0);
+
+	/* log isn't synced before commit mark, mark keeps CRC of records */
+	dtk.size = sprintf(key, "w%05u", n + 1);
+	dtv.data = &i;
+	dtv.size = sizeof(i);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+	wal_size = wal_file_size(wal_fn);
+	TEST_CHECK(wal_size > 0);
+	f = fopen(wal_fn, "r+b");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fseek(f, wal_size - 14, SEEK_SET) == 0);
+	TEST_CHECK(fputc((i >> 24) ^ 0xff, f) != EOF);
+	fclose(f);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_NOT_FOUND);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	TEST_CHECK(wal_file_size(wal_fn) == 0);
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+	free(big);
+	free(stale);
+	tkvdb_params_free(params);
+	remove(fn);
+	remove(wal_fn);
+}
+
+/* group commit: commits of window are not synced one by one, handles of
+ * one file in many threads share syncs of file and writes of log */
+#define GROUP_THREADS 4
+#define GROUP_COMMITS 50
+
+struct group_arg
+{
+	const char *fn;
+	tkvdb_params *params;
+	unsigned int id;
+	int serial;
+	size_t errors;
+};
+
+static pthread_mutex_t group_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+group_thread(void *p)
+{
+	struct group_arg *arg = p;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_datum dtk, dtv;
+	char key[32];
+	unsigned int i;
+	TKVDB_RES r;
+
+	db = tkvdb_open(arg->fn, arg->params);
+	if (!db) {
+		arg->errors++;
+		return NULL;
+	}
+	tr = tkvdb_tr_create(db, arg->params);
+	if (!tr) {
+		arg->errors++;
+		tkvdb_close(db);
+		return NULL;
+	}
+
+	dtk.data = key;
+	for (i=0; i<GROUP_COMMITS; i++) {
+		dtk.size = sprintf(key, "g%u-%03u", arg->id, i);
+		dtv.data = &i;
+		dtv.size = sizeof(i);
+		do {
+			/* writers of database file are not serialized by
+			 * library, log appends are */
+			if (arg->serial) {
+				pthread_mutex_lock(&group_mtx);
+			}
+			if ((tr->begin(tr) != TKVDB_OK)
+				|| (tr->put(tr, &dtk, &dtv) != TKVDB_OK)) {
+
+				arg->errors++;
+			}
+			r = tr->commit(tr);
+			if (r == TKVDB_MODIFIED) {
+				/* file was changed by other thread */
+				tr->rollback(tr);
+			}
+			if (arg->serial) {
+				pthread_mutex_unlock(&group_mtx);
+			}
+		} while (r == TKVDB_MODIFIED);
+		if (r != TKVDB_OK) {
+			arg->errors++;
+		}
+	}
+
+	tr->free(tr);
+	if (tkvdb_close(db) != TKVDB_OK) {
+		arg->errors++;
+	}
+
+	return NULL;
+}
+
+void
+test_group_commit(void)
+{
+	const char fn[] = "group_test.tkv", wal_fn[] = "group_test.tkv-wal";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	pthread_t threads[GROUP_THREADS];
+	struct group_arg args[GROUP_THREADS];
+	char key[32];
+	unsigned int i, j, wal;
+	off_t size;
+	FILE *f;
+	int c;
+
+	remove(fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_DURABILITY,
+		TKVDB_DURABILITY_GROUP);
+	tkvdb_param_set(params, TKVDB_PARAM_SYNC_INTERVAL, 1000000);
+	tkvdb_param_set(params, TKVDB_PARAM_SYNC_BYTES, 1024 * 1024 * 1024);
+
+	/* commit isn't synced before footer, footer keeps CRC of data
+	 * written after the last sync */
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	dtk.data = key;
+	dtv.data = &i;
+	dtv.size = sizeof(i);
+	i = 1;
+	dtk.size = sprintf(key, "a");
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	size = wal_file_size(fn);
+	dtk.size = sprintf(key, "b");
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+
+	/* nodes of the last commit are lost, commit is dropped */
+	f = fopen(fn, "r+b");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fseek(f, size, SEEK_SET) == 0);
+	c = fgetc(f);
+	TEST_CHECK(fseek(f, size, SEEK_SET) == 0);
+	TEST_CHECK(fputc(c ^ 0xff, f) != EOF);
+	fclose(f);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.size = sprintf(key, "a");
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	dtk.size = sprintf(key, "b");
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_NOT_FOUND);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	tr->free(tr);
+	TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+	TEST_CHECK(wal_file_size(fn) == size);
+
+	/* every commit is synced, by database file or by log */
+	tkvdb_param_set(params, TKVDB_PARAM_SYNC_BYTES, 1);
+	for (wal=0; wal<=1; wal++) {
+		remove(fn);
+		remove(wal_fn);
+		tkvdb_param_set(params, TKVDB_PARAM_WAL_LIMIT,
+			wal ? WAL_LIMIT / 32 : 0);
+
+		for (i=0; i<GROUP_THREADS; i++) {
+			args[i].fn = fn;
+			args[i].params = params;
+			args[i].id = i;
+#ifdef TKVDB_NO_THREADS
+			/* library doesn't lock log without threads */
+			args[i].serial = 1;
+#else
+			args[i].serial = !wal;
+#endif
+			args[i].errors = 0;
+			TEST_CHECK(pthread_create(&threads[i], NULL,
+				&group_thread, &args[i]) == 0);
+		}
+		for (i=0; i<GROUP_THREADS; i++) {
+			TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+			TEST_CHECK(args[i].errors == 0);
+		}
+
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, params);
+		TEST_CHECK(tr != NULL);
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		dtk.data = key;
+		for (i=0; i<GROUP_THREADS; i++) {
+			for (j=0; j<GROUP_COMMITS; j++) {
+				dtk.size = sprintf(key, "g%u-%03u", i, j);
+				TEST_CHECK(tr->get(tr, &dtk, &dtv)
+					== TKVDB_OK);
+				TEST_CHECK(dtv.size == sizeof(j));
+				TEST_CHECK(memcmp(dtv.data, &j, sizeof(j))
+					== 0);
+			}
+		}
+		TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+		tr->free(tr);
+		TEST_CHECK(tkvdb_close(db) == TKVDB_OK);
+	}
+
+	tkvdb_params_free(params);
+	remove(fn);
+	remove(wal_fn);
+}
+
+/* nodes cache shared by transactions */
+void
+test_cache(void)
+{
+	const char fn[] = "cache_test.tkv";
+	const size_t cache_size = 64 * 1024;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	uint64_t hits, misses, hits1, misses1;
+	size_t i, used;
+	int pass;
+
+	remove(fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_CACHE_SIZE, cache_size);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum dtk, dtv;
+
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		dtv.data = kvs[i].val;
+		dtv.size = kvs[i].vlen;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* read the same keys in two transactions */
+	hits1 = misses1 = 0;
+	for (pass=0; pass<2; pass++) {
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<100; i++) {
+			tkvdb_datum dtk, dtv;
+
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+			TEST_CHECK(dtv.size == kvs[i].vlen);
+			TEST_CHECK(memcmp(dtv.data, kvs[i].val,
+				dtv.size) == 0);
+		}
+		TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+		TEST_CHECK(tkvdb_cache_info(db, &hits, &misses, &used)
+			== TKVDB_OK);
+		TEST_CHECK(used <= cache_size);
+		if (pass == 0) {
+			hits1 = hits;
+			misses1 = misses;
+			TEST_CHECK(misses1 > 0);
+		}
+	}
+	/* second pass is served from cache */
+	TEST_CHECK(misses == misses1);
+	TEST_CHECK(hits > hits1);
+
+	/* whole database doesn't fit, check eviction */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum dtk, dtv;
+
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(memcmp(dtv.data, kvs[i].val, dtv.size) == 0);
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_cache_info(db, &hits, &misses, &used) == TKVDB_OK);
+	TEST_CHECK(used <= cache_size);
+
+	tr->free(tr);
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	remove(fn);
+}
+
+/* read nodes from mapped database file */
+void
+test_mmap(void)
+{
+	const char fn[] = "mmap_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_cursor *c;
+	tkvdb_params *params;
+	size_t i;
+	int align, n;
+
+	for (align=0; align<=VAL_ALIGNMENT; align+=VAL_ALIGNMENT) {
+		remove(fn);
+
+		params = tkvdb_params_create();
+		TEST_CHECK(params != NULL);
+		tkvdb_param_set(params, TKVDB_PARAM_MMAP, 1);
+		tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, align);
+
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, NULL);
+		TEST_CHECK(tr != NULL);
+
+		/* many commits, file will be remapped */
+		for (i=0; i<N; i++) {
+			tkvdb_datum dtk, dtv;
+
+			if ((i % (N / 10)) == 0) {
+				TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			}
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			if ((i % (N / 10)) == (N / 10 - 1)) {
+				TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+			}
+		}
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<N; i++) {
+			tkvdb_datum dtk, dtv;
+
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+			TEST_CHECK(dtv.size == kvs[i].vlen);
+			TEST_CHECK(memcmp(dtv.data, kvs[i].val,
+				dtv.size) == 0);
+			if (align) {
+				TEST_CHECK(((uintptr_t)dtv.data
+					& (align - 1)) == 0);
+			}
+		}
+
+		/* update (nodes are loaded) and read again */
+		{
+			tkvdb_datum dtk, dtv;
+
+			dtk.data = kvs[0].key;
+			dtk.size = kvs[0].klen;
+			dtv.data = &i;
+			dtv.size = sizeof(i);
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+			TEST_CHECK(dtv.size == sizeof(i));
+		}
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+		/* iterate with cursor */
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		c = tkvdb_cursor_create(tr);
+		TEST_CHECK(c != NULL);
+		n = 0;
+		if (c->first(c) == TKVDB_OK) {
+			do {
+				n++;
+			} while (c->next(c) == TKVDB_OK);
+		}
+		TEST_CHECK(n == N);
+		c->free(c);
+		TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+		tr->free(tr);
+		tkvdb_close(db);
+		tkvdb_params_free(params);
+	}
+	remove(fn);
+}
+
+/* concurrent readers of RAM-only transaction */
+#define READERS_N 4
+#define READERS_KEYS 2000
+
+/* stop flag of reader threads, same ordering as in tkvdb.c */
+#define TKVDB_LOAD_ACQ(V) __atomic_load_n(&(V), __ATOMIC_ACQUIRE)
+#define TKVDB_STORE_REL(V, X) __atomic_store_n(&(V), (X), __ATOMIC_RELEASE)
+
+struct reader_arg
+{
+	tkvdb_tr *tr;
+	int *stop;
+	size_t errors;
+};
+
+/* value is derived from key, so reader can check it */
+static void
+reader_kv(unsigned int k, uint32_t *key, uint64_t *val)
+{
+	*key = k * 2654435761U;
+	*val = (uint64_t)(*key) * 0x9E3779B97F4A7C15ULL;
+}
+
+static void *
+reader_thread(void *p)
+{
+	struct reader_arg *arg = p;
+	tkvdb_reader *r;
+	tkvdb_cursor *c;
+	unsigned int k = 0;
+
+	r = tkvdb_reader_create(arg->tr);
+	if (!r) {
+		arg->errors++;
+		return NULL;
+	}
+	c = tkvdb_cursor_create(arg->tr);
+
+	while (!TKVDB_LOAD_ACQ(*arg->stop)) {
+		tkvdb_datum dtk, dtv;
+		uint32_t key;
+		uint64_t val, v;
+
+		tkvdb_reader_enter(r, arg->tr);
+
+		reader_kv(k, &key, &val);
+		dtk.data = &key;
+		dtk.size = sizeof(key);
+		if (arg->tr->get(arg->tr, &dtk, &dtv) == TKVDB_OK) {
+			memcpy(&v, dtv.data, sizeof(v));
+			if ((dtv.size != sizeof(v)) || (v != val)) {
+				arg->errors++;
+			}
+		}
+
+		if ((k % 500) == 0) {
+			/* short scan */
+			int n = 0;
+
+			if (c->first(c) == TKVDB_OK) {
+				do {
+					memcpy(&key, c->key(c), sizeof(key));
+					memcpy(&v, c->val(c), sizeof(v));
+					if (v != (uint64_t)key
+						* 0x9E3779B97F4A7C15ULL) {
+
+						arg->errors++;
+					}
+					n++;
+				} while ((n < 100) && (c->next(c) == TKVDB_OK));
+			}
+		}
+
+		tkvdb_reader_leave(r);
+		k = (k + 1) % READERS_KEYS;
+	}
+
+	c->free(c);
+	tkvdb_reader_free(r);
+	return NULL;
+}
+
+void
+test_readers(void)
+{
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	pthread_t threads[READERS_N];
+	struct reader_arg args[READERS_N];
+	int stop = 0;
+	int dynalloc, i;
+	unsigned int k, iter;
+
+	for (dynalloc=0; dynalloc<=1; dynalloc++) {
+		params = tkvdb_params_create();
+		TEST_CHECK(params != NULL);
+		tkvdb_param_set(params, TKVDB_PARAM_READERS, READERS_N);
+		tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, dynalloc);
+		tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, 64 * 1024 * 1024);
+
+		tr = tkvdb_tr_create(NULL, params);
+		TEST_CHECK(tr != NULL);
+		tkvdb_params_free(params);
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+
+		TKVDB_STORE_REL(stop, 0);
+		for (i=0; i<READERS_N; i++) {
+			args[i].tr = tr;
+			args[i].stop = &stop;
+			args[i].errors = 0;
+			TEST_CHECK(pthread_create(&threads[i], NULL,
+				&reader_thread, &args[i]) == 0);
+		}
+
+		/* writer: insert, update, delete and rollback */
+		for (iter=0; iter<20; iter++) {
+			for (k=0; k<READERS_KEYS; k++) {
+				tkvdb_datum dtk, dtv;
+				uint32_t key;
+				uint64_t val;
+
+				reader_kv(k, &key, &val);
+				dtk.data = &key;
+				dtk.size = sizeof(key);
+				dtv.data = &val;
+				dtv.size = sizeof(val);
+
+				TEST_CHECK(tr->put(tr, &dtk, &dtv)
+					== TKVDB_OK);
+				/* same value, shouldn't be updated in place */
+				TEST_CHECK(tr->put(tr, &dtk, &dtv)
+					== TKVDB_OK);
+				if ((k % 3) == (iter % 3)) {
+					TEST_CHECK(tr->del(tr, &dtk, 0)
+						== TKVDB_OK);
+				}
+			}
+			if (dynalloc) {
+				TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+			} else if ((iter % 5) == 4) {
+				/* don't run out of preallocated buffer */
+				TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+			}
+			TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		}
+
+		TKVDB_STORE_REL(stop, 1);
+		for (i=0; i<READERS_N; i++) {
+			TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+			TEST_CHECK(args[i].errors == 0);
+		}
+
+		/* all reader slots are free again */
+		for (i=0; i<READERS_N; i++) {
+			TEST_CHECK(tkvdb_reader_create(tr) != NULL);
+		}
+		TEST_CHECK(tkvdb_reader_create(tr) == NULL);
+
+		tr->free(tr);
+	}
+}
+
+/* many writers of one RAM-only transaction */
+#define WRITERS_N 4
+#define WRITERS_KEYS 20000
+
+struct writer_arg
+{
+	tkvdb_tr *tr;
+	unsigned int id;
+	int del_pfx;
+	size_t errors;
+};
+
+/* keys of all threads are interleaved and share nodes */
+static void
+writer_key(unsigned int id, unsigned int i, unsigned char *key)
+{
+	unsigned int k = i * WRITERS_N + id;
+
+	key[0] = k >> 24;
+	key[1] = k >> 16;
+	key[2] = k >> 8;
+	key[3] = k;
+}
+
+static void *
+writer_thread(void *p)
+{
+	struct writer_arg *arg = p;
+	tkvdb_tr *tr = arg->tr;
+	unsigned char key[4];
+	tkvdb_datum dtk, dtv;
+	unsigned int i, val;
+
+	dtk.data = key;
+	dtk.size = sizeof(key);
+
+	if (arg->del_pfx) {
+		/* remove subtrees under other writers */
+		dtk.size = 3;
+		for (i=0; i<WRITERS_KEYS; i++) {
+			writer_key(arg->id, i, key);
+			tr->del(tr, &dtk, 1);
+		}
+		return NULL;
+	}
+
+	for (i=0; i<WRITERS_KEYS; i++) {
+		writer_key(arg->id, i, key);
+		val = i;
+		dtv.data = &val;
+		dtv.size = sizeof(val);
+		if (tr->put(tr, &dtk, &dtv) != TKVDB_OK) {
+			arg->errors++;
+		}
+		/* update with value of different size */
+		if ((i % 5) == 0) {
+			dtv.size = 2;
+			if (tr->put(tr, &dtk, &dtv) != TKVDB_OK) {
+				arg->errors++;
+			}
+		}
+		if ((i % 3) == 0) {
+			if (tr->del(tr, &dtk, 0) != TKVDB_OK) {
+				arg->errors++;
+			}
+		}
+	}
+
+	/* check own keys */
+	for (i=0; i<WRITERS_KEYS; i++) {
+		TKVDB_RES r;
+
+		writer_key(arg->id, i, key);
+		r = tr->get(tr, &dtk, &dtv);
+		if ((i % 3) == 0) {
+			if (r != TKVDB_NOT_FOUND) {
+				arg->errors++;
+			}
+		} else if ((r != TKVDB_OK)
+			|| (dtv.size != (((i % 5) == 0) ? 2 : sizeof(val)))
+			|| (memcmp(dtv.data, &i, dtv.size) != 0)) {
+
+			arg->errors++;
+		}
+	}
+
+	return NULL;
+}
+
+void
+test_writers(void)
+{
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_cursor *c;
+	pthread_t threads[WRITERS_N];
+	struct writer_arg args[WRITERS_N];
+	unsigned int i, prev;
+	int n;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_CONCURRENT, 1);
+
+	/* only RAM-only transactions */
+	remove("writers_test.tkv");
+	db = tkvdb_open("writers_test.tkv", NULL);
+	TEST_CHECK(db != NULL);
+	TEST_CHECK(tkvdb_tr_create(db, params) == NULL);
+	tkvdb_close(db);
+	remove("writers_test.tkv");
+
+	tr = tkvdb_tr_create(NULL, params);
+	TEST_CHECK(tr != NULL);
+	tkvdb_params_free(params);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+
+	for (i=0; i<WRITERS_N; i++) {
+		args[i].tr = tr;
+		args[i].id = i;
+		args[i].del_pfx = 0;
+		args[i].errors = 0;
+		TEST_CHECK(pthread_create(&threads[i], NULL, &writer_thread,
+			&args[i]) == 0);
+	}
+	for (i=0; i<WRITERS_N; i++) {
+		TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+		TEST_CHECK(args[i].errors == 0);
+	}
+
+	/* all keys are in place and sorted */
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	n = 0;
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			n++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+	TEST_CHECK(n == (WRITERS_KEYS - (WRITERS_KEYS + 2) / 3)
+		* WRITERS_N);
+
+	/* delete by prefix while other threads insert */
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<WRITERS_N; i++) {
+		args[i].del_pfx = (i == 0);
+		TEST_CHECK(pthread_create(&threads[i], NULL, &writer_thread,
+			&args[i]) == 0);
+	}
+	for (i=0; i<WRITERS_N; i++) {
+		TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+	}
+
+	/* keys are still sorted */
+	n = 0;
+	prev = 0;
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			unsigned char *k = c->key(c);
+			unsigned int cur;
+
+			TEST_CHECK(c->keysize(c) == 4);
+			cur = ((unsigned int)k[0] << 24) | (k[1] << 16)
+				| (k[2] << 8) | k[3];
+			TEST_CHECK((n == 0) || (cur > prev));
+			prev = cur;
+			n++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+	c->free(c);
+
+	tr->free(tr);
+}
+
+/* merge of transactions */
+#define MERGE_KEYS 5000
+
+static TKVDB_RES
+merge_sum(tkvdb_datum *val, const tkvdb_datum *src_val, void *userdata)
+{
+	uint64_t a, b;
+
+	(void)userdata;
+	if ((val->size != sizeof(uint64_t))
+		|| (src_val->size != sizeof(uint64_t))) {
+		return TKVDB_CORRUPTED;
+	}
+
+	memcpy(&a, val->data, sizeof(uint64_t));
+	memcpy(&b, src_val->data, sizeof(uint64_t));
+	a += b;
+	memcpy(val->data, &a, sizeof(uint64_t));
+
+	return TKVDB_OK;
+}
+
+/* put decimal number as key (keys '1', '12', '123' are prefixes of each
+ * other) */
+static TKVDB_RES
+merge_put(tkvdb_tr *tr, int i, const void *val, size_t size)
+{
+	char k[16];
+	tkvdb_datum key, dtv;
+
+	key.data = k;
+	key.size = sprintf(k, "%d", i);
+	dtv.data = (void *)val;
+	dtv.size = size;
+
+	return tr->put(tr, &key, &dtv);
+}
+
+static uint64_t
+merge_get(tkvdb_tr *tr, int i, size_t *size)
+{
+	char k[16];
+	tkvdb_datum key, val;
+	uint64_t v = 0;
+
+	key.data = k;
+	key.size = sprintf(k, "%d", i);
+
+	*size = 0;
+	if (tr->get(tr, &key, &val) == TKVDB_OK) {
+		*size = val.size;
+		memcpy(&v, val.data, val.size);
+	}
+
+	return v;
+}
+
+static int
+merge_count(tkvdb_tr *tr)
+{
+	tkvdb_cursor *c;
+	int n = 0;
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			n++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+
+	c->free(c);
+	return n;
+}
+
+static tkvdb_tr *
+merge_tr(size_t alignval, size_t readers)
+{
+	tkvdb_params *params;
+	tkvdb_tr *tr;
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 1);
+	tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL, alignval);
+	tkvdb_param_set(params, TKVDB_PARAM_READERS, readers);
+
+	tr = tkvdb_tr_create(NULL, params);
+	TEST_CHECK(tr != NULL);
+	tkvdb_params_free(params);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+
+	return tr;
+}
+
+void
+test_merge(void)
+{
+	static const size_t conf[][2] = { {0, 0}, {VAL_ALIGNMENT, 0}, {0, 2} };
+	tkvdb_tr *tr1, *tr2, *tr3, *tr4, *other;
+	tkvdb_params *params;
+	uint64_t one = 1, ten = 10, v;
+	uint32_t v32;
+	size_t size, k;
+	int i;
+
+	for (k=0; k<(sizeof(conf) / sizeof(conf[0])); k++) {
+		tr1 = merge_tr(conf[k][0], conf[k][1]);
+		tr2 = merge_tr(conf[k][0], conf[k][1]);
+		tr3 = merge_tr(conf[k][0], conf[k][1]);
+		tr4 = merge_tr(conf[k][0], conf[k][1]);
+
+		/* overlapping sets of keys */
+		for (i=0; i<3000; i++) {
+			TEST_CHECK(merge_put(tr1, i, &one, sizeof(one))
+				== TKVDB_OK);
+		}
+		for (i=MERGE_KEYS-1; i>=2000; i--) {
+			/* value is replaced, so source has chains of
+			   replaced nodes */
+			v32 = i;
+			TEST_CHECK(merge_put(tr2, i, &v32, sizeof(v32))
+				== TKVDB_OK);
+			TEST_CHECK(merge_put(tr2, i, &ten, sizeof(ten))
+				== TKVDB_OK);
+		}
+
+		TEST_CHECK(tkvdb_tr_merge(tr1, tr2, &merge_sum, NULL)
+			== TKVDB_OK);
+		TEST_CHECK(merge_count(tr1) == MERGE_KEYS);
+		TEST_CHECK(merge_count(tr2) == 0);
+		TEST_CHECK(tr2->mem(tr2) == 0);
+
+		for (i=0; i<MERGE_KEYS; i++) {
+			v = merge_get(tr1, i, &size);
+			TEST_CHECK(size == sizeof(uint64_t));
+			if (i < 2000) {
+				TEST_CHECK(v == 1);
+			} else if (i < 3000) {
+				TEST_CHECK(v == 11);
+			} else {
+				TEST_CHECK(v == 10);
+			}
+		}
+
+		/* empty source can be reused */
+		TEST_CHECK(merge_put(tr2, 1, &one, sizeof(one)) == TKVDB_OK);
+		TEST_CHECK(merge_count(tr2) == 1);
+
+		/* without merge function value from source wins */
+		for (i=4000; i<6000; i++) {
+			v32 = i;
+			TEST_CHECK(merge_put(tr3, i, &v32, sizeof(v32))
+				== TKVDB_OK);
+		}
+		TEST_CHECK(tkvdb_tr_merge(tr1, tr3, NULL, NULL) == TKVDB_OK);
+		TEST_CHECK(merge_count(tr1) == 6000);
+		for (i=3000; i<6000; i++) {
+			v = merge_get(tr1, i, &size);
+			if (i < 4000) {
+				TEST_CHECK((size == sizeof(uint64_t))
+					&& (v == 10));
+			} else {
+				TEST_CHECK((size == sizeof(uint32_t))
+					&& (v == (uint64_t)i));
+			}
+		}
+
+		/* error in merge function */
+		TEST_CHECK(tkvdb_tr_merge(tr1, tr2, &merge_sum, NULL)
+			== TKVDB_OK);
+		TEST_CHECK(merge_get(tr1, 1, &size) == 2);
+		TEST_CHECK(merge_put(tr2, 4000, &one, sizeof(one))
+			== TKVDB_OK);
+		/* subtrees that are merged after failed key and subnodes
+		   of failed key */
+		for (i=10000; i<11000; i++) {
+			TEST_CHECK(merge_put(tr2, i, &one, sizeof(one))
+				== TKVDB_OK);
+			TEST_CHECK(merge_put(tr2, i + 30000, &one, sizeof(one))
+				== TKVDB_OK);
+		}
+		TEST_CHECK(tkvdb_tr_merge(tr1, tr2, &merge_sum, NULL)
+			== TKVDB_CORRUPTED);
+
+		/* keys that are not merged are left in source */
+		TEST_CHECK(merge_get(tr2, 4000, &size) == 1);
+		for (i=10000; i<41000; i++) {
+			size_t size2;
+
+			if ((i >= 11000) && (i < 40000)) {
+				continue;
+			}
+			v = merge_get(tr1, i, &size) + merge_get(tr2, i, &size2);
+			TEST_CHECK((v == 1) && (size + size2 == sizeof(one)));
+		}
+		TEST_CHECK(merge_count(tr1) + merge_count(tr2) == 8001);
+
+		TEST_CHECK(tkvdb_tr_merge(tr1, tr2, NULL, NULL) == TKVDB_OK);
+		TEST_CHECK(merge_count(tr1) == 8000);
+		TEST_CHECK(merge_count(tr2) == 0);
+		TEST_CHECK(merge_get(tr1, 4000, &size) == 1);
+
+		/* merge to empty transaction */
+		TEST_CHECK(tkvdb_tr_merge(tr4, tr1, &merge_sum, NULL)
+			== TKVDB_OK);
+		TEST_CHECK(merge_count(tr4) == 8000);
+		TEST_CHECK(merge_count(tr1) == 0);
+
+		tr1->free(tr1);
+		tr2->free(tr2);
+		tr3->free(tr3);
+		tr4->free(tr4);
+	}
+
+	/* transactions with different layout of nodes can't be merged */
+	tr1 = merge_tr(0, 0);
+	other = merge_tr(VAL_ALIGNMENT, 0);
+	TEST_CHECK(tkvdb_tr_merge(tr1, other, NULL, NULL)
+		== TKVDB_NOT_SUPPORTED);
+	other->free(other);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 0);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, 100000);
+	other = tkvdb_tr_create(NULL, params);
+	TEST_CHECK(other != NULL);
+	tkvdb_params_free(params);
+	TEST_CHECK(other->begin(other) == TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_merge(tr1, other, NULL, NULL)
+		== TKVDB_NOT_SUPPORTED);
+	other->free(other);
+
+	tr1->free(tr1);
+}
+
+/* compare results of mget() with get() for existing keys, their prefixes
+ * and longer keys */
+static void
+mget_check(tkvdb_tr *tr)
+{
+	static tkvdb_datum keys[N * 3], vals[N * 3];
+	static TKVDB_RES results[N * 3];
+	static char longer[N][KLEN + 1];
+	size_t i, n = 0;
+
+	for (i=0; i<N; i++) {
+		keys[n].data = kvs_unsorted[i].key;
+		keys[n].size = kvs_unsorted[i].klen;
+		n++;
+
+		keys[n].data = kvs_unsorted[i].key;
+		keys[n].size = kvs_unsorted[i].klen / 2;
+		n++;
+
+		memcpy(longer[i], kvs_unsorted[i].key, kvs_unsorted[i].klen);
+		longer[i][kvs_unsorted[i].klen] = i;
+		keys[n].data = longer[i];
+		keys[n].size = kvs_unsorted[i].klen + 1;
+		n++;
+	}
+
+	TEST_CHECK(tr->mget(tr, keys, vals, results, n) == TKVDB_OK);
+
+	for (i=0; i<n; i++) {
+		tkvdb_datum dtv;
+		TKVDB_RES r;
+
+		r = tr->get(tr, &keys[i], &dtv);
+		TEST_CHECK(r == results[i]);
+		if ((i % 3) == 0) {
+			TEST_CHECK(r == TKVDB_OK);
+		}
+		if ((r == TKVDB_OK) && (results[i] == TKVDB_OK)) {
+			TEST_CHECK(dtv.size == vals[i].size);
+			TEST_CHECK(dtv.data == vals[i].data);
+		}
+	}
+}
+
+void
+test_mget(void)
+{
+	const char fn[] = "mget_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	TKVDB_RES r;
+	size_t i;
+	int aligned;
+
+	for (aligned=0; aligned<2; aligned++) {
+		params = tkvdb_params_create();
+		TEST_CHECK(params != NULL);
+		if (aligned) {
+			tkvdb_param_set(params, TKVDB_PARAM_ALIGNVAL,
+				VAL_ALIGNMENT);
+		}
+
+		/* RAM-only */
+		tr = tkvdb_tr_create(NULL, params);
+		TEST_CHECK(tr != NULL);
+		dtk.data = kvs[0].key;
+		dtk.size = kvs[0].klen;
+		TEST_CHECK(tr->mget(tr, &dtk, &dtv, &r, 1)
+			== TKVDB_NOT_STARTED);
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<N; i++) {
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		mget_check(tr);
+
+		/* less keys than size of group */
+		{
+			tkvdb_datum keys[3], vals[3];
+			TKVDB_RES results[3];
+
+			for (i=0; i<3; i++) {
+				keys[i].data = kvs[i].key;
+				keys[i].size = kvs[i].klen;
+				results[i] = TKVDB_IO_ERROR;
+			}
+			keys[2].size = kvs[2].klen / 2;
+			TEST_CHECK(tr->mget(tr, keys, vals, results, 3)
+				== TKVDB_OK);
+			for (i=0; i<3; i++) {
+				TEST_CHECK(results[i]
+					== tr->get(tr, &keys[i], &dtv));
+			}
+			TEST_CHECK(results[0] == TKVDB_OK);
+			TEST_CHECK(vals[1].size == kvs[1].vlen);
+			TEST_CHECK(memcmp(vals[1].data, kvs[1].val,
+				kvs[1].vlen) == 0);
+		}
+		tr->free(tr);
+
+		/* half of keys in file, half in transaction */
+		remove(fn);
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tr = tkvdb_tr_create(db, NULL);
+		TEST_CHECK(tr != NULL);
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		dtk.data = kvs[0].key;
+		dtk.size = kvs[0].klen;
+		TEST_CHECK(tr->mget(tr, &dtk, &dtv, &r, 1) == TKVDB_OK);
+		TEST_CHECK(r == TKVDB_EMPTY);
+		for (i=0; i<N; i+=2) {
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=1; i<N; i+=2) {
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		mget_check(tr);
+		TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+		tr->free(tr);
+		tkvdb_close(db);
+		tkvdb_params_free(params);
+		remove(fn);
+	}
+}
+
+#define LOADER_KEYS 20000
+
+struct loader_kv
+{
+	uint8_t key[16];
+	size_t klen;
+	uint32_t val;
+};
+
+static int
+loader_cmp(const void *a, const void *b)
+{
+	const struct loader_kv *x = a, *y = b;
+	int r;
+
+	r = memcmp(x->key, y->key, x->klen < y->klen ? x->klen : y->klen);
+	if (r != 0) {
+		return r;
+	}
+	return (x->klen > y->klen) - (x->klen < y->klen);
+}
+
+static int
+loader_add(tkvdb_loader *ldr, struct loader_kv *kv)
+{
+	tkvdb_datum dtk, dtv;
+
+	dtk.data = kv->key;
+	dtk.size = kv->klen;
+	dtv.data = &kv->val;
+	/* some keys have empty values */
+	dtv.size = (kv->val % 7) ? sizeof(kv->val) : 0;
+
+	return tkvdb_loader_add(ldr, &dtk, &dtv);
+}
+
+/* check that transaction contains exactly loaded keys */
+static void
+loader_check(tkvdb_tr *tr, struct loader_kv *kvs, size_t n)
+{
+	tkvdb_cursor *c;
+	size_t i;
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<n; i++) {
+		tkvdb_datum dtk, dtv;
+
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		if (kvs[i].val % 7) {
+			TEST_CHECK(dtv.size == sizeof(uint32_t));
+			TEST_CHECK(memcmp(dtv.data, &kvs[i].val,
+				sizeof(uint32_t)) == 0);
+		} else {
+			TEST_CHECK(dtv.size == 0);
+		}
+	}
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	i = 0;
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			TEST_CHECK(i < n);
+			if (i >= n) {
+				break;
+			}
+			TEST_CHECK(c->keysize(c) == kvs[i].klen);
+			TEST_CHECK(memcmp(c->key(c), kvs[i].key,
+				kvs[i].klen) == 0);
+			i++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+	TEST_CHECK(i == n);
+	c->free(c);
+
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+}
+
+void
+test_loader(void)
+{
+	const char fn[] = "loader_test.tkv";
+	struct loader_kv *kvs;
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_loader *ldr;
+	tkvdb_datum dtk, dtv;
+	size_t i, n = 0;
+
+	remove(fn);
+
+	/* decimal numbers without terminator (so many keys are prefixes
+	 * of other keys) and node with all 256 subnodes */
+	kvs = malloc((LOADER_KEYS + 257) * sizeof(struct loader_kv));
+	TEST_CHECK(kvs != NULL);
+	for (i=0; i<LOADER_KEYS; i++, n++) {
+		kvs[n].klen = sprintf((char *)kvs[n].key, "%u",
+			(unsigned int)i * 3);
+		kvs[n].val = i;
+	}
+	for (i=0; i<257; i++, n++) {
+		memcpy(kvs[n].key, "wide", 4);
+		kvs[n].key[4] = i;
+		kvs[n].klen = (i == 256) ? 4 : 5;
+		kvs[n].val = LOADER_KEYS + i;
+	}
+	qsort(kvs, n, sizeof(struct loader_kv), &loader_cmp);
+
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+
+	/* some keys from regular transaction, they are replaced */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.data = "old";
+	dtk.size = 3;
+	dtv = dtk;
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* nothing to load */
+	ldr = tkvdb_loader_create(db);
+	TEST_CHECK(ldr != NULL);
+	TEST_CHECK(tkvdb_loader_finish(ldr) == TKVDB_EMPTY);
+	tkvdb_loader_free(ldr);
+
+	/* keys must be in ascending order, wrong key is skipped */
+	ldr = tkvdb_loader_create(db);
+	TEST_CHECK(ldr != NULL);
+	TEST_CHECK(loader_add(ldr, &kvs[1]) == TKVDB_OK);
+	TEST_CHECK(loader_add(ldr, &kvs[1]) == TKVDB_CORRUPTED);
+	TEST_CHECK(loader_add(ldr, &kvs[0]) == TKVDB_CORRUPTED);
+	TEST_CHECK(loader_add(ldr, &kvs[2]) == TKVDB_OK);
+	TEST_CHECK(tkvdb_loader_finish(ldr) == TKVDB_OK);
+	tkvdb_loader_free(ldr);
+	loader_check(tr, kvs + 1, 2);
+
+	ldr = tkvdb_loader_create(db);
+	TEST_CHECK(ldr != NULL);
+	for (i=0; i<n; i++) {
+		TEST_CHECK(loader_add(ldr, &kvs[i]) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_loader_finish(ldr) == TKVDB_OK);
+	tkvdb_loader_free(ldr);
+
+	loader_check(tr, kvs, n);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.data = "old";
+	dtk.size = 3;
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_NOT_FOUND);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	tkvdb_close(db);
+
+	/* loaded database is regular one */
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	loader_check(tr, kvs, n);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.data = kvs[0].key;
+	dtk.size = kvs[0].klen;
+	TEST_CHECK(tr->del(tr, &dtk, 0) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	loader_check(tr, kvs + 1, n - 1);
+
+	tr->free(tr);
+	tkvdb_close(db);
+	free(kvs);
+	remove(fn);
+}
+
+/* count keys with cursor, check order */
+static int
+count_keys(tkvdb_tr *tr)
+{
+	tkvdb_cursor *c;
+	int n = 0, prev = -1;
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			int sym = ((unsigned char *)c->key(c))[1];
+
+			TEST_CHECK(c->keysize(c) == 2);
+			TEST_CHECK(sym > prev);
+			prev = sym;
+			n++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+
+	c->free(c);
+	return n;
+}
+
+/* grow node through all classes and shrink it back */
+void
+test_node_classes(void)
+{
+	const char fn[] = "classes_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	int i, r;
+	unsigned char k[2];
+	tkvdb_datum key, val;
+
+	remove(fn);
+
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 1);
+
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, params);
+	TEST_CHECK(tr != NULL);
+
+	key.data = k;
+	key.size = sizeof(k);
+	k[0] = 'k';
+
+	/* insert subnodes in descending order */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=255; i>=0; i--) {
+		k[1] = i;
+		val.data = &i;
+		val.size = sizeof(int);
+		TEST_CHECK(tr->put(tr, &key, &val) == TKVDB_OK);
+	}
+	TEST_CHECK(count_keys(tr) == 256);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* delete from disk-loaded nodes, check after each class boundary */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<256; i++) {
+		k[1] = i;
+		if ((i % 3) == 0) {
+			continue;
+		}
+		TEST_CHECK(tr->del(tr, &key, 0) == TKVDB_OK);
+		TEST_CHECK(tr->get(tr, &key, &val) == TKVDB_NOT_FOUND);
+	}
+	TEST_CHECK(count_keys(tr) == 86);
+
+	for (i=0; i<256; i+=3) {
+		k[1] = i;
+		r = tr->get(tr, &key, &val);
+		TEST_CHECK(r == TKVDB_OK);
+		TEST_CHECK((r == TKVDB_OK) && (*((int *)val.data) == i));
+		if (i > 12) {
+			TEST_CHECK(tr->del(tr, &key, 0) == TKVDB_OK);
+		}
+	}
+	TEST_CHECK(count_keys(tr) == 5);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* read back */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(count_keys(tr) == 5);
+	for (i=0; i<256; i++) {
+		k[1] = i;
+		r = tr->get(tr, &key, &val);
+		if (((i % 3) == 0) && (i <= 12)) {
+			TEST_CHECK(r == TKVDB_OK);
+		} else {
+			TEST_CHECK(r == TKVDB_NOT_FOUND);
+		}
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	tkvdb_close(db);
+	tkvdb_params_free(params);
+	remove(fn);
+}
+
+/* sparse and dense nodes on disk, subnodes written by this and by
+ * previous commits */
+void
+test_subnodes_encoding(void)
+{
+	const char fn[] = "subnodes_test.tkv";
+	const int nsubnodes[] = {1, 32, 33, 200, 256};
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	int i, j, mmap, r;
+	unsigned char k[2], v[300];
+	tkvdb_datum key, val;
+
+	key.data = k;
+	key.size = sizeof(k);
+	k[0] = 'k';
+
+	for (j=0; j<(int)(sizeof(nsubnodes) / sizeof(int)); j++) {
+		for (mmap=0; mmap<=1; mmap++) {
+			remove(fn);
+			val.data = v;
+			val.size = sizeof(v);
+
+			params = tkvdb_params_create();
+			TEST_CHECK(params != NULL);
+			tkvdb_param_set(params, TKVDB_PARAM_MMAP, mmap);
+
+			db = tkvdb_open(fn, params);
+			TEST_CHECK(db != NULL);
+			tr = tkvdb_tr_create(db, params);
+			TEST_CHECK(tr != NULL);
+
+			/* offsets of big values doesn't fit in one byte */
+			TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			for (i=0; i<nsubnodes[j]; i++) {
+				k[1] = i;
+				memset(v, i, sizeof(v));
+				TEST_CHECK(tr->put(tr, &key, &val)
+					== TKVDB_OK);
+			}
+			TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+			/* rewrite every other subnode */
+			TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			for (i=0; i<nsubnodes[j]; i+=2) {
+				k[1] = i;
+				memset(v, i + 1, sizeof(v));
+				TEST_CHECK(tr->put(tr, &key, &val)
+					== TKVDB_OK);
+			}
+			TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+			tr->free(tr);
+			tkvdb_close(db);
+
+			db = tkvdb_open(fn, params);
+			TEST_CHECK(db != NULL);
+			tr = tkvdb_tr_create(db, params);
+			TEST_CHECK(tr != NULL);
+
+			TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			TEST_CHECK(count_keys(tr) == nsubnodes[j]);
+			for (i=0; i<256; i++) {
+				k[1] = i;
+				r = tr->get(tr, &key, &val);
+				if (i >= nsubnodes[j]) {
+					TEST_CHECK(r == TKVDB_NOT_FOUND);
+					continue;
+				}
+				TEST_CHECK(r == TKVDB_OK);
+				TEST_CHECK((r == TKVDB_OK)
+					&& (val.size == sizeof(v))
+					&& (((unsigned char *)val.data)[0]
+					== (unsigned char)(i + !(i % 2))));
+			}
+			TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+			tr->free(tr);
+			tkvdb_close(db);
+			tkvdb_params_free(params);
+		}
+	}
+	remove(fn);
+}
+
+static TKVDB_RES
+trigger_basic(tkvdb_trigger_info *info)
+{
+	struct basic_trigger_data *data = info->userdata;
+
+	switch (info->type) {
+		case TKVDB_TRIGGER_UPDATE:
+			data->updates++;
+			break;
+
+		case TKVDB_TRIGGER_INSERT_NEWROOT:
+		case TKVDB_TRIGGER_INSERT_NEWNODE:
+		case TKVDB_TRIGGER_INSERT_SUBKEY:
+		case TKVDB_TRIGGER_INSERT_SHORTER:
+		case TKVDB_TRIGGER_INSERT_LONGER:
+		case TKVDB_TRIGGER_INSERT_SPLIT:
+			data->inserts++;
+			break;
+			break;
+
+		default:
+			break;
+	}
+
+	return TKVDB_OK;
+}
+
+void
+test_triggers_basic(void)
+{
+	tkvdb_tr *tr;
+	int i;
+	tkvdb_triggers *trg;
+	struct basic_trigger_data userdata1, userdata2, userdata3;
+	TKVDB_RES r;
+
+	userdata1.inserts = userdata1.updates = 0;
+	userdata2.inserts = userdata2.updates = 0;
+	userdata3.inserts = userdata3.updates = 0;
+
+	tr = tkvdb_tr_create(NULL, NULL);
+	TEST_CHECK(tr != NULL);
+
+	trg = tkvdb_triggers_create(128);
+	TEST_CHECK(trg != NULL);
+
+	r = tkvdb_triggers_add(trg, &trigger_basic, sizeof(uint64_t),
+		&userdata1);
+	TEST_CHECK(r == TKVDB_OK);
+
+	r = tkvdb_triggers_add(trg, &trigger_basic, sizeof(uint64_t),
+		&userdata2);
+	TEST_CHECK(r == TKVDB_OK);
+
+	r = tkvdb_triggers_add(trg, &trigger_basic, sizeof(uint64_t),
+		&userdata3);
+	TEST_CHECK(r == TKVDB_OK);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs_unsorted[i].key;
+		key.size = kvs_unsorted[i].klen;
+		val.data = kvs_unsorted[i].val;
+		val.size = kvs_unsorted[i].vlen;
+
+		/* 1 insert and 2 updates for each key */
+		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
+
+		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
+		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	tr->free(tr);
+	tkvdb_triggers_free(trg);
+
+	TEST_CHECK(userdata1.inserts + userdata1.updates == (N + N * 2));
+	TEST_CHECK(userdata2.inserts + userdata2.updates == (N + N * 2));
+	TEST_CHECK(userdata3.inserts + userdata3.updates == (N + N * 2));
+	TEST_CHECK(userdata1.inserts == userdata2.inserts);
+	TEST_CHECK(userdata2.inserts == userdata3.inserts);
+}
+
+
+static TKVDB_RES
+trigger_nth(tkvdb_trigger_info *info)
+{
+	size_t i;
+
+	switch (info->type) {
+		case TKVDB_TRIGGER_UPDATE:
+			break;
+		case TKVDB_TRIGGER_INSERT_NEWROOT:
+			*((uint64_t *)info->newroot) = 1;
+
+			break;
+		case TKVDB_TRIGGER_INSERT_NEWNODE:
+			*((uint64_t *)info->subnode1) = 1;
+
+			for (i=0; i<info->stack->size; i++) {
+				*((uint64_t *)info->stack->meta[i]) += 1;
+			}
+
+			break;
+		case TKVDB_TRIGGER_INSERT_SUBKEY:
+			*((uint64_t *)info->newroot) += 1;
+
+			for (i=0; i<info->stack->size; i++) {
+				*((uint64_t *)info->stack->meta[i]) += 1;
+			}
+
+			break;
+		case TKVDB_TRIGGER_INSERT_SHORTER:
+			*((uint64_t *)info->newroot) =
+			*((uint64_t *)info->subnode1) + 1;
+
+			for (i=0; i<info->stack->size; i++) {
+				*((uint64_t *)info->stack->meta[i]) += 1;
+			}
+
+			break;
+		case TKVDB_TRIGGER_INSERT_LONGER:
+			*((uint64_t *)info->newroot) += 1;
+			*((uint64_t *)info->subnode1) = 1;
+
+			for (i=0; i<info->stack->size; i++) {
+				*((uint64_t *)info->stack->meta[i]) += 1;
+			}
+
+			break;
+		case TKVDB_TRIGGER_INSERT_SPLIT:
+			*((uint64_t *)info->newroot) =
+				*((uint64_t *)info->subnode1) + 1;
+			*((uint64_t *)info->subnode2) = 1;
+
+			for (i=0; i<info->stack->size; i++) {
+				*((uint64_t *)info->stack->meta[i]) += 1;
+			}
+
+			break;
+
+		case TKVDB_TRIGGER_DELETE_ROOT:
+			break;
+
+		case TKVDB_TRIGGER_DELETE_PREFIX:
+			break;
+
+		case TKVDB_TRIGGER_DELETE_LEAF:
+			for (i=0; i<(info->stack->size - 1); i++) {
+				*((uint64_t *)info->stack->meta[i]) -= 1;
+			}
+			break;
+
+		case TKVDB_TRIGGER_DELETE_INTNODE:
+			for (i=0; i<info->stack->size; i++) {
+				*((uint64_t *)info->stack->meta[i]) -= 1;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return TKVDB_OK;
+}
+
+#define TKVDB_TRG_GET_NTH_REALLOC_KEY(K, LEN, A)                      \
 do {                                                                  \
 	if (A < (K->size + LEN)) {                                    \
 		void *tmp = realloc(K->data, K->size + LEN);          \
@@ -833,256 +3488,1128 @@ do {                                                                  \
 	}                                                             \
 } while (0)
 
-static TKVDB_RES
-tkvdb_get_nth(tkvdb_tr *tr, uint64_t n, tkvdb_datum *key, tkvdb_datum *val,
-		tkvdb_datum *prealloc)
+static TKVDB_RES
+tkvdb_get_nth(tkvdb_tr *tr, uint64_t n, tkvdb_datum *key, tkvdb_datum *val,
+		tkvdb_datum *prealloc)
+{
+	tkvdb_datum pfx, meta;
+	void *node, *subnode;
+	uint64_t s = 0;
+	TKVDB_RES r;
+	int i, prev_i = 0;
+	uint64_t nmeta;
+	size_t allocated;
+
+	if (prealloc) {
+		allocated = prealloc->size;
+		key->data = prealloc->data;
+	} else {
+		allocated = 0;
+		key->data = NULL;
+	}
+	key->size = 0;
+
+	/* get root node */
+	r = tr->subnode(tr, NULL, 0, &node, &pfx, val, &meta);
+	if (r != TKVDB_OK) {
+		return r;
+	}
+	nmeta = *((uint64_t *)meta.data);
+
+	if ((n + 1) > nmeta) {
+		return TKVDB_NOT_FOUND;
+	}
+next:
+	/* append prefix to key */
+	TKVDB_TRG_GET_NTH_REALLOC_KEY(key, pfx.size, allocated);
+	memcpy((char *)(key->data) + key->size, pfx.data, pfx.size);
+	key->size += pfx.size;
+
+	if (val->data) {
+		s += 1;
+		if (s == (n + 1)) {
+			goto ok;
+		}
+	}
+
+	for (i=0; i<256; i++) {
+		r = tr->subnode(tr, node, i, &subnode, &pfx, val, &meta);
+		if (r != TKVDB_OK) {
+			continue;
+		}
+
+		nmeta = *((uint64_t *)meta.data);
+
+		prev_i = i;
+
+		if ((s + nmeta) == (n + 1)) {
+			TKVDB_TRG_GET_NTH_REALLOC_KEY(key, 1, allocated);
+			((char *)(key->data))[key->size] = i;
+			key->size += 1;
+
+			if (!val->data) {
+				/* non-val node */
+				node = subnode;
+				prev_i = i;
+				goto next;
+			} else {
+				if (nmeta > 1) {
+					node = subnode;
+					prev_i = i;
+					goto next;
+				}
+				/* append last prefix */
+				TKVDB_TRG_GET_NTH_REALLOC_KEY(key, pfx.size,
+					allocated);
+				memcpy((char *)(key->data) + key->size,
+					pfx.data, pfx.size);
+				key->size += pfx.size;
+
+				goto ok;
+			}
+		} else if ((s + nmeta) > (n + 1)) {
+			node = subnode;
+
+			TKVDB_TRG_GET_NTH_REALLOC_KEY(key, 1, allocated);
+			((char *)(key->data))[key->size] = i;
+			key->size += 1;
+
+			prev_i = i;
+			goto next;
+		}
+		s += nmeta;
+	}
+
+	if ((!val->data) || (val->data && (nmeta > 1))) {
+		TKVDB_TRG_GET_NTH_REALLOC_KEY(key, 1, allocated);
+		((char *)(key->data))[key->size] = prev_i;
+		key->size += 1;
+
+		s -= nmeta;
+		node = subnode;
+		goto next;
+	}
+ok:
+	if (prealloc) {
+		prealloc->size = allocated;
+		prealloc->data = key->data;
+	}
+	return TKVDB_OK;
+}
+#undef TKVDB_TRG_GET_NTH_REALLOC_KEY
+
+void
+test_triggers_nth(void)
 {
-	tkvdb_datum pfx, meta;
-	void *node, *subnode;
-	uint64_t s = 0;
+	tkvdb_tr *tr;
+	int i;
+	tkvdb_triggers *trg;
 	TKVDB_RES r;
-	int i, prev_i = 0;
-	uint64_t nmeta;
-	size_t allocated;
 
-	if (prealloc) {
-		allocated = prealloc->size;
-		key->data = prealloc->data;
-	} else {
-		allocated = 0;
-		key->data = NULL;
+	tr = tkvdb_tr_create(NULL, NULL);
+	TEST_CHECK(tr != NULL);
+
+	trg = tkvdb_triggers_create(128);
+	TEST_CHECK(trg != NULL);
+
+	r = tkvdb_triggers_add(trg, &trigger_nth, sizeof(uint64_t), NULL);
+	TEST_CHECK(r == TKVDB_OK);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	/* fill transaction with unsorted kv-pairs */
+	for (i=0; i<N; i++) {
+		tkvdb_datum key, val;
+
+		key.data = kvs_unsorted[i].key;
+		key.size = kvs_unsorted[i].klen;
+		val.data = kvs_unsorted[i].val;
+		val.size = kvs_unsorted[i].vlen;
+
+		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
 	}
-	key->size = 0;
 
-	/* get root node */
-	r = tr->subnode(tr, NULL, 0, &node, &pfx, val, &meta);
-	if (r != TKVDB_OK) {
-		return r;
+	/* get all pairs by number */
+	for (i=0; i<N; i++) {
+		tkvdb_datum key, val, prealloc;
+		char databuf[KLEN];
+
+		memset(databuf, 0, sizeof(databuf));
+		prealloc.size = sizeof(databuf);
+		prealloc.data = databuf;
+
+		r = tkvdb_get_nth(tr, i, &key, &val, &prealloc);
+
+		TEST_CHECK(val.size == kvs[i].vlen);
+		TEST_CHECK(key.size == kvs[i].klen);
+		TEST_CHECK(memcmp(key.data, kvs[i].key, key.size) == 0);
+		TEST_CHECK(memcmp(val.data, kvs[i].val, val.size) == 0);
+	}
+
+	/* remove each 2-nd key-value pair */
+	for (i=0; i<N/2; i++) {
+		tkvdb_datum key;
+
+		key.data = kvs[i * 2].key;
+		key.size = kvs[i * 2].klen;
+
+		TEST_CHECK(tr->delx(tr, &key, 0, trg) == TKVDB_OK);
+	}
+
+	for (i=0; i<N/2; i++) {
+		tkvdb_datum key, val, prealloc;
+		char databuf[KLEN];
+
+		memset(databuf, 0, sizeof(databuf));
+		prealloc.size = sizeof(databuf);
+		prealloc.data = databuf;
+
+		r = tkvdb_get_nth(tr, i, &key, &val, &prealloc);
+
+		TEST_CHECK(val.size == kvs[i * 2 + 1].vlen);
+		TEST_CHECK(key.size == kvs[i * 2 + 1].klen);
+		TEST_CHECK(memcmp(key.data, kvs[i * 2 + 1].key, key.size) == 0);
+		TEST_CHECK(memcmp(val.data, kvs[i * 2 + 1].val, val.size) == 0);
+	}
+
+
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+	tr->free(tr);
+	tkvdb_triggers_free(trg);
+}
+
+/* check keys after vacuum, every third key is deleted */
+static void
+vacuum_check(tkvdb_tr *tr, size_t nextra)
+{
+	tkvdb_datum dtk, dtv;
+	size_t i;
+	char key[32];
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		TKVDB_RES r;
+
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		r = tr->get(tr, &dtk, &dtv);
+		if ((i % 3) == 0) {
+			TEST_CHECK(r == TKVDB_NOT_FOUND);
+			continue;
+		}
+		TEST_CHECK(r == TKVDB_OK);
+		if (r == TKVDB_OK) {
+			TEST_CHECK(dtv.size == kvs[i].vlen);
+			TEST_CHECK(memcmp(dtv.data, kvs[i].val, dtv.size) == 0);
+		}
+	}
+	for (i=0; i<nextra; i++) {
+		dtk.size = sprintf(key, "vacuum-%u", (unsigned int)i);
+		dtk.data = key;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+}
+
+void
+test_vacuum(void)
+{
+	const char fn[] = "data_test_vac.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr, *vac, *ram;
+	tkvdb_vacuum_stat st;
+	tkvdb_datum dtk, dtv;
+	uint64_t size_before, moved = 0, reclaimed = 0, pos = 0;
+	uint64_t root_off, gap_begin, gap_end;
+	size_t i, round, steps, nextra = 0;
+	char key[32];
+
+	remove(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	vac = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(vac != NULL);
+
+	TEST_CHECK(tkvdb_vacuum(vac, 0, &st) == TKVDB_EMPTY);
+
+	/* RAM-only transaction has no file to vacuum */
+	ram = tkvdb_tr_create(NULL, NULL);
+	TEST_CHECK(ram != NULL);
+	TEST_CHECK(tkvdb_vacuum(ram, 0, &st) == TKVDB_NOT_SUPPORTED);
+	ram->free(ram);
+
+	/* the same keys are written twice, so about half of file is free */
+	for (round=0; round<2; round++) {
+		for (i=0; i<N; i++) {
+			if ((i % 1000) == 0) {
+				TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			}
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			if ((i % 1000) == 999) {
+				TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+			}
+		}
+	}
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i+=3) {
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->del(tr, &dtk, 0) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+	/* vacuum in small steps, with transactions between them */
+	size_before = 0;
+	for (steps=0; steps<100000; steps++) {
+		TEST_CHECK(tkvdb_vacuum(vac, 64 * 1024, &st) == TKVDB_OK);
+		if (steps == 0) {
+			size_before = st.end;
+		}
+		TEST_CHECK(st.done || (st.pos >= pos));
+		pos = st.pos;
+		moved += st.moved;
+		reclaimed += st.reclaimed;
+		if (st.done) {
+			break;
+		}
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		dtk.size = sprintf(key, "vacuum-%u", (unsigned int)nextra);
+		dtk.data = key;
+		TEST_CHECK(tr->put(tr, &dtk, &dtk) == TKVDB_OK);
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+		nextra++;
+	}
+	TEST_CHECK(st.done);
+	TEST_CHECK(steps > 1);
+	TEST_CHECK(moved > 0);
+	TEST_CHECK(reclaimed > 0);
+	TEST_CHECK(st.end < size_before * 2 / 3);
+	TEST_CHECK(tkvdb_dbinfo(db, &root_off, &gap_begin, &gap_end)
+		== TKVDB_OK);
+	/* largest free extent is before the end of data */
+	TEST_CHECK(gap_begin <= gap_end);
+	TEST_CHECK(gap_end <= st.end);
+
+	vacuum_check(tr, nextra);
+
+	/* transaction started before vacuum can't be committed */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->put(tr, &dtk, &dtk) == TKVDB_OK);
+	TEST_CHECK(tkvdb_vacuum(vac, 0, &st) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_MODIFIED);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	vac->free(vac);
+	tkvdb_close(db);
+
+	/* whole pass in one step after reopen */
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	vac = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(vac != NULL);
+
+	vacuum_check(tr, nextra);
+	for (steps=0; steps<10; steps++) {
+		TEST_CHECK(tkvdb_vacuum(vac, 0, &st) == TKVDB_OK);
+		if (st.done) {
+			break;
+		}
+	}
+	TEST_CHECK(st.done);
+	vacuum_check(tr, nextra);
+
+	tr->free(tr);
+	vac->free(vac);
+	tkvdb_close(db);
+	remove(fn);
+}
+
+/* keys are rewritten many times with vacuum step after each commit,
+ * commits reuse free extents, so file doesn't grow */
+void
+test_freemap(void)
+{
+	const char fn[] = "data_test_freemap.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr, *vac;
+	tkvdb_vacuum_stat st;
+	tkvdb_datum dtk, dtv;
+	uint64_t first_end = 0, max_end = 0, root_off, gap_begin, gap_end;
+	size_t i, round, reused = 0;
+
+	remove(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	vac = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(vac != NULL);
+
+	for (round=0; round<10; round++) {
+		for (i=0; i<N; i++) {
+			if ((i % 1000) == 0) {
+				TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			}
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			if ((i % 1000) != 999) {
+				continue;
+			}
+
+			/* root of appended transaction is after the end of
+			 * data */
+			TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+			TEST_CHECK(tkvdb_dbinfo(db, &root_off, &gap_begin,
+				&gap_end) == TKVDB_OK);
+			if (root_off < max_end) {
+				reused++;
+			}
+
+			TEST_CHECK(tkvdb_vacuum(vac, 768 * 1024, &st)
+				== TKVDB_OK);
+			if (st.end > max_end) {
+				max_end = st.end;
+			}
+		}
+		if (round == 0) {
+			first_end = max_end;
+		}
+	}
+	TEST_CHECK(reused > 0);
+	TEST_CHECK(max_end < first_end * 3);
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i++) {
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.size == kvs[i].vlen);
+		TEST_CHECK(memcmp(dtv.data, kvs[i].val, dtv.size) == 0);
+	}
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+
+	tr->free(tr);
+	vac->free(vac);
+	tkvdb_close(db);
+	remove(fn);
+}
+
+/* compressible values and random ones (frames are stored as is), big
+ * value in its own frame, bulk loader and vacuum of compressed file */
+#define COMPRESS_KEYS 20000
+
+static void
+compress_check(tkvdb_tr *tr, size_t nkeys, const char *big, size_t big_size)
+{
+	tkvdb_datum dtk, dtv;
+	tkvdb_cursor *c;
+	size_t i, n;
+	char key[32], val[64];
+
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<nkeys; i++) {
+		TKVDB_RES r;
+
+		dtk.size = sprintf(key, "compress-%06u", (unsigned int)i);
+		dtk.data = key;
+		r = tr->get(tr, &dtk, &dtv);
+		TEST_CHECK(r == TKVDB_OK);
+		if (r == TKVDB_OK) {
+			TEST_CHECK(dtv.size == (size_t)sprintf(val,
+				"value of key %u", (unsigned int)i));
+			TEST_CHECK(memcmp(dtv.data, val, dtv.size) == 0);
+		}
+	}
+	for (i=0; i<N; i+=7) {
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(dtv.size == kvs[i].vlen);
+		TEST_CHECK(memcmp(dtv.data, kvs[i].val, dtv.size) == 0);
+	}
+	dtk.data = "big";
+	dtk.size = 3;
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(dtv.size == big_size);
+	TEST_CHECK(memcmp(dtv.data, big, big_size) == 0);
+
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	n = 0;
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			n++;
+		} while (c->next(c) == TKVDB_OK);
+	}
+	TEST_CHECK(n == (nkeys + (N + 6) / 7 + 1));
+	c->free(c);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
+}
+
+void
+test_compression(void)
+{
+	const char fn[] = "compress_test.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr, *vac;
+	tkvdb_params *params;
+	tkvdb_loader *ldr;
+	tkvdb_vacuum_stat st;
+	tkvdb_datum dtk, dtv;
+	uint64_t written[2], wal_bytes;
+	size_t i, steps, big_size = 200 * 1024;
+	int compress;
+	char key[32], val[64], *big;
+
+	big = malloc(big_size);
+	TEST_CHECK(big != NULL);
+	for (i=0; i<big_size; i++) {
+		big[i] = "abcd"[(i / 3) % 4];
+	}
+
+	for (compress=0; compress<=1; compress++) {
+		remove(fn);
+
+		params = tkvdb_params_create();
+		TEST_CHECK(params != NULL);
+		tkvdb_param_set(params, TKVDB_PARAM_COMPRESS, compress);
+		db = tkvdb_open(fn, params);
+		TEST_CHECK(db != NULL);
+		tkvdb_params_free(params);
+		tr = tkvdb_tr_create(db, NULL);
+		TEST_CHECK(tr != NULL);
+
+		for (i=0; i<COMPRESS_KEYS; i++) {
+			if ((i % 1000) == 0) {
+				TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+			}
+			dtk.size = sprintf(key, "compress-%06u",
+				(unsigned int)i);
+			dtk.data = key;
+			dtv.size = sprintf(val, "value of key %u",
+				(unsigned int)i);
+			dtv.data = val;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+			if ((i % 1000) == 999) {
+				TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+			}
+		}
+
+		TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+		for (i=0; i<N; i+=7) {
+			dtk.data = kvs[i].key;
+			dtk.size = kvs[i].klen;
+			dtv.data = kvs[i].val;
+			dtv.size = kvs[i].vlen;
+			TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		}
+		dtk.data = "big";
+		dtk.size = 3;
+		dtv.data = big;
+		dtv.size = big_size;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+
+		compress_check(tr, COMPRESS_KEYS, big, big_size);
+		TEST_CHECK(tkvdb_write_info(db, &written[compress],
+			&wal_bytes) == TKVDB_OK);
+
+		tr->free(tr);
+		tkvdb_close(db);
+	}
+	/* compressible part is most of data */
+	TEST_CHECK(written[1] < written[0] / 2);
+
+	/* compression is property of file, one set of frames is enough */
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_FRAME_CACHE, 1);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tkvdb_params_free(params);
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
+	compress_check(tr, COMPRESS_KEYS, big, big_size);
+
+	/* keys after existing ones */
+	ldr = tkvdb_loader_create(db);
+	TEST_CHECK(ldr != NULL);
+	for (i=0; i<COMPRESS_KEYS; i++) {
+		dtk.size = sprintf(key, "compress-%06u",
+			(unsigned int)(i + COMPRESS_KEYS));
+		dtk.data = key;
+		dtv.size = sprintf(val, "value of key %u",
+			(unsigned int)(i + COMPRESS_KEYS));
+		dtv.data = val;
+		TEST_CHECK(tkvdb_loader_add(ldr, &dtk, &dtv) == TKVDB_OK);
 	}
-	nmeta = *((uint64_t *)meta.data);
+	TEST_CHECK(tkvdb_loader_finish(ldr) == TKVDB_OK);
+	tkvdb_loader_free(ldr);
 
-	if ((n + 1) > nmeta) {
-		return TKVDB_NOT_FOUND;
-	}
-next:
-	/* append prefix to key */
-	TKVDB_TRG_GET_NTH_REALLOC_KEY(key, pfx.size, allocated);
-	memcpy((char *)(key->data) + key->size, pfx.data, pfx.size);
-	key->size += pfx.size;
+	/* loaded tree replaces previous one */
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	dtk.size = sprintf(key, "compress-%06u", 0);
+	dtk.data = key;
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_NOT_FOUND);
+	dtk.size = sprintf(key, "compress-%06u", COMPRESS_KEYS);
+	TEST_CHECK(tr->get(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
 
-	if (val->data) {
-		s += 1;
-		if (s == (n + 1)) {
-			goto ok;
+	/* previous keys are written again, old nodes are vacuumed */
+	for (i=0; i<COMPRESS_KEYS; i++) {
+		if ((i % 1000) == 0) {
+			TEST_CHECK(tr->begin(tr) == TKVDB_OK);
 		}
+		dtk.size = sprintf(key, "compress-%06u", (unsigned int)i);
+		dtk.data = key;
+		dtv.size = sprintf(val, "value of key %u", (unsigned int)i);
+		dtv.data = val;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+		if ((i % 1000) == 999) {
+			TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+		}
+	}
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<N; i+=7) {
+		dtk.data = kvs[i].key;
+		dtk.size = kvs[i].klen;
+		dtv.data = kvs[i].val;
+		dtv.size = kvs[i].vlen;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
 	}
+	dtk.data = "big";
+	dtk.size = 3;
+	dtv.data = big;
+	dtv.size = big_size;
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
 
-	for (i=0; i<256; i++) {
-		r = tr->subnode(tr, node, i, &subnode, &pfx, val, &meta);
-		if (r != TKVDB_OK) {
-			continue;
+	vac = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(vac != NULL);
+	for (steps=0; steps<10000; steps++) {
+		TEST_CHECK(tkvdb_vacuum(vac, 64 * 1024, &st) == TKVDB_OK);
+		if (st.done) {
+			break;
 		}
+	}
+	TEST_CHECK(st.done);
+	compress_check(tr, COMPRESS_KEYS * 2, big, big_size);
 
-		nmeta = *((uint64_t *)meta.data);
+	vac->free(vac);
+	tr->free(tr);
+	tkvdb_close(db);
+	free(big);
+	remove(fn);
+}
 
-		prev_i = i;
+/* each commit is a snapshot, old versions of keys are read while new
+ * ones are committed, vacuum waits for pinned snapshots */
+#define SNAPSHOT_KEYS 1000
 
-		if ((s + nmeta) == (n + 1)) {
-			TKVDB_TRG_GET_NTH_REALLOC_KEY(key, 1, allocated);
-			((char *)(key->data))[key->size] = i;
-			key->size += 1;
+static void
+snapshot_put(tkvdb_tr *tr, unsigned int version)
+{
+	tkvdb_datum dtk, dtv;
+	unsigned int i;
+	char key[32], val[32];
 
-			if (!val->data) {
-				/* non-val node */
-				node = subnode;
-				prev_i = i;
-				goto next;
-			} else {
-				if (nmeta > 1) {
-					node = subnode;
-					prev_i = i;
-					goto next;
-				}
-				/* append last prefix */
-				TKVDB_TRG_GET_NTH_REALLOC_KEY(key, pfx.size,
-					allocated);
-				memcpy((char *)(key->data) + key->size,
-					pfx.data, pfx.size);
-				key->size += pfx.size;
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<SNAPSHOT_KEYS; i++) {
+		dtk.size = sprintf(key, "snapshot-%04u", i);
+		dtk.data = key;
+		dtv.size = sprintf(val, "v%u-%u", version, i);
+		dtv.data = val;
+		TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	}
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+}
 
-				goto ok;
-			}
-		} else if ((s + nmeta) > (n + 1)) {
-			node = subnode;
+/* started transaction sees 'version' of all keys */
+static void
+snapshot_check(tkvdb_tr *tr, unsigned int version)
+{
+	tkvdb_datum dtk, dtv;
+	tkvdb_cursor *c;
+	unsigned int i;
+	size_t n;
+	char key[32], val[32];
 
-			TKVDB_TRG_GET_NTH_REALLOC_KEY(key, 1, allocated);
-			((char *)(key->data))[key->size] = i;
-			key->size += 1;
+	for (i=0; i<SNAPSHOT_KEYS; i+=97) {
+		TKVDB_RES r;
 
-			prev_i = i;
-			goto next;
+		dtk.size = sprintf(key, "snapshot-%04u", i);
+		dtk.data = key;
+		r = tr->get(tr, &dtk, &dtv);
+		TEST_CHECK(r == TKVDB_OK);
+		if (r == TKVDB_OK) {
+			TEST_CHECK(dtv.size
+				== (size_t)sprintf(val, "v%u-%u", version, i));
+			TEST_CHECK(memcmp(dtv.data, val, dtv.size) == 0);
 		}
-		s += nmeta;
 	}
 
-	if ((!val->data) || (val->data && (nmeta > 1))) {
-		TKVDB_TRG_GET_NTH_REALLOC_KEY(key, 1, allocated);
-		((char *)(key->data))[key->size] = prev_i;
-		key->size += 1;
-
-		s -= nmeta;
-		node = subnode;
-		goto next;
-	}
-ok:
-	if (prealloc) {
-		prealloc->size = allocated;
-		prealloc->data = key->data;
+	c = tkvdb_cursor_create(tr);
+	TEST_CHECK(c != NULL);
+	n = 0;
+	if (c->first(c) == TKVDB_OK) {
+		do {
+			n++;
+		} while (c->next(c) == TKVDB_OK);
 	}
-	return TKVDB_OK;
+	TEST_CHECK(n == SNAPSHOT_KEYS);
+	c->free(c);
 }
-#undef TKVDB_TRG_GET_NTH_REALLOC_KEY
 
 void
-test_triggers_nth(void)
+test_snapshots(void)
 {
-	tkvdb_tr *tr;
-	int i;
-	tkvdb_triggers *trg;
-	TKVDB_RES r;
+	const char fn[] = "data_test_snapshots.tkv";
+	tkvdb *db;
+	tkvdb_tr *tr, *snap, *vac;
+	tkvdb_snapshot snaps[16];
+	tkvdb_vacuum_stat st;
+	tkvdb_datum dtk, dtv;
+	uint64_t root_off, gap_begin, gap_end, id;
+	size_t n, steps;
+	unsigned int v;
 
-	tr = tkvdb_tr_create(NULL, NULL);
+	remove(fn);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	tr = tkvdb_tr_create(db, NULL);
 	TEST_CHECK(tr != NULL);
+	snap = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(snap != NULL);
+	vac = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(vac != NULL);
 
-	trg = tkvdb_triggers_create(128);
-	TEST_CHECK(trg != NULL);
-
-	r = tkvdb_triggers_add(trg, &trigger_nth, sizeof(uint64_t), NULL);
-	TEST_CHECK(r == TKVDB_OK);
-
-	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
-	/* fill transaction with unsorted kv-pairs */
-	for (i=0; i<N; i++) {
-		tkvdb_datum key, val;
-
-		key.data = kvs_unsorted[i].key;
-		key.size = kvs_unsorted[i].klen;
-		val.data = kvs_unsorted[i].val;
-		val.size = kvs_unsorted[i].vlen;
+	n = 16;
+	TEST_CHECK(tkvdb_snapshots(db, snaps, &n) == TKVDB_OK);
+	TEST_CHECK(n == 0);
 
-		TEST_CHECK(tr->putx(tr, &key, &val, trg) == TKVDB_OK);
+	for (v=0; v<4; v++) {
+		snapshot_put(tr, v);
 	}
 
-	/* get all pairs by number */
-	for (i=0; i<N; i++) {
-		tkvdb_datum key, val, prealloc;
-		char databuf[KLEN];
-
-		memset(databuf, 0, sizeof(databuf));
-		prealloc.size = sizeof(databuf);
-		prealloc.data = databuf;
+	/* newest first */
+	n = 16;
+	TEST_CHECK(tkvdb_snapshots(db, snaps, &n) == TKVDB_OK);
+	TEST_CHECK(n == 4);
+	TEST_CHECK(tkvdb_dbinfo(db, &root_off, &gap_begin, &gap_end)
+		== TKVDB_OK);
+	TEST_CHECK(snaps[0].root_off == root_off);
+	TEST_CHECK(snaps[0].transaction_id == snaps[3].transaction_id + 3);
+
+	for (v=0; v<4; v++) {
+		TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[3 - v].transaction_id)
+			== TKVDB_OK);
+		snapshot_check(snap, v);
+		TEST_CHECK(snap->rollback(snap) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[0].transaction_id + 1)
+		== TKVDB_NOT_FOUND);
+
+	/* new commit doesn't change snapshot */
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[3].transaction_id)
+		== TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[3].transaction_id)
+		== TKVDB_LOCKED);
+	snapshot_put(tr, 4);
+	snapshot_check(snap, 0);
+
+	/* snapshot is read-only */
+	dtk.data = "key";
+	dtk.size = 3;
+	dtv.data = "val";
+	dtv.size = 3;
+	TEST_CHECK(snap->put(snap, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(snap->commit(snap) == TKVDB_MODIFIED);
+	TEST_CHECK(snap->rollback(snap) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[3].transaction_id)
+		== TKVDB_OK);
+	TEST_CHECK(snap->commit(snap) == TKVDB_OK);
+
+	/* pinned snapshots are kept, pass moves nodes and waits for unpin */
+	id = snaps[3].transaction_id;
+	TEST_CHECK(tkvdb_snapshot_pin(db, id) == TKVDB_OK);
+	TEST_CHECK(tkvdb_vacuum(vac, 0, &st) == TKVDB_OK);
+	TEST_CHECK(!st.done);
+	TEST_CHECK(tkvdb_vacuum(vac, 0, &st) == TKVDB_LOCKED);
+	snapshot_put(tr, 5);
+	TEST_CHECK(tkvdb_tr_snapshot(snap, id) == TKVDB_OK);
+	snapshot_check(snap, 0);
+	TEST_CHECK(snap->rollback(snap) == TKVDB_OK);
+
+	/* pins are counted by id */
+	for (v=1; v<4; v++) {
+		TEST_CHECK(tkvdb_snapshot_pin(db, id) == TKVDB_OK);
+	}
+	TEST_CHECK(tkvdb_snapshot_pin(db, id) == TKVDB_ENOMEM);
+	n = 16;
+	TEST_CHECK(tkvdb_snapshots(db, snaps, &n) == TKVDB_OK);
+	TEST_CHECK((n > 0) && (snaps[n - 1].transaction_id == id));
+	TEST_CHECK(snaps[n - 1].pinned == 4);
+	TEST_CHECK(snaps[0].pinned == 0);
+	TEST_CHECK(tkvdb_snapshot_unpin(db, id) == TKVDB_OK);
+	TEST_CHECK(tkvdb_snapshot_unpin(db, id + 1) == TKVDB_NOT_FOUND);
+	/* stale pins */
+	TEST_CHECK(tkvdb_snapshot_unpin(db, TKVDB_PINS_ALL) == TKVDB_OK);
+	TEST_CHECK(tkvdb_snapshot_unpin(db, TKVDB_PINS_ALL)
+		== TKVDB_NOT_FOUND);
+
+	/* snapshot pinned after walk doesn't keep range of pass */
+	n = 16;
+	TEST_CHECK(tkvdb_snapshots(db, snaps, &n) == TKVDB_OK);
+	TEST_CHECK(tkvdb_snapshot_pin(db, snaps[0].transaction_id)
+		== TKVDB_OK);
+	TEST_CHECK(tkvdb_vacuum(vac, 0, &st) == TKVDB_OK);
+	TEST_CHECK(tkvdb_tr_snapshot(snap, id) == TKVDB_NOT_FOUND);
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[0].transaction_id)
+		== TKVDB_OK);
+	snapshot_check(snap, 5);
+	TEST_CHECK(snap->rollback(snap) == TKVDB_OK);
+	TEST_CHECK(tkvdb_snapshot_unpin(db, snaps[0].transaction_id)
+		== TKVDB_OK);
+
+	/* vacuum frees old snapshots */
+	for (steps=0; steps<1000; steps++) {
+		TEST_CHECK(tkvdb_vacuum(vac, 16 * 1024, &st) == TKVDB_OK);
+		if (st.done) {
+			break;
+		}
+	}
+	TEST_CHECK(st.done);
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[3].transaction_id)
+		== TKVDB_NOT_FOUND);
+	n = 16;
+	TEST_CHECK(tkvdb_snapshots(db, snaps, &n) == TKVDB_OK);
+	TEST_CHECK(n == 1);
+	TEST_CHECK(tkvdb_tr_snapshot(snap, snaps[0].transaction_id)
+		== TKVDB_OK);
+	snapshot_check(snap, 5);
+	TEST_CHECK(snap->rollback(snap) == TKVDB_OK);
+
+	vac->free(vac);
+	snap->free(snap);
+	tr->free(tr);
+	tkvdb_close(db);
+	remove(fn);
+}
 
-		r = tkvdb_get_nth(tr, i, &key, &val, &prealloc);
+/* handles with control page see commits without reading file, page
+ * which was not updated by other writer is detected by commit */
+static TKVDB_RES
+control_kv(tkvdb_tr *tr, const char *key, int put)
+{
+	tkvdb_datum dtk, dtv;
 
-		TEST_CHECK(val.size == kvs[i].vlen);
-		TEST_CHECK(key.size == kvs[i].klen);
-		TEST_CHECK(memcmp(key.data, kvs[i].key, key.size) == 0);
-		TEST_CHECK(memcmp(val.data, kvs[i].val, val.size) == 0);
+	dtk.data = (void *)key;
+	dtk.size = strlen(key);
+	if (!put) {
+		return tr->get(tr, &dtk, &dtv);
 	}
+	dtv.data = (void *)key;
+	dtv.size = dtk.size;
+	return tr->put(tr, &dtk, &dtv);
+}
 
-	/* remove each 2-nd key-value pair */
-	for (i=0; i<N/2; i++) {
-		tkvdb_datum key;
+void
+test_control(void)
+{
+	const char fn[] = "data_test_control.tkv";
+	const char ctl_fn[] = "data_test_control.tkv-ctl";
+	tkvdb *db1, *db2, *db3;
+	tkvdb_tr *tr1, *tr2, *tr3;
+	tkvdb_params *params;
+	uint64_t id;
+	FILE *f;
 
-		key.data = kvs[i * 2].key;
-		key.size = kvs[i * 2].klen;
+	remove(fn);
+	remove(ctl_fn);
 
-		TEST_CHECK(tr->delx(tr, &key, 0, trg) == TKVDB_OK);
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_CONTROL, 1);
+
+	db1 = tkvdb_open(fn, params);
+	TEST_CHECK(db1 != NULL);
+	db2 = tkvdb_open(fn, params);
+	TEST_CHECK(db2 != NULL);
+	tr1 = tkvdb_tr_create(db1, NULL);
+	TEST_CHECK(tr1 != NULL);
+	tr2 = tkvdb_tr_create(db2, NULL);
+	TEST_CHECK(tr2 != NULL);
+
+	f = fopen(ctl_fn, "rb");
+	TEST_CHECK(f != NULL);
+	if (f) {
+		fclose(f);
 	}
 
-	for (i=0; i<N/2; i++) {
-		tkvdb_datum key, val, prealloc;
-		char databuf[KLEN];
+	TEST_CHECK(tkvdb_last_commit(db2, &id) == TKVDB_EMPTY);
+	TEST_CHECK(tr1->begin(tr1) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr1, "key1", 1) == TKVDB_OK);
+	TEST_CHECK(tr1->commit(tr1) == TKVDB_OK);
+	TEST_CHECK(tkvdb_last_commit(db2, &id) == TKVDB_OK);
+	TEST_CHECK(id == 0);
+
+	TEST_CHECK(tr2->begin(tr2) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr2, "key1", 0) == TKVDB_OK);
+	TEST_CHECK(tr2->commit(tr2) == TKVDB_OK);
+
+	/* writer without control page */
+	db3 = tkvdb_open(fn, NULL);
+	TEST_CHECK(db3 != NULL);
+	tr3 = tkvdb_tr_create(db3, NULL);
+	TEST_CHECK(tr3 != NULL);
+	TEST_CHECK(tr3->begin(tr3) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr3, "key3", 1) == TKVDB_OK);
+	TEST_CHECK(tr3->commit(tr3) == TKVDB_OK);
+
+	TEST_CHECK(tr2->begin(tr2) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr2, "key3", 0) == TKVDB_NOT_FOUND);
+	TEST_CHECK(control_kv(tr2, "key2", 1) == TKVDB_OK);
+	TEST_CHECK(tr2->commit(tr2) == TKVDB_MODIFIED);
+	TEST_CHECK(tr2->rollback(tr2) == TKVDB_OK);
+
+	TEST_CHECK(tr2->begin(tr2) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr2, "key3", 0) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr2, "key2", 1) == TKVDB_OK);
+	TEST_CHECK(tr2->commit(tr2) == TKVDB_OK);
+
+	/* commit after own one trusts page */
+	TEST_CHECK(tr2->begin(tr2) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr2, "key4", 1) == TKVDB_OK);
+	TEST_CHECK(tr2->commit(tr2) == TKVDB_OK);
+
+	TEST_CHECK(tkvdb_last_commit(db1, &id) == TKVDB_OK);
+	TEST_CHECK(id == 3);
+	TEST_CHECK(tr1->begin(tr1) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr1, "key2", 0) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr1, "key3", 0) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr1, "key4", 0) == TKVDB_OK);
+	TEST_CHECK(tr1->rollback(tr1) == TKVDB_OK);
+
+	tr3->free(tr3);
+	tkvdb_close(db3);
+	tr2->free(tr2);
+	tkvdb_close(db2);
+	tr1->free(tr1);
+	tkvdb_close(db1);
+	tkvdb_params_free(params);
+	remove(fn);
+	remove(ctl_fn);
+}
 
-		memset(databuf, 0, sizeof(databuf));
-		prealloc.size = sizeof(databuf);
-		prealloc.data = databuf;
+#define CHECKSUM_KEYS 3000
 
-		r = tkvdb_get_nth(tr, i, &key, &val, &prealloc);
+/* offset of 'pattern' in buffer */
+static size_t
+checksum_find(const uint8_t *buf, size_t size, const void *pattern,
+	size_t len)
+{
+	size_t i;
 
-		TEST_CHECK(val.size == kvs[i * 2 + 1].vlen);
-		TEST_CHECK(key.size == kvs[i * 2 + 1].klen);
-		TEST_CHECK(memcmp(key.data, kvs[i * 2 + 1].key, key.size) == 0);
-		TEST_CHECK(memcmp(val.data, kvs[i * 2 + 1].val, val.size) == 0);
+	for (i=0; (i + len)<=size; i++) {
+		if (memcmp(buf + i, pattern, len) == 0) {
+			return i;
+		}
 	}
+	TEST_CHECK(0);
+	return 0;
+}
 
+static void
+checksum_write(const char *fn, const uint8_t *buf, size_t size)
+{
+	FILE *f;
 
-	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
-	tr->free(tr);
-	tkvdb_triggers_free(trg);
+	f = fopen(fn, "wb");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fwrite(buf, 1, size, f) == size);
+	fclose(f);
 }
 
-#if 0
-void
-test_vacuum(void)
+static void
+checksum_fill(const char *fn, int compress, const char *big,
+	size_t big_size)
 {
-	const char fn[] = "data_test_vac.tkv";
 	tkvdb *db;
-	tkvdb_tr *tr, *vac, *trres;
-	tkvdb_cursor *c;
-	size_t i, j;
-	const size_t NI = 10, NJ = 10, NK = 20;
-	uint64_t root_off, gap_begin, gap_end;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	tkvdb_datum dtk, dtv;
+	unsigned int i;
+	char key[32];
 
-	/* fill database */
-	db = tkvdb_open(fn, NULL);
+	remove(fn);
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_CHECKSUM, 1);
+	tkvdb_param_set(params, TKVDB_PARAM_COMPRESS, compress);
+	db = tkvdb_open(fn, params);
 	TEST_CHECK(db != NULL);
+	tkvdb_params_free(params);
 	tr = tkvdb_tr_create(db, NULL);
 	TEST_CHECK(tr != NULL);
 
-	for (i=0; i<NI; i++) {
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	for (i=0; i<CHECKSUM_KEYS; i++) {
+		sprintf(key, "checksum-%05u", i);
+		TEST_CHECK(control_kv(tr, key, 1) == TKVDB_OK);
+	}
+	dtk.data = "big";
+	dtk.size = 3;
+	dtv.data = (void *)big;
+	dtv.size = big_size;
+	TEST_CHECK(tr->put(tr, &dtk, &dtv) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
 
-		TEST_CHECK(tkvdb_begin(tr) == TKVDB_OK);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	TEST_CHECK(control_kv(tr, "second", 1) == TKVDB_OK);
+	TEST_CHECK(tr->commit(tr) == TKVDB_OK);
+	TEST_CHECK(tkvdb_verify(db) == TKVDB_OK);
 
-		for (j=0; j<NJ; j++) {
-			tkvdb_datum datkey;
-			char key[NK];
+	tr->free(tr);
+	tkvdb_close(db);
+}
 
-			sprintf(key, "%u-%03u", (unsigned int)i,
-				rand() % 1000);
-			datkey.len = strlen(key) + 1;
-			datkey.data = key;
+/* open file and get key, returns result of get() */
+static TKVDB_RES
+checksum_get(const char *fn, int mmap, const char *key)
+{
+	tkvdb *db;
+	tkvdb_tr *tr;
+	tkvdb_params *params;
+	TKVDB_RES r;
 
-			TEST_CHECK(tkvdb_put(tr, &datkey, &datkey)
-				== TKVDB_OK);
-		}
-		TEST_CHECK(tkvdb_commit(tr) == TKVDB_OK);
+	params = tkvdb_params_create();
+	TEST_CHECK(params != NULL);
+	tkvdb_param_set(params, TKVDB_PARAM_MMAP, mmap);
+	db = tkvdb_open(fn, params);
+	TEST_CHECK(db != NULL);
+	tkvdb_params_free(params);
+	if (!db) {
+		return TKVDB_IO_ERROR;
 	}
+	tr = tkvdb_tr_create(db, NULL);
+	TEST_CHECK(tr != NULL);
 
-	/* vacuum */
-	vac = tkvdb_tr_create(db, NULL);
-	TEST_CHECK(vac != NULL);
+	TEST_CHECK(tr->begin(tr) == TKVDB_OK);
+	r = control_kv(tr, key, 0);
+	TEST_CHECK(tr->rollback(tr) == TKVDB_OK);
 
-	trres = tkvdb_tr_create(db);
-	TEST_CHECK(trres != NULL);
+	tr->free(tr);
+	tkvdb_close(db);
+	return r;
+}
 
-	c = tkvdb_cursor_create(tr);
-	TEST_CHECK(c != NULL);
+static TKVDB_RES
+checksum_verify(const char *fn)
+{
+	tkvdb *db;
+	TKVDB_RES r;
 
-	TEST_CHECK(tkvdb_vacuum(tr, vac, trres, c) == TKVDB_OK);
+	db = tkvdb_open(fn, NULL);
+	TEST_CHECK(db != NULL);
+	if (!db) {
+		return TKVDB_IO_ERROR;
+	}
+	r = tkvdb_verify(db);
+	tkvdb_close(db);
+	return r;
+}
 
-	/* get file info */
-	TEST_CHECK(tkvdb_dbinfo(db, &root_off,
-		&gap_begin, &gap_end) == TKVDB_OK);
-	/*printf("%lu:%lu:%lu\n", root_off, gap_begin, gap_end);*/
+/* damaged nodes are found by get() and verify, torn tail of file is cut
+ * on open */
+void
+test_checksum(void)
+{
+	const char fn[] = "checksum_test.tkv";
+	uint8_t *buf, junk[1000];
+	size_t i, size, pos, big_size = 100 * 1024;
+	off_t first;
+	char *big;
+	int mmap;
+	FILE *f;
 
+	big = malloc(big_size);
+	TEST_CHECK(big != NULL);
+	for (i=0; i<big_size; i++) {
+		big[i] = 'a' + (i * 7) % 26;
+	}
 
-	tkvdb_tr_free(tr);
-	tkvdb_tr_free(vac);
-	tkvdb_tr_free(trres);
-	tkvdb_close(db);
+	/* compressed file */
+	checksum_fill(fn, 1, big, big_size);
+	TEST_CHECK(checksum_get(fn, 0, "checksum-00042") == TKVDB_OK);
+	TEST_CHECK(checksum_verify(fn) == TKVDB_OK);
+
+	checksum_fill(fn, 0, big, big_size);
+	TEST_CHECK(checksum_get(fn, 1, "checksum-00042") == TKVDB_OK);
+	TEST_CHECK(checksum_get(fn, 0, "big") == TKVDB_OK);
+	TEST_CHECK(checksum_verify(fn) == TKVDB_OK);
+
+	/* nodes of interrupted commit are cut */
+	size = wal_file_size(fn);
+	memset(junk, 0xab, sizeof(junk));
+	f = fopen(fn, "ab");
+	TEST_CHECK(f != NULL);
+	TEST_CHECK(fwrite(junk, 1, sizeof(junk), f) == sizeof(junk));
+	fclose(f);
+	TEST_CHECK(checksum_get(fn, 0, "second") == TKVDB_OK);
+	TEST_CHECK(wal_file_size(fn) == (off_t)size);
+
+	/* torn footer, previous commit is used */
+	buf = commit_threads_read(fn, &size);
+	pos = checksum_find(buf, size, "second", 6);
+	first = pos;
+	checksum_write(fn, buf, size - 10);
+	TEST_CHECK(checksum_get(fn, 0, "second") == TKVDB_NOT_FOUND);
+	TEST_CHECK(checksum_get(fn, 0, "checksum-00042") == TKVDB_OK);
+	TEST_CHECK(wal_file_size(fn) <= first);
+	free(buf);
+
+	/* damaged value */
+	buf = commit_threads_read(fn, &size);
+	pos = checksum_find(buf, size, "checksum-01234", 14);
+	buf[pos] ^= 1;
+	checksum_write(fn, buf, size);
+	for (mmap=0; mmap<=1; mmap++) {
+		TEST_CHECK(checksum_get(fn, mmap, "checksum-01234")
+			== TKVDB_CORRUPTED);
+		TEST_CHECK(checksum_get(fn, mmap, "checksum-02345")
+			== TKVDB_OK);
+	}
+	TEST_CHECK(checksum_verify(fn) == TKVDB_CORRUPTED);
+	buf[pos] ^= 1;
+
+	/* node bigger than read buffer */
+	pos = checksum_find(buf, size, big, 64) + big_size / 2;
+	buf[pos] ^= 1;
+	checksum_write(fn, buf, size);
+	TEST_CHECK(checksum_get(fn, 0, "big") == TKVDB_CORRUPTED);
+	TEST_CHECK(checksum_verify(fn) == TKVDB_CORRUPTED);
+	buf[pos] ^= 1;
+	checksum_write(fn, buf, size);
+	TEST_CHECK(checksum_get(fn, 0, "big") == TKVDB_OK);
+	TEST_CHECK(checksum_verify(fn) == TKVDB_OK);
+
+	free(buf);
+	free(big);
+	remove(fn);
 }
-#endif
 
 TEST_LIST = {
 	{ "open db", test_open_db },
@@ -1092,12 +4619,37 @@ TEST_LIST = {
 	{ "random seeks", test_seek },
 	{ "get", test_get },
 	{ "get/put aligned", test_get_put_aligned },
+	{ "mget", test_mget },
 	{ "db traversal aligned", test_dbtrav_aligned },
 	{ "delete", test_del },
 	{ "ram-only memory usage", test_ram_mem },
+	{ "nodes arena", test_arena },
+	{ "32-bit node references", test_ref32 },
+	{ "node classes", test_node_classes },
+	{ "subnodes encoding", test_subnodes_encoding },
+	{ "commit only changed nodes", test_dirty_commit },
+	{ "subnodes on disk", test_disk_subnodes },
+	{ "commit with small write buffer", test_write_buf },
+	{ "commit in many threads", test_commit_threads },
+	{ "asynchronous commit", test_async },
+	{ "asynchronous commit retry", test_async_retry },
+	{ "durability levels", test_durability },
+	{ "write-ahead log", test_wal },
+	{ "group commit", test_group_commit },
+	{ "nodes cache", test_cache },
+	{ "mmap", test_mmap },
+	{ "concurrent readers", test_readers },
+	{ "concurrent writers", test_writers },
+	{ "merge of transactions", test_merge },
+	{ "bulk loader", test_loader },
 	{ "triggers basic", test_triggers_basic },
 	{ "triggers nth", test_triggers_nth },
-	/*{ "vacuum", test_vacuum },*/
+	{ "vacuum", test_vacuum },
+	{ "freemap", test_freemap },
+	{ "compression", test_compression },
+	{ "snapshots", test_snapshots },
+	{ "control page", test_control },
+	{ "checksums", test_checksum },
 	{ 0 }
 };
 
@@ -24,13 +24,8 @@
 #define CURSOR_UPDATE_VAL()                                                  \
 do {                                                                         \
 	c->val_size = node->c.val_size;                                      \
-	if (node->c.type & TKVDB_NODE_LEAF) {                                \
-		c->val = ((TKVDB_MEMNODE_TYPE_LEAF *)node)->prefix_val_meta  \
-			+ node->c.prefix_size + node->c.val_pad;             \
-	} else {                                                             \
-		c->val = node->prefix_val_meta                               \
-			+ node->c.prefix_size + node->c.val_pad;             \
-	}                                                                    \
+	c->val = node->prefix_val_meta                                       \
+		+ node->c.prefix_size + node->c.val_pad;                     \
 } while (0)
 
 #else
@@ -38,13 +33,7 @@ do {                                                                         \
 #define CURSOR_UPDATE_VAL()                                                  \
 do {                                                                         \
 	c->val_size = node->c.val_size;                                      \
-	if (node->c.type & TKVDB_NODE_LEAF) {                                \
-		c->val = ((TKVDB_MEMNODE_TYPE_LEAF *)node)->prefix_val_meta  \
-			+ node->c.prefix_size;                               \
-	} else {                                                             \
-		c->val = node->prefix_val_meta                               \
-			+ node->c.prefix_size;                               \
-	}                                                                    \
+	c->val = node->prefix_val_meta + node->c.prefix_size;               \
 } while (0)
 
 
@@ -142,10 +131,11 @@ TKVDB_IMPL_SMALLEST(tkvdb_cursor *cr, TKVDB_MEMNODE_TYPE *node)
 	int off;
 	TKVDB_MEMNODE_TYPE *next;
 	tkvdb_cursor_data *c = cr->data;
+	tkvdb_tr_data *tr = c->tr->data;
 
 	for (;;) {
 		/* skip replaced nodes */
-		TKVDB_SKIP_RNODES(node);
+		TKVDB_SKIP_RNODES(tr, node);
 
 		/* if node has prefix, append it to cursor */
 		if (node->c.prefix_size > 0) {
@@ -153,17 +143,8 @@ TKVDB_IMPL_SMALLEST(tkvdb_cursor *cr, TKVDB_MEMNODE_TYPE *node)
 				node->c.prefix_size, 1) );
 
 			/* append prefix */
-			if (node->c.type & TKVDB_NODE_LEAF) {
-				TKVDB_MEMNODE_TYPE_LEAF *node_leaf;
-				node_leaf = (TKVDB_MEMNODE_TYPE_LEAF *)node;
-				memcpy(c->prefix + c->prefix_size,
-					node_leaf->prefix_val_meta,
-					node->c.prefix_size);
-			} else {
-				memcpy(c->prefix + c->prefix_size,
-					node->prefix_val_meta,
-					node->c.prefix_size);
-			}
+			memcpy(c->prefix + c->prefix_size,
+				node->prefix_val_meta, node->c.prefix_size);
 			c->prefix_size += node->c.prefix_size;
 		}
 
@@ -204,9 +185,10 @@ TKVDB_IMPL_BIGGEST(tkvdb_cursor *cr, TKVDB_MEMNODE_TYPE *node)
 	int off;
 	TKVDB_MEMNODE_TYPE *next;
 	tkvdb_cursor_data *c = cr->data;
+	tkvdb_tr_data *tr = c->tr->data;
 
 	for (;;) {
-		TKVDB_SKIP_RNODES(node);
+		TKVDB_SKIP_RNODES(tr, node);
 
 		/* if node has prefix, append it to cursor */
 		if (node->c.prefix_size > 0) {
@@ -214,17 +196,8 @@ TKVDB_IMPL_BIGGEST(tkvdb_cursor *cr, TKVDB_MEMNODE_TYPE *node)
 				node->c.prefix_size, 1) );
 
 			/* append prefix */
-			if (node->c.type & TKVDB_NODE_LEAF) {
-				TKVDB_MEMNODE_TYPE_LEAF *node_leaf;
-				node_leaf = (TKVDB_MEMNODE_TYPE_LEAF *)node;
-				memcpy(c->prefix + c->prefix_size,
-					node_leaf->prefix_val_meta,
-					node->c.prefix_size);
-			} else {
-				memcpy(c->prefix + c->prefix_size,
-					node->prefix_val_meta,
-					node->c.prefix_size);
-			}
+			memcpy(c->prefix + c->prefix_size,
+				node->prefix_val_meta, node->c.prefix_size);
 			c->prefix_size += node->c.prefix_size;
 		}
 
@@ -256,13 +229,15 @@ TKVDB_IMPL_BIGGEST(tkvdb_cursor *cr, TKVDB_MEMNODE_TYPE *node)
 	return TKVDB_OK;
 }
 
+/* get root node (or load it from disk) */
 static TKVDB_RES
-TKVDB_IMPL_CURSOR_LOAD_ROOT(tkvdb_cursor *cr)
+TKVDB_IMPL_CURSOR_LOAD_ROOT(tkvdb_cursor *cr, TKVDB_MEMNODE_TYPE **root)
 {
 	tkvdb_cursor_data *c = cr->data;
 	tkvdb_tr_data *tr = c->tr->data;
 
-	if (!tr->root) {
+	*root = TKVDB_LOAD_ACQ(tr->root);
+	if (!(*root)) {
 #ifndef TKVDB_PARAMS_NODBFILE
 		/* empty root node */
 		if (!tr->db) {
@@ -270,14 +245,14 @@ TKVDB_IMPL_CURSOR_LOAD_ROOT(tkvdb_cursor *cr)
 			return TKVDB_EMPTY;
 		}
 
-		if (tr->db->info.filesize == 0) {
+		if (tkvdb_root_off(tr) == 0) {
 			/* database is empty */
 			return TKVDB_EMPTY;
 		}
 		/* try to read root node */
 		TKVDB_EXEC( TKVDB_IMPL_NODE_READ(c->tr,
-			tr->db->info.footer.root_off,
-			(TKVDB_MEMNODE_TYPE **)&(tr->root)) );
+			tkvdb_root_off(tr), root) );
+		tr->root = *root;
 #else
 		return TKVDB_EMPTY;
 #endif
@@ -289,23 +264,21 @@ TKVDB_IMPL_CURSOR_LOAD_ROOT(tkvdb_cursor *cr)
 static TKVDB_RES
 TKVDB_IMPL_FIRST(tkvdb_cursor *cr)
 {
-	tkvdb_cursor_data *c = cr->data;
-	tkvdb_tr_data *tr = c->tr->data;
+	TKVDB_MEMNODE_TYPE *root;
 
 	tkvdb_cursor_reset(cr);
-	TKVDB_EXEC( TKVDB_IMPL_CURSOR_LOAD_ROOT(cr) );
-	return TKVDB_IMPL_SMALLEST(cr, tr->root);
+	TKVDB_EXEC( TKVDB_IMPL_CURSOR_LOAD_ROOT(cr, &root) );
+	return TKVDB_IMPL_SMALLEST(cr, root);
 }
 
 static TKVDB_RES
 TKVDB_IMPL_LAST(tkvdb_cursor *cr)
 {
-	tkvdb_cursor_data *c = cr->data;
-	tkvdb_tr_data *tr = c->tr->data;
+	TKVDB_MEMNODE_TYPE *root;
 
 	tkvdb_cursor_reset(cr);
-	TKVDB_EXEC( TKVDB_IMPL_CURSOR_LOAD_ROOT(cr) );
-	return TKVDB_IMPL_BIGGEST(cr, tr->root);
+	TKVDB_EXEC( TKVDB_IMPL_CURSOR_LOAD_ROOT(cr, &root) );
+	return TKVDB_IMPL_BIGGEST(cr, root);
 }
 
 static TKVDB_RES
@@ -409,22 +382,16 @@ TKVDB_IMPL_SEEK(tkvdb_cursor *cr, const tkvdb_datum *key, TKVDB_SEEK seek)
 	tkvdb_cursor_data *c = cr->data;
 	tkvdb_tr_data *tr = c->tr->data;
 
-	TKVDB_EXEC( TKVDB_IMPL_CURSOR_LOAD_ROOT(cr) );
+	TKVDB_EXEC( TKVDB_IMPL_CURSOR_LOAD_ROOT(cr, &node) );
 	tkvdb_cursor_reset(cr);
 
-	node = tr->root;
 	sym = key->data;
 
 next_node:
-	TKVDB_SKIP_RNODES(node);
+	TKVDB_SKIP_RNODES(tr, node);
 
 	pi = 0;
-	if (node->c.type & TKVDB_NODE_LEAF) {
-		prefix_val_meta =
-			((TKVDB_MEMNODE_TYPE_LEAF *)node)->prefix_val_meta;
-	} else {
-		prefix_val_meta = node->prefix_val_meta;
-	}
+	prefix_val_meta = node->prefix_val_meta;
 
 next_byte:
 
@@ -29,24 +29,24 @@ do {                                                                        \
 #define TKVDB_TRIGGERS_DELPREFIX(T, P, N)                                   \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_DELETE_PREFIX;                         \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(P);                             \
-	T->info.subnode1 = TKVDB_META_ADDR(N);                                    \
+	T->info.newroot = TKVDB_META_ADDR(P);                               \
+	T->info.subnode1 = TKVDB_META_ADDR(N);                              \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
 
 #define TKVDB_TRIGGERS_DELINTNODE(T, P, N)                                  \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_DELETE_INTNODE;                        \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(P);                             \
-	T->info.subnode1 = TKVDB_META_ADDR(N);                                    \
+	T->info.newroot = TKVDB_META_ADDR(P);                               \
+	T->info.subnode1 = TKVDB_META_ADDR(N);                              \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
 
 #define TKVDB_TRIGGERS_DELLEAF(T, P, N)                                     \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_DELETE_LEAF;                           \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(P);                             \
-	T->info.subnode1 = TKVDB_META_ADDR(N);                                    \
+	T->info.newroot = TKVDB_META_ADDR(P);                               \
+	T->info.subnode1 = TKVDB_META_ADDR(N);                              \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
 
@@ -59,65 +59,96 @@ do {                                                                        \
 
 #endif
 
+/* unlock parent of deleted node, it may be replaced with smaller one */
+#define TKVDB_OLC_UNLOCK_PREV(PREV)                                         \
+do {                                                                        \
+	if (!PREV) {                                                        \
+		break;                                                      \
+	}                                                                   \
+	if (PREV->c.replaced_by) {                                          \
+		TKVDB_OLC_UNLOCK_OBSOLETE(PREV);                            \
+	} else {                                                            \
+		TKVDB_OLC_UNLOCK(PREV);                                     \
+	}                                                                   \
+} while (0)
+
 static TKVDB_RES
 #ifdef TKVDB_TRIGGER
 TKVDB_IMPL_DO_DEL(tkvdb_tr *trns, TKVDB_MEMNODE_TYPE *node,
-	TKVDB_MEMNODE_TYPE *prev, int prev_off, int del_pfx,
-	tkvdb_triggers *triggers)
+	TKVDB_MEMNODE_TYPE *rchain,
+	TKVDB_MEMNODE_TYPE *prev, TKVDB_MEMNODE_TYPE *prev_rchain,
+	int prev_off, int del_pfx, tkvdb_triggers *triggers)
 #else
 TKVDB_IMPL_DO_DEL(tkvdb_tr *trns, TKVDB_MEMNODE_TYPE *node,
-	TKVDB_MEMNODE_TYPE *prev, int prev_off, int del_pfx)
+	TKVDB_MEMNODE_TYPE *rchain,
+	TKVDB_MEMNODE_TYPE *prev, TKVDB_MEMNODE_TYPE *prev_rchain,
+	int prev_off, int del_pfx)
 #endif
 {
 	tkvdb_tr_data *tr = trns->data;
+	TKVDB_RES r;
+	int leaf;
+
+	/* node with value and without subnodes */
+	leaf = (node->c.type & TKVDB_NODE_VAL) && (node->c.nsubnodes == 0);
+
+	if (!prev && (del_pfx || leaf)) {
+		TKVDB_MEMNODE_TYPE *newroot;
 
-	if (!prev) {
 		/* remove root node */
 		TKVDB_TRIGGERS_DELROOT(triggers);
 
-		TKVDB_IMPL_NODE_FREE(tr, node);
-		node = TKVDB_IMPL_NODE_NEW(trns, 0, 0, NULL, 0, NULL, 0, NULL);
-		if (!node) {
+		newroot = TKVDB_IMPL_NODE_NEW(trns, 0, TKVDB_NODE_CLASS_4,
+			0, NULL, 0, NULL, 0, NULL);
+		if (!newroot) {
+			TKVDB_OLC_UNLOCK(node);
 			return TKVDB_ENOMEM;
 		}
-		tr->root = node;
+		if (tr->params.tr_concurrent) {
+			TKVDB_IMPL_NODE_OBSOLETE(tr, node);
+		}
+		TKVDB_STORE_REL(tr->root, newroot);
+		TKVDB_OLC_UNLOCK_OBSOLETE(node);
+		TKVDB_IMPL_NODE_RETIRE(tr, rchain);
 
 		return TKVDB_OK;
 	}
 
-	if (del_pfx) {
-		TKVDB_TRIGGERS_DELPREFIX(triggers, prev, node);
-
-		prev->next[prev_off] = NULL;
-#ifndef TKVDB_PARAMS_NODBFILE
-		prev->fnext[prev_off] = 0;
-#endif
-		TKVDB_IMPL_NODE_FREE(tr, node);
-		return TKVDB_OK;
-	} else if (node->c.type & TKVDB_NODE_VAL) {
-		if (node->c.nsubnodes != 0) {
-			TKVDB_TRIGGERS_DELINTNODE(triggers, prev, node);
-
-			/* we have subnodes, so just clear value bit */
-			node->c.type &= ~TKVDB_NODE_VAL;
+	if (del_pfx || leaf) {
+		if (del_pfx) {
+			TKVDB_TRIGGERS_DELPREFIX(triggers, prev, node);
+			if (tr->params.tr_concurrent) {
+				TKVDB_IMPL_NODE_OBSOLETE(tr, node);
+			}
 		} else {
 			TKVDB_TRIGGERS_DELLEAF(triggers, prev, node);
+		}
 
-			/* no subnodes, delete node */
-			prev->next[prev_off] = NULL;
-#ifndef TKVDB_PARAMS_NODBFILE
-			prev->fnext[prev_off] = 0;
-#endif
+		r = TKVDB_IMPL_NODE_REMOVE(trns, prev, prev_rchain, prev_off);
+		TKVDB_OLC_UNLOCK_PREV(prev);
+		if (r != TKVDB_OK) {
+			TKVDB_OLC_UNLOCK(node);
+			return r;
+		}
+		TKVDB_OLC_UNLOCK_OBSOLETE(node);
+		TKVDB_IMPL_NODE_RETIRE(tr, rchain);
+		return TKVDB_OK;
+	}
 
-			prev->c.nsubnodes -= 1; /* XXX: not atomic */
+	r = TKVDB_NOT_FOUND;
+	if (node->c.type & TKVDB_NODE_VAL) {
+		TKVDB_TRIGGERS_DELINTNODE(triggers, prev, node);
 
-			TKVDB_IMPL_NODE_FREE(tr, node);
-		}
-	} else {
-		return TKVDB_NOT_FOUND;
+		/* we have subnodes, so just clear value bit */
+		TKVDB_STORE_REL(node->c.type, node->c.type & ~TKVDB_NODE_VAL);
+		node->c.dirty = 1;
+		r = TKVDB_OK;
 	}
 
-	return TKVDB_OK;
+	TKVDB_OLC_UNLOCK(node);
+	TKVDB_OLC_UNLOCK_PREV(prev);
+
+	return r;
 }
 
 static TKVDB_RES
@@ -129,29 +160,33 @@ TKVDB_IMPL_DEL(tkvdb_tr *trns, const tkvdb_datum *key, int del_pfx)
 #endif
 {
 	const unsigned char *sym;
-	TKVDB_MEMNODE_TYPE *node, *prev;
+	TKVDB_MEMNODE_TYPE *node, *prev, *next;
+	TKVDB_MEMNODE_TYPE *rnodes_chain, *prev_rchain = NULL;
 	size_t pi;
 	unsigned char *prefix_val_meta;
-	int prev_off = 0;
+	int slot, prev_off = 0;
+	unsigned int v = 0, prev_v = 0;
 	tkvdb_tr_data *tr = trns->data;
 
 	if (!tr->started) {
 		return TKVDB_NOT_STARTED;
 	}
 
+restart:
 #ifdef TKVDB_TRIGGER
 	/* resets triggers stack to initial state */
 	triggers->stack.size = 0;
 #endif
 
 	/* check root */
-	if (tr->root == NULL) {
+	node = TKVDB_LOAD_ACQ(tr->root);
+	if (node == NULL) {
 #ifndef TKVDB_PARAMS_NODBFILE
-		if (tr->db && (tr->db->info.filesize > 0)) {
+		if (tr->db && (tkvdb_root_off(tr) > 0)) {
 			/* we have underlying non-empty db file */
 			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
-				tr->db->info.footer.root_off,
-				(TKVDB_MEMNODE_TYPE **)&(tr->root)) );
+				tkvdb_root_off(tr), &node) );
+			tr->root = node;
 		} else
 #endif
 		{
@@ -160,19 +195,15 @@ TKVDB_IMPL_DEL(tkvdb_tr *trns, const tkvdb_datum *key, int del_pfx)
 	}
 
 	sym = key->data;
-	node = tr->root;
 	prev = NULL;
 
 next_node:
-	TKVDB_SKIP_RNODES(node);
+	rnodes_chain = node;
+	TKVDB_SKIP_RNODES(tr, node);
+	TKVDB_OLC_READ(node, v);
 
 	pi = 0;
-	if (node->c.type & TKVDB_NODE_LEAF) {
-		prefix_val_meta =
-			((TKVDB_MEMNODE_TYPE_LEAF *)node)->prefix_val_meta;
-	} else {
-		prefix_val_meta = node->prefix_val_meta;
-	}
+	prefix_val_meta = node->prefix_val_meta;
 
 	TKVDB_TRIGGER_NODE_PUSH(triggers, node, prefix_val_meta);
 
@@ -182,45 +213,76 @@ next_byte:
 		/* end of key */
 		if ((pi == node->c.prefix_size) || (del_pfx)) {
 			/* exact match or we should delete by prefix */
+			if (prev) {
+				TKVDB_OLC_LOCK(prev, prev_v);
+			}
+			if (tr->params.tr_concurrent
+				&& !tkvdb_olc_lock(&node->c.version, v)) {
+
+				TKVDB_OLC_UNLOCK_PREV(prev);
+				goto restart;
+			}
 #ifdef TKVDB_TRIGGER
-			return TKVDB_IMPL_DO_DEL(trns, node, prev, prev_off,
-				del_pfx, triggers);
+			return TKVDB_IMPL_DO_DEL(trns, node, rnodes_chain,
+				prev, prev_rchain, prev_off, del_pfx,
+				triggers);
 #else
-			return TKVDB_IMPL_DO_DEL(trns, node, prev, prev_off,
-				del_pfx);
+			return TKVDB_IMPL_DO_DEL(trns, node, rnodes_chain,
+				prev, prev_rchain, prev_off, del_pfx);
 #endif
 		}
+
+		/* key is shorter than prefix */
+		return TKVDB_NOT_FOUND;
 	}
 
 	if (pi >= node->c.prefix_size) {
 		/* end of prefix */
-		if (node->next[*sym] != NULL) {
+		if (node->c.type & TKVDB_NODE_LEAF) {
+			return TKVDB_NOT_FOUND;
+		}
+
+		slot = TKVDB_IMPL_NODE_SLOT(node, *sym);
+		if (slot < 0) {
+			TKVDB_OLC_CHECK(node, v);
+			return TKVDB_NOT_FOUND;
+		}
+
+		next = TKVDB_REF_NODE(tr,
+			TKVDB_LOAD_ACQ(TKVDB_NODE_NEXT(node)[slot]));
+		if (next != NULL) {
+			TKVDB_OLC_CHECK(node, v);
+
 			/* continue with next node */
 			prev = node;
+			prev_rchain = rnodes_chain;
 			prev_off = *sym;
+			prev_v = v;
 
-			node = node->next[*sym];
+			node = next;
 			sym++;
 			goto next_node;
 		}
 #ifndef TKVDB_PARAMS_NODBFILE
-		else if (tr->db && (node->fnext[*sym] != 0)) {
+		else if (tr->db && (TKVDB_NODE_FNEXT(node, slot) != 0)) {
 			TKVDB_MEMNODE_TYPE *tmp;
 
 			/* load subnode from disk */
 			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
-				node->fnext[*sym], &tmp) );
+				TKVDB_NODE_FNEXT(node, slot), &tmp) );
 
 			prev = node;
+			prev_rchain = rnodes_chain;
 			prev_off = *sym;
 
-			node->next[*sym] = tmp;
+			TKVDB_NODE_NEXT(node)[slot] = TKVDB_NODE_REF(tr, tmp);
 			node = tmp;
 			sym++;
 			goto next_node;
 		}
 #endif
 		else {
+			TKVDB_OLC_CHECK(node, v);
 			return TKVDB_NOT_FOUND;
 		}
 	}
@@ -240,13 +302,13 @@ next_byte:
 #undef TKVDB_TRIGGERS_DELPREFIX
 #undef TKVDB_TRIGGERS_DELINTNODE
 #undef TKVDB_TRIGGERS_DELLEAF
+#undef TKVDB_OLC_UNLOCK_PREV
 
-#undef TKVDB_META_ADDR_LEAF
-#undef TKVDB_META_ADDR_NONLEAF
 #undef TKVDB_META_ADDR
 #undef TKVDB_INC_VOID_PTR
 #undef TKVDB_CALL_ALL_TRIGGER_FUNCTIONS
 
 #undef TKVDB_TRIGGER_NODE_PUSH
+#undef TKVDB_TRIGGER_NODE_POP
 
 #undef TKVDB_VAL_ALIGN_PAD
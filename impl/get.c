@@ -14,6 +14,12 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef TKVDB_PARAMS_ALIGN_VAL
+#define TKVDB_MAP_ALIGN ((size_t)tr->params.alignval)
+#else
+#define TKVDB_MAP_ALIGN 0
+#endif
+
 /* get value for given key */
 static TKVDB_RES
 #ifdef TKVDB_TRIGGER
@@ -23,13 +29,18 @@ TKVDB_IMPL_GET(tkvdb_tr *trns, const tkvdb_datum *key, tkvdb_datum *val,
 TKVDB_IMPL_GET(tkvdb_tr *trns, const tkvdb_datum *key, tkvdb_datum *val)
 #endif
 {
-	const unsigned char *sym;
+	const unsigned char *sym, *key_end;
 	unsigned char *prefix_val_meta;
 	size_t pi;
-	TKVDB_MEMNODE_TYPE *node = NULL;
+	int slot;
+	unsigned int v = 0;
+#ifndef TKVDB_PARAMS_NODBFILE
+	int found;
+#endif
+	TKVDB_MEMNODE_TYPE *node = NULL, *next;
 	tkvdb_tr_data *tr = trns->data;
 
-	if (!tr->started) {
+	if (!TKVDB_LOAD_ACQ(tr->started)) {
 		return TKVDB_NOT_STARTED;
 	}
 
@@ -37,14 +48,25 @@ TKVDB_IMPL_GET(tkvdb_tr *trns, const tkvdb_datum *key, tkvdb_datum *val)
 	(void)triggers;
 #endif
 
-	/* check root */
-	if (tr->root == NULL) {
+	key_end = (unsigned char *)key->data + key->size;
+
+restart:
+	/* check root, it is loaded once since writer may replace it */
+	node = TKVDB_LOAD_ACQ(tr->root);
+	if (node == NULL) {
 #ifndef TKVDB_PARAMS_NODBFILE
-		if (tr->db && (tr->db->info.filesize > 0)) {
+		if (tr->db && (tkvdb_root_off(tr) > 0)) {
 			/* we have underlying non-empty db file */
+			found = tkvdb_map_get(tr->db,
+				tkvdb_root_off(tr),
+				key->data, key_end, val, TKVDB_MAP_ALIGN);
+			if (found >= 0) {
+				return found ? TKVDB_OK : TKVDB_NOT_FOUND;
+			}
+
 			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
-				tr->db->info.footer.root_off,
-				(TKVDB_MEMNODE_TYPE **)&(tr->root)) );
+				tkvdb_root_off(tr), &node) );
+			tr->root = node;
 		} else
 #endif
 		{
@@ -53,22 +75,17 @@ TKVDB_IMPL_GET(tkvdb_tr *trns, const tkvdb_datum *key, tkvdb_datum *val)
 	}
 
 	sym = key->data;
-	node = tr->root;
 
 next_node:
-	TKVDB_SKIP_RNODES(node);
+	TKVDB_SKIP_RNODES(tr, node);
+	TKVDB_OLC_READ(node, v);
 
 	pi = 0;
-	if (node->c.type & TKVDB_NODE_LEAF) {
-		prefix_val_meta =
-			((TKVDB_MEMNODE_TYPE_LEAF *)node)->prefix_val_meta;
-	} else {
-		prefix_val_meta = node->prefix_val_meta;
-	}
+	prefix_val_meta = node->prefix_val_meta;
 
 next_byte:
 
-	if (sym >= ((unsigned char *)key->data + key->size)) {
+	if (sym >= key_end) {
 		/* end of key */
 		if ((pi == node->c.prefix_size)
 			&& (node->c.type & TKVDB_NODE_VAL)) {
@@ -80,8 +97,10 @@ next_byte:
 #else
 			val->data = prefix_val_meta + node->c.prefix_size;
 #endif
+			TKVDB_OLC_CHECK(node, v);
 			return TKVDB_OK;
 		} else {
+			TKVDB_OLC_CHECK(node, v);
 			return TKVDB_NOT_FOUND;
 		}
 	}
@@ -90,28 +109,49 @@ next_byte:
 		/* end of prefix */
 		if (node->c.type & TKVDB_NODE_LEAF) {
 			return TKVDB_NOT_FOUND;
-		} else if (node->next[*sym] != NULL) {
+		}
+
+		slot = TKVDB_IMPL_NODE_SLOT(node, *sym);
+		if (slot < 0) {
+			TKVDB_OLC_CHECK(node, v);
+			return TKVDB_NOT_FOUND;
+		}
+
+		next = TKVDB_REF_NODE(tr,
+			TKVDB_LOAD_ACQ(TKVDB_NODE_NEXT(node)[slot]));
+		if (next != NULL) {
+			TKVDB_OLC_CHECK(node, v);
+
 			/* continue with next node */
-			node = node->next[*sym];
+			node = next;
 			sym++;
 			goto next_node;
 		}
 #ifndef TKVDB_PARAMS_NODBFILE
-		else if (tr->db && (node->fnext[*sym] != 0)) {
+		else if (tr->db && (TKVDB_NODE_FNEXT(node, slot) != 0)) {
 			TKVDB_MEMNODE_TYPE *tmp;
 			uint64_t off;
 
+			off = TKVDB_NODE_FNEXT(node, slot);
+
+			/* try to find rest of key in mapped file */
+			found = tkvdb_map_get(tr->db, off, sym + 1, key_end,
+				val, TKVDB_MAP_ALIGN);
+			if (found >= 0) {
+				return found ? TKVDB_OK : TKVDB_NOT_FOUND;
+			}
+
 			/* load subnode from disk */
-			off = node->fnext[*sym];
 			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns, off, &tmp) );
 
-			node->next[*sym] = tmp;
+			TKVDB_NODE_NEXT(node)[slot] = TKVDB_NODE_REF(tr, tmp);
 			node = tmp;
 			sym++;
 			goto next_node;
 		}
 #endif
 		else {
+			TKVDB_OLC_CHECK(node, v);
 			return TKVDB_NOT_FOUND;
 		}
 	}
@@ -127,3 +167,136 @@ next_byte:
 	return TKVDB_OK;
 }
 
+/* get values for many keys, traversals of different keys are interleaved
+ * 'results[i]' is result of lookup of 'keys[i]' */
+static TKVDB_RES
+TKVDB_IMPL_MGET(tkvdb_tr *trns, const tkvdb_datum *keys, tkvdb_datum *vals,
+	TKVDB_RES *results, size_t n)
+{
+	struct
+	{
+		size_t i;                       /* index of key */
+		const unsigned char *sym;       /* rest of key */
+		TKVDB_MEMNODE_TYPE *node;       /* next node, prefetched */
+	} st[TKVDB_MGET_GROUP];
+
+	TKVDB_MEMNODE_TYPE *root, *node, *next;
+	const unsigned char *sym, *key_end;
+	unsigned char *prefix_val_meta;
+	size_t i, s, nkey = 0, active = 0, nslots;
+	int slot;
+	tkvdb_tr_data *tr = trns->data;
+
+	if (!TKVDB_LOAD_ACQ(tr->started)) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	root = TKVDB_LOAD_ACQ(tr->root);
+	if ((root == NULL) || tr->params.tr_concurrent) {
+		/* nodes should be read from file or may be changed by
+		   other threads, search keys one by one */
+		for (i=0; i<n; i++) {
+			results[i] = TKVDB_IMPL_GET(trns, &keys[i], &vals[i]);
+		}
+		return TKVDB_OK;
+	}
+
+	/* start first group */
+	for (s=0; (s < TKVDB_MGET_GROUP) && (nkey < n); s++, nkey++) {
+		st[s].i = nkey;
+		st[s].sym = keys[nkey].data;
+		st[s].node = root;
+		active++;
+	}
+	/* with less keys than group size only part of slots is used */
+	nslots = s;
+
+	while (active > 0) {
+		for (s=0; s<nslots; s++) {
+			if (st[s].node == NULL) {
+				continue;
+			}
+
+			i = st[s].i;
+			node = st[s].node;
+			sym = st[s].sym;
+			key_end = (unsigned char *)keys[i].data + keys[i].size;
+
+			TKVDB_SKIP_RNODES(tr, node);
+			prefix_val_meta = node->prefix_val_meta;
+
+			if (((size_t)(key_end - sym) < node->c.prefix_size)
+				|| (memcmp(prefix_val_meta, sym,
+					node->c.prefix_size) != 0)) {
+
+				results[i] = TKVDB_NOT_FOUND;
+				goto key_done;
+			}
+			sym += node->c.prefix_size;
+
+			if (sym == key_end) {
+				if (!(node->c.type & TKVDB_NODE_VAL)) {
+					results[i] = TKVDB_NOT_FOUND;
+					goto key_done;
+				}
+				vals[i].size = node->c.val_size;
+#ifdef TKVDB_PARAMS_ALIGN_VAL
+				vals[i].data = prefix_val_meta
+					+ node->c.prefix_size
+					+ node->c.val_pad;
+#else
+				vals[i].data = prefix_val_meta
+					+ node->c.prefix_size;
+#endif
+				results[i] = TKVDB_OK;
+				goto key_done;
+			}
+
+			if (node->c.type & TKVDB_NODE_LEAF) {
+				results[i] = TKVDB_NOT_FOUND;
+				goto key_done;
+			}
+
+			slot = TKVDB_IMPL_NODE_SLOT(node, *sym);
+			if (slot < 0) {
+				results[i] = TKVDB_NOT_FOUND;
+				goto key_done;
+			}
+
+			next = TKVDB_REF_NODE(tr,
+				TKVDB_LOAD_ACQ(TKVDB_NODE_NEXT(node)[slot]));
+			if (next != NULL) {
+				/* switch to other key while node is loaded */
+				TKVDB_PREFETCH(next);
+				st[s].node = next;
+				st[s].sym = sym + 1;
+				continue;
+			}
+#ifndef TKVDB_PARAMS_NODBFILE
+			if (tr->db && (TKVDB_NODE_FNEXT(node, slot) != 0)) {
+				/* subtree is on disk */
+				results[i] = TKVDB_IMPL_GET(trns, &keys[i],
+					&vals[i]);
+				goto key_done;
+			}
+#endif
+			results[i] = TKVDB_NOT_FOUND;
+
+key_done:
+			/* replace with next key */
+			if (nkey < n) {
+				st[s].i = nkey;
+				st[s].sym = keys[nkey].data;
+				st[s].node = root;
+				nkey++;
+			} else {
+				st[s].node = NULL;
+				active--;
+			}
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+#undef TKVDB_MAP_ALIGN
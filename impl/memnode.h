@@ -16,13 +16,44 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* reference to node in memory (subnode or replacing node)
+ * with TKVDB_PARAMS_REF32 all nodes are placed in preallocated transaction
+ * buffer, and reference is 32-bit offset from start of buffer in units of
+ * node alignment (so buffer may be up to 64G). Zero is NULL in both cases
+ * 'TR' is transaction data (tkvdb_tr_data *) */
+#ifdef TKVDB_PARAMS_REF32
 
-/* node in memory */
+#define TKVDB_REF uint32_t
+
+#define TKVDB_REF_NODE(TR, REF)                                           \
+	((TKVDB_MEMNODE_TYPE *)tkvdb_arena_ref_ptr(&(TR)->arena, (REF)))
+
+#define TKVDB_NODE_REF(TR, NODE) tkvdb_arena_ptr_ref(&(TR)->arena, (NODE))
+
+#else
+
+#define TKVDB_REF void *
+
+#define TKVDB_REF_NODE(TR, REF) ((void)(TR), (TKVDB_MEMNODE_TYPE *)(REF))
+#define TKVDB_NODE_REF(TR, NODE) ((void)(TR), (void *)(NODE))
+
+#endif
+
+/* node in memory
+ * header starts with fields used by lookups, disk bookkeeping is at the
+ * end. Positions of subnodes in file are kept in separate array which is
+ * allocated only for nodes with subnodes on disk (nodes loaded from file
+ * and their copies) */
 typedef struct TKVDB_MEMNODE_TYPE_COMMON
 {
-	int type;
+	uint8_t type;
+	uint8_t nclass;                   /* class of non-leaf node */
+	uint8_t dirty;                    /* node differs from disk copy */
+	uint8_t aclass;                   /* size class of memory block */
+	unsigned int version;             /* optimistic lock */
+	unsigned int nsubnodes;           /* number of subnodes */
 
-	struct TKVDB_MEMNODE_TYPE *replaced_by;
+	TKVDB_REF replaced_by;
 
 	size_t prefix_size;
 	size_t val_size;
@@ -33,49 +64,80 @@ typedef struct TKVDB_MEMNODE_TYPE_COMMON
 	size_t meta_pad;                  /* and metadata */
 #endif
 
-	uint64_t disk_size;               /* size of node on disk */
+#ifndef TKVDB_PARAMS_NODBFILE
 	uint64_t disk_off;                /* offset of node on disk */
-	unsigned int nsubnodes;           /* number of subnodes */
+	uint64_t *fnext;                  /* positions of subnodes in file */
+#endif
 } TKVDB_MEMNODE_TYPE_COMMON;
 
+/* leaf and non-leaf nodes share the same header, subnodes of non-leaf
+ * node are placed right after prefix, value and metadata. Layout of
+ * subnodes depends on node class:
+ *   symbols or indexes (tkvdb_class_symsize[] bytes)
+ *   TKVDB_REF next[tkvdb_class_max[]]  - subnodes in memory
+ * 'fnext' array (if any) has tkvdb_class_max[] slots too
+ */
 typedef struct TKVDB_MEMNODE_TYPE
 {
 	TKVDB_MEMNODE_TYPE_COMMON c;
 
-	/* subnodes in memory */
-	void *next[256];
-#ifndef TKVDB_PARAMS_NODBFILE
-	/* positions of subnodes in file */
-	uint64_t fnext[256];
-#endif
-
 	unsigned char prefix_val_meta[1]; /* prefix, value and metadata */
 } TKVDB_MEMNODE_TYPE;
 
-/* no subnodes in leaf */
-typedef struct TKVDB_MEMNODE_TYPE_LEAF
-{
-	TKVDB_MEMNODE_TYPE_COMMON c;
+#ifdef TKVDB_PARAMS_ALIGN_VAL
+#define TKVDB_NODE_VAL_PAD(NODE) ((NODE)->c.val_pad)
+#else
+#define TKVDB_NODE_VAL_PAD(NODE) 0
+#endif
 
-	unsigned char prefix_val_meta[1]; /* prefix, value and metadata */
-} TKVDB_MEMNODE_TYPE_LEAF;
+/* size of prefix + value + metadata */
+#define TKVDB_NODE_PVM_SIZE(NODE)                                         \
+	((NODE)->c.prefix_size + TKVDB_NODE_VAL_PAD(NODE)                 \
+	+ (NODE)->c.val_size + (NODE)->c.meta_size)
+
+/* start of subnodes area (aligned to 8 bytes) */
+#define TKVDB_NODE_SUBNODES(NODE)                                         \
+	((uint8_t *)(NODE) + ((offsetof(TKVDB_MEMNODE_TYPE, prefix_val_meta)\
+	+ TKVDB_NODE_PVM_SIZE(NODE) + 7) & ~((size_t)7)))
+
+/* symbols (or indexes) and arrays of subnodes */
+#define TKVDB_NODE_SYMS(NODE) TKVDB_NODE_SUBNODES(NODE)
+
+#define TKVDB_NODE_NEXT(NODE)                                             \
+	((TKVDB_REF *)(TKVDB_NODE_SUBNODES(NODE)                          \
+	+ tkvdb_class_symsize[(NODE)->c.nclass]))
+
+/* size of subnodes area for node class */
+#define TKVDB_SUBNODES_SIZE(CLASS)                                        \
+	(tkvdb_class_symsize[CLASS] + tkvdb_class_max[CLASS]              \
+	* sizeof(TKVDB_REF))
 
-/* get next subnode (or load from disk) */
 #ifndef TKVDB_PARAMS_NODBFILE
 
-#define TKVDB_SUBNODE_NEXT(TR, NODE, NEXT, OFF)                           \
+/* position of subnode in file (0 if subnode is not on disk) */
+#define TKVDB_NODE_FNEXT(NODE, SLOT)                                      \
+	((NODE)->c.fnext ? (NODE)->c.fnext[SLOT] : 0)
+
+/* size of array with positions of subnodes in file */
+#define TKVDB_FNEXT_SIZE(CLASS) (tkvdb_class_max[CLASS] * sizeof(uint64_t))
+
+#endif
+
+/* get subnode by slot (or load from disk) */
+#ifndef TKVDB_PARAMS_NODBFILE
+
+#define TKVDB_SUBNODE_LOAD(TR, NODE, NEXT, SLOT)                          \
 do {                                                                      \
 	tkvdb_tr_data *trd = TR->data;                                    \
-	if (NODE->c.type & TKVDB_NODE_LEAF) {                             \
-		break;                                                    \
-	}                                                                 \
-	if (NODE->next[OFF]) {                                            \
-		NEXT = node->next[OFF];                                   \
-	} else if (trd->db && NODE->fnext[OFF]) {                         \
+	TKVDB_REF *next_arr = TKVDB_NODE_NEXT(NODE);                      \
+	NEXT = TKVDB_REF_NODE(trd, TKVDB_LOAD_ACQ(next_arr[SLOT]));       \
+	if (NEXT) {                                                       \
+		/* in memory */                                           \
+	} else if (trd->db && TKVDB_NODE_FNEXT(NODE, SLOT)) {             \
 		TKVDB_MEMNODE_TYPE *tmp;                                  \
-		TKVDB_EXEC( TKVDB_IMPL_NODE_READ(TR, NODE->fnext[OFF],    \
-			&tmp) );                                          \
-		NODE->next[OFF] = tmp;                                    \
+		TKVDB_EXEC( TKVDB_IMPL_NODE_READ(TR,                      \
+			TKVDB_NODE_FNEXT(NODE, SLOT), &tmp) );            \
+		next_arr[SLOT] = TKVDB_NODE_REF(trd, tmp);                \
 		NEXT = tmp;                                               \
 	}                                                                 \
 } while (0)
@@ -83,37 +145,39 @@ do {                                                                      \
 #else
 
 /* RAM-only */
+#define TKVDB_SUBNODE_LOAD(TR, NODE, NEXT, SLOT)                          \
+do {                                                                      \
+	tkvdb_tr_data *trd = TR->data;                                    \
+	TKVDB_REF *next_arr = TKVDB_NODE_NEXT(NODE);                      \
+	NEXT = TKVDB_REF_NODE(trd, TKVDB_LOAD_ACQ(next_arr[SLOT]));       \
+} while (0)
+
+#endif
+
+/* get next subnode by symbol */
 #define TKVDB_SUBNODE_NEXT(TR, NODE, NEXT, OFF)                           \
 do {                                                                      \
+	int slot;                                                         \
 	if (NODE->c.type & TKVDB_NODE_LEAF) {                             \
 		break;                                                    \
 	}                                                                 \
-	if (NODE->next[OFF]) {                                            \
-		NEXT = node->next[OFF];                                   \
+	slot = TKVDB_IMPL_NODE_SLOT(NODE, OFF);                           \
+	if (slot >= 0) {                                                  \
+		TKVDB_SUBNODE_LOAD(TR, NODE, NEXT, slot);                 \
 	}                                                                 \
 } while (0)
 
-#endif
-
+/* search for nearest subnode starting from symbol OFF */
 #define TKVDB_SUBNODE_SEARCH(TR, NODE, NEXT, OFF, INCR)                   \
 do {                                                                      \
-	int lim, step;                                                    \
+	int slot;                                                         \
 	NEXT = NULL;                                                      \
 	if (NODE->c.type & TKVDB_NODE_LEAF) {                             \
 		break;                                                    \
 	}                                                                 \
-	if (INCR) {                                                       \
-		lim = 256;                                                \
-		step = 1;                                                 \
-	} else {                                                          \
-		lim = -1;                                                 \
-		step = -1;                                                \
-	}                                                                 \
-	for (; OFF!=lim; OFF+=step) {                                     \
-		TKVDB_SUBNODE_NEXT(TR, NODE, NEXT, OFF);                  \
-		if (next) {                                               \
-			break;                                            \
-		}                                                         \
+	slot = TKVDB_IMPL_NODE_SLOT_SEARCH(NODE, &(OFF), INCR);           \
+	if (slot >= 0) {                                                  \
+		TKVDB_SUBNODE_LOAD(TR, NODE, NEXT, slot);                 \
 	}                                                                 \
 } while (0)
 
@@ -0,0 +1,480 @@
+/*
+ * tkvdb
+ *
+ * Copyright (c) 2016-2021, Vladimir Misyurov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* merge of two RAM-only transactions
+ * both trees are walked at once, subtrees that exist only in source
+ * transaction are linked to destination as is, without copying
+ * nodes in preallocated buffer can't be moved, so there is no merge for
+ * transactions with 32-bit references */
+
+#if defined(TKVDB_PARAMS_NODBFILE) && !defined(TKVDB_PARAMS_REF32)
+
+#define TKVDB_NODE_VAL_PTR(NODE)                                          \
+	((NODE)->prefix_val_meta + (NODE)->c.prefix_size                  \
+	+ TKVDB_NODE_VAL_PAD(NODE))
+
+#define TKVDB_NODE_META_PTR(NODE)                                         \
+	(TKVDB_NODE_VAL_PTR(NODE) + (NODE)->c.val_size)
+
+/* copy of node without first 'n' bytes of prefix */
+static TKVDB_MEMNODE_TYPE *
+TKVDB_IMPL_NODE_STRIP(tkvdb_tr *tr, TKVDB_MEMNODE_TYPE *node, size_t n)
+{
+	TKVDB_MEMNODE_TYPE *newnode;
+
+	newnode = TKVDB_IMPL_NODE_NEW(tr, node->c.type, node->c.nclass,
+		node->c.prefix_size - n, node->prefix_val_meta + n,
+		node->c.val_size, TKVDB_NODE_VAL_PTR(node),
+		node->c.meta_size, TKVDB_NODE_META_PTR(node));
+	if (!newnode) {
+		return NULL;
+	}
+
+	/* RAM-only nodes, copy never fails */
+	TKVDB_IMPL_CLONE_SUBNODES(tr->data, newnode, node);
+
+	return newnode;
+}
+
+/* merge value of source node 'src' into destination node
+ * '*node_ptr' is updated if node was replaced */
+static TKVDB_RES
+TKVDB_IMPL_MERGE_VAL(tkvdb_tr *trns, TKVDB_MEMNODE_TYPE *rchain,
+	TKVDB_MEMNODE_TYPE **node_ptr, TKVDB_MEMNODE_TYPE *src,
+	tkvdb_merge_func merge, void *userdata)
+{
+	TKVDB_MEMNODE_TYPE *node = *node_ptr, *upd = *node_ptr, *newnode;
+	tkvdb_datum val, src_val;
+	TKVDB_RES r;
+	tkvdb_tr_data *tr = trns->data;
+
+	src_val.data = TKVDB_NODE_VAL_PTR(src);
+	src_val.size = src->c.val_size;
+
+	if (!merge || !(node->c.type & TKVDB_NODE_VAL)) {
+		/* source value wins */
+		val = src_val;
+
+		if ((node->c.type & TKVDB_NODE_VAL)
+			&& (node->c.val_size == val.size) && !tr->ebr) {
+
+			memcpy(TKVDB_NODE_VAL_PTR(node), val.data, val.size);
+			node->c.dirty = 1;
+			return TKVDB_OK;
+		}
+	} else {
+		if (tr->ebr) {
+			/* node may be in use by readers, modify its copy */
+			upd = TKVDB_IMPL_NODE_RESIZE(trns, node,
+				node->c.nclass);
+			if (!upd) {
+				return TKVDB_ENOMEM;
+			}
+		}
+
+		val.data = TKVDB_NODE_VAL_PTR(upd);
+		val.size = upd->c.val_size;
+
+		r = merge(&val, &src_val, userdata);
+		if (r != TKVDB_OK) {
+			if (upd != node) {
+				TKVDB_IMPL_NODE_DISCARD(tr, upd);
+			}
+			return r;
+		}
+
+		if ((val.data == TKVDB_NODE_VAL_PTR(upd))
+			&& (val.size == upd->c.val_size)) {
+
+			/* value was updated in place */
+			upd->c.dirty = 1;
+			if (upd != node) {
+				TKVDB_IMPL_NODE_REPLACE(tr, rchain, node, upd);
+				*node_ptr = upd;
+			}
+			return TKVDB_OK;
+		}
+	}
+
+	/* value with different size, create new node */
+	newnode = TKVDB_IMPL_NODE_NEW(trns,
+		node->c.type | TKVDB_NODE_VAL, node->c.nclass,
+		node->c.prefix_size, node->prefix_val_meta,
+		val.size, val.data,
+		node->c.meta_size, TKVDB_NODE_META_PTR(node));
+	if (upd != node) {
+		TKVDB_IMPL_NODE_DISCARD(tr, upd);
+	}
+	if (!newnode) {
+		return TKVDB_ENOMEM;
+	}
+
+	TKVDB_IMPL_CLONE_SUBNODES(tr, newnode, node);
+
+	TKVDB_IMPL_NODE_REPLACE(tr, rchain, node, newnode);
+	*node_ptr = newnode;
+
+	return TKVDB_OK;
+}
+
+/* add subtree 'sub' of source transaction to node as subnode 'sym'
+ * if node already has such subnode, pair of subtrees is pushed to stack */
+static TKVDB_RES
+TKVDB_IMPL_MERGE_LINK(tkvdb_tr *trns, struct tkvdb_merge_stack *st,
+	TKVDB_MEMNODE_TYPE *rchain, TKVDB_MEMNODE_TYPE **node_ptr,
+	int sym, TKVDB_MEMNODE_TYPE *sub)
+{
+	TKVDB_MEMNODE_TYPE *node = *node_ptr, *newnode;
+	tkvdb_tr_data *tr = trns->data;
+	int slot;
+
+	if (!(node->c.type & TKVDB_NODE_LEAF)) {
+		TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+
+		slot = TKVDB_IMPL_NODE_SLOT(node, sym);
+		if ((slot >= 0) && next_arr[slot]) {
+			return tkvdb_merge_push(st,
+				TKVDB_REF_NODE(tr, next_arr[slot]), sub,
+				node->prefix_val_meta, node->c.prefix_size,
+				sym);
+		}
+
+		if (node->c.nsubnodes < tkvdb_class_max[node->c.nclass]) {
+			TKVDB_IMPL_NODE_ADD_SUBNODE(node, sym,
+				TKVDB_NODE_REF(tr, sub), 0);
+			return TKVDB_OK;
+		}
+
+		/* no room for subnode */
+		newnode = TKVDB_IMPL_NODE_RESIZE(trns, node,
+			node->c.nclass + 1);
+	} else {
+		/* leaf can't have subnodes */
+		newnode = TKVDB_IMPL_NODE_NEW(trns,
+			node->c.type & (~TKVDB_NODE_LEAF),
+			TKVDB_NODE_CLASS_4,
+			node->c.prefix_size, node->prefix_val_meta,
+			node->c.val_size, TKVDB_NODE_VAL_PTR(node),
+			node->c.meta_size, TKVDB_NODE_META_PTR(node));
+	}
+	if (!newnode) {
+		return TKVDB_ENOMEM;
+	}
+
+	TKVDB_IMPL_NODE_ADD_SUBNODE(newnode, sym, TKVDB_NODE_REF(tr, sub), 0);
+
+	TKVDB_IMPL_NODE_REPLACE(tr, rchain, node, newnode);
+	*node_ptr = newnode;
+
+	return TKVDB_OK;
+}
+
+/* put keys of source subtree 'node' back to source transaction and free
+ * subtree, key prefix of subtree is 'size' bytes at 'off' in stack path */
+static TKVDB_RES
+TKVDB_IMPL_MERGE_RESTORE(tkvdb_tr *dst_tr, tkvdb_tr *src_tr,
+	TKVDB_MEMNODE_TYPE *node, const struct tkvdb_merge_stack *st,
+	size_t off, size_t size)
+{
+	struct tkvdb_visit_helper *stack = NULL, *top;
+	size_t stack_size = 0, stack_allocated = 0;
+	uint8_t *key = NULL;
+	size_t key_size = 0, key_allocated = 0;
+	TKVDB_MEMNODE_TYPE *n = node, *p;
+	tkvdb_datum dtk, dtv;
+	int slot, sym;
+	TKVDB_RES r;
+
+	tkvdb_tr_data *dst = dst_tr->data;
+
+	r = tkvdb_buf_reserve(&key, 0, &key_allocated, size);
+	if (r != TKVDB_OK) {
+		goto end;
+	}
+	if (size > 0) {
+		memcpy(key, st->path + off, size);
+	}
+	key_size = size;
+
+	while (n) {
+		TKVDB_SKIP_RNODES(dst, n);
+
+		/* prefix of node and symbol of next subnode */
+		r = tkvdb_buf_reserve(&key, key_size, &key_allocated,
+			n->c.prefix_size + 1);
+		if (r != TKVDB_OK) {
+			goto end;
+		}
+		memcpy(key + key_size, n->prefix_val_meta, n->c.prefix_size);
+		key_size += n->c.prefix_size;
+
+		if (n->c.type & TKVDB_NODE_VAL) {
+			dtk.data = key;
+			dtk.size = key_size;
+			dtv.data = TKVDB_NODE_VAL_PTR(n);
+			dtv.size = n->c.val_size;
+
+			r = src_tr->put(src_tr, &dtk, &dtv);
+			if (r != TKVDB_OK) {
+				goto end;
+			}
+		}
+
+		if (stack_size >= stack_allocated) {
+			size_t a = stack_allocated * 2 + 16;
+
+			top = realloc(stack,
+				a * sizeof(struct tkvdb_visit_helper));
+			if (!top) {
+				r = TKVDB_ENOMEM;
+				goto end;
+			}
+			stack = top;
+			stack_allocated = a;
+		}
+		stack[stack_size].node = n;
+		stack[stack_size].off = 0;
+		stack_size++;
+
+		/* next subnode of node on top of stack */
+		n = NULL;
+		while (!n && (stack_size > 0)) {
+			top = &stack[stack_size - 1];
+			p = top->node;
+			sym = top->off;
+
+			slot = -1;
+			if (!(p->c.type & TKVDB_NODE_LEAF)) {
+				slot = TKVDB_IMPL_NODE_SLOT_SEARCH(p, &sym, 1);
+			}
+			if (slot >= 0) {
+				top->off = sym + 1;
+				n = TKVDB_REF_NODE(dst,
+					TKVDB_NODE_NEXT(p)[slot]);
+				if (n) {
+					key[key_size++] = sym;
+				}
+				continue;
+			}
+
+			/* no more subnodes, remove prefix and symbol of node */
+			key_size -= p->c.prefix_size;
+			stack_size--;
+			if (stack_size > 0) {
+				key_size--;
+			}
+		}
+	}
+
+end:
+	TKVDB_IMPL_NODE_FREE(dst, node);
+	free(stack);
+	free(key);
+
+	return r;
+}
+
+/* move all nodes of 'src_tr' to 'dst_tr'
+ * transactions must be checked by caller, see tkvdb_tr_merge()
+ * metadata of triggers is not recalculated */
+static TKVDB_RES
+TKVDB_IMPL_MERGE(tkvdb_tr *dst_tr, tkvdb_tr *src_tr, tkvdb_merge_func merge,
+	void *userdata)
+{
+	struct tkvdb_merge_stack st = {NULL, 0, 0, NULL, 0, 0, 0, 0};
+	TKVDB_MEMNODE_TYPE *dchain, *d, *s, *rest, *tmp, *newroot;
+	uint8_t *dpvm, *spvm;
+	size_t c;
+	int slot, sym;
+	TKVDB_RES r;
+
+	tkvdb_tr_data *dst = dst_tr->data;
+	tkvdb_tr_data *src = src_tr->data;
+
+	rest = src->root;
+	if (!rest) {
+		return TKVDB_OK;
+	}
+
+	/* source transaction is empty from now */
+	TKVDB_STORE_REL(src->root, NULL);
+	if (src->ebr) {
+		/* wait for readers that may still see old root */
+		tkvdb_ebr_synchronize(src->ebr);
+	}
+
+	/* all allocated nodes belong to destination now */
+	tkvdb_arena_move(&dst->arena, &src->arena);
+	dst->tr_buf_allocated += src->tr_buf_allocated;
+	src->tr_buf_allocated = 0;
+
+	if (!dst->root) {
+		TKVDB_STORE_REL(dst->root, rest);
+		return TKVDB_OK;
+	}
+
+	r = tkvdb_merge_push(&st, dst->root, rest, rest->prefix_val_meta, 0,
+		-1);
+	if (r != TKVDB_OK) {
+		goto fail;
+	}
+
+	while (st.size > 0) {
+		st.size--;
+		dchain = st.pairs[st.size].dst;
+		rest = st.pairs[st.size].src;
+
+		/* prefixes of pairs above are not needed */
+		st.cur_off = st.pairs[st.size].path_off;
+		st.cur_size = st.pairs[st.size].path_size;
+		st.path_size = st.cur_off + st.cur_size;
+
+		/* nodes replaced in source transaction are not needed */
+		while (rest->c.replaced_by) {
+			tmp = TKVDB_REF_NODE(dst, rest->c.replaced_by);
+			TKVDB_IMPL_NODE_DISCARD(dst, rest);
+			rest = tmp;
+		}
+		s = rest;
+		spvm = s->prefix_val_meta;
+
+next_prefix:
+		d = dchain;
+		TKVDB_SKIP_RNODES(dst, d);
+		dpvm = d->prefix_val_meta;
+
+		/* common part of prefixes */
+		for (c=0; (c < d->c.prefix_size) && (c < s->c.prefix_size)
+			&& (dpvm[c] == spvm[c]); c++);
+
+/* destination prefix is longer (or prefixes don't match)
+  [1][2][3][4][5][6] - destination
+  [1][2][3][7]       - source
+
+  split destination node
+  [1][2][3] - new node without value
+  next['4'] => [5][6] - tail of destination
+*/
+		if (c < d->c.prefix_size) {
+			newroot = TKVDB_IMPL_NODE_NEW(dst_tr, 0,
+				TKVDB_NODE_CLASS_4, c, dpvm, 0, NULL,
+				d->c.meta_size, TKVDB_NODE_META_PTR(d));
+			if (!newroot) {
+				goto enomem;
+			}
+
+			tmp = TKVDB_IMPL_NODE_STRIP(dst_tr, d, c + 1);
+			if (!tmp) {
+				TKVDB_IMPL_NODE_DISCARD(dst, newroot);
+				goto enomem;
+			}
+			TKVDB_IMPL_NODE_ADD_SUBNODE(newroot, dpvm[c],
+				TKVDB_NODE_REF(dst, tmp), 0);
+
+			TKVDB_IMPL_NODE_REPLACE(dst, dchain, d, newroot);
+
+			/* now destination prefix is prefix of source */
+			goto next_prefix;
+		}
+
+/* source prefix is longer
+  [1][2][3]          - destination
+  [1][2][3][4][5][6] - source
+
+  [5][6] - tail of source, becomes subnode '4' of destination
+*/
+		if (c < s->c.prefix_size) {
+			sym = spvm[c];
+
+			tmp = TKVDB_IMPL_NODE_STRIP(dst_tr, s, c + 1);
+			if (!tmp) {
+				goto enomem;
+			}
+
+			r = TKVDB_IMPL_MERGE_LINK(dst_tr, &st, dchain, &d, sym,
+				tmp);
+			if (r != TKVDB_OK) {
+				/* subtree is still in 's' */
+				TKVDB_IMPL_NODE_DISCARD(dst, tmp);
+				goto fail;
+			}
+			TKVDB_IMPL_NODE_DISCARD(dst, s);
+			continue;
+		}
+
+		/* prefixes are equal */
+		if (s->c.type & TKVDB_NODE_VAL) {
+			r = TKVDB_IMPL_MERGE_VAL(dst_tr, dchain, &d, s,
+				merge, userdata);
+			if (r != TKVDB_OK) {
+				goto fail;
+			}
+			/* value is in destination now */
+			s->c.type &= ~TKVDB_NODE_VAL;
+		}
+
+		if (!(s->c.type & TKVDB_NODE_LEAF)) {
+			TKVDB_REF *next_arr = TKVDB_NODE_NEXT(s);
+
+			sym = 0;
+			while ((slot = TKVDB_IMPL_NODE_SLOT_SEARCH(s, &sym, 1))
+				>= 0) {
+
+				r = TKVDB_IMPL_MERGE_LINK(dst_tr, &st, dchain,
+					&d, sym,
+					TKVDB_REF_NODE(dst, next_arr[slot]));
+				if (r != TKVDB_OK) {
+					goto fail;
+				}
+				/* subnode is in destination now */
+				TKVDB_IMPL_NODE_DEL_SUBNODE(s, sym);
+				sym++;
+			}
+		}
+
+		TKVDB_IMPL_NODE_DISCARD(dst, s);
+	}
+
+	free(st.pairs);
+	free(st.path);
+	return TKVDB_OK;
+
+enomem:
+	r = TKVDB_ENOMEM;
+fail:
+	/* keys that are not merged yet are put back to source, nodes of
+	   destination can't be linked to source as is */
+	TKVDB_IMPL_MERGE_RESTORE(dst_tr, src_tr, rest, &st, st.cur_off,
+		st.cur_size);
+	while (st.size > 0) {
+		st.size--;
+		TKVDB_IMPL_MERGE_RESTORE(dst_tr, src_tr,
+			st.pairs[st.size].src, &st,
+			st.pairs[st.size].path_off,
+			st.pairs[st.size].path_size);
+	}
+	free(st.pairs);
+	free(st.path);
+
+	return r;
+}
+
+#undef TKVDB_NODE_VAL_PTR
+#undef TKVDB_NODE_META_PTR
+
+#endif
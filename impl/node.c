@@ -19,65 +19,257 @@
 
 
 /* get memory for node
- * memory block is taken from system using malloc()
- * when 'tr->tr_buf_dynalloc' is true
- * or from preallocated buffer
- * preallocation occurs in tkvdb_tr_create() */
+ * memory block is taken from system using malloc() when transaction has
+ * concurrent writers or from arena of transaction (growable or in
+ * preallocated buffer, see tkvdb_tr_create()) */
 void *
 TKVDB_IMPL_NODE_ALLOC(tkvdb_tr *trns, size_t node_size)
 {
 	TKVDB_MEMNODE_TYPE *node;
 	tkvdb_tr_data *tr = trns->data;
+	size_t block_size = node_size;
+	uint8_t aclass;
 
-	if (tr->params.tr_buf_dynalloc) {
-		/* allocate node using system malloc() */
-		if ((tr->tr_buf_allocated + node_size)
+	if (tr->params.tr_concurrent) {
+		/* many writers, update counter atomically */
+		if (TKVDB_ADD_FETCH(tr->tr_buf_allocated, node_size)
 			> tr->params.tr_buf_limit) {
 
-			/* memory limit exceeded */
+			TKVDB_SUB_FETCH(tr->tr_buf_allocated, node_size);
 			return NULL;
 		}
 
 		node = malloc(node_size);
 		if (!node) {
-			return NULL;
+			TKVDB_SUB_FETCH(tr->tr_buf_allocated, node_size);
 		}
-	} else {
-		uint8_t *buf_ptr;
-		/* FIXME: don't hardcode! */
-		/* align to 16-byte boundary */
-		buf_ptr = (uint8_t *)
-			((uintptr_t)(tr->tr_buf_ptr + 16 - 1) & (-16));
+		return node;
+	}
 
-		/* calculate node size with alignment */
-		node_size += buf_ptr - tr->tr_buf_ptr;
+	tkvdb_arena_class(&block_size);
+	if ((tr->tr_buf_allocated + block_size) > tr->params.tr_buf_limit) {
+		/* memory limit exceeded */
+		return NULL;
+	}
 
-		if ((tr->tr_buf_allocated + node_size)
-			> tr->params.tr_buf_limit) {
+	node = tkvdb_arena_alloc(&tr->arena, &block_size, &aclass);
+	if (!node) {
+		return NULL;
+	}
+	node->c.aclass = aclass;
 
-			/* memory limit exceeded */
-			return NULL;
+	tr->tr_buf_allocated += block_size;
+
+	return node;
+}
+
+/* allocate array with positions of subnodes in file for non-leaf node
+ * of disk-backed transaction (never concurrent, so arena is used) */
+#ifndef TKVDB_PARAMS_NODBFILE
+static TKVDB_RES
+TKVDB_IMPL_NODE_FNEXT_ALLOC(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node)
+{
+	size_t block_size = TKVDB_FNEXT_SIZE(node->c.nclass);
+	uint8_t aclass;
+
+	tkvdb_arena_class(&block_size);
+	if ((tr->tr_buf_allocated + block_size) > tr->params.tr_buf_limit) {
+		return TKVDB_ENOMEM;
+	}
+
+	node->c.fnext = tkvdb_arena_alloc(&tr->arena, &block_size, &aclass);
+	if (!node->c.fnext) {
+		return TKVDB_ENOMEM;
+	}
+	memset(node->c.fnext, 0, TKVDB_FNEXT_SIZE(node->c.nclass));
+
+	tr->tr_buf_allocated += block_size;
+
+	return TKVDB_OK;
+}
+#endif
+
+/* free single node which is not referenced from tree */
+static void
+TKVDB_IMPL_NODE_DISCARD(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node)
+{
+	if (tr->params.tr_concurrent) {
+		free(node);
+		return;
+	}
+
+#ifndef TKVDB_PARAMS_NODBFILE
+	if (node->c.fnext) {
+		/* size class of array is defined by node class */
+		size_t block_size = TKVDB_FNEXT_SIZE(node->c.nclass);
+
+		tr->tr_buf_allocated -= tkvdb_arena_free(&tr->arena,
+			node->c.fnext, tkvdb_arena_class(&block_size));
+	}
+#endif
+
+	tr->tr_buf_allocated -= tkvdb_arena_free(&tr->arena, node,
+		node->c.aclass);
+}
+
+/* free node and subnodes */
+static void
+TKVDB_IMPL_NODE_FREE(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node)
+{
+	size_t stack_size = 0;
+
+	TKVDB_MEMNODE_TYPE *next;
+	int off = 0;
+
+	for (;;) {
+		if (node->c.replaced_by) {
+			next = TKVDB_REF_NODE(tr, node->c.replaced_by);
+			TKVDB_IMPL_NODE_DISCARD(tr, node);
+			node = next;
+			continue;
+		}
+
+		if (!(node->c.type & TKVDB_NODE_LEAF)) {
+			TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+			int nslots = tkvdb_class_max[node->c.nclass];
+
+			/* search in subnodes */
+			next = NULL;
+			for (; off<nslots; off++) {
+				if (next_arr[off]) {
+					next = TKVDB_REF_NODE(tr,
+						next_arr[off]);
+					break;
+				}
+			}
+
+			if (next) {
+				/* push */
+				if ((stack_size + 1) > tr->stack_allocated) {
+					tr->stack = realloc(tr->stack,
+						(stack_size + 1)
+						* sizeof(struct tkvdb_visit_helper));
+					if (!tr->stack) {
+						return;
+					}
+					tr->stack_allocated = stack_size + 1;
+				}
+				tr->stack[stack_size].node = node;
+				tr->stack[stack_size].off = off;
+				stack_size++;
+
+				node = next;
+				off = 0;
+				continue;
+			}
+		}
+
+		/* no more subnodes */
+		if (stack_size < 1) {
+			break;
 		}
-		node = (TKVDB_MEMNODE_TYPE *)buf_ptr;
-		tr->tr_buf_ptr += node_size;
+
+		TKVDB_IMPL_NODE_DISCARD(tr, node);
+		/* get node from stack's top */
+		stack_size--;
+		node = tr->stack[stack_size].node;
+		off = tr->stack[stack_size].off;
+		off++;
 	}
+	TKVDB_IMPL_NODE_DISCARD(tr, node);
+}
 
-	tr->tr_buf_allocated += node_size;
+/* free nodes whose grace period is over */
+static void
+TKVDB_IMPL_NODE_RECLAIM(tkvdb_tr_data *tr, struct tkvdb_ebr_node *ready)
+{
+	struct tkvdb_ebr_node *next;
 
-	return node;
+	while (ready) {
+		next = ready->next;
+		if (ready->subtree) {
+			TKVDB_IMPL_NODE_FREE(tr, ready->node);
+		} else {
+			TKVDB_IMPL_NODE_DISCARD(tr, ready->node);
+		}
+		free(ready);
+		ready = next;
+	}
+}
+
+/* free node unlinked from tree (with subnodes if 'subtree' is set)
+ * with concurrent readers node is freed only after all readers that could
+ * see it have left their critical sections */
+static void
+TKVDB_IMPL_NODE_UNLINK(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node,
+	int subtree)
+{
+	if (tr->params.tr_concurrent) {
+		/* other writers may still use node, free it on reset */
+		tkvdb_retire_concurrent(&tr->retired, node);
+		return;
+	}
+
+	if (!tr->ebr) {
+		if (subtree) {
+			TKVDB_IMPL_NODE_FREE(tr, node);
+		} else {
+			TKVDB_IMPL_NODE_DISCARD(tr, node);
+		}
+		return;
+	}
+
+	if (!tkvdb_ebr_retire(tr->ebr, node, subtree)) {
+		/* no memory for limbo list, wait for readers */
+		tkvdb_ebr_synchronize(tr->ebr);
+		if (subtree) {
+			TKVDB_IMPL_NODE_FREE(tr, node);
+		} else {
+			TKVDB_IMPL_NODE_DISCARD(tr, node);
+		}
+	}
+
+	TKVDB_IMPL_NODE_RECLAIM(tr, tkvdb_ebr_collect(tr->ebr, 0));
+}
+
+/* free subtree unlinked from tree */
+static void
+TKVDB_IMPL_NODE_RETIRE(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node)
+{
+	TKVDB_IMPL_NODE_UNLINK(tr, node, 1);
+}
+
+/* replace 'node' (last in chain of replaced nodes started at 'rchain')
+ * with updated copy
+ * parent points to start of chain, so new node is linked to it and nodes
+ * in the middle of chain are freed */
+static void
+TKVDB_IMPL_NODE_REPLACE(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *rchain,
+	TKVDB_MEMNODE_TYPE *node, TKVDB_MEMNODE_TYPE *newnode)
+{
+	if (tr->params.tr_concurrent) {
+		/* other writers may be on any node of chain */
+		TKVDB_STORE_REL(node->c.replaced_by,
+			TKVDB_NODE_REF(tr, newnode));
+		return;
+	}
+
+	TKVDB_STORE_REL(rchain->c.replaced_by, TKVDB_NODE_REF(tr, newnode));
+	if (node != rchain) {
+		/* subnodes are shared with new node */
+		TKVDB_IMPL_NODE_UNLINK(tr, node, 0);
+	}
 }
 
-/* create new node and append prefix and value */
+/* create new node and append prefix and value
+ * 'nclass' is used only for non-leaf nodes */
 void *
-TKVDB_IMPL_NODE_NEW(tkvdb_tr *tr, int type, size_t prefix_size,
+TKVDB_IMPL_NODE_NEW(tkvdb_tr *tr, int type, int nclass, size_t prefix_size,
 	const void *prefix, size_t val_size, const void *val,
 	size_t meta_size, void *meta)
 {
 	TKVDB_MEMNODE_TYPE *node;
-	TKVDB_MEMNODE_TYPE_LEAF *node_leaf;
-	TKVDB_MEMNODE_TYPE_COMMON *node_common;
 	size_t node_size;
-	void *ret;
 
 #ifdef TKVDB_PARAMS_ALIGN_VAL
 /* aligned value */
@@ -118,75 +310,53 @@ do {                                                                       \
 
 #endif
 
-	if (type & TKVDB_NODE_LEAF) {
-		node_size = sizeof(TKVDB_MEMNODE_TYPE_LEAF)
-			+ prefix_size + val_size + NODE_ALIGN + meta_size;
-		node_leaf = TKVDB_IMPL_NODE_ALLOC(tr, node_size);
-		if (!node_leaf) {
-			return NULL;
-		}
-		node_common = &node_leaf->c;
-	} else {
-		node_size = sizeof(TKVDB_MEMNODE_TYPE)
-			+ prefix_size + val_size + NODE_ALIGN + meta_size;
-		node = TKVDB_IMPL_NODE_ALLOC(tr, node_size);
-		if (!node) {
-			return NULL;
-		}
-		node_common = &node->c;
+	node_size = sizeof(TKVDB_MEMNODE_TYPE)
+		+ prefix_size + val_size + NODE_ALIGN + meta_size;
+	if (!(type & TKVDB_NODE_LEAF)) {
+		/* space for alignment and subnodes */
+		node_size += 7 + TKVDB_SUBNODES_SIZE(nclass);
 	}
 
-	node_common->type = type;
-	node_common->prefix_size = prefix_size;
-	node_common->val_size = val_size;
-	node_common->meta_size = meta_size;
-	node_common->replaced_by = NULL;
-	node_common->disk_size = 0;
-	node_common->disk_off = 0;
-
+	node = TKVDB_IMPL_NODE_ALLOC(tr, node_size);
+	if (!node) {
+		return NULL;
+	}
 
-	node_common->nsubnodes = 0;
+	node->c.type = type;
+	node->c.nclass = nclass;
+	node->c.prefix_size = prefix_size;
+	node->c.val_size = val_size;
+	node->c.meta_size = meta_size;
+	node->c.replaced_by = 0;
+	node->c.dirty = 1;
+	node->c.version = 0;
+#ifndef TKVDB_PARAMS_NODBFILE
+	node->c.disk_off = 0;
+	node->c.fnext = NULL;
+#endif
 
-	if (type & TKVDB_NODE_LEAF) {
-		if (prefix_size > 0) {
-			memcpy(node_leaf->prefix_val_meta,
-				prefix, prefix_size);
-		}
+	node->c.nsubnodes = 0;
 
-#ifdef TKVDB_PARAMS_ALIGN_VAL
-		node_leaf->c.val_pad = VALPADDING(node_leaf);
-#endif
-		if (val_size > 0) {
-			COPY_VAL(node_leaf);
-		}
-		if (meta && (meta_size > 0)) {
-			COPY_META(node_leaf);
-		}
-		ret = node_leaf;
-	} else {
-		if (prefix_size > 0) {
-			memcpy(node->prefix_val_meta,
-				prefix, prefix_size);
-		}
+	if (prefix_size > 0) {
+		memcpy(node->prefix_val_meta, prefix, prefix_size);
+	}
 
 #ifdef TKVDB_PARAMS_ALIGN_VAL
-		node->c.val_pad = VALPADDING(node);
+	node->c.val_pad = VALPADDING(node);
 #endif
-		if (val_size > 0) {
-			COPY_VAL(node);
-		}
+	if (val_size > 0) {
+		COPY_VAL(node);
+	}
+	if (meta && (meta_size > 0)) {
+		COPY_META(node);
+	}
 
-		memset(node->next, 0, sizeof(TKVDB_MEMNODE_TYPE *) * 256);
-#ifndef TKVDB_PARAMS_NODBFILE
-		memset(node->fnext, 0, sizeof(uint64_t) * 256);
-#endif
-		if (meta && (meta_size > 0)) {
-			COPY_META(node);
-		}
-		ret = node;
+	if (!(type & TKVDB_NODE_LEAF)) {
+		memset(TKVDB_NODE_SUBNODES(node), 0,
+			TKVDB_SUBNODES_SIZE(nclass));
 	}
 
-	return ret;
+	return node;
 #undef NODE_ALIGN
 #undef PTR_TO_VAL
 #undef VALPADDING
@@ -194,26 +364,323 @@ do {                                                                       \
 #undef COPY_META
 }
 
+/* find slot of subnode with symbol 'sym'
+ * returns -1 if there is no such subnode
+ * for nodes with 256 subnodes slot is always equal to symbol, and slot may
+ * be empty */
+static int
+TKVDB_IMPL_NODE_SLOT(TKVDB_MEMNODE_TYPE *node, int sym)
+{
+	uint8_t *syms = TKVDB_NODE_SYMS(node);
+	unsigned int i, n;
+
+	switch (node->c.nclass) {
+		case TKVDB_NODE_CLASS_4:
+		case TKVDB_NODE_CLASS_16:
+			n = TKVDB_LOAD_ACQ(node->c.nsubnodes);
+			for (i=0; i<n; i++) {
+				if (syms[i] == sym) {
+					return i;
+				}
+			}
+			return -1;
+
+		case TKVDB_NODE_CLASS_48:
+			return (int)TKVDB_LOAD_ACQ(syms[sym]) - 1;
+
+		default:
+			return sym;
+	}
+}
+
+/* search for subnode with nearest symbol starting from '*sym' in increasing
+ * (or decreasing) order
+ * returns slot of subnode (or -1) and symbol in '*sym' */
+static int
+TKVDB_IMPL_NODE_SLOT_SEARCH(TKVDB_MEMNODE_TYPE *node, int *sym, int incr)
+{
+	uint8_t *syms = TKVDB_NODE_SYMS(node);
+	TKVDB_REF *next;
+#ifndef TKVDB_PARAMS_NODBFILE
+	uint64_t *fnext;
+#endif
+	int lim, step, s, slot = -1;
+	unsigned int i, n;
+
+	if (incr) {
+		lim = 256;
+		step = 1;
+	} else {
+		lim = -1;
+		step = -1;
+	}
+
+	switch (node->c.nclass) {
+		case TKVDB_NODE_CLASS_4:
+		case TKVDB_NODE_CLASS_16:
+			/* symbols are unsorted */
+			s = lim;
+			n = TKVDB_LOAD_ACQ(node->c.nsubnodes);
+			for (i=0; i<n; i++) {
+				int cur = syms[i];
+
+				if (incr) {
+					if ((cur >= *sym) && (cur < s)) {
+						s = cur;
+						slot = i;
+					}
+				} else {
+					if ((cur <= *sym) && (cur > s)) {
+						s = cur;
+						slot = i;
+					}
+				}
+			}
+			*sym = s;
+			return slot;
+
+		case TKVDB_NODE_CLASS_48:
+			for (s=*sym; (s>=0) && (s<256); s+=step) {
+				int idx = TKVDB_LOAD_ACQ(syms[s]);
+
+				if (idx) {
+					*sym = s;
+					return idx - 1;
+				}
+			}
+			break;
+
+		default:
+			next = TKVDB_NODE_NEXT(node);
+#ifndef TKVDB_PARAMS_NODBFILE
+			fnext = node->c.fnext;
+#endif
+			for (s=*sym; (s>=0) && (s<256); s+=step) {
+				if (TKVDB_LOAD_ACQ(next[s])) {
+					*sym = s;
+					return s;
+				}
+#ifndef TKVDB_PARAMS_NODBFILE
+				if (fnext && fnext[s]) {
+					*sym = s;
+					return s;
+				}
+#endif
+			}
+			break;
+	}
+
+	*sym = lim;
+	return -1;
+}
+
+/* add subnode with symbol 'sym' (and offset in file 'off') to node
+ * node must have free slot
+ * reference to subnode is set before symbol and counter, so readers never
+ * see partially added subnode */
+static void
+TKVDB_IMPL_NODE_ADD_SUBNODE(TKVDB_MEMNODE_TYPE *node, int sym,
+	TKVDB_REF subnode, uint64_t off)
+{
+	uint8_t *syms = TKVDB_NODE_SYMS(node);
+	TKVDB_REF *next = TKVDB_NODE_NEXT(node);
+	unsigned int slot;
+
+	switch (node->c.nclass) {
+		case TKVDB_NODE_CLASS_4:
+		case TKVDB_NODE_CLASS_16:
+		case TKVDB_NODE_CLASS_48:
+			slot = node->c.nsubnodes;
+			break;
+		default:
+			slot = sym;
+			break;
+	}
+
+#ifndef TKVDB_PARAMS_NODBFILE
+	if (node->c.fnext) {
+		node->c.fnext[slot] = off;
+	}
+#else
+	(void)off;
+#endif
+	TKVDB_STORE_REL(next[slot], subnode);
+
+	switch (node->c.nclass) {
+		case TKVDB_NODE_CLASS_4:
+		case TKVDB_NODE_CLASS_16:
+			syms[slot] = sym;
+			break;
+		case TKVDB_NODE_CLASS_48:
+			TKVDB_STORE_REL(syms[sym], slot + 1);
+			break;
+		default:
+			break;
+	}
+
+	TKVDB_STORE_REL(node->c.nsubnodes, node->c.nsubnodes + 1);
+	node->c.dirty = 1;
+}
+
+/* remove subnode with symbol 'sym', last slot is moved to the freed one
+ * this is not safe for concurrent readers, see NODE_REMOVE() */
 static void
-TKVDB_IMPL_CLONE_SUBNODES(TKVDB_MEMNODE_TYPE *dst, TKVDB_MEMNODE_TYPE *src)
+TKVDB_IMPL_NODE_DEL_SUBNODE(TKVDB_MEMNODE_TYPE *node, int sym)
+{
+	uint8_t *syms = TKVDB_NODE_SYMS(node);
+	TKVDB_REF *next = TKVDB_NODE_NEXT(node);
+#ifndef TKVDB_PARAMS_NODBFILE
+	uint64_t *fnext = node->c.fnext;
+#endif
+	int slot, last, s;
+
+	slot = TKVDB_IMPL_NODE_SLOT(node, sym);
+	if ((slot < 0) || (node->c.nsubnodes == 0)) {
+		return;
+	}
+
+	last = node->c.nsubnodes - 1;
+
+	switch (node->c.nclass) {
+		case TKVDB_NODE_CLASS_4:
+		case TKVDB_NODE_CLASS_16:
+			syms[slot] = syms[last];
+			break;
+		case TKVDB_NODE_CLASS_48:
+			if (slot != last) {
+				/* reindex symbol of last slot */
+				for (s=0; s<256; s++) {
+					if (syms[s] == (last + 1)) {
+						syms[s] = slot + 1;
+						break;
+					}
+				}
+			}
+			syms[sym] = 0;
+			break;
+		default:
+			last = slot;
+			break;
+	}
+
+	next[slot] = next[last];
+	next[last] = 0;
+#ifndef TKVDB_PARAMS_NODBFILE
+	if (fnext) {
+		fnext[slot] = fnext[last];
+		fnext[last] = 0;
+	}
+#endif
+
+	TKVDB_STORE_REL(node->c.nsubnodes, node->c.nsubnodes - 1);
+	node->c.dirty = 1;
+}
+
+/* copy subnodes from 'src' to 'dst', 'dst' class must have enough room
+ * 'dst' replaces 'src' in tree, so array with positions of subnodes in
+ * file is moved to 'dst' if node class is the same */
+static TKVDB_RES
+TKVDB_IMPL_CLONE_SUBNODES(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *dst,
+	TKVDB_MEMNODE_TYPE *src)
 {
+	TKVDB_REF *next;
+	int sym, slot;
+
 	if (dst->c.type & TKVDB_NODE_LEAF) {
 		/* dst has no subnodes, nothing to do */
-		return;
+		return TKVDB_OK;
 	}
+
+	memset(TKVDB_NODE_SUBNODES(dst), 0,
+		TKVDB_SUBNODES_SIZE(dst->c.nclass));
+	dst->c.nsubnodes = 0;
+
 	if (src->c.type & TKVDB_NODE_LEAF) {
-		memset(dst->next, 0, sizeof(void *) * 256);
+		return TKVDB_OK;
+	}
+
+	if (dst->c.nclass == src->c.nclass) {
+		memcpy(TKVDB_NODE_SUBNODES(dst), TKVDB_NODE_SUBNODES(src),
+			TKVDB_SUBNODES_SIZE(src->c.nclass));
+		dst->c.nsubnodes = src->c.nsubnodes;
 #ifndef TKVDB_PARAMS_NODBFILE
-		memset(dst->fnext, 0, sizeof(uint64_t) * 256);
+		dst->c.fnext = src->c.fnext;
+		src->c.fnext = NULL;
 #endif
-	} else {
-		memcpy(dst->next,  src->next,
-			sizeof(TKVDB_MEMNODE_TYPE *) * 256);
+		return TKVDB_OK;
+	}
+
 #ifndef TKVDB_PARAMS_NODBFILE
-		memcpy(dst->fnext, src->fnext, sizeof(uint64_t) * 256);
+	if (src->c.fnext) {
+		/* slots of different class don't match, new array */
+		TKVDB_EXEC( TKVDB_IMPL_NODE_FNEXT_ALLOC(tr, dst) );
+	}
+#else
+	(void)tr;
+#endif
+
+	/* different classes, add subnodes one by one */
+	next = TKVDB_NODE_NEXT(src);
+	sym = 0;
+	while ((slot = TKVDB_IMPL_NODE_SLOT_SEARCH(src, &sym, 1)) >= 0) {
+#ifndef TKVDB_PARAMS_NODBFILE
+		TKVDB_IMPL_NODE_ADD_SUBNODE(dst, sym, next[slot],
+			TKVDB_NODE_FNEXT(src, slot));
+#else
+		TKVDB_IMPL_NODE_ADD_SUBNODE(dst, sym, next[slot], 0);
 #endif
+		sym++;
+	}
+
+	return TKVDB_OK;
+}
+
+/* create copy of non-leaf node with different class */
+static TKVDB_MEMNODE_TYPE *
+TKVDB_IMPL_NODE_RESIZE(tkvdb_tr *tr, TKVDB_MEMNODE_TYPE *node, int nclass)
+{
+	TKVDB_MEMNODE_TYPE *newnode;
+
+	newnode = TKVDB_IMPL_NODE_NEW(tr, node->c.type, nclass,
+		node->c.prefix_size, node->prefix_val_meta,
+		node->c.val_size,
+		node->prefix_val_meta + node->c.prefix_size
+			+ TKVDB_NODE_VAL_PAD(node),
+		node->c.meta_size,
+		node->prefix_val_meta + node->c.prefix_size
+			+ TKVDB_NODE_VAL_PAD(node) + node->c.val_size);
+	if (!newnode) {
+		return NULL;
+	}
+
+	if (TKVDB_IMPL_CLONE_SUBNODES(tr->data, newnode, node) != TKVDB_OK) {
+		TKVDB_IMPL_NODE_DISCARD(tr->data, newnode);
+		return NULL;
+	}
+
+	return newnode;
+}
+
+/* replace node with smaller one if it became too sparse */
+static void
+TKVDB_IMPL_NODE_SHRINK(tkvdb_tr *trns, TKVDB_MEMNODE_TYPE *node,
+	TKVDB_MEMNODE_TYPE *rchain)
+{
+	TKVDB_MEMNODE_TYPE *shrunk;
+	tkvdb_tr_data *tr = trns->data;
+
+	if ((node->c.nclass == TKVDB_NODE_CLASS_4)
+		|| (node->c.nsubnodes > tkvdb_class_shrink[node->c.nclass])) {
+		return;
+	}
+
+	shrunk = TKVDB_IMPL_NODE_RESIZE(trns, node, node->c.nclass - 1);
+	if (!shrunk) {
+		/* not fatal, keep bigger node */
+		return;
 	}
-	dst->c.nsubnodes = src->c.nsubnodes;
+
+	TKVDB_IMPL_NODE_REPLACE(tr, rchain, node, shrunk);
 }
 
 /* read node from disk */
@@ -224,11 +691,18 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 {
 	uint8_t buf[TKVDB_READ_SIZE];
 	struct tkvdb_disknode *disknode;
+	struct tkvdb_cache_node *cached;
+	int mapped = 0;
 	size_t prefix_val_meta_size;
-	uint8_t *ptr;
-	int fd;
+	const uint8_t *ptr;
+	uint8_t syms[256];
+	uint64_t offs[256];
+	uint32_t val_size = 0, meta_size = 0;
+	int fd, nclass, i;
 	unsigned char *prefix_val_meta;
 	tkvdb_tr_data *tr = trns->data;
+	size_t tail = tkvdb_node_tail(tr->db);
+	TKVDB_RES r;
 
 #ifdef TKVDB_PARAMS_ALIGN_VAL
 /* aligned value */
@@ -246,106 +720,118 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 
 	fd = tr->db->fd;
 
-	if (lseek(fd, off, SEEK_SET) != (off_t)off) {
-		return TKVDB_IO_ERROR;
+	cached = NULL;
+	disknode = tkvdb_map_node(tr->db, off);
+	if (disknode) {
+		/* whole node is in mapped file */
+		mapped = 1;
+		if (tail && !tkvdb_node_crc_ok(disknode)) {
+			return TKVDB_CORRUPTED;
+		}
+	} else {
+		cached = tkvdb_cache_get(&tr->db->cache, off);
 	}
 
-	if (!tkvdb_try_read_file(fd, buf, TKVDB_READ_SIZE, 1)) {
-		return TKVDB_IO_ERROR;
-	}
-	disknode = (struct tkvdb_disknode *)buf;
+	if (cached) {
+		/* only nodes not bigger than read block are cached */
+		disknode = (struct tkvdb_disknode *)cached->data;
+	} else if (!mapped) {
+		if (tkvdb_compressed(tr->db)) {
+			/* whole node is in decompressed frame */
+			TKVDB_EXEC( tkvdb_frame_node(tr->db, off,
+				&disknode) );
+			mapped = 1;
+		} else {
+			if (lseek(fd, off, SEEK_SET) != (off_t)off) {
+				return TKVDB_IO_ERROR;
+			}
+
+			if (!tkvdb_try_read_file(fd, buf, TKVDB_READ_SIZE,
+				1)) {
+
+				return TKVDB_IO_ERROR;
+			}
+			disknode = (struct tkvdb_disknode *)buf;
+		}
+
+		/* nodes which are not in memory as a whole are checked
+		 * after read */
+		if (tail && (mapped || (disknode->size <= TKVDB_READ_SIZE))
+			&& !tkvdb_node_crc_ok(disknode)) {
+
+			return TKVDB_CORRUPTED;
+		}
+
+		if ((tr->db->cache.limit > 0)
+			&& (disknode->size <= TKVDB_READ_SIZE)) {
 
-	/* calculate size of prefix + value + metadata */
-	prefix_val_meta_size = disknode->size - sizeof(struct tkvdb_disknode)
-		+ sizeof(uint8_t) * 1;
+			tkvdb_cache_put(&tr->db->cache, off, disknode,
+				disknode->size);
+		}
+	}
 
+	ptr = disknode->data;
 	if (disknode->type & TKVDB_NODE_VAL) {
-		prefix_val_meta_size -= sizeof(uint32_t);
+		val_size = *((uint32_t *)ptr);
+		ptr += sizeof(uint32_t);
 	}
 	if (disknode->type & TKVDB_NODE_META) {
-		prefix_val_meta_size -= sizeof(uint32_t);
+		meta_size = *((uint32_t *)ptr);
+		ptr += sizeof(uint32_t);
 	}
-
-	if (disknode->nsubnodes > TKVDB_SUBNODES_THR) {
-		prefix_val_meta_size -= 256 * sizeof(uint64_t);
-	} else {
-		prefix_val_meta_size -= disknode->nsubnodes * sizeof(uint8_t);
-		prefix_val_meta_size -= disknode->nsubnodes * sizeof(uint64_t);
+	if (!(disknode->type & TKVDB_NODE_LEAF)) {
+		ptr = tkvdb_subnodes_get(ptr, disknode->nsubnodes, off, syms,
+			offs);
 	}
 
+	/* prefix + value + metadata are the rest of node */
+	prefix_val_meta_size = disknode->size - tail
+		- (ptr - (const uint8_t *)disknode);
+
 	/* allocate memnode */
+	nclass = tkvdb_node_class(disknode->nsubnodes);
 	if (disknode->type & TKVDB_NODE_LEAF) {
 		*node_ptr = TKVDB_IMPL_NODE_ALLOC(trns,
-			sizeof(TKVDB_MEMNODE_TYPE_LEAF)
-			+ prefix_val_meta_size + NODE_ALIGN);
+			sizeof(TKVDB_MEMNODE_TYPE)
+			+ prefix_val_meta_size + NODE_ALIGN + tail);
 	} else {
 		*node_ptr = TKVDB_IMPL_NODE_ALLOC(trns,
 			sizeof(TKVDB_MEMNODE_TYPE)
-			+ prefix_val_meta_size + NODE_ALIGN);
+			+ prefix_val_meta_size + NODE_ALIGN + tail
+			+ 7 + TKVDB_SUBNODES_SIZE(nclass));
 	}
 
 	if (!(*node_ptr)) {
 		return TKVDB_ENOMEM;
 	}
 
-	(*node_ptr)->c.replaced_by = NULL;
+	(*node_ptr)->c.replaced_by = 0;
+	(*node_ptr)->c.version = 0;
 
 	/* now fill memnode with values from disk node */
 	(*node_ptr)->c.type = disknode->type;
+	(*node_ptr)->c.nclass = nclass;
 	(*node_ptr)->c.prefix_size = disknode->prefix_size;
 
-	(*node_ptr)->c.disk_size = 0;
 	(*node_ptr)->c.disk_off = 0;
+	(*node_ptr)->c.fnext = NULL;
 
-	(*node_ptr)->c.nsubnodes = disknode->nsubnodes;
-
-	ptr = disknode->data;
-
-	(*node_ptr)->c.val_size = (*node_ptr)->c.meta_size = 0;
-	if (disknode->type & TKVDB_NODE_VAL) {
-		(*node_ptr)->c.val_size = *((uint32_t *)ptr);
-		ptr += sizeof(uint32_t);
-	}
-	if (disknode->type & TKVDB_NODE_META) {
-		(*node_ptr)->c.meta_size = *((uint32_t *)ptr);
-		ptr += sizeof(uint32_t);
-	}
-
-	if (disknode->type & TKVDB_NODE_LEAF) {
-		TKVDB_MEMNODE_TYPE_LEAF *node_leaf;
-		node_leaf = (TKVDB_MEMNODE_TYPE_LEAF *)(*node_ptr);
-		prefix_val_meta = node_leaf->prefix_val_meta;
-	} else {
-		/* non-leaf node */
-		memset((*node_ptr)->next, 0,
-			sizeof(TKVDB_MEMNODE_TYPE *) * 256);
-
-		if (disknode->nsubnodes > TKVDB_SUBNODES_THR) {
-			memcpy((*node_ptr)->fnext, ptr,
-				256 * sizeof(uint64_t));
-			ptr += 256 * sizeof(uint64_t);
-		} else {
-			int i;
-			uint64_t *offptr;
+	(*node_ptr)->c.nsubnodes = 0;
 
-			offptr = (uint64_t *)(ptr
-				+ disknode->nsubnodes * sizeof(uint8_t));
-			memset((*node_ptr)->fnext, 0, sizeof(uint64_t) * 256);
+	(*node_ptr)->c.val_size = val_size;
+	(*node_ptr)->c.meta_size = meta_size;
 
-			for (i=0; i<disknode->nsubnodes; i++) {
-				(*node_ptr)->fnext[*ptr] = *offptr;
-				ptr++;
-				offptr++;
-			}
-			ptr += disknode->nsubnodes * sizeof(uint64_t);
-		}
-		prefix_val_meta = (*node_ptr)->prefix_val_meta;
-	}
+	/* subnodes are added after prefix, value and metadata are copied,
+	   their position in memnode depends on value alignment */
+	prefix_val_meta = (*node_ptr)->prefix_val_meta;
 
-	if (disknode->size > TKVDB_READ_SIZE) {
-		/* prefix + value + metadata bigger than read block */
-		size_t blk_tail = TKVDB_READ_SIZE
-			- (disknode->size - prefix_val_meta_size);
+	if (!mapped && (disknode->size > TKVDB_READ_SIZE)) {
+		/* prefix + value + metadata bigger than read block, CRC32C
+		 * is read after them */
+		size_t head = disknode->size - prefix_val_meta_size - tail;
+		size_t blk_tail = TKVDB_READ_SIZE - head;
+		uint8_t *vm;
+		uint32_t crc;
 
 #ifdef TKVDB_PARAMS_ALIGN_VAL
 		size_t pfx_size = (*node_ptr)->c.prefix_size;
@@ -367,7 +853,8 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 			if (!tkvdb_try_read_file(fd, val_meta_ptr,
 				disknode->size - TKVDB_READ_SIZE, 0)) {
 
-				return TKVDB_IO_ERROR;
+				r = TKVDB_IO_ERROR;
+				goto fail_read;
 			}
 		} else {
 			/* copy start of prefix */
@@ -378,7 +865,8 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 				prefix_val_meta + blk_tail,
 				pfx_size - blk_tail, 0)) {
 
-				return TKVDB_IO_ERROR;
+				r = TKVDB_IO_ERROR;
+				goto fail_read;
 			}
 
 			/* read value + metadata */
@@ -387,19 +875,36 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 				+ (*node_ptr)->c.val_pad;
 
 			if (!tkvdb_try_read_file(fd, val_meta_ptr,
-				prefix_val_meta_size - pfx_size, 0)) {
+				prefix_val_meta_size - pfx_size + tail, 0)) {
 
-				return TKVDB_IO_ERROR;
+				r = TKVDB_IO_ERROR;
+				goto fail_read;
 			}
 		}
+		vm = prefix_val_meta + pfx_size + (*node_ptr)->c.val_pad;
 #else
 		memcpy(prefix_val_meta, ptr, blk_tail);
 		if (!tkvdb_try_read_file(fd, prefix_val_meta + blk_tail,
 			disknode->size - TKVDB_READ_SIZE, 0)) {
 
-			return TKVDB_IO_ERROR;
+			r = TKVDB_IO_ERROR;
+			goto fail_read;
 		}
+		vm = prefix_val_meta + (*node_ptr)->c.prefix_size;
 #endif
+		if (tail) {
+			size_t vm_size = prefix_val_meta_size
+				- (*node_ptr)->c.prefix_size;
+
+			crc = tkvdb_crc32c(0, disknode, head);
+			crc = tkvdb_crc32c(crc, prefix_val_meta,
+				(*node_ptr)->c.prefix_size);
+			crc = tkvdb_crc32c(crc, vm, vm_size);
+			if (memcmp(&crc, vm + vm_size, TKVDB_CRC_SIZE) != 0) {
+				r = TKVDB_CORRUPTED;
+				goto fail_read;
+			}
+		}
 	} else {
 #ifdef TKVDB_PARAMS_ALIGN_VAL
 		/* copy prefix */
@@ -416,7 +921,40 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 #endif
 	}
 
+	if (!(disknode->type & TKVDB_NODE_LEAF)) {
+		/* non-leaf node */
+		memset(TKVDB_NODE_SUBNODES(*node_ptr), 0,
+			TKVDB_SUBNODES_SIZE(nclass));
+
+		r = TKVDB_IMPL_NODE_FNEXT_ALLOC(tr, *node_ptr);
+		if (r != TKVDB_OK) {
+			goto fail_read;
+		}
+
+		if (nclass == TKVDB_NODE_CLASS_256) {
+			/* slot is symbol */
+			for (i=0; i<disknode->nsubnodes; i++) {
+				(*node_ptr)->c.fnext[syms[i]] = offs[i];
+			}
+			(*node_ptr)->c.nsubnodes = disknode->nsubnodes;
+		} else {
+			for (i=0; i<disknode->nsubnodes; i++) {
+				TKVDB_IMPL_NODE_ADD_SUBNODE(*node_ptr, syms[i],
+					0, offs[i]);
+			}
+		}
+	}
+
+	/* node is the same as on disk */
+	(*node_ptr)->c.dirty = 0;
+
 	return TKVDB_OK;
+
+fail_read:
+	/* node is not in tree yet */
+	TKVDB_IMPL_NODE_DISCARD(tr, *node_ptr);
+	*node_ptr = NULL;
+	return r;
 #undef NODE_ALIGN
 #undef PTR_TO_VAL
 #undef VALPADDING
@@ -425,66 +963,96 @@ TKVDB_IMPL_NODE_READ(tkvdb_tr *trns,
 #endif
 /* no NODE_READ function in RAM-only mode */
 
-/* free node and subnodes */
-static void
-TKVDB_IMPL_NODE_FREE(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node)
+/* remove subnode with symbol 'sym' from node
+ * with concurrent readers node is copied and modified copy replaces
+ * original */
+static TKVDB_RES
+TKVDB_IMPL_NODE_REMOVE(tkvdb_tr *trns, TKVDB_MEMNODE_TYPE *node,
+	TKVDB_MEMNODE_TYPE *rchain, int sym)
 {
-	size_t stack_size = 0;
+	TKVDB_MEMNODE_TYPE *newnode;
+	tkvdb_tr_data *tr = trns->data;
 
-	TKVDB_MEMNODE_TYPE *next;
-	int off = 0;
+	if (!tr->ebr) {
+		TKVDB_IMPL_NODE_DEL_SUBNODE(node, sym);
+		TKVDB_IMPL_NODE_SHRINK(trns, node, rchain);
+		return TKVDB_OK;
+	}
 
-	for (;;) {
-		if (node->c.replaced_by) {
-			next = node->c.replaced_by;
-			free(node);
-			node = next;
-			continue;
-		}
+	newnode = TKVDB_IMPL_NODE_RESIZE(trns, node, node->c.nclass);
+	if (!newnode) {
+		return TKVDB_ENOMEM;
+	}
+	TKVDB_IMPL_NODE_DEL_SUBNODE(newnode, sym);
+	TKVDB_IMPL_NODE_REPLACE(tr, rchain, node, newnode);
+	TKVDB_IMPL_NODE_SHRINK(trns, newnode, rchain);
+
+	return TKVDB_OK;
+}
 
+/* mark all nodes below locked node as obsolete
+ * concurrent writers that are inside subtree will restart instead of
+ * updating nodes that are about to be removed from tree */
+static void
+TKVDB_IMPL_NODE_OBSOLETE(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node)
+{
+	TKVDB_MEMNODE_TYPE **stack = NULL, **tmpstack, *next;
+	size_t stack_size = 0, stack_allocated = 0;
+	unsigned int v;
+	int i, nslots;
+
+	for (;;) {
 		if (!(node->c.type & TKVDB_NODE_LEAF)) {
-			/* search in subnodes */
-			next = NULL;
-			for (; off<256; off++) {
-				if (node->next[off]) {
-					next = node->next[off];
-					break;
+			TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+
+			nslots = tkvdb_class_max[node->c.nclass];
+			for (i=0; i<nslots; i++) {
+				next = TKVDB_REF_NODE(tr,
+					TKVDB_LOAD_ACQ(next_arr[i]));
+				if (!next) {
+					continue;
 				}
-			}
 
-			if (next) {
-				/* push */
-				if ((stack_size + 1) > tr->stack_allocated) {
-					tr->stack = realloc(tr->stack,
-						(stack_size + 1)
-						* sizeof(struct tkvdb_visit_helper));
-					if (!tr->stack) {
+				/* lock last version of subnode */
+				for (;;) {
+					TKVDB_SKIP_RNODES(tr, next);
+					v = tkvdb_olc_read(&next->c.version);
+					if (!(v & TKVDB_OLC_OBSOLETE)
+						&& tkvdb_olc_lock(
+						&next->c.version, v)) {
+
+						break;
+					}
+				}
+				tkvdb_olc_unlock(&next->c.version, 1);
+
+				/* subnodes of obsolete node can't be changed
+				   anymore, traverse them later */
+				if ((stack_size + 1) > stack_allocated) {
+					stack_allocated = stack_allocated * 2
+						+ 16;
+					tmpstack = realloc(stack,
+						stack_allocated
+						* sizeof(TKVDB_MEMNODE_TYPE *));
+					if (!tmpstack) {
+						/* not fatal, rest of subtree
+						   is removed anyway */
+						free(stack);
 						return;
 					}
-					tr->stack_allocated = stack_size + 1;
+					stack = tmpstack;
 				}
-				tr->stack[stack_size].node = node;
-				tr->stack[stack_size].off = off;
+				stack[stack_size] = next;
 				stack_size++;
-
-				node = next;
-				off = 0;
-				continue;
 			}
 		}
 
-		/* no more subnodes */
-		if (stack_size < 1) {
+		if (stack_size == 0) {
 			break;
 		}
-
-		free(node);
-		/* get node from stack's top */
 		stack_size--;
-		node = tr->stack[stack_size].node;
-		off = tr->stack[stack_size].off;
-		off++;
+		node = stack[stack_size];
 	}
-	free(node);
-}
 
+	free(stack);
+}
@@ -32,7 +32,7 @@ do {                                                                        \
 #define TKVDB_TRIGGERS_NEWROOT(T, N)                                        \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_INSERT_NEWROOT;                        \
-	T->info.newroot = TKVDB_META_ADDR_LEAF(N);                          \
+	T->info.newroot = TKVDB_META_ADDR(N);                               \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
 
@@ -46,7 +46,7 @@ do {                                                                        \
 #define TKVDB_TRIGGERS_SHORTER(T, N, R)                                     \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_INSERT_SHORTER;                        \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(N);                       \
+	T->info.newroot = TKVDB_META_ADDR(N);                               \
 	T->info.subnode1 = TKVDB_META_ADDR(R);                              \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
@@ -54,15 +54,15 @@ do {                                                                        \
 #define TKVDB_TRIGGERS_LONGER(T, N, R)                                      \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_INSERT_LONGER;                         \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(N);                       \
-	T->info.subnode1 = TKVDB_META_ADDR_LEAF(R);                         \
+	T->info.newroot = TKVDB_META_ADDR(N);                               \
+	T->info.subnode1 = TKVDB_META_ADDR(R);                              \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
 
 #define TKVDB_TRIGGERS_NEWNODE(T, N, R)                                     \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_INSERT_NEWNODE;                        \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(N);                       \
+	T->info.newroot = TKVDB_META_ADDR(N);                               \
 	T->info.subnode1 = TKVDB_META_ADDR(R);                              \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
@@ -70,9 +70,9 @@ do {                                                                        \
 #define TKVDB_TRIGGERS_SPLIT(T, N, R1, R2)                                  \
 do {                                                                        \
 	T->info.type = TKVDB_TRIGGER_INSERT_SPLIT;                          \
-	T->info.newroot = TKVDB_META_ADDR_NONLEAF(N);                       \
+	T->info.newroot = TKVDB_META_ADDR(N);                               \
 	T->info.subnode1 = TKVDB_META_ADDR(R1);                             \
-	T->info.subnode2 = TKVDB_META_ADDR_LEAF(R2);                        \
+	T->info.subnode2 = TKVDB_META_ADDR(R2);                             \
 	TKVDB_CALL_ALL_TRIGGER_FUNCTIONS(T);                                \
 } while (0)
 
@@ -103,6 +103,8 @@ TKVDB_IMPL_PUT(tkvdb_tr *trns, const tkvdb_datum *key, const tkvdb_datum *val)
 	const unsigned char *sym;  /* pointer to current symbol in key */
 	TKVDB_MEMNODE_TYPE *node;  /* current node */
 	size_t pi;                 /* prefix index */
+	int slot;                  /* slot of subnode */
+	unsigned int v = 0;        /* version of node for concurrent writers */
 	/* replaced nodes chain start */
 	TKVDB_MEMNODE_TYPE *rnodes_chain = NULL;
 
@@ -112,31 +114,37 @@ TKVDB_IMPL_PUT(tkvdb_tr *trns, const tkvdb_datum *key, const tkvdb_datum *val)
 
 	tkvdb_tr_data *tr = trns->data;
 
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	/* concurrent writer starts from root if some node was changed */
+restart:
 #ifdef TKVDB_TRIGGER
 	/* resets triggers stack to initial state */
 	triggers->stack.size = 0;
 #endif
 
-
-	if (!tr->started) {
-		return TKVDB_NOT_STARTED;
-	}
-
 	/* new root */
-	if (tr->root == NULL) {
+	node = TKVDB_LOAD_ACQ(tr->root);
+	if (node == NULL) {
 		TKVDB_MEMNODE_TYPE *new_root;
 #ifndef TKVDB_PARAMS_NODBFILE
-		if (tr->db && (tr->db->info.filesize > 0)) {
+		if (tr->db && (tkvdb_root_off(tr) > 0)) {
 			/* we have underlying non-empty db file */
 			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
-				tr->db->info.footer.root_off, &new_root) );
+				tkvdb_root_off(tr), &new_root) );
 
 			tr->root = new_root;
+			node = new_root;
 		} else 
 #endif
 		{
+			void *empty = NULL;
+
 			new_root = TKVDB_IMPL_NODE_NEW(trns,
 				TKVDB_NODE_VAL | TKVDB_NODE_LEAF,
+				TKVDB_NODE_CLASS_4,
 				key->size, key->data, val->size, val->data,
 				TKVDB_TRIGGERS_META_SIZE(triggers), NULL);
 			if (!new_root) {
@@ -145,24 +153,25 @@ TKVDB_IMPL_PUT(tkvdb_tr *trns, const tkvdb_datum *key, const tkvdb_datum *val)
 
 			TKVDB_TRIGGERS_NEWROOT(triggers, new_root);
 
-			tr->root = new_root;
+			if (!tr->params.tr_concurrent) {
+				TKVDB_STORE_REL(tr->root, new_root);
+			} else if (!TKVDB_CAS(tr->root, empty, new_root)) {
+				/* root was created by other writer */
+				TKVDB_IMPL_NODE_DISCARD(tr, new_root);
+				goto restart;
+			}
 			return TKVDB_OK;
 		}
 	}
 
 	sym = key->data;
-	node = tr->root;
 
 next_node:
 	rnodes_chain = node;
-	TKVDB_SKIP_RNODES(node);
+	TKVDB_SKIP_RNODES(tr, node);
+	TKVDB_OLC_READ(node, v);
 
-	if (node->c.type & TKVDB_NODE_LEAF) {
-		prefix_val_meta =
-			((TKVDB_MEMNODE_TYPE_LEAF *)node)->prefix_val_meta;
-	} else {
-		prefix_val_meta = node->prefix_val_meta;
-	}
+	prefix_val_meta = node->prefix_val_meta;
 
 	TKVDB_TRIGGER_NODE_PUSH(triggers, node, prefix_val_meta);
 
@@ -182,19 +191,23 @@ next_byte:
 	if (sym >= ((unsigned char *)key->data + key->size)) {
 		TKVDB_MEMNODE_TYPE *newroot, *subnode_rest;
 
+		TKVDB_OLC_LOCK(node, v);
+
 		if (pi == node->c.prefix_size) {
 			/* exact match */
 			if ((node->c.type & TKVDB_NODE_VAL)
-				&& (node->c.val_size == val->size)) {
+				&& (node->c.val_size == val->size)
+				&& !tr->ebr && !tr->params.tr_concurrent) {
 
-				/* same value size, so copy new value
-					and return */
+				/* same value size and no concurrent readers,
+					so copy new value and return */
 				TKVDB_TRIGGERS_UPDATE(triggers);
 
 				memcpy(prefix_val_meta
 					+ node->c.prefix_size
 					+ TKVDB_VAL_ALIGN_PAD(node),
 					val->data, val->size);
+				node->c.dirty = 1;
 				return TKVDB_OK;
 			}
 
@@ -202,15 +215,21 @@ next_byte:
 				create new node */
 			newroot = TKVDB_IMPL_NODE_NEW(trns,
 				node->c.type | TKVDB_NODE_VAL,
+				node->c.nclass,
 				pi, prefix_val_meta,
 				val->size, val->data,
 				node->c.meta_size,
 				prefix_val_meta + node->c.prefix_size
 					+ TKVDB_VAL_ALIGN_PAD(node)
 					+ node->c.val_size);
-			if (!newroot) return TKVDB_ENOMEM;
+			if (!newroot) goto enomem;
 
-			TKVDB_IMPL_CLONE_SUBNODES(newroot, node);
+			if (TKVDB_IMPL_CLONE_SUBNODES(tr, newroot, node)
+				!= TKVDB_OK) {
+
+				TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+				goto enomem;
+			}
 
 			if (node->c.type & TKVDB_NODE_VAL) {
 				TKVDB_TRIGGERS_UPDATE(triggers);
@@ -218,8 +237,8 @@ next_byte:
 				TKVDB_TRIGGERS_SUBKEY(triggers, newroot);
 			}
 
-			TKVDB_REPLACE_NODE(!tr->params.tr_buf_dynalloc,
-				rnodes_chain, node, newroot);
+			TKVDB_IMPL_NODE_REPLACE(tr, rnodes_chain, node, newroot);
+			TKVDB_OLC_UNLOCK_OBSOLETE(node);
 
 			return TKVDB_OK;
 		}
@@ -232,14 +251,15 @@ next_byte:
   [1][2][3] - new root
   next['4'] => [5][6] - tail
 */
-		newroot = TKVDB_IMPL_NODE_NEW(trns, TKVDB_NODE_VAL, pi,
+		newroot = TKVDB_IMPL_NODE_NEW(trns, TKVDB_NODE_VAL,
+			TKVDB_NODE_CLASS_4, pi,
 			prefix_val_meta,
 			val->size, val->data,
 			TKVDB_TRIGGERS_META_SIZE(triggers), NULL);
-		if (!newroot) return TKVDB_ENOMEM;
+		if (!newroot) goto enomem;
 
 		subnode_rest = TKVDB_IMPL_NODE_NEW(trns,
-			node->c.type,
+			node->c.type, node->c.nclass,
 			node->c.prefix_size - pi - 1,
 			prefix_val_meta + pi + 1,
 			node->c.val_size,
@@ -250,20 +270,24 @@ next_byte:
 				+ TKVDB_VAL_ALIGN_PAD(node)
 				+ node->c.val_size);
 		if (!subnode_rest) {
-			if (tr->params.tr_buf_dynalloc) {
-				free(newroot);
-			}
-			return TKVDB_ENOMEM;
+			TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+			goto enomem;
+		}
+		if (TKVDB_IMPL_CLONE_SUBNODES(tr, subnode_rest, node)
+			!= TKVDB_OK) {
+
+			TKVDB_IMPL_NODE_DISCARD(tr, subnode_rest);
+			TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+			goto enomem;
 		}
-		TKVDB_IMPL_CLONE_SUBNODES(subnode_rest, node);
 
-		newroot->next[prefix_val_meta[pi]] = subnode_rest;
-		newroot->c.nsubnodes += 1;
+		TKVDB_IMPL_NODE_ADD_SUBNODE(newroot, prefix_val_meta[pi],
+			TKVDB_NODE_REF(tr, subnode_rest), 0);
 
 		TKVDB_TRIGGERS_SHORTER(triggers, newroot, subnode_rest);
 
-		TKVDB_REPLACE_NODE(!tr->params.tr_buf_dynalloc,
-			rnodes_chain, node, newroot);
+		TKVDB_IMPL_NODE_REPLACE(tr, rnodes_chain, node, newroot);
+		TKVDB_OLC_UNLOCK_OBSOLETE(node);
 
 		return TKVDB_OK;
 	}
@@ -277,12 +301,17 @@ next_byte:
   next['7'] => [8][9] - tail
 */
 	if (pi >= node->c.prefix_size) {
+		TKVDB_MEMNODE_TYPE *tail, *grown;
+
 		if (node->c.type & TKVDB_NODE_LEAF) {
 			/* create 2 nodes */
 			TKVDB_MEMNODE_TYPE *newroot, *subnode_rest;
 
+			TKVDB_OLC_LOCK(node, v);
+
 			newroot = TKVDB_IMPL_NODE_NEW(trns,
 				node->c.type & (~TKVDB_NODE_LEAF),
+				TKVDB_NODE_CLASS_4,
 				node->c.prefix_size,
 				prefix_val_meta,
 				node->c.val_size,
@@ -293,72 +322,107 @@ next_byte:
 				prefix_val_meta + node->c.prefix_size
 					+ TKVDB_VAL_ALIGN_PAD(node)
 					+ node->c.val_size);
-			if (!newroot) {
-				if (tr->params.tr_buf_dynalloc) {
-					free(newroot);
-				}
-				return TKVDB_ENOMEM;
-			}
+			if (!newroot) goto enomem;
 
 			subnode_rest = TKVDB_IMPL_NODE_NEW(trns,
 				TKVDB_NODE_VAL | TKVDB_NODE_LEAF,
+				TKVDB_NODE_CLASS_4,
 				key->size -
 					(sym - (unsigned char *)key->data) - 1,
 				sym + 1,
 				val->size, val->data,
 				TKVDB_TRIGGERS_META_SIZE(triggers), NULL);
-			if (!subnode_rest) return TKVDB_ENOMEM;
+			if (!subnode_rest) {
+				TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+				goto enomem;
+			}
 
-			newroot->c.nsubnodes += 1;
-			newroot->next[*sym] = subnode_rest;
+			TKVDB_IMPL_NODE_ADD_SUBNODE(newroot, *sym,
+				TKVDB_NODE_REF(tr, subnode_rest), 0);
 
 			TKVDB_TRIGGERS_LONGER(triggers, newroot, subnode_rest);
 
-			TKVDB_REPLACE_NODE(!tr->params.tr_buf_dynalloc,
-				rnodes_chain, node, newroot);
+			TKVDB_IMPL_NODE_REPLACE(tr, rnodes_chain, node, newroot);
+			TKVDB_OLC_UNLOCK_OBSOLETE(node);
 
 			return TKVDB_OK;
-		} else if (node->next[*sym] != NULL) {
-			/* continue with next node */
-			node = node->next[*sym];
-			sym++;
-			goto next_node;
 		}
-#ifndef TKVDB_PARAMS_NODBFILE
-		/* only if we have underlying db file */
-		else if (tr->db && (node->fnext[*sym] != 0)) {
-			TKVDB_MEMNODE_TYPE *tmp;
 
-			/* load subnode from disk */
-			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
-				node->fnext[*sym], &tmp) );
-
-			node->next[*sym] = tmp;
-			node = tmp;
-			sym++;
-			goto next_node;
-		}
+		slot = TKVDB_IMPL_NODE_SLOT(node, *sym);
+		if (slot >= 0) {
+			TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+			TKVDB_MEMNODE_TYPE *next;
+
+			next = TKVDB_REF_NODE(tr,
+				TKVDB_LOAD_ACQ(next_arr[slot]));
+			if (next != NULL) {
+				/* node wasn't changed while we read it */
+				TKVDB_OLC_CHECK(node, v);
+
+				/* continue with next node */
+				node = next;
+				sym++;
+				goto next_node;
+			}
+#ifndef TKVDB_PARAMS_NODBFILE
+			/* only if we have underlying db file */
+			if (tr->db && (TKVDB_NODE_FNEXT(node, slot) != 0)) {
+				TKVDB_MEMNODE_TYPE *tmp;
+
+				/* load subnode from disk */
+				TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
+					TKVDB_NODE_FNEXT(node, slot), &tmp) );
+
+				next_arr[slot] = TKVDB_NODE_REF(tr, tmp);
+				node = tmp;
+				sym++;
+				goto next_node;
+			}
 #endif
-		else {
-			/* non-leaf node */
-			TKVDB_MEMNODE_TYPE *tmp;
+		}
 
-			/* allocate tail */
-			tmp = TKVDB_IMPL_NODE_NEW(trns,
-				TKVDB_NODE_VAL | TKVDB_NODE_LEAF,
-				key->size -
-					(sym - (unsigned char *)key->data) - 1,
-				sym + 1,
-				val->size, val->data,
-				TKVDB_TRIGGERS_META_SIZE(triggers), NULL);
-			if (!tmp) return TKVDB_ENOMEM;
+		/* non-leaf node without such subnode, allocate tail */
+		TKVDB_OLC_LOCK(node, v);
 
-			TKVDB_TRIGGERS_NEWNODE(triggers, node, tmp);
+		tail = TKVDB_IMPL_NODE_NEW(trns,
+			TKVDB_NODE_VAL | TKVDB_NODE_LEAF,
+			TKVDB_NODE_CLASS_4,
+			key->size - (sym - (unsigned char *)key->data) - 1,
+			sym + 1,
+			val->size, val->data,
+			TKVDB_TRIGGERS_META_SIZE(triggers), NULL);
+		if (!tail) goto enomem;
 
-			node->next[*sym] = tmp;
-			node->c.nsubnodes += 1; /* XXX: not atomic */
+		if (node->c.nsubnodes < tkvdb_class_max[node->c.nclass]) {
+			TKVDB_TRIGGERS_NEWNODE(triggers, node, tail);
+
+			TKVDB_IMPL_NODE_ADD_SUBNODE(node, *sym,
+				TKVDB_NODE_REF(tr, tail), 0);
+			TKVDB_OLC_UNLOCK(node);
 			return TKVDB_OK;
 		}
+
+		/* no room for subnode, replace node with bigger one */
+		grown = TKVDB_IMPL_NODE_RESIZE(trns, node, node->c.nclass + 1);
+		if (!grown) {
+			TKVDB_IMPL_NODE_DISCARD(tr, tail);
+			goto enomem;
+		}
+
+		/* metadata of current node is in grown node now */
+		TKVDB_TRIGGER_NODE_POP(triggers);
+		TKVDB_TRIGGER_NODE_PUSH(triggers, grown,
+			grown->prefix_val_meta);
+
+		TKVDB_TRIGGERS_NEWNODE(triggers, grown, tail);
+
+		TKVDB_IMPL_NODE_ADD_SUBNODE(grown, *sym,
+			TKVDB_NODE_REF(tr, tail), 0);
+
+		TKVDB_IMPL_NODE_REPLACE(tr, rnodes_chain, node, grown);
+		TKVDB_OLC_UNLOCK_OBSOLETE(node);
+
+		return TKVDB_OK;
 	}
 
 /* node prefix don't match with corresponding part of key
@@ -372,18 +436,20 @@ next_byte:
 	if (prefix_val_meta[pi] != *sym) {
 		TKVDB_MEMNODE_TYPE *newroot, *subnode_rest, *subnode_key;
 
+		TKVDB_OLC_LOCK(node, v);
+
 		/* split current node into 3 subnodes */
-		newroot = TKVDB_IMPL_NODE_NEW(trns, 0, pi,
+		newroot = TKVDB_IMPL_NODE_NEW(trns, 0, TKVDB_NODE_CLASS_4, pi,
 			prefix_val_meta, 0, NULL,
 			node->c.meta_size,
 			prefix_val_meta + node->c.prefix_size
 				+ TKVDB_VAL_ALIGN_PAD(node)
 				+ node->c.val_size);
-		if (!newroot) return TKVDB_ENOMEM;
+		if (!newroot) goto enomem;
 
 		/* rest of prefix (skip current symbol) */
 		subnode_rest = TKVDB_IMPL_NODE_NEW(trns,
-			node->c.type,
+			node->c.type, node->c.nclass,
 			node->c.prefix_size - pi - 1,
 			prefix_val_meta + pi + 1,
 			node->c.val_size,
@@ -394,38 +460,46 @@ next_byte:
 				+ TKVDB_VAL_ALIGN_PAD(node)
 				+ node->c.val_size);
 		if (!subnode_rest) {
-			if (tr->params.tr_buf_dynalloc) {
-				free(newroot);
-			}
-			return TKVDB_ENOMEM;
+			TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+			goto enomem;
 		}
-		TKVDB_IMPL_CLONE_SUBNODES(subnode_rest, node);
 
 		/* rest of key */
 		subnode_key = TKVDB_IMPL_NODE_NEW(trns,
 			TKVDB_NODE_VAL | TKVDB_NODE_LEAF,
+			TKVDB_NODE_CLASS_4,
 			key->size -
 				(sym - (unsigned char *)key->data) - 1,
 			sym + 1,
 			val->size, val->data,
 			TKVDB_TRIGGERS_META_SIZE(triggers), NULL);
 		if (!subnode_key) {
-			if (tr->params.tr_buf_dynalloc) {
-				free(subnode_rest);
-				free(newroot);
-			}
-			return TKVDB_ENOMEM;
+			TKVDB_IMPL_NODE_DISCARD(tr, subnode_rest);
+			TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+			goto enomem;
+		}
+
+		/* subnodes are cloned when nothing else may fail, positions
+		 * of subnodes in file may be moved from current node */
+		if (TKVDB_IMPL_CLONE_SUBNODES(tr, subnode_rest, node)
+			!= TKVDB_OK) {
+
+			TKVDB_IMPL_NODE_DISCARD(tr, subnode_key);
+			TKVDB_IMPL_NODE_DISCARD(tr, subnode_rest);
+			TKVDB_IMPL_NODE_DISCARD(tr, newroot);
+			goto enomem;
 		}
 
-		newroot->next[prefix_val_meta[pi]] = subnode_rest;
-		newroot->next[*sym] = subnode_key;
-		newroot->c.nsubnodes += 2;
+		TKVDB_IMPL_NODE_ADD_SUBNODE(newroot, prefix_val_meta[pi],
+			TKVDB_NODE_REF(tr, subnode_rest), 0);
+		TKVDB_IMPL_NODE_ADD_SUBNODE(newroot, *sym,
+			TKVDB_NODE_REF(tr, subnode_key), 0);
 
 		TKVDB_TRIGGERS_SPLIT(triggers, newroot,
 			subnode_rest, subnode_key);
 
-		TKVDB_REPLACE_NODE(!tr->params.tr_buf_dynalloc,
-			rnodes_chain, node, newroot);
+		TKVDB_IMPL_NODE_REPLACE(tr, rnodes_chain, node, newroot);
+		TKVDB_OLC_UNLOCK_OBSOLETE(node);
 
 		return TKVDB_OK;
 	}
@@ -434,12 +508,15 @@ next_byte:
 	pi++;
 	goto next_byte;
 
-	return TKVDB_OK;
+enomem:
+	TKVDB_OLC_UNLOCK(node);
+	return TKVDB_ENOMEM;
 }
 
 #undef TKVDB_TRIGGERS_META_SIZE
 
 #undef TKVDB_TRIGGER_NODE_PUSH
+#undef TKVDB_TRIGGER_NODE_POP
 
 #undef TKVDB_TRIGGERS_UPDATE
 #undef TKVDB_TRIGGERS_NEWROOT
@@ -449,8 +526,6 @@ next_byte:
 #undef TKVDB_TRIGGERS_NEWNODE
 #undef TKVDB_TRIGGERS_SPLIT
 
-#undef TKVDB_META_ADDR_LEAF
-#undef TKVDB_META_ADDR_NONLEAF
 #undef TKVDB_META_ADDR
 #undef TKVDB_INC_VOID_PTR
 #undef TKVDB_CALL_ALL_TRIGGER_FUNCTIONS
@@ -22,6 +22,7 @@ TKVDB_IMPL_SUBNODE(tkvdb_tr *trns, void *node, int n, void **ret,
 {
 	unsigned char *prefix_val_meta;
 	TKVDB_MEMNODE_TYPE *tmpnode;
+	int slot;
 	tkvdb_tr_data *tr = trns->data;
 
 	if (!tr->started) {
@@ -54,40 +55,42 @@ TKVDB_IMPL_SUBNODE(tkvdb_tr *trns, void *node, int n, void **ret,
 	}
 
 	tmpnode = node;
-	TKVDB_SKIP_RNODES(tmpnode);
+	TKVDB_SKIP_RNODES(tr, tmpnode);
 
 	if (tmpnode->c.type & TKVDB_NODE_LEAF) {
 		return TKVDB_NOT_FOUND;
 	}
 
-	tmpnode = tmpnode->next[n];
-	if (tmpnode != NULL) {
+	slot = TKVDB_IMPL_NODE_SLOT(tmpnode, n);
+	if (slot < 0) {
+		return TKVDB_NOT_FOUND;
+	}
+
+	if (TKVDB_NODE_NEXT(tmpnode)[slot]) {
+		tmpnode = TKVDB_REF_NODE(tr, TKVDB_NODE_NEXT(tmpnode)[slot]);
 		goto ok;
 	}
 #ifndef TKVDB_PARAMS_NODBFILE
-	else if (tr->db && (tmpnode->fnext[n] != 0)) {
+	else if (tr->db && (TKVDB_NODE_FNEXT(tmpnode, slot) != 0)) {
+		TKVDB_MEMNODE_TYPE *loaded;
 		uint64_t off;
 
 		/* load subnode from disk */
-		off = tmpnode->fnext[n];
-		TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns, off, &tmpnode) );
+		off = TKVDB_NODE_FNEXT(tmpnode, slot);
+		TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns, off, &loaded) );
 
+		TKVDB_NODE_NEXT(tmpnode)[slot] = TKVDB_NODE_REF(tr, loaded);
+		tmpnode = loaded;
 		goto ok;
 	}
 #endif
 
-
 	return TKVDB_NOT_FOUND;
 
 ok:
-	TKVDB_SKIP_RNODES(tmpnode);
+	TKVDB_SKIP_RNODES(tr, tmpnode);
 
-	if (tmpnode->c.type & TKVDB_NODE_LEAF) {
-		prefix_val_meta =
-			((TKVDB_MEMNODE_TYPE_LEAF *)tmpnode)->prefix_val_meta;
-	} else {
-		prefix_val_meta = tmpnode->prefix_val_meta;
-	}
+	prefix_val_meta = tmpnode->prefix_val_meta;
 
 	/* prefix */
 	prefix->data = prefix_val_meta;
@@ -22,20 +22,45 @@ static void
 TKVDB_IMPL_TR_RESET(tkvdb_tr *trns)
 {
 	tkvdb_tr_data *tr = trns->data;
+	TKVDB_MEMNODE_TYPE *root = tr->root;
 
-	if (tr->params.tr_buf_dynalloc) {
-		if (tr->root) {
-			TKVDB_IMPL_NODE_FREE(tr, tr->root);
+	/* detach tree from concurrent readers */
+	TKVDB_STORE_REL(tr->root, NULL);
+
+	if (tr->params.tr_concurrent) {
+		if (root) {
+			TKVDB_IMPL_NODE_FREE(tr, root);
+		}
+		/* nodes deleted by concurrent writers */
+		while (tr->retired) {
+			struct tkvdb_ebr_node *next = tr->retired->next;
+
+			TKVDB_IMPL_NODE_FREE(tr, tr->retired->node);
+			free(tr->retired);
+			tr->retired = next;
 		}
 	} else {
-		tr->tr_buf_ptr = tr->tr_buf;
+		if (tr->ebr && (root || tr->ebr->limbo)) {
+			struct tkvdb_ebr_node *ready, *next;
+
+			/* memory will be reused, wait for readers */
+			tkvdb_ebr_synchronize(tr->ebr);
+
+			/* retired nodes are released with arena */
+			ready = tkvdb_ebr_collect(tr->ebr, 1);
+			while (ready) {
+				next = ready->next;
+				free(ready);
+				ready = next;
+			}
+		}
+		tkvdb_arena_reset(&tr->arena);
 	}
 
-	tr->root = NULL;
-
 	tr->tr_buf_allocated = 0;
+	tr->snapshot = 0;
 	if (!tr->params.autobegin) {
-		tr->started = 0;
+		TKVDB_STORE_REL(tr->started, 0);
 	}
 }
 
@@ -44,10 +69,12 @@ TKVDB_IMPL_TR_FREE(tkvdb_tr *trns)
 {
 	tkvdb_tr_data *tr = trns->data;
 
-	if (tr->params.tr_buf_dynalloc) {
-		TKVDB_IMPL_TR_RESET(trns);
-	} else {
-		free(tr->tr_buf);
+	/* all readers must be freed at this point */
+	TKVDB_IMPL_TR_RESET(trns);
+	free(tr->arena.buf);
+
+	if (tr->ebr) {
+		tkvdb_ebr_free(tr->ebr);
 	}
 
 	free(tr->stack);
@@ -66,25 +93,81 @@ TKVDB_IMPL_ROLLBACK(tkvdb_tr *tr)
 }
 
 
-/* compact node and put it to write buffer */
+/* sorted symbols and encoded offsets of subnodes of node at 'node_off',
+ * subnodes changed by this commit are at their 'disk_off' (offsets in
+ * subtree when sizes are calculated before write) */
+#ifndef TKVDB_PARAMS_NODBFILE
+static void
+TKVDB_IMPL_NODE_SUBNODES(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node,
+	uint64_t node_off, struct tkvdb_subnodes *sub)
+{
+	TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+	uint8_t *idx = TKVDB_NODE_SYMS(node);
+	TKVDB_MEMNODE_TYPE *next;
+	int sym = 0, slot;
+
+	sub->n = 0;
+	for (;;) {
+		/* dense nodes are scanned directly, without search of
+		 * each next symbol */
+		if (node->c.nclass == TKVDB_NODE_CLASS_48) {
+			for (; (sym < 256) && !idx[sym]; sym++);
+			slot = (sym < 256) ? (idx[sym] - 1) : -1;
+		} else if (node->c.nclass == TKVDB_NODE_CLASS_256) {
+			for (; (sym < 256) && !next_arr[sym]
+				&& !TKVDB_NODE_FNEXT(node, sym); sym++);
+			slot = (sym < 256) ? sym : -1;
+		} else {
+			slot = TKVDB_IMPL_NODE_SLOT_SEARCH(node, &sym, 1);
+		}
+		if (slot < 0) {
+			break;
+		}
+
+		next = TKVDB_REF_NODE(tr, next_arr[slot]);
+		if (next) {
+			TKVDB_SKIP_RNODES(tr, next);
+		}
+
+		sub->syms[sub->n] = sym;
+		if (next && next->c.dirty) {
+			sub->vals[sub->n] = TKVDB_SUBNODE_REL(node_off,
+				next->c.disk_off);
+		} else {
+			/* subnode is on disk or unchanged since read */
+			sub->vals[sub->n] = TKVDB_SUBNODE_ABS(
+				TKVDB_NODE_FNEXT(node, slot));
+		}
+		sub->n++;
+		sym++;
+	}
+}
+#endif
+
+/* compact node and append it to write buffer, 'size' and 'sub' are
+ * calculated by TKVDB_IMPL_NODE_CALC_DISKSIZE(), node ends with CRC32C if
+ * 'tail' is not 0 */
 #ifndef TKVDB_PARAMS_NODBFILE
 static TKVDB_RES
-TKVDB_IMPL_NODE_TO_BUF(tkvdb *db, TKVDB_MEMNODE_TYPE *node,
-	uint64_t transaction_off)
+TKVDB_IMPL_NODE_WRITE(struct tkvdb_writer *w, TKVDB_MEMNODE_TYPE *node,
+	uint64_t size, const struct tkvdb_subnodes *sub, size_t tail)
 {
 	struct tkvdb_disknode *disknode;
-	uint8_t *ptr;
-	uint64_t iobuf_off;
+	uint8_t *ptr, *meta;
+	size_t head_size, val_size;
+	uint32_t crc = 0;
 
-	iobuf_off = node->c.disk_off - transaction_off;
+	/* value of deleted key is still in node */
+	val_size = (node->c.type & TKVDB_NODE_VAL) ? node->c.val_size : 0;
 
-	TKVDB_EXEC(
-		tkvdb_writebuf_realloc(db, iobuf_off + node->c.disk_size)
-	);
+	/* node without prefix, value and metadata always fits in buffer */
+	head_size = size - node->c.prefix_size
+		- val_size - node->c.meta_size - tail;
+	TKVDB_EXEC( tkvdb_writer_reserve(w, head_size, &ptr) );
 
-	disknode = (struct tkvdb_disknode *)(db->write_buf + iobuf_off);
+	disknode = (struct tkvdb_disknode *)ptr;
 
-	disknode->size = node->c.disk_size;
+	disknode->size = size;
 	disknode->type = node->c.type;
 	disknode->nsubnodes = node->c.nsubnodes;
 	disknode->prefix_size = node->c.prefix_size;
@@ -100,118 +183,423 @@ TKVDB_IMPL_NODE_TO_BUF(tkvdb *db, TKVDB_MEMNODE_TYPE *node,
 		ptr += sizeof(uint32_t);
 	}
 
-	if (node->c.type & TKVDB_NODE_LEAF) {
-		TKVDB_MEMNODE_TYPE_LEAF *node_leaf;
-		node_leaf = (TKVDB_MEMNODE_TYPE_LEAF *)node;
-#ifdef TKVDB_PARAMS_ALIGN_VAL
-		/* copy prefix */
-		memcpy(ptr, node_leaf->prefix_val_meta, node->c.prefix_size);
-		/* and value */
-		memcpy(ptr + node_leaf->c.prefix_size,
-			node_leaf->prefix_val_meta
-				+ node_leaf->c.prefix_size
-				+ node_leaf->c.val_pad,
-			node_leaf->c.val_size);
-#else
-		memcpy(ptr, node_leaf->prefix_val_meta,
-			node_leaf->c.prefix_size
-			+ node_leaf->c.val_size
-			+ node_leaf->c.meta_size);
-#endif
-	} else {
-		if (node->c.nsubnodes > TKVDB_SUBNODES_THR) {
-			memcpy(ptr, node->fnext, sizeof(uint64_t) * 256);
-			ptr += sizeof(uint64_t) * 256;
-		} else {
-			int i;
-			uint8_t *symbols;
-
-			/* array of next symbols */
-			symbols = ptr;
-			ptr += node->c.nsubnodes * sizeof(uint8_t);
-			for (i=0; i<256; i++) {
-				if (node->fnext[i]) {
-					*symbols = i;
-					symbols++;
-
-					*((uint64_t *)ptr) = node->fnext[i];
-					ptr += sizeof(uint64_t);
-				}
-			}
-		}
+	if (!(node->c.type & TKVDB_NODE_LEAF)) {
+		tkvdb_subnodes_put(ptr, sub);
+	}
+	if (tail) {
+		/* header may be flushed by next puts */
+		crc = tkvdb_crc32c(0, disknode, head_size);
+	}
+
+	/* prefix, value and metadata may be big, they are not copied to
+	 * buffer if there is no space */
 #ifdef TKVDB_PARAMS_ALIGN_VAL
-		memcpy(ptr, node->prefix_val_meta, node->c.prefix_size);
-		memcpy(ptr + node->c.prefix_size,
-			node->prefix_val_meta
-				+ node->c.prefix_size
-				+ node->c.val_pad,
-			node->c.val_size);
+	TKVDB_EXEC( tkvdb_writer_put(w, node->prefix_val_meta,
+		node->c.prefix_size) );
+	TKVDB_EXEC( tkvdb_writer_put(w,
+		node->prefix_val_meta + node->c.prefix_size + node->c.val_pad,
+		val_size) );
+	meta = node->prefix_val_meta + node->c.prefix_size + node->c.val_pad
+		+ node->c.val_size;
+	TKVDB_EXEC( tkvdb_writer_put(w, meta, node->c.meta_size) );
+	if (tail) {
+		crc = tkvdb_crc32c(crc, node->prefix_val_meta,
+			node->c.prefix_size);
+		crc = tkvdb_crc32c(crc, node->prefix_val_meta
+			+ node->c.prefix_size + node->c.val_pad, val_size);
+	}
 #else
-		memcpy(ptr, node->prefix_val_meta,
-			node->c.prefix_size
-			+ node->c.val_size
-			+ node->c.meta_size);
+	TKVDB_EXEC( tkvdb_writer_put(w, node->prefix_val_meta,
+		node->c.prefix_size + val_size) );
+	meta = node->prefix_val_meta + node->c.prefix_size + node->c.val_size;
+	TKVDB_EXEC( tkvdb_writer_put(w, meta, node->c.meta_size) );
+	if (tail) {
+		crc = tkvdb_crc32c(crc, node->prefix_val_meta,
+			node->c.prefix_size + val_size);
+	}
 #endif
+	if (tail) {
+		crc = tkvdb_crc32c(crc, meta, node->c.meta_size);
+		TKVDB_EXEC( tkvdb_writer_put(w, &crc, TKVDB_CRC_SIZE) );
 	}
 
-
 	return TKVDB_OK;
 }
 #endif
 
-/* calculate size of node on disk */
+/* calculate size of node at 'node_off' on disk, subnodes are collected
+ * to 'sub' */
 #ifndef TKVDB_PARAMS_NODBFILE
-static void
-TKVDB_IMPL_NODE_CALC_DISKSIZE(TKVDB_MEMNODE_TYPE *node)
+static uint64_t
+TKVDB_IMPL_NODE_CALC_DISKSIZE(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *node,
+	uint64_t node_off, struct tkvdb_subnodes *sub, size_t tail)
 {
-	node->c.disk_size = sizeof(struct tkvdb_disknode) - 1;
+	uint64_t size = sizeof(struct tkvdb_disknode) - 1 + tail;
 
 	/* if node has value add 4 bytes for value size */
 	if (node->c.type & TKVDB_NODE_VAL) {
-		node->c.disk_size += sizeof(uint32_t);
+		size += sizeof(uint32_t);
 	}
 	/* 4 bytes for metadata size */
 	if (node->c.type & TKVDB_NODE_META) {
-		node->c.disk_size += sizeof(uint32_t);
+		size += sizeof(uint32_t);
 	}
 
-	/* subnodes */
-	if (node->c.nsubnodes > TKVDB_SUBNODES_THR) {
-		node->c.disk_size += 256 * sizeof(uint64_t);
-	} else {
-		node->c.disk_size += node->c.nsubnodes * sizeof(uint8_t)
-			+ node->c.nsubnodes * sizeof(uint64_t);
+	/* subnodes, size of offsets depends on position of node */
+	if (!(node->c.type & TKVDB_NODE_LEAF)) {
+		TKVDB_IMPL_NODE_SUBNODES(tr, node, node_off, sub);
+		size += tkvdb_subnodes_size(sub);
 	}
 
 	/* prefix + value + metadata */
-	node->c.disk_size += node->c.prefix_size + node->c.val_size
-		+ node->c.meta_size;
+	size += node->c.prefix_size + node->c.meta_size;
+	if (node->c.type & TKVDB_NODE_VAL) {
+		size += node->c.val_size;
+	}
+
+	return size;
 }
 #endif
 
 
-/* commit */
+/* mark nodes with modified subnodes as dirty, so after this pass
+ * node is dirty if anything in its subtree was changed. If 'size' is not
+ * NULL, disk size of dirty nodes is added to it */
 #ifndef TKVDB_PARAMS_NODBFILE
 static TKVDB_RES
-TKVDB_IMPL_DO_COMMIT(tkvdb_tr *trns, struct tkvdb_db_info *vacdbinfo)
+TKVDB_IMPL_MARK_DIRTY(tkvdb_tr_data *tr, struct tkvdb_visit_helper **stack,
+	size_t *stack_allocated, TKVDB_MEMNODE_TYPE *node, uint64_t *size)
 {
 	size_t stack_size = 0;
+	TKVDB_MEMNODE_TYPE *next;
+	struct tkvdb_subnodes sub;
+	int off = 0;
+
+	for (;;) {
+		TKVDB_SKIP_RNODES(tr, node);
+
+		next = NULL;
+		if (!(node->c.type & TKVDB_NODE_LEAF)) {
+			TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+			int nslots = tkvdb_class_max[node->c.nclass];
+
+			for (; off<nslots; off++) {
+				if (next_arr[off]) {
+					next = TKVDB_REF_NODE(tr,
+						next_arr[off]);
+					break;
+				}
+			}
+		}
+
+		if (next) {
+			/* push node and position to stack */
+			TKVDB_EXEC( tkvdb_visit_stack_grow(stack,
+				stack_allocated, stack_size + 1,
+				tr->params.stack_dynalloc) );
+			(*stack)[stack_size].node = node;
+			(*stack)[stack_size].off = off;
+			stack_size++;
+
+			node = next;
+			off = 0;
+			continue;
+		}
+
+		/* all subnodes visited, node will be written after its
+		 * subtree, at 'size' from start of subtree */
+		if (size && node->c.dirty) {
+			node->c.disk_off = *size;
+			*size += TKVDB_IMPL_NODE_CALC_DISKSIZE(tr, node,
+				node->c.disk_off, &sub,
+				tkvdb_node_tail(tr->db));
+		}
+
+		/* pop */
+		if (stack_size == 0) {
+			break;
+		}
+
+		stack_size--;
+		next = node;
+		node = (*stack)[stack_size].node;
+		off  = (*stack)[stack_size].off + 1;
+
+		if (next->c.dirty) {
+			node->c.dirty = 1;
+		}
+	}
+
+	return TKVDB_OK;
+}
+#endif
+
+/* write modified nodes of subtree in post-order: node is written after all
+ * of its subnodes, so their offsets are already known and file is written
+ * sequentially. Node is written if anything in its subtree was changed.
+ * If dirty flags are already set by TKVDB_IMPL_MARK_DIRTY() ('marked'),
+ * unchanged subtrees are skipped */
+#ifndef TKVDB_PARAMS_NODBFILE
+static TKVDB_RES
+TKVDB_IMPL_SUBTREE_WRITE(tkvdb_tr_data *tr, struct tkvdb_visit_helper **stack,
+	size_t *stack_allocated, TKVDB_MEMNODE_TYPE *node,
+	struct tkvdb_writer *w, int marked)
+{
+	size_t stack_size = 0, tail = tkvdb_node_tail(tr->db);
+	TKVDB_MEMNODE_TYPE *next;
+	struct tkvdb_subnodes sub;
+	uint64_t size;
+	int off = 0;
+
+	for (;;) {
+		TKVDB_SKIP_RNODES(tr, node);
+
+		next = NULL;
+		if (!(node->c.type & TKVDB_NODE_LEAF)) {
+			/* non-leaf node, 'off' is a slot here */
+			TKVDB_REF *next_arr = TKVDB_NODE_NEXT(node);
+			int nslots = tkvdb_class_max[node->c.nclass];
+
+			for (; off<nslots; off++) {
+				if (!next_arr[off]) {
+					continue;
+				}
+				next = TKVDB_REF_NODE(tr, next_arr[off]);
+				if (!marked) {
+					break;
+				}
+				TKVDB_SKIP_RNODES(tr, next);
+				if (next->c.dirty) {
+					break;
+				}
+				/* subtree is unchanged, keep its offset */
+				next = NULL;
+			}
+		}
+
+		if (next) {
+			/* push node and position to stack */
+			TKVDB_EXEC( tkvdb_visit_stack_grow(stack,
+				stack_allocated, stack_size + 1,
+				tr->params.stack_dynalloc) );
+			(*stack)[stack_size].node = node;
+			(*stack)[stack_size].off = off;
+			stack_size++;
+
+			node = next;
+			off = 0;
+			continue;
+		}
+
+		/* all subnodes visited */
+		if (node->c.dirty) {
+			node->c.disk_off = tkvdb_writer_pos(w);
+			size = TKVDB_IMPL_NODE_CALC_DISKSIZE(tr, node,
+				node->c.disk_off, &sub, tail);
+			if (!tkvdb_writer_fits(w, size)) {
+				/* node starts next compressed frame */
+				TKVDB_EXEC( tkvdb_writer_frame_end(w) );
+				node->c.disk_off = tkvdb_writer_pos(w);
+				size = TKVDB_IMPL_NODE_CALC_DISKSIZE(tr, node,
+					node->c.disk_off, &sub, tail);
+			}
+
+			TKVDB_EXEC( TKVDB_IMPL_NODE_WRITE(w, node, size,
+				&sub, tail) );
+		}
+
+		/* pop */
+		if (stack_size == 0) {
+			break;
+		}
+
+		stack_size--;
+		next = node;
+		node = (*stack)[stack_size].node;
+		off  = (*stack)[stack_size].off + 1;
+
+		if (next->c.dirty) {
+			/* parent should be written with new offset */
+			node->c.dirty = 1;
+		}
+	}
+
+	return TKVDB_OK;
+}
+#endif
+
+/* commit thread, takes subtrees of root one by one */
+#if !defined(TKVDB_PARAMS_NODBFILE) && defined(TKVDB_COMMIT_THREADS)
+static void *
+TKVDB_IMPL_COMMIT_WORKER(void *arg)
+{
+	struct tkvdb_commit_worker *wrk = arg;
+	struct tkvdb_commit_ctx *ctx = wrk->ctx;
+	tkvdb_tr_data *tr = ctx->tr;
+	size_t i;
+
+	for (;;) {
+		i = TKVDB_ADD_FETCH(ctx->next, 1) - 1;
+		if (i >= ctx->nsubtrees) {
+			break;
+		}
+
+		if (!ctx->write) {
+			ctx->sizes[i] = 0;
+			wrk->r = TKVDB_IMPL_MARK_DIRTY(tr, &wrk->stack,
+				&wrk->stack_allocated, ctx->subtrees[i],
+				&ctx->sizes[i]);
+		} else if (ctx->sizes[i] > 0) {
+			/* subtree is written to its own part of file */
+			tkvdb_writer_seek(&wrk->w, ctx->offs[i]);
+			wrk->r = TKVDB_IMPL_SUBTREE_WRITE(tr, &wrk->stack,
+				&wrk->stack_allocated, ctx->subtrees[i],
+				&wrk->w, 1);
+			if (wrk->r == TKVDB_OK) {
+				wrk->r = tkvdb_writer_flush(&wrk->w);
+			}
+		}
 
+		if (wrk->r != TKVDB_OK) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/* write subtrees of root in parallel: sizes of modified nodes of each
+ * subtree are calculated by threads, then each subtree gets its part of
+ * file and threads write them. Root is written last */
+#if !defined(TKVDB_PARAMS_NODBFILE) && defined(TKVDB_COMMIT_THREADS)
+static TKVDB_RES
+TKVDB_IMPL_COMMIT_PARALLEL(tkvdb_tr_data *tr, TKVDB_MEMNODE_TYPE *root,
+	struct tkvdb_writer *w)
+{
+	struct tkvdb_commit_ctx ctx;
+	struct tkvdb_commit_worker *wrk;
+	TKVDB_REF *next_arr = TKVDB_NODE_NEXT(root);
+	int nslots = tkvdb_class_max[root->c.nclass];
+	int i, nthreads;
+	uint64_t off, size;
+	struct tkvdb_subnodes sub;
+	TKVDB_RES r;
+
+	ctx.nsubtrees = 0;
+	ctx.tr = tr;
+	for (i=0; i<nslots; i++) {
+		TKVDB_MEMNODE_TYPE *next = TKVDB_REF_NODE(tr, next_arr[i]);
+
+		if (next) {
+			TKVDB_SKIP_RNODES(tr, next);
+			ctx.subtrees[ctx.nsubtrees] = next;
+			ctx.nsubtrees++;
+		}
+	}
+
+	nthreads = tr->params.commit_threads;
+	if ((size_t)nthreads > ctx.nsubtrees) {
+		/* at least one worker, root may have no subnodes after del */
+		nthreads = ctx.nsubtrees > 0 ? (int)ctx.nsubtrees : 1;
+	}
+
+	wrk = malloc(nthreads * sizeof(struct tkvdb_commit_worker));
+	if (!wrk) {
+		return TKVDB_ENOMEM;
+	}
+	for (i=0; i<nthreads; i++) {
+		wrk[i].ctx = &ctx;
+		wrk[i].stack = NULL;
+		wrk[i].stack_allocated = 0;
+		wrk[i].r = TKVDB_OK;
+		tkvdb_writer_init(&wrk[i].w, w->fd, w->limit, 1);
+	}
+
+	/* sizes */
+	ctx.write = 0;
+	ctx.next = 0;
+	r = tkvdb_commit_run(wrk, nthreads, &TKVDB_IMPL_COMMIT_WORKER);
+	if (r != TKVDB_OK) {
+		goto done;
+	}
+
+	/* offsets, header is still in buffer */
+	off = tkvdb_writer_pos(w);
+	for (i=0; (size_t)i<ctx.nsubtrees; i++) {
+		ctx.offs[i] = off;
+		off += ctx.sizes[i];
+	}
+
+	/* nodes */
+	ctx.write = 1;
+	ctx.next = 0;
+	r = tkvdb_commit_run(wrk, nthreads, &TKVDB_IMPL_COMMIT_WORKER);
+	if (r != TKVDB_OK) {
+		goto done;
+	}
+
+	for (i=0; (size_t)i<ctx.nsubtrees; i++) {
+		TKVDB_MEMNODE_TYPE *next = ctx.subtrees[i];
+
+		if (next->c.dirty) {
+			/* root should be written with new offsets */
+			root->c.dirty = 1;
+		}
+	}
+
+	if (root->c.dirty) {
+		/* header, then root after all subtrees */
+		r = tkvdb_writer_flush(w);
+		if (r != TKVDB_OK) {
+			goto done;
+		}
+		tkvdb_writer_seek(w, off);
+
+		root->c.disk_off = off;
+		size = TKVDB_IMPL_NODE_CALC_DISKSIZE(tr, root,
+			root->c.disk_off, &sub, tkvdb_node_tail(tr->db));
+		r = TKVDB_IMPL_NODE_WRITE(w, root, size, &sub,
+			tkvdb_node_tail(tr->db));
+	}
+
+done:
+	for (i=0; i<nthreads; i++) {
+		free(wrk[i].stack);
+		tkvdb_writer_free(&wrk[i].w);
+	}
+	free(wrk);
+
+	return r;
+}
+#endif
+
+/* commit, 'vacrange' is part of file processed by vacuum (or NULL), it
+ * becomes free after commit if 'vacdone' is not 0. Otherwise range is
+ * kept in footer and commits don't write to it until pass is done */
+#ifndef TKVDB_PARAMS_NODBFILE
+static TKVDB_RES
+TKVDB_IMPL_DO_COMMIT(tkvdb_tr *trns, const struct tkvdb_extent *vacrange,
+	int vacdone)
+{
 	struct tkvdb_db_info info;
+	struct tkvdb_extent pass;
+	struct tkvdb_writer *w;
+	struct tkvdb_freemap *fm;
+	struct tkvdb_tr_footer *footer;
+	int ext = -1;
 
 	/* offset of whole transaction in file */
 	uint64_t transaction_off;
 	/* offset of next node in file */
 	uint64_t node_off;
-	/* size of last accessed node, will be added to node_off */
-	uint64_t last_node_size;
-	struct tkvdb_tr_header *header_ptr;
-	int append;
+	uint64_t nodes_end;
+	struct tkvdb_tr_header header;
+	int append, dosync, barrier, ordered;
 	tkvdb_tr_data *tr = trns->data;
 
 	TKVDB_MEMNODE_TYPE *node;
-	int off = 0;
-	TKVDB_RES r = TKVDB_OK;
+	TKVDB_RES r;
 
 	if (!tr->started) {
 		return TKVDB_NOT_STARTED;
@@ -228,27 +616,58 @@ TKVDB_IMPL_DO_COMMIT(tkvdb_tr *trns, struct tkvdb_db_info *vacdbinfo)
 		return TKVDB_OK;
 	}
 
-	/* read transaction footer before commit to make some checks */
-	TKVDB_EXEC( tkvdb_info_read(tr->db->fd, &info) );
+	/* transaction without changes doesn't touch file */
+	TKVDB_EXEC( TKVDB_IMPL_MARK_DIRTY(tr, &tr->stack,
+		&tr->stack_allocated, tr->root, NULL) );
 
-	if (info.filesize != tr->db->info.filesize) {
-		/* file was modified during transaction */
-		return TKVDB_MODIFIED;
+	node = tr->root;
+	TKVDB_SKIP_RNODES(tr, node);
+	if (!node->c.dirty) {
+		TKVDB_IMPL_TR_RESET(trns);
+		return TKVDB_OK;
 	}
 
-	if (info.filesize > 0) {
-		if ((info.footer.transaction_id + 1)
-			!= tr->db->info.footer.transaction_id) {
+	/* read transaction footer before commit to make some checks */
+	TKVDB_EXEC( tkvdb_info_get(tr->db, &info) );
 
-			return TKVDB_MODIFIED;
-		}
+	if (tr->snapshot || (info.filesize != tr->db->info.filesize)
+		|| ((info.filesize > 0) && ((info.footer.transaction_id + 1)
+			!= tr->db->info.footer.transaction_id))) {
 
-		if ((info.footer.gap_end - info.footer.gap_begin)
-			> tr->tr_buf_allocated) {
+		/* file was modified during transaction (or transaction is
+		 * read-only snapshot) */
+		return TKVDB_MODIFIED;
+	}
+	TKVDB_EXEC( tkvdb_ctl_check(tr->db, &info) );
 
-			/* we have enough space in vacuumed gap */
-			transaction_off = info.footer.gap_begin;
+	fm = &tr->db->freemap;
+	footer = &tr->db->info.footer;
+	if (!vacrange) {
+		/* commit of keys, log of older ones can't be replayed */
+		footer->data_gen += 1;
+	}
+	if (!vacrange && (footer->vacuum_end > 0)) {
+		/* range of unfinished vacuum pass */
+		pass.off = footer->vacuum_pos;
+		pass.size = footer->vacuum_end - footer->vacuum_pos;
+		vacrange = &pass;
+	}
+	if (info.filesize > 0) {
+		TKVDB_EXEC( tkvdb_freemap_load(tr->db, &info) );
+		/* extents are changed by commit */
+		tr->db->freemap_own = 0;
+		footer->prev_footer = info.filesize - TKVDB_TR_FTRSIZE;
+
+		/* the smallest free extent where transaction fits, vacuum
+		 * doesn't write to part of file which it frees */
+		ext = tkvdb_freemap_fit(fm, tr->tr_buf_allocated, vacrange);
+		if (ext >= 0) {
+			transaction_off = fm->ext[ext].off;
 			append = 0;
+
+			/* nodes in extent are overwritten */
+			tkvdb_invalidate(tr->db, fm->ext[ext].off,
+				fm->ext[ext].off + fm->ext[ext].size);
 		} else {
 			/* append transaction to the end of file */
 			transaction_off = info.filesize;
@@ -256,162 +675,157 @@ TKVDB_IMPL_DO_COMMIT(tkvdb_tr *trns, struct tkvdb_db_info *vacdbinfo)
 		}
 	} else {
 		/* empty data file */
-		memcpy(tr->db->info.footer.signature,
-			TKVDB_SIGNATURE,
+		memcpy(footer->signature, TKVDB_SIGNATURE,
 			sizeof(TKVDB_SIGNATURE) - 1);
+		footer->compression = tr->db->params.compress
+			? TKVDB_COMPRESSION_LZ : TKVDB_COMPRESSION_NONE;
+		footer->checksum = tr->db->params.checksum ? 1 : 0;
+		fm->n = 0;
 
 		transaction_off = 0;
 		append = 1;
 	}
 
-	/* first node offset, skip transaction header */
-	node_off = transaction_off + sizeof(struct tkvdb_tr_header);
+	barrier = tkvdb_syncer_barrier(tr->db, append);
+	if (!append) {
+		TKVDB_EXEC( tkvdb_syncer_reuse(tr->db, &info.footer) );
+	}
+
+	w = &tr->db->writer;
+	tkvdb_writer_seek(w, transaction_off);
 
-	last_node_size = 0;
+	/* footer offset is known after write */
+	header.type = TKVDB_BLOCKTYPE_TRANSACTION;
+	header.footer_off = 0;
+	r = tkvdb_writer_put(w, &header, sizeof(header));
+	if ((r == TKVDB_OK) && tkvdb_compressed(tr->db)) {
+		r = tkvdb_writer_compress(w, 1);
+	}
+	if (r != TKVDB_OK) {
+		goto fail_write;
+	}
 
-	/* now iterate through nodes in transaction */
 	node = tr->root;
+	TKVDB_SKIP_RNODES(tr, node);
 
-	for (;;) {
-		TKVDB_MEMNODE_TYPE *next;
+#ifdef TKVDB_COMMIT_THREADS
+	/* sizes of compressed subtrees are not known before write */
+	if ((tr->params.commit_threads > 1) && tr->params.stack_dynalloc
+		&& !tkvdb_compressed(tr->db)
+		&& (tr->tr_buf_allocated >= TKVDB_COMMIT_PARALLEL_MIN)
+		&& !(node->c.type & TKVDB_NODE_LEAF)) {
 
-		TKVDB_SKIP_RNODES(node);
+		r = TKVDB_IMPL_COMMIT_PARALLEL(tr, node, w);
+	} else
+#endif
+	{
+		r = TKVDB_IMPL_SUBTREE_WRITE(tr, &tr->stack,
+			&tr->stack_allocated, node, w, 1);
+	}
+	if (r != TKVDB_OK) {
+		goto fail_write;
+	}
 
-		if (node->c.disk_size == 0) {
-			TKVDB_IMPL_NODE_CALC_DISKSIZE(node);
+	if (!node->c.dirty) {
+		/* nothing changed, only header is in buffer, rollback */
+		tkvdb_writer_seek(w, 0);
+		TKVDB_IMPL_TR_RESET(trns);
+		return TKVDB_OK;
+	}
 
-			node->c.disk_off = node_off;
-			last_node_size = node->c.disk_size;
+	/* root is the last node */
+	r = tkvdb_writer_compress(w, 0);
+	if (r != TKVDB_OK) {
+		goto fail_write;
+	}
+	node_off = tkvdb_writer_pos(w);
+	footer->root_off = node->c.disk_off;
+	footer->transaction_size = node_off - transaction_off;
+
+	/* free extents and footer */
+	footer->type = TKVDB_BLOCKTYPE_FOOTER;
+	if (!append) {
+		tkvdb_freemap_take(fm, ext, footer->transaction_size);
+		footer->free_gen += 1;
+	}
+	if (vacdone) {
+		/* vacuum commit, processed part of file becomes free */
+		tkvdb_freemap_add(fm, vacrange->off, vacrange->size);
+		footer->vacuum_pos = vacrange->off + vacrange->size;
+		footer->vacuum_end = 0;
+		footer->vacuum_walked = 0;
+		/* nodes of older snapshots may be overwritten, pinned ones
+		 * are newer than walk of pass */
+		footer->oldest_id = footer->transaction_id;
+		if (tkvdb_pins_oldest(footer) < footer->oldest_id) {
+			footer->oldest_id = tkvdb_pins_oldest(footer);
 		}
-
-		next = NULL;
-		if (!(node->c.type & TKVDB_NODE_LEAF)) {
-			/* non-leaf node */
-			for (; off<256; off++) {
-				if (node->next[off]) {
-					/* found next subnode */
-					next = node->next[off];
-					break;
-				}
-			}
+	} else if (vacrange && (footer->vacuum_end == 0)) {
+		/* first step of pass */
+		footer->vacuum_pos = vacrange->off;
+		footer->vacuum_end = vacrange->off + vacrange->size;
+		footer->vacuum_id = footer->transaction_id;
+	}
+	tkvdb_freemap_split(fm, footer->vacuum_pos);
+	if (footer->vacuum_end > 0) {
+		tkvdb_freemap_split(fm, footer->vacuum_end);
+	}
+	tkvdb_freemap_trim(fm, TKVDB_FREEMAP_MAX);
+
+	dosync = tkvdb_syncer_add(tr->db, footer->transaction_size, 1);
+
+	/* free extents and footer follow nodes or are at the end of file */
+	nodes_end = append ? node_off : (uint64_t)info.filesize;
+	header.footer_off = nodes_end + tkvdb_freemap_size(fm);
+	ordered = barrier || !tkvdb_syncer_window(tr->db);
+	if (!append || barrier || !ordered) {
+		/* nodes are synced before footer or read back for CRC of
+		 * tail, header is fixed before that */
+		r = tkvdb_writer_flush(w);
+		if ((r == TKVDB_OK)
+			&& !tkvdb_try_pwrite_file(tr->db->fd, &header,
+				sizeof(header), transaction_off)) {
+
+			r = TKVDB_IO_ERROR;
 		}
-
-		if (next) {
-			TKVDB_SKIP_RNODES(next);
-
-			node_off += last_node_size;
-			node->fnext[off] = node_off;
-
-			/* push node and position to stack */
-			if ((stack_size + 1) > tr->stack_allocated) {
-				struct tkvdb_visit_helper *tmpstack;
-
-				if (!tr->params.stack_dynalloc) {
-					return TKVDB_ENOMEM;
-				}
-
-				tmpstack = realloc(tr->stack, (stack_size + 1)
-					* sizeof(struct tkvdb_visit_helper));
-				if (!tmpstack) {
-					return TKVDB_ENOMEM;
-				}
-				tr->stack = tmpstack;
-				tr->stack_allocated = stack_size + 1;
-			}
-			tr->stack[stack_size].node = node;
-			tr->stack[stack_size].off = off;
-			stack_size++;
-
-			node = next;
-			off = 0;
-		} else {
-			/* no more subnodes, serialize node to memory buffer */
-			r = TKVDB_IMPL_NODE_TO_BUF(tr->db, node,
-				transaction_off);
-			if (r != TKVDB_OK) {
-				goto fail_node_to_buf;
-			}
-
-			/* pop */
-			if (stack_size == 0) {
-				break;
-			}
-
-			stack_size--;
-			node = tr->stack[stack_size].node;
-			off  = tr->stack[stack_size].off + 1;
+		if ((r == TKVDB_OK) && barrier) {
+			r = tkvdb_group_sync(tr->db);
+		}
+		if (r != TKVDB_OK) {
+			goto fail_write;
 		}
 	}
-
-	node_off += last_node_size;
-
-	tr->db->info.footer.root_off = transaction_off
-		+ sizeof(struct tkvdb_tr_header);
-	tr->db->info.footer.transaction_size = node_off - transaction_off;
-
-	/* seek */
-	if (lseek(tr->db->fd, transaction_off, SEEK_SET)
-		!= (off_t)transaction_off) {
-		return TKVDB_IO_ERROR;
+	if (!append) {
+		tkvdb_writer_seek(w, nodes_end);
 	}
 
-	/* prepare header, footer and write */
-	header_ptr = (struct tkvdb_tr_header *)tr->db->write_buf;
-	header_ptr->type = TKVDB_BLOCKTYPE_TRANSACTION;
-	tr->db->info.footer.type = TKVDB_BLOCKTYPE_FOOTER;
-	if (vacdbinfo) {
-		/* vacuum commit */
-		/*tr->db->info.footer.gap_end = *gap_end_ptr;*/
+	r = tkvdb_syncer_tail(tr->db, footer, fm, &info, nodes_end, ordered);
+	if (r == TKVDB_OK) {
+		r = tkvdb_writer_put_footer(w, footer, fm);
+	}
+	if (r == TKVDB_OK) {
+		r = tkvdb_writer_flush(w);
+	}
+	if (r != TKVDB_OK) {
+		goto fail_write;
 	}
-	if (append) {
-		ssize_t wsize;
-		struct tkvdb_tr_footer *footer_ptr;
-
-		header_ptr->footer_off = node_off;
-
-		wsize = tr->db->info.footer.transaction_size
-			+ TKVDB_TR_FTRSIZE;
-
-		/* try to append footer to buffer */
-		TKVDB_EXEC( tkvdb_writebuf_realloc(tr->db, wsize) );
-
-		footer_ptr = (struct tkvdb_tr_footer *)
-			&(tr->db->write_buf[wsize - TKVDB_TR_FTRSIZE]);
-
-		*footer_ptr = tr->db->info.footer;
-		if (!tkvdb_try_write_file(tr->db->fd, tr->db->write_buf,
-			wsize)) {
-
-			return TKVDB_IO_ERROR;
-		}
-	} else {
-		ssize_t wsize;
-
-		wsize = tr->db->info.footer.transaction_size;
-		tr->db->info.footer.gap_begin += wsize;
-
-		header_ptr->footer_off = tr->db->info.filesize;
-		if (!tkvdb_try_write_file(tr->db->fd, tr->db->write_buf,
-			wsize)) {
-
-			return TKVDB_IO_ERROR;
-		}
-		/* seek to end of file */
-		if (lseek(tr->db->fd, tr->db->info.filesize, SEEK_SET)
-			!= (off_t)tr->db->info.filesize) {
 
-			return TKVDB_IO_ERROR;
-		}
-		/* write footer */
-		wsize = sizeof(struct tkvdb_tr_footer);
-		if (!tkvdb_try_write_file(tr->db->fd, &tr->db->info.footer,
-			wsize)) {
+	if (append && !barrier && ordered) {
+		/* nodes and footer were written at once */
+		if (!tkvdb_try_pwrite_file(tr->db->fd, &header,
+			sizeof(header), transaction_off)) {
 
 			return TKVDB_IO_ERROR;
 		}
 	}
 
-	r = TKVDB_OK;
+	tr->db->written += footer->transaction_size
+		+ tkvdb_freemap_size(fm) + TKVDB_TR_FTRSIZE;
+
+	/* other handles see commit without reading file */
+	info.footer = *footer;
+	info.filesize = header.footer_off + TKVDB_TR_FTRSIZE;
+	tkvdb_ctl_commit(tr->db, &info);
 
 	/* return root offset */
 /*
@@ -419,21 +833,29 @@ TKVDB_IMPL_DO_COMMIT(tkvdb_tr *trns, struct tkvdb_db_info *vacdbinfo)
 		*root_off = tr->db->info.footer.root_off;
 	}
 */
-/*
-	if (sync && (fsync(tr->db->fd) < 0)) {
-		return TKVDB_IO_ERROR;
+	if (barrier) {
+		/* previous footers were synced with nodes */
+		tkvdb_syncer_durable(tr->db, footer->transaction_id);
 	}
-*/
-fail_node_to_buf:
+	if (dosync) {
+		/* footer, and commits of group before it */
+		TKVDB_EXEC( tkvdb_syncer_sync(tr->db) );
+		tkvdb_syncer_durable(tr->db, footer->transaction_id + 1);
+	}
+
 	TKVDB_IMPL_TR_RESET(trns);
 
+	return TKVDB_OK;
+
+fail_write:
+	tkvdb_writer_seek(w, 0);
 	return r;
 }
 
 static TKVDB_RES
 TKVDB_IMPL_COMMIT(tkvdb_tr *tr)
 {
-	return TKVDB_IMPL_DO_COMMIT(tr, NULL);
+	return TKVDB_IMPL_DO_COMMIT(tr, NULL, 0);
 }
 #endif
 
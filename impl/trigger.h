@@ -29,22 +29,12 @@
 
 #ifdef TKVDB_TRIGGER
 
-#define TKVDB_META_ADDR_LEAF(NODE)                                          \
-	((TKVDB_MEMNODE_TYPE_LEAF *)NODE)->prefix_val_meta                  \
-	+ NODE->c.prefix_size                                               \
-	+ TKVDB_VAL_ALIGN_PAD(NODE)                                         \
-	+ NODE->c.val_size
-
-#define TKVDB_META_ADDR_NONLEAF(NODE)                                       \
+#define TKVDB_META_ADDR(NODE)                                               \
 	NODE->prefix_val_meta                                               \
 	+ NODE->c.prefix_size                                               \
 	+ TKVDB_VAL_ALIGN_PAD(NODE)                                         \
 	+ NODE->c.val_size
 
-#define TKVDB_META_ADDR(NODE)                                               \
-	(NODE->c.type & TKVDB_NODE_LEAF)                                    \
-	? (TKVDB_META_ADDR_LEAF(NODE)) : (TKVDB_META_ADDR_NONLEAF(NODE))
-
 #define TKVDB_INC_VOID_PTR(P, I)                                            \
 do {                                                                        \
 	char *tmp = P;                                                      \
@@ -81,9 +71,15 @@ do {                                                                        \
 	T->stack.size++;                                                    \
 } while (0)
 
+#define TKVDB_TRIGGER_NODE_POP(T)                                           \
+do {                                                                        \
+	T->stack.size--;                                                    \
+} while (0)
+
 #else
 
 #define TKVDB_TRIGGER_NODE_PUSH(T, NODE, PVM)
+#define TKVDB_TRIGGER_NODE_POP(T)
 
 #endif
 
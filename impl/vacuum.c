@@ -0,0 +1,379 @@
+/*
+ * tkvdb
+ *
+ * Copyright (c) 2016-2021, Vladimir Misyurov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* incremental vacuum
+ * pass processes file from the position of vacuum in footer to the end of
+ * data. Tree is walked on disk, live nodes from processed range are loaded
+ * to transaction with path from root and marked as dirty, so commit writes
+ * them (to free extent outside of range or to the end of file). Footer of
+ * the last commit of pass adds processed range to free extents. When
+ * nothing after the beginning of range is used, free extent at the end of
+ * data is cut and next pass starts from the beginning of file.
+ * Step with limit reads not much more than limit of tree, walk of big tree
+ * is split to several steps. Range is kept in footers until the last of
+ * them, nodes of processed range are never linked to tree again, so walk
+ * is resumed from the key of next node.
+ * Range isn't freed while snapshot older than the end of walk is pinned,
+ * pass waits for unpin with all nodes moved */
+
+#ifndef TKVDB_PARAMS_NODBFILE
+
+/* load nodes on path to last level */
+static TKVDB_RES
+TKVDB_IMPL_VACUUM_LOAD(tkvdb_tr *trns, struct tkvdb_vacuum_level *path,
+	size_t depth)
+{
+	TKVDB_MEMNODE_TYPE *node, *next;
+	tkvdb_tr_data *tr = trns->data;
+	size_t i;
+	int slot;
+
+	for (i=1; i<depth; i++) {
+		if (path[i].node) {
+			continue;
+		}
+
+		node = path[i - 1].node;
+		slot = TKVDB_IMPL_NODE_SLOT(node, path[i].sym);
+		if (slot < 0) {
+			return TKVDB_CORRUPTED;
+		}
+
+		next = TKVDB_REF_NODE(tr, TKVDB_NODE_NEXT(node)[slot]);
+		if (!next) {
+			TKVDB_EXEC( TKVDB_IMPL_NODE_READ(trns,
+				TKVDB_NODE_FNEXT(node, slot), &next) );
+			TKVDB_NODE_NEXT(node)[slot] = TKVDB_NODE_REF(tr, next);
+		}
+		path[i].node = next;
+	}
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+TKVDB_IMPL_VACUUM(tkvdb_tr *trns, size_t max_bytes, tkvdb_vacuum_stat *stat)
+{
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_db_info vacinfo, info;
+	struct tkvdb_freemap *fm = &tr->db->freemap;
+	struct tkvdb_vacuum_cursor *cur = &tr->db->vacuum;
+	struct tkvdb_extent range;
+	struct tkvdb_vacuum_level *path = NULL, *lvl;
+	uint8_t *key = NULL;
+	size_t i, n, depth, allocated = 0, key_size = 0, key_allocated = 0;
+	uint64_t lo, hi, end, off, pos, moved = 0, walked = 0;
+	TKVDB_MEMNODE_TYPE *root;
+	TKVDB_RES r;
+	int sym = 0, c, visited = 0, complete = 1, tail, pending = 0;
+
+	memset(stat, 0, sizeof(tkvdb_vacuum_stat));
+
+	if (tr->started) {
+		/* transaction is used for something else */
+		return TKVDB_LOCKED;
+	}
+
+	/* records of write-ahead log are not replayed to vacuum transaction */
+	TKVDB_EXEC( tkvdb_begin_db(trns) );
+
+	vacinfo = tr->db->info;
+	if (vacinfo.filesize == 0) {
+		stat->done = 1;
+		r = TKVDB_EMPTY;
+		goto done;
+	}
+	r = tkvdb_freemap_load(tr->db, &vacinfo);
+	if (r != TKVDB_OK) {
+		goto done;
+	}
+
+	/* range of file to process, free extents are skipped */
+	end = vacinfo.filesize - TKVDB_TR_FTRSIZE - tkvdb_freemap_size(fm);
+	if (vacinfo.footer.vacuum_end > 0) {
+		/* unfinished pass, walk is resumed if this handle did the
+		   previous step */
+		lo = vacinfo.footer.vacuum_pos;
+		hi = vacinfo.footer.vacuum_end;
+		pending = (vacinfo.footer.vacuum_walked > 0);
+		if (pending && (tkvdb_pins_oldest(&vacinfo.footer)
+			< vacinfo.footer.vacuum_walked)) {
+
+			/* pass is walked, but pinned snapshot may have nodes
+			 * in range */
+			r = TKVDB_LOCKED;
+			goto done;
+		}
+		if (!cur->active
+			|| (cur->pass_id != vacinfo.footer.vacuum_id)) {
+
+			cur->key_size = 0;
+			cur->moved = 0;
+		}
+	} else {
+		lo = vacinfo.footer.vacuum_pos;
+		if (lo > end) {
+			lo = 0;
+		}
+		for (i=0; i<fm->n; i++) {
+			if ((fm->ext[i].off <= lo)
+				&& (lo < (fm->ext[i].off + fm->ext[i].size))) {
+
+				lo = fm->ext[i].off + fm->ext[i].size;
+			}
+		}
+		hi = (end > lo) ? end : lo;
+		cur->key_size = 0;
+		cur->moved = 0;
+	}
+	cur->active = 0;
+
+	/* root is always rewritten */
+	off = vacinfo.footer.root_off;
+	r = TKVDB_IMPL_NODE_READ(trns, off, &root);
+	if (r != TKVDB_OK) {
+		goto done;
+	}
+	root->c.dirty = 1;
+	tr->root = root;
+	if (pending) {
+		/* nodes were moved before pins were released */
+		goto pass_walked;
+	}
+
+	/* walk tree on disk in order of keys, nodes before resume key are
+	 * skipped. Step reads about 'max_bytes' of nodes, the rest of tree
+	 * is walked by next steps */
+	depth = 0;
+	for (;;) {
+		if (depth >= allocated) {
+			struct tkvdb_vacuum_level *tmp;
+
+			allocated = allocated * 2 + 16;
+			tmp = realloc(path,
+				allocated * sizeof(struct tkvdb_vacuum_level));
+			if (!tmp) {
+				r = TKVDB_ENOMEM;
+				goto done;
+			}
+			path = tmp;
+		}
+
+		/* key of node is key of parent + symbol + prefix */
+		lvl = &path[depth];
+		key_size = 0;
+		if (depth > 0) {
+			key_size = path[depth - 1].key_size;
+			r = tkvdb_buf_reserve(&key, key_size, &key_allocated,
+				1);
+			if (r != TKVDB_OK) {
+				goto done;
+			}
+			key[key_size++] = (uint8_t)sym;
+		}
+		r = tkvdb_vacuum_read(tr->db, off, lvl, &key, &key_size,
+			&key_allocated);
+		if (r != TKVDB_OK) {
+			goto done;
+		}
+		lvl->key_size = key_size;
+		walked += lvl->size;
+
+		lvl->after = (depth > 0) ? path[depth - 1].after
+			: (cur->key_size == 0);
+		c = 1;
+		if (!lvl->after) {
+			n = (key_size < cur->key_size) ? key_size
+				: cur->key_size;
+			c = (n > 0) ? memcmp(key, cur->key, n) : 0;
+			if ((c == 0) && (key_size >= cur->key_size)) {
+				c = 1;
+			}
+			lvl->after = (c > 0);
+		}
+
+		if (lvl->after && (visited > 0) && (max_bytes > 0)
+			&& (walked > max_bytes)) {
+
+			/* the rest of tree is walked by next step */
+			r = tkvdb_buf_reserve(&cur->key, 0, &cur->key_allocated,
+				key_size);
+			if (r != TKVDB_OK) {
+				goto done;
+			}
+			memcpy(cur->key, key, key_size);
+			cur->key_size = key_size;
+			complete = 0;
+			break;
+		}
+
+		if (c >= 0) {
+			/* node after resume key or on path to it */
+			lvl->node = (depth == 0) ? root : NULL;
+			lvl->sym = sym;
+			depth++;
+			visited += lvl->after;
+
+			pos = tkvdb_node_pos(tr->db, off);
+			if ((pos >= lo) && (pos < hi)) {
+				/* live node in processed range (node of
+				 * compressed file is moved with its frame) */
+				moved += lvl->size;
+				r = TKVDB_IMPL_VACUUM_LOAD(trns, path, depth);
+				if (r != TKVDB_OK) {
+					goto done;
+				}
+				((TKVDB_MEMNODE_TYPE *)lvl->node)->c.dirty = 1;
+			}
+		}
+
+		/* next subnode, subnodes before resume key are skipped */
+		for (;;) {
+			while ((depth > 0) && (path[depth - 1].pos
+				>= path[depth - 1].nsubnodes)) {
+
+				depth--;
+			}
+			if (depth == 0) {
+				break;
+			}
+
+			lvl = &path[depth - 1];
+			off = lvl->offs[lvl->pos];
+			sym = lvl->syms[lvl->pos];
+			lvl->pos++;
+			if (lvl->after || (sym >= cur->key[lvl->key_size])) {
+				break;
+			}
+		}
+		if (depth == 0) {
+			break;
+		}
+	}
+
+pass_walked:
+	stat->pos = complete ? hi : lo;
+	stat->moved = moved;
+
+	if (!complete) {
+		/* step of unfinished pass, nothing to commit if no nodes
+		   were moved and range is already kept in footer */
+		if ((moved == 0) && (vacinfo.footer.vacuum_end > 0)) {
+			TKVDB_IMPL_ROLLBACK(trns);
+			r = TKVDB_OK;
+		} else {
+			range.off = lo;
+			range.size = hi - lo;
+			r = TKVDB_IMPL_DO_COMMIT(trns, &range, 0);
+			if (r != TKVDB_OK) {
+				goto done;
+			}
+		}
+		cur->active = 1;
+		cur->pass_id = tr->db->info.footer.vacuum_id;
+		cur->moved += moved;
+		stat->end = end;
+		goto done;
+	}
+
+	/* last node may be bigger than rest of range */
+	moved += cur->moved;
+	stat->reclaimed = ((hi - lo) > moved) ? (hi - lo - moved) : 0;
+
+	if (!pending && (tkvdb_pins_oldest(&vacinfo.footer) != UINT64_MAX)) {
+		/* pinned snapshots are older than this commit, range is
+		 * freed by step after their pins are released (snapshots
+		 * pinned after this commit don't keep it) */
+		tr->db->info.footer.vacuum_walked
+			= tr->db->info.footer.transaction_id;
+		range.off = lo;
+		range.size = hi - lo;
+		r = TKVDB_IMPL_DO_COMMIT(trns, &range, 0);
+		stat->reclaimed = 0;
+		stat->end = end;
+		goto done;
+	}
+
+	tail = (hi < end);
+	if (tail && (stat->moved == 0)) {
+		/* commits of previous steps may be after range */
+		r = tkvdb_info_read(tr->db->fd, &info);
+		if (r == TKVDB_OK) {
+			r = tkvdb_vacuum_tail_used(tr->db, &info, hi,
+				max_bytes, &tail);
+		}
+		if (r != TKVDB_OK) {
+			goto done;
+		}
+	}
+
+	if (!tail && (stat->moved == 0)
+		&& (tkvdb_pins_oldest(&vacinfo.footer) == UINT64_MAX)) {
+
+		/* nothing after 'lo' is used, file is truncated (footers of
+		 * pinned snapshots may be there) */
+		TKVDB_IMPL_ROLLBACK(trns);
+		r = tkvdb_info_read(tr->db->fd, &info);
+		if (r != TKVDB_OK) {
+			goto done;
+		}
+		if ((info.filesize != vacinfo.filesize)
+			|| (info.footer.transaction_id + 1
+				!= vacinfo.footer.transaction_id)) {
+
+			/* control page may be stale */
+			tkvdb_ctl_publish(tr->db, &info);
+			r = TKVDB_MODIFIED;
+			goto done;
+		}
+		tr->db->freemap_own = 0;
+		tkvdb_freemap_add(fm, lo, end - lo);
+		r = tkvdb_vacuum_truncate(tr->db, &info, fm);
+		if (r == TKVDB_OK) {
+			stat->pos = stat->end = info.filesize
+				- TKVDB_TR_FTRSIZE - tkvdb_freemap_size(fm);
+			stat->done = 1;
+		}
+		goto done;
+	}
+
+	/* footer of commit adds range to free extents */
+	range.off = lo;
+	range.size = hi - lo;
+	r = TKVDB_IMPL_DO_COMMIT(trns, &range, 1);
+	if (r != TKVDB_OK) {
+		goto done;
+	}
+
+	r = tkvdb_info_read(tr->db->fd, &info);
+	if (r != TKVDB_OK) {
+		goto done;
+	}
+	stat->end = info.filesize - TKVDB_TR_FTRSIZE
+		- info.footer.nextents * sizeof(struct tkvdb_extent);
+
+done:
+	if (tr->started) {
+		TKVDB_IMPL_ROLLBACK(trns);
+	}
+	free(path);
+	free(key);
+	return r;
+}
+
+#endif
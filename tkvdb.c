@@ -19,14 +19,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "tkvdb.h"
 
-#define TKVDB_SIGNATURE    "tkvdb003"
+/* commit may write subtrees in parallel threads and asynchronous commit
+ * runs in background thread */
+#if !defined(_WIN32) && !defined(TKVDB_NO_THREADS) \
+	&& (defined(__GNUC__) || defined(__clang__))
+#define TKVDB_COMMIT_THREADS
+#include <pthread.h>
+#endif
+
+#define TKVDB_SIGNATURE    "tkvdb008"
+
+/* write-ahead log file starts with header and contains records of
+ * committed transactions, each transaction ends with commit record */
+#define TKVDB_WAL_SIGNATURE "tkvwal03"
+#define TKVDB_CTL_SIGNATURE "tkvctl01"
+/* attempts to read control page while it's updated by other process */
+#define TKVDB_CTL_RETRIES   16
+
+#define TKVDB_WAL_PUT      1
+#define TKVDB_WAL_DEL      2
+#define TKVDB_WAL_DEL_PFX  3
+#define TKVDB_WAL_COMMIT   4
 
 /* at the begin of each on-disk block there is a byte with type.
  * footer marked as removed is used in vacuum procedure */
@@ -34,19 +59,94 @@
 #define TKVDB_BLOCKTYPE_FOOTER       1
 #define TKVDB_BLOCKTYPE_RM_FOOTER    2
 
+/* compression of nodes, see TKVDB_PARAM_COMPRESS */
+#define TKVDB_COMPRESSION_NONE 0
+#define TKVDB_COMPRESSION_LZ   1
+
+/* nodes end with CRC32C, see TKVDB_PARAM_CHECKSUM */
+#define TKVDB_CRC_SIZE (sizeof(uint32_t))
+/* reads of verify, nodes of one level of tree are read in order */
+#define TKVDB_VERIFY_READ (1024 * 1024)
+
+/* nodes of compressed database are collected to frames up to
+ * TKVDB_FRAME_SIZE bytes (node bigger than that is alone in its frame),
+ * each frame is compressed independently. Offset of node is
+ * (file offset of frame << TKVDB_FRAME_BITS) | (offset in frame),
+ * so frame of node is found without index */
+#define TKVDB_FRAME_BITS 16
+#define TKVDB_FRAME_SIZE ((size_t)1 << TKVDB_FRAME_BITS)
+#define TKVDB_FRAME_POS(OFF) ((OFF) >> TKVDB_FRAME_BITS)
+
+/* default memory for decompressed frames kept by database, frames are
+ * found in sets of TKVDB_FRAME_WAYS frames by hash of offset */
+#define TKVDB_FRAME_CACHE (4 * 1024 * 1024)
+#define TKVDB_FRAME_WAYS 4
+
+/* max number of free extents written with footer, smallest extents are
+ * dropped (they become free again on next pass of vacuum) */
+#define TKVDB_FREEMAP_MAX 256
+
+/* LZ compressor, hash table of 4-byte sequences */
+#define TKVDB_LZ_HASH_BITS 13
+#define TKVDB_LZ_MINMATCH 4
+
 /* node properties */
 #define TKVDB_NODE_VAL  (1 << 0)
 #define TKVDB_NODE_META (1 << 1)
 #define TKVDB_NODE_LEAF (1 << 2)
 
-/* max number of subnodes we store as [symbols array] => [offsets array]
+/* classes of non-leaf nodes in memory, node grows to next class when
+ * it has no room for new subnode and shrinks when most of subnodes
+ * are deleted */
+#define TKVDB_NODE_CLASS_4   0
+#define TKVDB_NODE_CLASS_16  1
+#define TKVDB_NODE_CLASS_48  2
+#define TKVDB_NODE_CLASS_256 3
+
+/* max number of subnodes in each class */
+static const unsigned int tkvdb_class_max[] = {4, 16, 48, 256};
+
+/* node is shrunk to previous class when number of subnodes is less or
+ * equal to this value */
+static const unsigned int tkvdb_class_shrink[] = {0, 3, 12, 40};
+
+/* size of array placed before subnodes pointers:
+ * symbols for 4 and 16 subnodes (unsorted, padded to pointer size),
+ * 256 indexes (slot + 1) for 48 subnodes, nothing for 256 subnodes */
+static const size_t tkvdb_class_symsize[] = {8, 16, 256, 0};
+
+/* find smallest class for given number of subnodes */
+static int
+tkvdb_node_class(unsigned int nsubnodes)
+{
+	int nclass;
+
+	for (nclass=TKVDB_NODE_CLASS_4; nclass<TKVDB_NODE_CLASS_256;
+		nclass++) {
+
+		if (nsubnodes <= tkvdb_class_max[nclass]) {
+			break;
+		}
+	}
+
+	return nclass;
+}
+
+/* max number of subnodes we store as [symbols array] => [varint offsets]
  * if number of subnodes is more than TKVDB_SUBNODES_THR, they stored on disk
- * as array of 256 offsets */
-#define TKVDB_SUBNODES_THR (256 - 256 / sizeof(uint64_t))
+ * as [bitmap of symbols] => [fixed-width offsets], bitmap is smaller than
+ * symbols array */
+#define TKVDB_SUBNODES_THR 32
 
 /* read block size */
 #define TKVDB_READ_SIZE 4096
 
+/* default size of commit write buffer, nodes are written to file in chunks
+ * of this size */
+#define TKVDB_WRITE_BUF_SIZE (4 * 1024 * 1024)
+/* write buffer must hold node without prefix, value and metadata */
+#define TKVDB_WRITE_BUF_MIN TKVDB_READ_SIZE
+
 /* helper macro for executing functions which returns TKVDB_RES */
 #define TKVDB_EXEC(FUNC)                   \
 do {                                       \
@@ -56,21 +156,95 @@ do {                                       \
 	}                                  \
 } while (0)
 
-/* skip replaced nodes */
-#define TKVDB_SKIP_RNODES(NODE)            \
-while (NODE->c.replaced_by) {              \
-	NODE = NODE->c.replaced_by;        \
-}
-
-/* replace node with updated one */
-/* FIXME: (optional) memory barrier? */
-#define TKVDB_REPLACE_NODE(REPLACE_CHAIN, RCHAIN_START, NODE, NEWNODE) \
-do {                                                                   \
-	if (REPLACE_CHAIN) {                                           \
-		RCHAIN_START->c.replaced_by = NEWNODE;                 \
-	} else {                                                       \
-		NODE->c.replaced_by = NEWNODE;                         \
-	}                                                              \
+/* memory ordering for lock-free readers
+ * writer fills new node and then publishes pointer to it with release
+ * semantics, readers load pointers with acquire semantics */
+#if defined(__GNUC__) || defined(__clang__)
+#define TKVDB_LOAD_ACQ(V) __atomic_load_n(&(V), __ATOMIC_ACQUIRE)
+#define TKVDB_STORE_REL(V, X) __atomic_store_n(&(V), (X), __ATOMIC_RELEASE)
+#define TKVDB_LOAD_SEQ(V) __atomic_load_n(&(V), __ATOMIC_SEQ_CST)
+#define TKVDB_STORE_SEQ(V, X) __atomic_store_n(&(V), (X), __ATOMIC_SEQ_CST)
+#define TKVDB_CAS(V, E, X) __atomic_compare_exchange_n(&(V), &(E), (X), \
+	0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define TKVDB_ADD_FETCH(V, X) __atomic_add_fetch(&(V), (X), __ATOMIC_RELAXED)
+#define TKVDB_SUB_FETCH(V, X) __atomic_sub_fetch(&(V), (X), __ATOMIC_RELAXED)
+#define TKVDB_FENCE_ACQ() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define TKVDB_FENCE_REL() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define TKVDB_PREFETCH(P) __builtin_prefetch(P)
+#else
+/* no atomics, concurrent readers are not supported */
+#define TKVDB_LOAD_ACQ(V) (V)
+#define TKVDB_STORE_REL(V, X) ((V) = (X))
+#define TKVDB_LOAD_SEQ(V) (V)
+#define TKVDB_STORE_SEQ(V, X) ((V) = (X))
+#define TKVDB_CAS(V, E, X) ((V) == (E) ? ((V) = (X), 1) : ((E) = (V), 0))
+#define TKVDB_ADD_FETCH(V, X) ((V) += (X))
+#define TKVDB_SUB_FETCH(V, X) ((V) -= (X))
+#define TKVDB_FENCE_ACQ()
+#define TKVDB_FENCE_REL()
+#define TKVDB_PREFETCH(P)
+#endif
+
+/* number of keys looked up at once by mget(), while node of one key is
+ * prefetched, nodes of other keys are processed */
+#define TKVDB_MGET_GROUP 32
+
+/* smaller transactions are always committed in one thread */
+#define TKVDB_COMMIT_PARALLEL_MIN (1024 * 1024)
+
+/* skip replaced nodes, 'TR' is transaction data */
+#define TKVDB_SKIP_RNODES(TR, NODE)                                  \
+while (TKVDB_LOAD_ACQ(NODE->c.replaced_by)) {                        \
+	NODE = TKVDB_REF_NODE(TR, TKVDB_LOAD_ACQ(NODE->c.replaced_by)); \
+}
+
+/* optimistic lock coupling for concurrent writers
+ * each node has version: counter, 'locked' and 'obsolete' bits
+ * readers remember version and check it after reading node, writers lock
+ * node only if it wasn't changed since it was read.
+ * macros below expect 'tr' (transaction data) and 'restart' label */
+#define TKVDB_OLC_OBSOLETE 1
+#define TKVDB_OLC_LOCKED 2
+
+#define TKVDB_OLC_READ(NODE, V)                                       \
+do {                                                                  \
+	if (tr->params.tr_concurrent) {                               \
+		V = tkvdb_olc_read(&(NODE)->c.version);               \
+		if (V & TKVDB_OLC_OBSOLETE) {                         \
+			goto restart;                                 \
+		}                                                     \
+	}                                                             \
+} while (0)
+
+#define TKVDB_OLC_CHECK(NODE, V)                                      \
+do {                                                                  \
+	if (tr->params.tr_concurrent                                  \
+		&& !tkvdb_olc_check(&(NODE)->c.version, V)) {         \
+		goto restart;                                         \
+	}                                                             \
+} while (0)
+
+#define TKVDB_OLC_LOCK(NODE, V)                                       \
+do {                                                                  \
+	if (tr->params.tr_concurrent                                  \
+		&& !tkvdb_olc_lock(&(NODE)->c.version, V)) {          \
+		goto restart;                                         \
+	}                                                             \
+} while (0)
+
+#define TKVDB_OLC_UNLOCK(NODE)                                        \
+do {                                                                  \
+	if (tr->params.tr_concurrent) {                               \
+		tkvdb_olc_unlock(&(NODE)->c.version, 0);              \
+	}                                                             \
+} while (0)
+
+/* node was replaced or removed from tree */
+#define TKVDB_OLC_UNLOCK_OBSOLETE(NODE)                               \
+do {                                                                  \
+	if (tr->params.tr_concurrent) {                               \
+		tkvdb_olc_unlock(&(NODE)->c.version, 1);              \
+	}                                                             \
 } while (0)
 
 
@@ -94,6 +268,27 @@ struct tkvdb_params
 
 	size_t key_limit;      /* cursor key size limit */
 	int key_dynalloc;      /* dynamically allocate cursor key */
+
+	size_t cache_limit;    /* size of nodes cache */
+	int mmap;              /* map database file to memory */
+
+	size_t readers;        /* max number of concurrent readers */
+	int tr_concurrent;     /* put/get/del from multiple threads */
+
+	int commit_threads;    /* threads used by commit */
+
+	int durability;         /* TKVDB_DURABILITY_* */
+	uint64_t sync_interval; /* group/periodic sync window, ms */
+	uint64_t sync_bytes;    /* group sync window, bytes */
+
+	size_t wal_limit;       /* size of write-ahead log, 0 - no log */
+
+	int compress;           /* compress nodes of new database file */
+	size_t frame_cache;     /* memory for decompressed frames */
+
+	int control;            /* shared control page '<path>-ctl' */
+
+	int checksum;           /* CRC32C of nodes of new database file */
 };
 
 /* packed structures */
@@ -112,6 +307,9 @@ struct tkvdb_tr_header
 	uint64_t footer_off;       /* pointer to footer */
 } PACKED;
 
+/* number of snapshot pins kept in footer */
+#define TKVDB_PINS 4
+
 /* on-disk transaction footer */
 struct tkvdb_tr_footer
 {
@@ -121,8 +319,33 @@ struct tkvdb_tr_footer
 	uint64_t transaction_size; /* transaction size */
 	uint64_t transaction_id;   /* transaction number */
 
-	uint64_t gap_begin;
-	uint64_t gap_end;
+	uint64_t vacuum_pos;       /* next step of vacuum starts here */
+	uint64_t vacuum_end;       /* end of range of unfinished pass or 0 */
+	uint64_t vacuum_id;        /* commit which started this pass */
+	uint64_t vacuum_walked;    /* commit which moved the last nodes of
+	                              pass waiting for pins (or 0) */
+	uint64_t free_gen;         /* changed when free space is reused */
+	uint64_t data_gen;         /* changed by commits of keys */
+	uint32_t nextents;         /* free extents written before footer */
+
+	uint64_t prev_footer;      /* footer of previous transaction (or 0) */
+	uint64_t oldest_id;        /* oldest snapshot which is still in file */
+	uint64_t pins[TKVDB_PINS]; /* ids of pinned snapshots + 1, 0 - free */
+	uint64_t synced_off;       /* file before it was on disk when footer
+	                              was written */
+	uint32_t tail_crc;         /* of file from 'synced_off' to footer */
+
+	uint8_t compression;       /* TKVDB_COMPRESSION_* of whole file */
+	uint8_t checksum;          /* nodes and footers have CRC32C */
+	uint32_t crc;              /* of free extents and footer */
+} PACKED;
+
+/* free part of file, array of extents sorted by offset is written
+ * right before footer */
+struct tkvdb_extent
+{
+	uint64_t off;
+	uint64_t size;
 } PACKED;
 
 #define TKVDB_TR_FTRSIZE (sizeof(struct tkvdb_tr_footer))
@@ -138,568 +361,6149 @@ struct tkvdb_disknode
 	uint8_t data[1];      /* variable size data */
 } PACKED;
 
+/* header of compressed frame, followed by compressed data */
+struct tkvdb_frame_header
+{
+	uint32_t size;        /* uncompressed size */
+	uint32_t comp_size;   /* equal to 'size' if frame is not compressed */
+} PACKED;
+
+/* header of write-ahead log */
+struct tkvdb_wal_header
+{
+	uint8_t signature[8];
+	uint64_t data_gen;    /* 'data_gen' of database file under log */
+} PACKED;
+
+/* record of write-ahead log, followed by key and value */
+struct tkvdb_wal_rec
+{
+	uint8_t type;         /* TKVDB_WAL_* */
+	uint32_t key_size;
+	uint32_t val_size;
+} PACKED;
+
 #ifdef _WIN32
 #pragma pack(pop, packing)
 #else
 #undef PACKED
 #endif
 
-/* database file information */
-struct tkvdb_db_info
+/* subnodes of disk node (after sizes of value and metadata)
+ * node with up to TKVDB_SUBNODES_THR subnodes stores sorted symbols and
+ * varint offsets, denser node stores bitmap of symbols, width of offsets
+ * (1, 2, 4 or 8 bytes) and offsets of this width, so offset can be found
+ * without decoding previous ones.
+ * Subnode written by the same commit is always before parent and its
+ * offset is stored as distance to parent ((parent - subnode) << 1),
+ * offset of older subnode is stored as is ((subnode << 1) | 1) */
+#define TKVDB_SUBNODE_REL(NODE_OFF, OFF) (((NODE_OFF) - (OFF)) << 1)
+#define TKVDB_SUBNODE_ABS(OFF) (((uint64_t)(OFF) << 1) | 1)
+#define TKVDB_SUBNODE_OFF(NODE_OFF, V)                                     \
+	(((V) & 1) ? ((V) >> 1) : ((NODE_OFF) - ((V) >> 1)))
+
+#define TKVDB_BITMAP_SIZE (256 / 8)
+
+/* subnodes of node being written */
+struct tkvdb_subnodes
 {
-	struct tkvdb_tr_footer footer;
-
-	uint64_t filesize;
+	unsigned int n;
+	unsigned int width;   /* width of offsets of dense node */
+	uint8_t syms[256];    /* sorted symbols */
+	uint64_t vals[256];   /* TKVDB_SUBNODE_REL() or TKVDB_SUBNODE_ABS() */
 };
 
-/* database */
-struct tkvdb
+static size_t
+tkvdb_varint_size(uint64_t v)
 {
-	int fd;                     /* database file handle */
-	struct tkvdb_db_info info;
-
-	tkvdb_params params;        /* database params */
+	size_t size = 1;
 
-	uint8_t *write_buf;
-	size_t write_buf_allocated;
-};
+	while (v >= 0x80) {
+		v >>= 7;
+		size++;
+	}
 
-/* helper struct for iterations through transaction */
-struct tkvdb_visit_helper
-{
-	void *node;                     /* pointer to memnode */
-	int off;                        /* index of subnode in node */
-};
+	return size;
+}
 
-/* transaction in memory */
-typedef struct tkvdb_tr_data
+static const uint8_t *
+tkvdb_varint_get(const uint8_t *ptr, uint64_t *v)
 {
-	tkvdb *db;
-	tkvdb_params params;
-
-	void *root;
-
-	int started;
+	unsigned int shift = 0;
 
-	uint8_t *tr_buf;                /* transaction buffer */
-	size_t tr_buf_allocated;
-	uint8_t *tr_buf_ptr;
+	*v = 0;
+	for (;;) {
+		*v |= (uint64_t)(*ptr & 0x7f) << shift;
+		if (!(*ptr++ & 0x80)) {
+			break;
+		}
+		shift += 7;
+	}
 
-	/* stack is used in commit() and free() */
-	struct tkvdb_visit_helper *stack;
-	/* allocated stack items (number of tkvdb_visit_helper) */
-	size_t stack_allocated;
-} tkvdb_tr_data;
+	return ptr;
+}
 
+static uint64_t
+tkvdb_fixed_get(const uint8_t *ptr, unsigned int width)
+{
+	uint8_t v8;
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch (width) {
+		case 1:
+			v8 = *ptr;
+			return v8;
+		case 2:
+			memcpy(&v16, ptr, sizeof(uint16_t));
+			return v16;
+		case 4:
+			memcpy(&v32, ptr, sizeof(uint32_t));
+			return v32;
+		default:
+			memcpy(&v64, ptr, sizeof(uint64_t));
+			return v64;
+	}
+}
 
-/* database cursor */
-typedef struct tkvdb_cursor_data
+/* size of encoded subnodes, width of offsets of dense node is the width
+ * of the biggest one */
+static size_t
+tkvdb_subnodes_size(struct tkvdb_subnodes *sub)
 {
-	size_t stack_size, stack_allocated;
-	struct tkvdb_visit_helper *stack;
+	size_t size;
+	uint64_t max = 0;
+	unsigned int i;
 
-	size_t stack_limit;
-	int stack_dynalloc;
+	if (sub->n > TKVDB_SUBNODES_THR) {
+		for (i=0; i<sub->n; i++) {
+			max |= sub->vals[i];
+		}
+		if (max <= UINT8_MAX) {
+			sub->width = sizeof(uint8_t);
+		} else if (max <= UINT16_MAX) {
+			sub->width = sizeof(uint16_t);
+		} else if (max <= UINT32_MAX) {
+			sub->width = sizeof(uint32_t);
+		} else {
+			sub->width = sizeof(uint64_t);
+		}
+		return TKVDB_BITMAP_SIZE + 1 + sub->n * sub->width;
+	}
 
-	size_t key_limit;
-	int key_dynalloc;
-	size_t key_allocated;
+	size = sub->n;
+	for (i=0; i<sub->n; i++) {
+		size += tkvdb_varint_size(sub->vals[i]);
+	}
 
-	size_t prefix_size;
-	uint8_t *prefix;
+	return size;
+}
 
-	size_t val_size;
-	uint8_t *val;
+/* encode subnodes, tkvdb_subnodes_size() must be called before */
+static uint8_t *
+tkvdb_subnodes_put(uint8_t *ptr, const struct tkvdb_subnodes *sub)
+{
+	unsigned int i;
+	uint64_t v;
 
-	tkvdb_tr *tr;
-} tkvdb_cursor_data;
+	if (sub->n > TKVDB_SUBNODES_THR) {
+		memset(ptr, 0, TKVDB_BITMAP_SIZE);
+		for (i=0; i<sub->n; i++) {
+			ptr[sub->syms[i] >> 3] |= 1 << (sub->syms[i] & 7);
+		}
+		ptr += TKVDB_BITMAP_SIZE;
+
+		*ptr++ = sub->width;
+		for (i=0; i<sub->n; i++) {
+			uint16_t v16;
+			uint32_t v32;
+
+			switch (sub->width) {
+				case 1:
+					*ptr = (uint8_t)sub->vals[i];
+					break;
+				case 2:
+					v16 = (uint16_t)sub->vals[i];
+					memcpy(ptr, &v16, sizeof(uint16_t));
+					break;
+				case 4:
+					v32 = (uint32_t)sub->vals[i];
+					memcpy(ptr, &v32, sizeof(uint32_t));
+					break;
+				default:
+					memcpy(ptr, &sub->vals[i],
+						sizeof(uint64_t));
+					break;
+			}
+			ptr += sub->width;
+		}
+		return ptr;
+	}
 
+	memcpy(ptr, sub->syms, sub->n);
+	ptr += sub->n;
+	for (i=0; i<sub->n; i++) {
+		for (v=sub->vals[i]; v>=0x80; v>>=7) {
+			*ptr++ = (uint8_t)(v & 0x7f) | 0x80;
+		}
+		*ptr++ = (uint8_t)v;
+	}
 
-/* triggers */
-struct tkvdb_trigger_func_info
-{
-	tkvdb_trigger_func func;
-	size_t meta_size;
-	void *userdata;
-};
+	return ptr;
+}
 
-struct tkvdb_triggers
+/* decode 'n' subnodes of node at 'node_off' to symbols and offsets,
+ * returns pointer to data after subnodes */
+static const uint8_t *
+tkvdb_subnodes_get(const uint8_t *ptr, unsigned int n, uint64_t node_off,
+	uint8_t *syms, uint64_t *offs)
 {
-	size_t n_funcs;
-	struct tkvdb_trigger_func_info *funcs;
-
-	/* sum of meta_size for each trigger */
-	size_t meta_size;
-
-	tkvdb_trigger_stack stack;
+	unsigned int i, sym, width;
+	uint64_t v;
+
+	if (n > TKVDB_SUBNODES_THR) {
+		const uint8_t *bitmap = ptr;
+
+		ptr += TKVDB_BITMAP_SIZE;
+		width = *ptr++;
+		for (i=0, sym=0; sym<256; sym++) {
+			if (bitmap[sym >> 3] & (1 << (sym & 7))) {
+				v = tkvdb_fixed_get(ptr, width);
+				ptr += width;
+				syms[i] = sym;
+				offs[i] = TKVDB_SUBNODE_OFF(node_off, v);
+				i++;
+			}
+		}
+		return ptr;
+	}
 
-	tkvdb_trigger_info info;
-};
+	memcpy(syms, ptr, n);
+	ptr += n;
+	for (i=0; i<n; i++) {
+		ptr = tkvdb_varint_get(ptr, &v);
+		offs[i] = TKVDB_SUBNODE_OFF(node_off, v);
+	}
 
+	return ptr;
+}
 
-static TKVDB_RES
-tkvdb_info_read(const int fd, struct tkvdb_db_info *info)
+/* find offset of subnode 'sym' of node at 'node_off', 0 if there is no
+ * such subnode */
+static uint64_t
+tkvdb_subnodes_find(const uint8_t *ptr, unsigned int n, uint64_t node_off,
+	unsigned int sym)
 {
-	struct stat st;
-	off_t footer_pos; /* position of footer in database file */
-	ssize_t io_res;
+	unsigned int i, idx, width;
+	uint8_t bits;
+	uint64_t v;
 
-	/* get file size */
-	if (fstat(fd, &st) != 0) {
-		return TKVDB_IO_ERROR;
-	}
+	if (n > TKVDB_SUBNODES_THR) {
+		if (!(ptr[sym >> 3] & (1 << (sym & 7)))) {
+			return 0;
+		}
 
-	info->filesize = st.st_size;
+		/* index of offset is number of symbols before 'sym' */
+		idx = 0;
+		for (i=0; i<=(sym >> 3); i++) {
+			bits = ptr[i];
+			if (i == (sym >> 3)) {
+				bits &= (1 << (sym & 7)) - 1;
+			}
+			for (; bits; bits&=bits-1) {
+				idx++;
+			}
+		}
 
-	if (info->filesize == 0) {
-		/* empty file */
-		return TKVDB_OK;
+		width = ptr[TKVDB_BITMAP_SIZE];
+		v = tkvdb_fixed_get(ptr + TKVDB_BITMAP_SIZE + 1 + idx * width,
+			width);
+		return TKVDB_SUBNODE_OFF(node_off, v);
 	}
 
-	if (info->filesize <= (off_t)TKVDB_TR_FTRSIZE) {
-		/* file is too small */
-		return TKVDB_CORRUPTED;
+	/* symbols are sorted */
+	for (idx=0; idx<n; idx++) {
+		if (ptr[idx] >= sym) {
+			break;
+		}
 	}
-
-	/* seek to the end of file (e.g. footer of last transaction) */
-	footer_pos = info->filesize - TKVDB_TR_FTRSIZE;
-	if (lseek(fd, footer_pos, SEEK_SET) != footer_pos) {
-		return TKVDB_IO_ERROR;
+	if ((idx == n) || (ptr[idx] != sym)) {
+		return 0;
 	}
 
-	io_res = read(fd, &info->footer, TKVDB_TR_FTRSIZE);
-	if (io_res < (ssize_t)TKVDB_TR_FTRSIZE) {
-		/* read less than footer, assuming it's error */
-		return TKVDB_IO_ERROR;
+	ptr += n;
+	for (i=0; i<=idx; i++) {
+		ptr = tkvdb_varint_get(ptr, &v);
 	}
 
-	/* check signature */
-	if ((memcmp(info->footer.signature, TKVDB_SIGNATURE,
-		sizeof(TKVDB_SIGNATURE) - 1)) != 0) {
+	return TKVDB_SUBNODE_OFF(node_off, v);
+}
 
-		return TKVDB_CORRUPTED;
-	}
+/* CRC32C (Castagnoli), with SSE4.2 instruction if CPU has it or with
+ * tables (8 bytes per step) */
+static uint32_t tkvdb_crc32c_table[8][256];
+static int tkvdb_crc32c_ready = 0;
 
-	if (info->footer.transaction_size > (uint64_t)footer_pos) {
-		return TKVDB_CORRUPTED;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define TKVDB_CRC32C_SSE42
+static int tkvdb_crc32c_sse42 = 0;
+
+__attribute__((target("sse4.2")))
+static uint32_t
+tkvdb_crc32c_hw(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint64_t c = crc, v;
+
+	for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+		memcpy(&v, p, sizeof(uint64_t));
+		c = __builtin_ia32_crc32di(c, v);
+		p += sizeof(uint64_t);
+	}
+	for (; size > 0; size--) {
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
 	}
 
-	return TKVDB_OK;
+	return (uint32_t)c;
 }
+#endif
 
-/* handle partial reads and writes */
-static int
-tkvdb_try_read_file(int fd, void *buf, size_t size, int ignore_eof)
+static void
+tkvdb_crc32c_init(void)
 {
-	size_t bytes_read = 0;
-	uint8_t *bbuf = buf;
-	for (;;) {
-		ssize_t read_res;
-		read_res = read(fd, bbuf, size - bytes_read);
-		if (read_res < 0) {
-			return 0;
-		} else if (read_res == 0) {
-			/* EOF */
-			if (ignore_eof) {
-				break;
-			}
-			if (bytes_read < size) {
-				return 0;
-			}
+	uint32_t c;
+	int i, j;
+
+	if (TKVDB_LOAD_ACQ(tkvdb_crc32c_ready)) {
+		return;
+	}
+
+	for (i=0; i<256; i++) {
+		c = i;
+		for (j=0; j<8; j++) {
+			c = (c & 1) ? ((c >> 1) ^ 0x82f63b78) : (c >> 1);
 		}
-		bytes_read += read_res;
-		if (bytes_read >= size) {
-			break;
+		tkvdb_crc32c_table[0][i] = c;
+	}
+	for (i=0; i<256; i++) {
+		c = tkvdb_crc32c_table[0][i];
+		for (j=1; j<8; j++) {
+			c = tkvdb_crc32c_table[0][c & 0xff] ^ (c >> 8);
+			tkvdb_crc32c_table[j][i] = c;
 		}
-		bbuf += bytes_read;
 	}
-	return 1;
+#ifdef TKVDB_CRC32C_SSE42
+	tkvdb_crc32c_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+	TKVDB_STORE_REL(tkvdb_crc32c_ready, 1);
 }
 
-static int
-tkvdb_try_write_file(int fd, void *buf, size_t size)
+/* 'crc' of previous part of data (0 - start) */
+static uint32_t
+tkvdb_crc32c(uint32_t crc, const void *buf, size_t size)
 {
-	size_t bytes_write = 0;
-	uint8_t *bbuf = buf;
-	for (;;) {
-		ssize_t write_res;
-		write_res = write(fd, bbuf, size - bytes_write);
-		if (write_res < 0) {
-			return 0;
-		}
-		bytes_write += write_res;
-		if (bytes_write >= size) {
-			break;
-		}
-		bbuf += bytes_write;
+	const uint8_t *p = buf;
+	uint32_t (*t)[256] = tkvdb_crc32c_table;
+	uint32_t lo, hi;
+
+	crc = ~crc;
+#ifdef TKVDB_CRC32C_SSE42
+	if (tkvdb_crc32c_sse42) {
+		return ~tkvdb_crc32c_hw(crc, p, size);
+	}
+#endif
+	for (; size >= 8; size -= 8) {
+		lo = crc ^ (p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16)
+			| ((uint32_t)p[3] << 24));
+		hi = p[4] | (p[5] << 8) | ((uint32_t)p[6] << 16)
+			| ((uint32_t)p[7] << 24);
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+			^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+			^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+		p += 8;
+	}
+	for (; size > 0; size--) {
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
 	}
-	return 1;
-}
 
+	return ~crc;
+}
 
-/* fill tkvdb_params with default values */
-void
-tkvdb_params_init(tkvdb_params *params)
+/* database file information */
+struct tkvdb_db_info
 {
-	params->write_buf_dynalloc = 1;
-	params->write_buf_limit = SIZE_MAX;
+	struct tkvdb_tr_footer footer;
 
-	params->tr_buf_dynalloc = 1;
-	params->tr_buf_limit = SIZE_MAX;
+	uint64_t filesize;
+};
+
+/* control page '<path>-ctl' mapped by all handles of database, copy of
+ * the last footer and file size. Sequence counter is odd while they are
+ * updated */
+struct tkvdb_ctl
+{
+	uint8_t signature[8];
+	uint64_t seq;
+	struct tkvdb_db_info info;
+};
+
+/* free extents of file, room for extents added before trim */
+struct tkvdb_freemap
+{
+	struct tkvdb_extent ext[TKVDB_FREEMAP_MAX + 2];
+	size_t n;
+};
+
+/* on-disk node in cache */
+struct tkvdb_cache_node
+{
+	uint64_t off;                   /* offset of node in file */
+	size_t size;
+	int ref;                        /* CLOCK reference bit */
+
+	struct tkvdb_cache_node *hnext; /* next node in hash bucket */
+	struct tkvdb_cache_node *prev;  /* CLOCK ring */
+	struct tkvdb_cache_node *next;
+
+	uint8_t data[1];                /* node as it stored on disk */
+};
+
+/* cache of committed nodes shared by all transactions of database,
+ * nodes in file are never changed after commit (until vacuum), so
+ * they are keyed by offset */
+struct tkvdb_cache
+{
+	size_t limit;                   /* max memory in bytes */
+	size_t used;
+
+	struct tkvdb_cache_node **buckets;
+	size_t nbuckets;                /* power of two */
+	size_t nnodes;
+
+	struct tkvdb_cache_node *hand;  /* CLOCK hand */
+
+	uint64_t hits, misses;
+};
+
+/* mapping of database file, old mappings are kept until database is
+ * closed, values returned by get() may point to them */
+struct tkvdb_map
+{
+	uint8_t *addr;
+	size_t size;
+
+	struct tkvdb_map *prev;
+};
+
+/* minimal size of mapping */
+#define TKVDB_MAP_MIN_SIZE (1024 * 1024)
+
+/* buffered writer, data is written sequentially to file starting from
+ * offset 'off' */
+struct tkvdb_writer
+{
+	int fd;
+	uint64_t off;               /* file offset of buffer */
+
+	uint8_t *buf;
+	size_t allocated;
+	size_t used;                /* bytes not flushed yet */
+	size_t limit;
+	int dynalloc;
+
+	/* nodes are collected to frame and compressed, see
+	 * tkvdb_writer_compress() */
+	int compress;
+	uint64_t frame_off;         /* file offset of frame */
+	uint8_t *frame;
+	size_t frame_used, frame_allocated;
+	uint8_t *comp;              /* compressed frame */
+	size_t comp_allocated;
+	uint32_t *lz_hash;
+};
+
+/* decompressed frame of compressed database */
+struct tkvdb_frame
+{
+	uint64_t off;               /* file offset of frame, 0 if none */
+	uint64_t used;              /* time of last use, for LRU */
+	uint8_t *data;
+	size_t size, allocated;
+};
+
+struct tkvdb_frames
+{
+	struct tkvdb_frame *frames; /* allocated on first read of frame */
+	size_t nsets;
+	uint64_t tick;
+
+	uint8_t *comp;              /* compressed frame */
+	size_t comp_allocated;
+};
+
+/* database */
+/* commits written after last fsync(), see TKVDB_PARAM_DURABILITY */
+struct tkvdb_syncer
+{
+	uint64_t unsynced;          /* bytes */
+	uint64_t since;             /* time of first unsynced commit, ms */
+	uint64_t durable_id;        /* footers before this one are on disk */
+	int file_dirty;             /* database file is in 'unsynced' */
+
+	/* end of last footer written by handle and file before it which
+	 * was synced, both are valid while 'free_gen' of file is the same */
+	uint64_t written_end, written_gen;
+	uint64_t synced_end, synced_gen;
+
+	/* CRC32C of [tail_off, tail_end) of file, see tkvdb_syncer_tail() */
+	uint64_t tail_off, tail_end;
+	uint32_t tail_crc;
+
+#ifdef TKVDB_COMMIT_THREADS
+	/* periodic sync, flush of last group by timer */
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int started;
+	int stop;
+#endif
+};
+
+/* append of log waiting in queue of group, see tkvdb_wal_submit() */
+struct tkvdb_wal_req
+{
+	const uint8_t *buf;         /* records */
+	size_t size;
+	uint8_t mark[sizeof(struct tkvdb_wal_rec) + TKVDB_CRC_SIZE];
+	uint64_t data_gen;          /* of database under records */
+	int dosync;
+
+	uint64_t off;               /* where records were written */
+	uint64_t written;           /* bytes, with header of new log */
+	TKVDB_RES r;
+	int taken, done;            /* by writer of group */
+
+	struct tkvdb_wal_req *next;
+};
+
+#ifdef TKVDB_COMMIT_THREADS
+/* fdatasync() of one file shared by handles, see tkvdb_group_fdsync() */
+struct tkvdb_group_sync
+{
+	uint64_t started, done;     /* generations */
+	uint64_t failed;            /* the last one which failed */
+};
+
+/* handles of one database file in process */
+struct tkvdb_group
+{
+	dev_t dev;
+	ino_t ino;
+	int refs;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	struct tkvdb_group_sync file, log;
+
+	struct tkvdb_wal_req *queue, *queue_last;
+	int writing;                /* log is written by one of handles */
+
+	struct tkvdb_group *next;
+};
+
+static struct tkvdb_group *tkvdb_groups = NULL;
+static pthread_mutex_t tkvdb_groups_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* resume point of vacuum pass which takes more than one step, pass may
+ * be continued by other handle, but then walk starts from the first key */
+struct tkvdb_vacuum_cursor
+{
+	int active;
+	uint64_t pass_id;           /* 'vacuum_id' of footer */
+	uint64_t moved;             /* bytes moved by previous steps */
+
+	uint8_t *key;               /* nodes before this key are processed */
+	size_t key_size, key_allocated;
+};
+
+struct tkvdb
+{
+	int fd;                     /* database file handle */
+	struct tkvdb_db_info info;
+
+	tkvdb_params params;        /* database params */
+
+	struct tkvdb_writer writer; /* commit write buffer */
+
+	struct tkvdb_cache cache;
+
+	struct tkvdb_map *map;      /* current mapping (or NULL) */
+
+	struct tkvdb_frames frames; /* last read frames of compressed file */
+
+	struct tkvdb_freemap freemap; /* free extents, used by commit */
+
+	struct tkvdb_syncer syncer; /* delayed fsync() */
+	struct tkvdb_group *group;  /* shared fsync() or NULL */
+
+	int wal_fd;                 /* write-ahead log or -1 */
+
+	int ctl_fd;                 /* control page or -1 */
+	struct tkvdb_ctl *ctl;      /* mapped control page (or NULL) */
+	uint64_t ctl_seq;           /* counter of last read of page */
+	struct tkvdb_db_info ctl_info; /* and info read */
+	uint64_t ctl_own;           /* counter after own commit was published */
+	int freemap_own;            /* freemap is one of own commit */
+
+	uint64_t written;           /* bytes written by commits */
+	uint64_t wal_written;       /* bytes written to log */
+
+	struct tkvdb_vacuum_cursor vacuum; /* walk of unfinished pass */
+};
+
+/* helper struct for iterations through transaction */
+struct tkvdb_visit_helper
+{
+	void *node;                     /* pointer to memnode */
+	int off;                        /* index of subnode in node */
+};
+
+/* subtrees of root written by commit threads, see TKVDB_IMPL_DO_COMMIT() */
+struct tkvdb_commit_ctx
+{
+	void *subtrees[256];            /* memnodes */
+	uint64_t sizes[256];            /* size of modified nodes */
+	uint64_t offs[256];             /* offset of subtree in file */
+	size_t nsubtrees;
+
+	size_t next;                    /* next subtree to process */
+	int write;                      /* 0 - calculate sizes, 1 - write */
+
+	void *tr;                       /* tkvdb_tr_data */
+};
+
+/* commit thread */
+struct tkvdb_commit_worker
+{
+	struct tkvdb_commit_ctx *ctx;
+
+	struct tkvdb_visit_helper *stack;
+	size_t stack_allocated;
+	struct tkvdb_writer w;
+
+	TKVDB_RES r;
+#ifdef TKVDB_COMMIT_THREADS
+	pthread_t thread;
+#endif
+};
+
+/* subtrees of two transactions to merge, see tkvdb_tr_merge() */
+struct tkvdb_merge_pair
+{
+	void *dst;                      /* replace chain in destination */
+	void *src;                      /* and in source transaction */
+	size_t path_off, path_size;     /* key prefix of subtrees in 'path' */
+};
+
+struct tkvdb_merge_stack
+{
+	struct tkvdb_merge_pair *pairs;
+	size_t size, allocated;
+
+	/* key prefixes of pairs, subtrees that are not merged are put back
+	   to source transaction on error */
+	uint8_t *path;
+	size_t path_size, path_allocated;
+	size_t cur_off, cur_size;       /* prefix of last pair taken */
+};
+
+/* node on path from root during vacuum, see tkvdb_vacuum() */
+struct tkvdb_vacuum_level
+{
+	void *node;                     /* node loaded to transaction or NULL */
+	int sym;                        /* symbol of node in parent */
+	size_t key_size;                /* key of node (with prefix) */
+	int after;                      /* key is not prefix of resume key */
+
+	uint32_t size;                  /* size of node on disk */
+	unsigned int nsubnodes, pos;    /* subnodes and next one to visit */
+	uint8_t syms[256];
+	uint64_t offs[256];
+};
+
+/* memory for nodes of transaction
+ * blocks are cut from big chunks, freed blocks are kept in lists by size
+ * class and reused. Block bigger than biggest class gets chunk of its own.
+ * All chunks are released at once on reset. Preallocated transaction
+ * buffer is the only (non-growable) chunk */
+#define TKVDB_ARENA_SHIFT 4
+#define TKVDB_ARENA_ALIGN (1 << TKVDB_ARENA_SHIFT)
+#define TKVDB_ARENA_CHUNK_MIN (64 * 1024)
+#define TKVDB_ARENA_CHUNK_MAX (4 * 1024 * 1024)
+
+/* size classes: 16 bytes steps up to 256, then 4 classes between powers
+ * of 2 up to 64K */
+#define TKVDB_ARENA_SMALL 256
+#define TKVDB_ARENA_BIG (64 * 1024)
+#define TKVDB_ARENA_CLASSES (TKVDB_ARENA_SMALL / TKVDB_ARENA_ALIGN + 4 * 8)
+#define TKVDB_ARENA_HUGE 0xff
+
+/* header is placed right before (aligned) chunk data */
+struct tkvdb_arena_chunk
+{
+	struct tkvdb_arena_chunk *prev, *next;
+	void *mem;                      /* as returned by malloc() */
+	size_t size;                    /* usable size */
+};
+
+/* freed block */
+struct tkvdb_arena_block
+{
+	struct tkvdb_arena_block *next;
+};
+
+struct tkvdb_arena
+{
+	struct tkvdb_arena_chunk *chunks;
+	size_t chunk_size;              /* size of next chunk */
+
+	uint8_t *ptr, *end;             /* free space in current chunk */
+
+	uint8_t *buf;                   /* preallocated buffer or NULL */
+	size_t buf_size;
+	uintptr_t base;                 /* origin of 32-bit references */
+
+	struct tkvdb_arena_block *free[TKVDB_ARENA_CLASSES];
+};
+
+/* epoch-based reclamation of nodes for concurrent readers
+ * reader announces global epoch when it enters critical section, writer
+ * advances global epoch only when all active readers have seen current
+ * one. Node retired at epoch E is unreachable for readers entered after
+ * that, so it can be freed when global epoch is E + 2 */
+#define TKVDB_EBR_ACTIVE 1
+
+struct tkvdb_reader
+{
+	uint64_t epoch;                 /* (epoch << 1) | active */
+	int used;
+
+	/* avoid false sharing between readers */
+	uint8_t pad[64 - sizeof(uint64_t) - sizeof(int)];
+};
+
+/* retired node */
+struct tkvdb_ebr_node
+{
+	void *node;
+	int subtree;                    /* node with subnodes or single one */
+	uint64_t epoch;                 /* epoch of retirement */
+
+	struct tkvdb_ebr_node *next;
+};
+
+struct tkvdb_ebr
+{
+	uint64_t epoch;                 /* global epoch */
+
+	size_t nreaders;
+	struct tkvdb_reader *readers;
+
+	struct tkvdb_ebr_node *limbo;   /* retired nodes, newest first */
+};
+
+/* transaction in memory */
+typedef struct tkvdb_tr_data
+{
+	tkvdb *db;
+	tkvdb_params params;
+
+	void *root;
+	uint64_t root_off;              /* root of snapshot */
+
+	int started;
+	int snapshot;                   /* read-only, at historical root */
+
+	struct tkvdb_arena arena;       /* nodes (unless tr_concurrent) */
+	size_t tr_buf_allocated;        /* bytes used by nodes */
+
+	/* stack is used in commit() and free() */
+	struct tkvdb_visit_helper *stack;
+	/* allocated stack items (number of tkvdb_visit_helper) */
+	size_t stack_allocated;
+
+	/* concurrent readers (NULL if disabled) */
+	struct tkvdb_ebr *ebr;
+
+	/* nodes deleted by concurrent writers, freed on reset */
+	struct tkvdb_ebr_node *retired;
+
+	/* write-ahead log (NULL if disabled) */
+	struct tkvdb_tr_wal *wal;
+} tkvdb_tr_data;
+
+
+/* database cursor */
+typedef struct tkvdb_cursor_data
+{
+	size_t stack_size, stack_allocated;
+	struct tkvdb_visit_helper *stack;
+
+	size_t stack_limit;
+	int stack_dynalloc;
+
+	size_t key_limit;
+	int key_dynalloc;
+	size_t key_allocated;
+
+	size_t prefix_size;
+	uint8_t *prefix;
+
+	size_t val_size;
+	uint8_t *val;
+
+	tkvdb_tr *tr;
+} tkvdb_cursor_data;
+
+
+/* triggers */
+struct tkvdb_trigger_func_info
+{
+	tkvdb_trigger_func func;
+	size_t meta_size;
+	void *userdata;
+};
+
+struct tkvdb_triggers
+{
+	size_t n_funcs;
+	struct tkvdb_trigger_func_info *funcs;
+
+	/* sum of meta_size for each trigger */
+	size_t meta_size;
+
+	tkvdb_trigger_stack stack;
+
+	tkvdb_trigger_info info;
+};
+
+
+static TKVDB_RES
+tkvdb_info_read(const int fd, struct tkvdb_db_info *info)
+{
+	struct stat st;
+	off_t footer_pos; /* position of footer in database file */
+	ssize_t io_res;
+
+	/* get file size */
+	if (fstat(fd, &st) != 0) {
+		return TKVDB_IO_ERROR;
+	}
+
+	info->filesize = st.st_size;
+
+	if (info->filesize == 0) {
+		/* empty file */
+		return TKVDB_OK;
+	}
+
+	if (info->filesize <= (off_t)TKVDB_TR_FTRSIZE) {
+		/* file is too small */
+		return TKVDB_CORRUPTED;
+	}
+
+	/* seek to the end of file (e.g. footer of last transaction) */
+	footer_pos = info->filesize - TKVDB_TR_FTRSIZE;
+	if (lseek(fd, footer_pos, SEEK_SET) != footer_pos) {
+		return TKVDB_IO_ERROR;
+	}
+
+	io_res = read(fd, &info->footer, TKVDB_TR_FTRSIZE);
+	if (io_res < (ssize_t)TKVDB_TR_FTRSIZE) {
+		/* read less than footer, assuming it's error */
+		return TKVDB_IO_ERROR;
+	}
+
+	/* check signature */
+	if ((memcmp(info->footer.signature, TKVDB_SIGNATURE,
+		sizeof(TKVDB_SIGNATURE) - 1)) != 0) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	if ((info->footer.nextents > TKVDB_FREEMAP_MAX)
+		|| ((info->footer.transaction_size
+			+ info->footer.nextents * sizeof(struct tkvdb_extent))
+			> (uint64_t)footer_pos)) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	return TKVDB_OK;
+}
+
+/* handle partial reads and writes */
+static int
+tkvdb_try_read_file(int fd, void *buf, size_t size, int ignore_eof)
+{
+	size_t bytes_read = 0;
+	uint8_t *bbuf = buf;
+	for (;;) {
+		ssize_t read_res;
+		read_res = read(fd, bbuf, size - bytes_read);
+		if (read_res < 0) {
+			return 0;
+		} else if (read_res == 0) {
+			/* EOF */
+			if (ignore_eof) {
+				break;
+			}
+			if (bytes_read < size) {
+				return 0;
+			}
+		}
+		bytes_read += read_res;
+		if (bytes_read >= size) {
+			break;
+		}
+		bbuf += read_res;
+	}
+	return 1;
+}
+
+static int
+tkvdb_try_write_file(int fd, void *buf, size_t size)
+{
+	size_t bytes_write = 0;
+	uint8_t *bbuf = buf;
+	for (;;) {
+		ssize_t write_res;
+		write_res = write(fd, bbuf, size - bytes_write);
+		if (write_res < 0) {
+			return 0;
+		}
+		bytes_write += write_res;
+		if (bytes_write >= size) {
+			break;
+		}
+		bbuf += write_res;
+	}
+	return 1;
+}
+
+static int
+tkvdb_try_pwrite_file(int fd, const void *buf, size_t size, uint64_t off)
+{
+#ifdef _WIN32
+	if (lseek(fd, off, SEEK_SET) != (off_t)off) {
+		return 0;
+	}
+	return tkvdb_try_write_file(fd, (void *)buf, size);
+#else
+	const uint8_t *bbuf = buf;
+
+	while (size > 0) {
+		ssize_t write_res;
+
+		write_res = pwrite(fd, bbuf, size, off);
+		if (write_res < 0) {
+			return 0;
+		}
+		bbuf += write_res;
+		size -= write_res;
+		off += write_res;
+	}
+	return 1;
+#endif
+}
+
+/* LZ compression of frames
+ * sequence is token (4 bits of literals length and 4 bits of match length
+ * minus TKVDB_LZ_MINMATCH, 15 means that length continues in next bytes
+ * up to byte not equal to 255), literals and 2-byte distance of match.
+ * Last sequence has only literals.
+ * returns compressed size or 0 if result doesn't fit in 'cap' bytes */
+static uint8_t *
+tkvdb_lz_length(uint8_t *op, size_t len)
+{
+	for (; len>=255; len-=255) {
+		*op++ = 255;
+	}
+	*op++ = (uint8_t)len;
+
+	return op;
+}
+
+static size_t
+tkvdb_lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t cap,
+	uint32_t *hash)
+{
+	const uint8_t *ip = src, *anchor = src, *end = src + size, *ref;
+	/* matches are not searched in last bytes */
+	const uint8_t *mlimit = (size > 12) ? (end - 12) : src;
+	uint8_t *op = dst, *token;
+	size_t lit, len;
+	uint32_t seq, h;
+
+	memset(hash, 0, sizeof(uint32_t) << TKVDB_LZ_HASH_BITS);
+
+	while (ip < mlimit) {
+		memcpy(&seq, ip, sizeof(uint32_t));
+		h = (seq * 2654435761U) >> (32 - TKVDB_LZ_HASH_BITS);
+		ref = src + hash[h];
+		hash[h] = (uint32_t)(ip - src);
+
+		if ((ref >= ip) || ((size_t)(ip - ref) > 0xffff)
+			|| (memcmp(ref, ip, TKVDB_LZ_MINMATCH) != 0)) {
+
+			ip++;
+			continue;
+		}
+
+		len = TKVDB_LZ_MINMATCH;
+		while (((ip + len) < mlimit) && (ref[len] == ip[len])) {
+			len++;
+		}
+
+		/* token, literals, distance and length */
+		lit = ip - anchor;
+		if ((size_t)(dst + cap - op)
+			< (lit + lit / 255 + len / 255 + 8)) {
+
+			return 0;
+		}
+		token = op++;
+		*token = (uint8_t)((lit < 15 ? lit : 15) << 4);
+		if (lit >= 15) {
+			op = tkvdb_lz_length(op, lit - 15);
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (uint8_t)(ip - ref);
+		*op++ = (uint8_t)((ip - ref) >> 8);
+		len -= TKVDB_LZ_MINMATCH;
+		*token |= (uint8_t)(len < 15 ? len : 15);
+		if (len >= 15) {
+			op = tkvdb_lz_length(op, len - 15);
+		}
+
+		ip += len + TKVDB_LZ_MINMATCH;
+		anchor = ip;
+	}
+
+	/* the rest is literals */
+	lit = end - anchor;
+	if ((size_t)(dst + cap - op) < (lit + lit / 255 + 2)) {
+		return 0;
+	}
+	token = op++;
+	*token = (uint8_t)((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15) {
+		op = tkvdb_lz_length(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+/* returns 0 if compressed data is corrupted or its uncompressed size
+ * is not 'size' */
+static int
+tkvdb_lz_decompress(const uint8_t *src, size_t comp_size, uint8_t *dst,
+	size_t size)
+{
+	const uint8_t *ip = src, *iend = src + comp_size, *ref;
+	uint8_t *op = dst, *oend = dst + size;
+	size_t lit, len, dist;
+	uint8_t token, b;
+
+	for (;;) {
+		if (ip >= iend) {
+			return 0;
+		}
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend) {
+					return 0;
+				}
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if ((lit > (size_t)(iend - ip))
+			|| (lit > (size_t)(oend - op))) {
+
+			return 0;
+		}
+		if ((lit <= 16) && ((iend - ip) >= 16) && ((oend - op) >= 16)) {
+			/* short literals are copied with fixed size */
+			memcpy(op, ip, 16);
+		} else {
+			memcpy(op, ip, lit);
+		}
+		ip += lit;
+		op += lit;
+
+		if (ip == iend) {
+			/* last sequence */
+			return op == oend;
+		}
+
+		if ((iend - ip) < 2) {
+			return 0;
+		}
+		dist = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if ((dist == 0) || (dist > (size_t)(op - dst))) {
+			return 0;
+		}
+
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend) {
+					return 0;
+				}
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += TKVDB_LZ_MINMATCH;
+		if (len > (size_t)(oend - op)) {
+			return 0;
+		}
+
+		ref = op - dist;
+		if ((dist >= 8) && ((size_t)(oend - op) >= (len + 8))) {
+			/* by 8 bytes, may write after end of match */
+			uint8_t *mend = op + len;
+
+			do {
+				memcpy(op, ref, 8);
+				op += 8;
+				ref += 8;
+			} while (op < mend);
+			op = mend;
+		} else if (dist >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping match repeats last 'dist' bytes */
+			while (len--) {
+				*op++ = *ref++;
+			}
+		}
+	}
+}
+
+/* commit is written sequentially through write buffer, buffer is flushed
+ * to file when full, so memory used by commit doesn't depend on
+ * transaction size */
+static TKVDB_RES
+tkvdb_writer_init(struct tkvdb_writer *w, int fd, size_t limit, int dynalloc)
+{
+	w->fd = fd;
+	w->off = 0;
+	w->used = 0;
+	w->limit = limit;
+	w->dynalloc = dynalloc;
+
+	w->compress = 0;
+	w->frame = w->comp = NULL;
+	w->frame_used = w->frame_allocated = w->comp_allocated = 0;
+	w->lz_hash = NULL;
+
+	if (dynalloc) {
+		w->buf = NULL;
+		w->allocated = 0;
+	} else {
+		w->buf = malloc(limit);
+		if (!w->buf) {
+			return TKVDB_ENOMEM;
+		}
+		w->allocated = limit;
+	}
+
+	return TKVDB_OK;
+}
+
+static void
+tkvdb_writer_free(struct tkvdb_writer *w)
+{
+	free(w->buf);
+	free(w->frame);
+	free(w->comp);
+	free(w->lz_hash);
+}
+
+/* start writing from offset 'off', unflushed data is dropped */
+static void
+tkvdb_writer_seek(struct tkvdb_writer *w, uint64_t off)
+{
+	w->off = off;
+	w->used = 0;
+	w->compress = 0;
+	w->frame_used = 0;
+}
+
+/* file offset of next byte (or offset of next node in frame) */
+static uint64_t
+tkvdb_writer_pos(const struct tkvdb_writer *w)
+{
+	if (w->compress) {
+		return (w->frame_off << TKVDB_FRAME_BITS) | w->frame_used;
+	}
+	return w->off + w->used;
+}
+
+/* node of 'size' bytes fits in current frame, otherwise it should be
+ * started in next one */
+static int
+tkvdb_writer_fits(const struct tkvdb_writer *w, size_t size)
+{
+	return !w->compress || (w->frame_used == 0)
+		|| ((w->frame_used + size) <= TKVDB_FRAME_SIZE);
+}
+
+/* get space in frame, frame grows for big node */
+static TKVDB_RES
+tkvdb_writer_frame_reserve(struct tkvdb_writer *w, size_t size,
+	uint8_t **ptr)
+{
+	if ((w->frame_used + size) > w->frame_allocated) {
+		size_t new_size = w->frame_allocated * 2;
+		uint8_t *tmp;
+
+		if (new_size < (w->frame_used + size)) {
+			new_size = w->frame_used + size;
+		}
+		tmp = realloc(w->frame, new_size);
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		w->frame = tmp;
+		w->frame_allocated = new_size;
+	}
+
+	*ptr = w->frame + w->frame_used;
+	w->frame_used += size;
+
+	return TKVDB_OK;
+}
+
+static TKVDB_RES
+tkvdb_writer_flush(struct tkvdb_writer *w)
+{
+	if (w->used == 0) {
+		return TKVDB_OK;
+	}
+
+	if (!tkvdb_try_pwrite_file(w->fd, w->buf, w->used, w->off)) {
+		return TKVDB_IO_ERROR;
+	}
+	w->off += w->used;
+	w->used = 0;
+
+	return TKVDB_OK;
+}
+
+/* get 'size' (not more than TKVDB_WRITE_BUF_MIN) bytes of write buffer */
+static TKVDB_RES
+tkvdb_writer_reserve(struct tkvdb_writer *w, size_t size, uint8_t **ptr)
+{
+	size_t new_size = w->used + size;
+
+	if (w->compress) {
+		return tkvdb_writer_frame_reserve(w, size, ptr);
+	}
+
+	if (new_size > w->limit) {
+		TKVDB_EXEC( tkvdb_writer_flush(w) );
+		new_size = size;
+	}
+
+	if (new_size > w->allocated) {
+		uint8_t *tmp;
+
+		if (!w->dynalloc) {
+			return TKVDB_ENOMEM;
+		}
+
+		/* grow geometrically up to limit */
+		if (new_size < w->allocated * 2) {
+			new_size = w->allocated * 2;
+		}
+		if (new_size > w->limit) {
+			new_size = w->limit;
+		}
+
+		tmp = realloc(w->buf, new_size);
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+
+		w->buf = tmp;
+		w->allocated = new_size;
+	}
+
+	*ptr = w->buf + w->used;
+	w->used += size;
+
+	return TKVDB_OK;
+}
+
+/* append data to write buffer, large blocks are written directly */
+static TKVDB_RES
+tkvdb_writer_put(struct tkvdb_writer *w, const void *data, size_t size)
+{
+	uint8_t *ptr;
+
+	if (w->compress) {
+		if (size > 0) {
+			TKVDB_EXEC( tkvdb_writer_frame_reserve(w, size,
+				&ptr) );
+			memcpy(ptr, data, size);
+		}
+		return TKVDB_OK;
+	}
+
+	if (((w->used + size) > w->limit) && (size >= w->limit)) {
+		/* block is bigger than buffer */
+		TKVDB_EXEC( tkvdb_writer_flush(w) );
+		if (!tkvdb_try_pwrite_file(w->fd, data, size, w->off)) {
+			return TKVDB_IO_ERROR;
+		}
+		w->off += size;
+		return TKVDB_OK;
+	}
+
+	/* copy by parts not bigger than TKVDB_WRITE_BUF_MIN */
+	while (size > 0) {
+		size_t part = (size > TKVDB_WRITE_BUF_MIN)
+			? TKVDB_WRITE_BUF_MIN : size;
+
+		TKVDB_EXEC( tkvdb_writer_reserve(w, part, &ptr) );
+		memcpy(ptr, data, part);
+		data = (const uint8_t *)data + part;
+		size -= part;
+	}
+
+	return TKVDB_OK;
+}
+
+/* compress collected nodes and append frame to write buffer */
+static TKVDB_RES
+tkvdb_writer_frame_end(struct tkvdb_writer *w)
+{
+	struct tkvdb_frame_header header;
+	size_t comp_size;
+
+	if (!w->compress || (w->frame_used == 0)) {
+		return TKVDB_OK;
+	}
+
+	/* frame is stored as is if it is not compressible */
+	if (w->comp_allocated < w->frame_used) {
+		uint8_t *tmp;
+
+		tmp = realloc(w->comp, w->frame_used);
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		w->comp = tmp;
+		w->comp_allocated = w->frame_used;
+	}
+	comp_size = tkvdb_lz_compress(w->frame, w->frame_used, w->comp,
+		w->frame_used - 1, w->lz_hash);
+
+	header.size = w->frame_used;
+	header.comp_size = comp_size ? comp_size : w->frame_used;
+
+	/* nodes are appended to frame, so buffer is written directly */
+	w->compress = 0;
+	TKVDB_EXEC( tkvdb_writer_put(w, &header, sizeof(header)) );
+	TKVDB_EXEC( tkvdb_writer_put(w, comp_size ? w->comp : w->frame,
+		header.comp_size) );
+	w->compress = 1;
+
+	w->frame_off = w->off + w->used;
+	w->frame_used = 0;
+
+	return TKVDB_OK;
+}
+
+/* start (or finish) collecting nodes to compressed frames, offsets of
+ * nodes returned by tkvdb_writer_pos() are offsets in frames */
+static TKVDB_RES
+tkvdb_writer_compress(struct tkvdb_writer *w, int on)
+{
+	if (!on) {
+		TKVDB_EXEC( tkvdb_writer_frame_end(w) );
+		w->compress = 0;
+		return TKVDB_OK;
+	}
+
+	if (!w->lz_hash) {
+		w->lz_hash = malloc(sizeof(uint32_t) << TKVDB_LZ_HASH_BITS);
+		if (!w->lz_hash) {
+			return TKVDB_ENOMEM;
+		}
+	}
+
+	w->compress = 1;
+	w->frame_off = w->off + w->used;
+	w->frame_used = 0;
+
+	return TKVDB_OK;
+}
+
+/* free space map
+ * each footer is preceded by array of free extents sorted by offset.
+ * Commit writes transaction to the smallest extent where it fits, the
+ * rest of extent stays free. Vacuum adds processed parts of file. Extents
+ * are split at position of vacuum, so transaction written between steps
+ * of vacuum is never partially before the next step */
+
+/* size of extents on disk */
+static size_t
+tkvdb_freemap_size(const struct tkvdb_freemap *fm)
+{
+	return fm->n * sizeof(struct tkvdb_extent);
+}
+
+/* CRC32C of free extents and footer (without crc field) */
+static uint32_t
+tkvdb_footer_crc(const struct tkvdb_tr_footer *footer,
+	const struct tkvdb_freemap *fm)
+{
+	struct tkvdb_tr_footer f = *footer;
+
+	f.crc = 0;
+	return tkvdb_crc32c(tkvdb_crc32c(0, fm->ext, tkvdb_freemap_size(fm)),
+		&f, TKVDB_TR_FTRSIZE);
+}
+
+/* read extents written before last footer */
+static TKVDB_RES
+tkvdb_freemap_read(int fd, const struct tkvdb_db_info *info,
+	struct tkvdb_freemap *fm)
+{
+	const struct tkvdb_extent *e;
+	uint64_t off;
+	size_t i;
+
+	fm->n = 0;
+	if ((info->filesize == 0) || (info->footer.nextents == 0)) {
+		return TKVDB_OK;
+	}
+
+	fm->n = info->footer.nextents;
+	off = info->filesize - TKVDB_TR_FTRSIZE - tkvdb_freemap_size(fm);
+	if ((lseek(fd, off, SEEK_SET) != (off_t)off)
+		|| !tkvdb_try_read_file(fd, fm->ext, tkvdb_freemap_size(fm),
+			0)) {
+
+		fm->n = 0;
+		return TKVDB_IO_ERROR;
+	}
+
+	/* extents are sorted and don't overlap */
+	for (i=0; i<fm->n; i++) {
+		e = &fm->ext[i];
+		if ((e->size == 0) || ((e->off + e->size) > off)
+			|| ((i > 0) && (e->off < (e[-1].off + e[-1].size)))) {
+
+			fm->n = 0;
+			return TKVDB_CORRUPTED;
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+/* index of the smallest extent bigger than 'size' or -1, extents which
+ * intersect with 'excl' (part of file freed by vacuum) are skipped */
+static int
+tkvdb_freemap_fit(const struct tkvdb_freemap *fm, uint64_t size,
+	const struct tkvdb_extent *excl)
+{
+	const struct tkvdb_extent *e;
+	size_t i;
+	int best = -1;
+
+	for (i=0; i<fm->n; i++) {
+		e = &fm->ext[i];
+		if (e->size <= size) {
+			continue;
+		}
+		if (excl && (e->off < (excl->off + excl->size))
+			&& ((e->off + e->size) > excl->off)) {
+
+			continue;
+		}
+		if ((best < 0) || (e->size < fm->ext[best].size)) {
+			best = (int)i;
+		}
+	}
+
+	return best;
+}
+
+static void
+tkvdb_freemap_remove(struct tkvdb_freemap *fm, size_t i)
+{
+	memmove(&fm->ext[i], &fm->ext[i + 1],
+		(fm->n - i - 1) * sizeof(struct tkvdb_extent));
+	fm->n--;
+}
+
+/* first 'size' bytes of extent 'i' are used */
+static void
+tkvdb_freemap_take(struct tkvdb_freemap *fm, size_t i, uint64_t size)
+{
+	fm->ext[i].off += size;
+	fm->ext[i].size -= size;
+	if (fm->ext[i].size == 0) {
+		tkvdb_freemap_remove(fm, i);
+	}
+}
+
+/* mark [off, off + size) as free, overlapping and adjacent extents are
+ * merged with it */
+static void
+tkvdb_freemap_add(struct tkvdb_freemap *fm, uint64_t off, uint64_t size)
+{
+	uint64_t end = off + size;
+	size_t i, j;
+
+	if (size == 0) {
+		return;
+	}
+
+	for (i=0; (i < fm->n) && ((fm->ext[i].off + fm->ext[i].size) < off);
+		i++);
+
+	for (j=i; (j < fm->n) && (fm->ext[j].off <= end); j++) {
+		if (fm->ext[j].off < off) {
+			off = fm->ext[j].off;
+		}
+		if ((fm->ext[j].off + fm->ext[j].size) > end) {
+			end = fm->ext[j].off + fm->ext[j].size;
+		}
+	}
+
+	/* extents [i, j) are replaced with one */
+	memmove(&fm->ext[i + 1], &fm->ext[j],
+		(fm->n - j) * sizeof(struct tkvdb_extent));
+	fm->n = fm->n + 1 - (j - i);
+
+	fm->ext[i].off = off;
+	fm->ext[i].size = end - off;
+}
+
+/* extent which contains 'pos' is split in two */
+static void
+tkvdb_freemap_split(struct tkvdb_freemap *fm, uint64_t pos)
+{
+	size_t i;
+
+	for (i=0; i<fm->n; i++) {
+		struct tkvdb_extent *e = &fm->ext[i];
+
+		if ((e->off < pos) && (pos < (e->off + e->size))) {
+			memmove(e + 1, e,
+				(fm->n - i) * sizeof(struct tkvdb_extent));
+			fm->n++;
+
+			e[1].off = pos;
+			e[1].size = e->off + e->size - pos;
+			e->size = pos - e->off;
+			break;
+		}
+	}
+}
+
+/* drop smallest extents until there are not more than 'max' of them */
+static void
+tkvdb_freemap_trim(struct tkvdb_freemap *fm, size_t max)
+{
+	size_t i, min;
+
+	while (fm->n > max) {
+		min = 0;
+		for (i=1; i<fm->n; i++) {
+			if (fm->ext[i].size < fm->ext[min].size) {
+				min = i;
+			}
+		}
+		tkvdb_freemap_remove(fm, min);
+	}
+}
+
+/* append free extents and footer */
+static TKVDB_RES
+tkvdb_writer_put_footer(struct tkvdb_writer *w,
+	struct tkvdb_tr_footer *footer, const struct tkvdb_freemap *fm)
+{
+	footer->nextents = (uint32_t)fm->n;
+	footer->crc = footer->checksum ? tkvdb_footer_crc(footer, fm) : 0;
+	TKVDB_EXEC( tkvdb_writer_put(w, fm->ext, tkvdb_freemap_size(fm)) );
+
+	return tkvdb_writer_put(w, footer, TKVDB_TR_FTRSIZE);
+}
+
+/* nodes cache */
+#define TKVDB_CACHE_MIN_BUCKETS 64
+
+static size_t
+tkvdb_cache_hash(const struct tkvdb_cache *c, uint64_t off)
+{
+	return (size_t)((off * 0x9E3779B97F4A7C15ULL) >> 32)
+		& (c->nbuckets - 1);
+}
+
+static void
+tkvdb_cache_init(struct tkvdb_cache *c, size_t limit)
+{
+	c->limit = limit;
+	c->used = 0;
+	c->buckets = NULL;
+	c->nbuckets = 0;
+	c->nnodes = 0;
+	c->hand = NULL;
+	c->hits = c->misses = 0;
+}
+
+/* remove node from hash and CLOCK ring */
+static void
+tkvdb_cache_remove(struct tkvdb_cache *c, struct tkvdb_cache_node *cn)
+{
+	struct tkvdb_cache_node **pp;
+
+	pp = &c->buckets[tkvdb_cache_hash(c, cn->off)];
+	while (*pp != cn) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = cn->hnext;
+
+	if (cn->next == cn) {
+		c->hand = NULL;
+	} else {
+		cn->prev->next = cn->next;
+		cn->next->prev = cn->prev;
+		if (c->hand == cn) {
+			c->hand = cn->next;
+		}
+	}
+
+	c->used -= sizeof(struct tkvdb_cache_node) + cn->size;
+	c->nnodes--;
+	free(cn);
+}
+
+static void
+tkvdb_cache_clear(struct tkvdb_cache *c)
+{
+	while (c->hand) {
+		tkvdb_cache_remove(c, c->hand);
+	}
+}
+
+static void
+tkvdb_cache_free(struct tkvdb_cache *c)
+{
+	tkvdb_cache_clear(c);
+	free(c->buckets);
+	c->buckets = NULL;
+	c->nbuckets = 0;
+}
+
+/* remove nodes in range [from, to) (e.g. after writing to free extent) */
+static void
+tkvdb_cache_invalidate(struct tkvdb_cache *c, uint64_t from, uint64_t to)
+{
+	struct tkvdb_cache_node *cn;
+	size_t n;
+
+	cn = c->hand;
+	for (n=c->nnodes; n>0; n--) {
+		struct tkvdb_cache_node *next = cn->next;
+
+		if ((cn->off >= from) && (cn->off < to)) {
+			tkvdb_cache_remove(c, cn);
+		}
+		cn = next;
+	}
+}
+
+/* get node from cache, NULL if there is no such node */
+static struct tkvdb_cache_node *
+tkvdb_cache_get(struct tkvdb_cache *c, uint64_t off)
+{
+	struct tkvdb_cache_node *cn;
+
+	if (c->limit == 0) {
+		return NULL;
+	}
+
+	if (c->nbuckets > 0) {
+		cn = c->buckets[tkvdb_cache_hash(c, off)];
+		for (; cn; cn = cn->hnext) {
+			if (cn->off == off) {
+				cn->ref = 1;
+				c->hits++;
+				return cn;
+			}
+		}
+	}
+
+	c->misses++;
+	return NULL;
+}
+
+/* double number of hash buckets */
+static void
+tkvdb_cache_rehash(struct tkvdb_cache *c)
+{
+	struct tkvdb_cache_node **old = c->buckets, **tmp, *cn;
+	size_t i, old_n = c->nbuckets;
+
+	c->nbuckets = old_n ? old_n * 2 : TKVDB_CACHE_MIN_BUCKETS;
+	tmp = calloc(c->nbuckets, sizeof(struct tkvdb_cache_node *));
+	if (!tmp) {
+		/* keep old table */
+		c->nbuckets = old_n;
+		return;
+	}
+	c->buckets = tmp;
+
+	for (i=0; i<old_n; i++) {
+		while (old[i]) {
+			size_t h;
+
+			cn = old[i];
+			old[i] = cn->hnext;
+
+			h = tkvdb_cache_hash(c, cn->off);
+			cn->hnext = c->buckets[h];
+			c->buckets[h] = cn;
+		}
+	}
+	free(old);
+}
+
+/* add node to cache, evict old nodes if needed
+ * failures are silently ignored, cache is only a hint */
+static void
+tkvdb_cache_put(struct tkvdb_cache *c, uint64_t off, const void *data,
+	size_t size)
+{
+	struct tkvdb_cache_node *cn;
+	size_t need = sizeof(struct tkvdb_cache_node) + size;
+	size_t h;
+
+	if (need > c->limit) {
+		return;
+	}
+
+	/* CLOCK eviction */
+	while ((c->used + need) > c->limit) {
+		cn = c->hand;
+		if (cn->ref) {
+			cn->ref = 0;
+			c->hand = cn->next;
+		} else {
+			tkvdb_cache_remove(c, cn);
+		}
+	}
+
+	if (c->nnodes >= c->nbuckets) {
+		tkvdb_cache_rehash(c);
+		if (c->nbuckets == 0) {
+			return;
+		}
+	}
+
+	cn = malloc(need);
+	if (!cn) {
+		return;
+	}
+
+	cn->off = off;
+	cn->size = size;
+	cn->ref = 0;
+	memcpy(cn->data, data, size);
+
+	h = tkvdb_cache_hash(c, off);
+	cn->hnext = c->buckets[h];
+	c->buckets[h] = cn;
+
+	/* insert behind the hand, so node will be checked last */
+	if (c->hand) {
+		cn->next = c->hand;
+		cn->prev = c->hand->prev;
+		c->hand->prev->next = cn;
+		c->hand->prev = cn;
+	} else {
+		cn->next = cn->prev = cn;
+		c->hand = cn;
+	}
+
+	c->used += need;
+	c->nnodes++;
+}
+
+/* map database file (or remap if file grew)
+ * mapping is bigger than file, so commits of this or other transactions
+ * don't need remapping every time
+ * failures are ignored, nodes will be read using read() */
+static void
+tkvdb_map_update(tkvdb *db)
+{
+#ifndef _WIN32
+	struct tkvdb_map *m;
+	uint64_t size;
+	void *addr;
+
+	if (!db->params.mmap || (db->info.filesize == 0)
+		|| db->info.footer.compression) {
+
+		/* nodes of compressed file are read from frames */
+		return;
+	}
+
+	if (db->map && (db->map->size >= db->info.filesize)) {
+		return;
+	}
+
+	for (size=TKVDB_MAP_MIN_SIZE; size<(db->info.filesize * 2); size*=2);
+	if (size > SIZE_MAX) {
+		return;
+	}
+
+	m = malloc(sizeof(struct tkvdb_map));
+	if (!m) {
+		return;
+	}
+
+	addr = mmap(NULL, size, PROT_READ, MAP_SHARED, db->fd, 0);
+	if (addr == MAP_FAILED) {
+		free(m);
+		return;
+	}
+
+	m->addr = addr;
+	m->size = size;
+	m->prev = db->map;
+	db->map = m;
+#else
+	(void)db;
+#endif
+}
+
+static void
+tkvdb_map_free(tkvdb *db)
+{
+	while (db->map) {
+		struct tkvdb_map *prev = db->map->prev;
+
+#ifndef _WIN32
+		munmap(db->map->addr, db->map->size);
+#endif
+		free(db->map);
+		db->map = prev;
+	}
+}
+
+/* get node from mapped file, NULL if node is not in mapping */
+static struct tkvdb_disknode *
+tkvdb_map_node(const tkvdb *db, uint64_t off)
+{
+	struct tkvdb_disknode *disknode;
+	uint64_t valid;
+
+	if (!db->map) {
+		return NULL;
+	}
+
+	/* don't touch pages after end of file */
+	valid = db->map->size;
+	if (valid > db->info.filesize) {
+		valid = db->info.filesize;
+	}
+
+	if ((off + sizeof(struct tkvdb_disknode)) > valid) {
+		return NULL;
+	}
+
+	disknode = (struct tkvdb_disknode *)(db->map->addr + off);
+	if ((off + disknode->size) > valid) {
+		return NULL;
+	}
+
+	return disknode;
+}
+
+/* bytes of CRC32C at the end of each node, checksums of new file are
+ * chosen by parameter */
+static size_t
+tkvdb_node_tail(const tkvdb *db)
+{
+	int checksum = (db->info.filesize > 0) ? db->info.footer.checksum
+		: db->params.checksum;
+
+	return checksum ? TKVDB_CRC_SIZE : 0;
+}
+
+/* check CRC32C of whole node in memory */
+static int
+tkvdb_node_crc_ok(const struct tkvdb_disknode *disknode)
+{
+	uint32_t crc;
+
+	if (disknode->size < (sizeof(struct tkvdb_disknode) - 1
+		+ TKVDB_CRC_SIZE)) {
+
+		return 0;
+	}
+	memcpy(&crc, (const uint8_t *)disknode + disknode->size
+		- TKVDB_CRC_SIZE, TKVDB_CRC_SIZE);
+
+	return tkvdb_crc32c(0, disknode, disknode->size - TKVDB_CRC_SIZE)
+		== crc;
+}
+
+/* search for the rest of key in mapped file starting from node at 'off'
+ * without loading nodes to transaction, value is returned as pointer into
+ * mapping
+ * returns 1 if key found, 0 if not and -1 if search can't be done in
+ * mapping (node outside of mapping or value is not aligned to 'align') */
+static int
+tkvdb_map_get(const tkvdb *db, uint64_t off, const unsigned char *sym,
+	const unsigned char *end, tkvdb_datum *val, size_t align)
+{
+	size_t tail = tkvdb_node_tail(db);
+
+	for (;;) {
+		struct tkvdb_disknode *disknode;
+		uint8_t *ptr, *prefix, *subnodes;
+		uint32_t val_size = 0, meta_size = 0;
+		uint64_t next;
+		size_t pi;
+
+		disknode = tkvdb_map_node(db, off);
+		if (!disknode) {
+			return -1;
+		}
+		if (tail && !tkvdb_node_crc_ok(disknode)) {
+			/* error is returned by usual read */
+			return -1;
+		}
+
+		ptr = disknode->data;
+		if (disknode->type & TKVDB_NODE_VAL) {
+			val_size = *((uint32_t *)ptr);
+			ptr += sizeof(uint32_t);
+		}
+		if (disknode->type & TKVDB_NODE_META) {
+			meta_size = *((uint32_t *)ptr);
+			ptr += sizeof(uint32_t);
+		}
+
+		subnodes = ptr;
+		/* prefix, value and metadata are at the end of node */
+		prefix = (uint8_t *)disknode + disknode->size - tail
+			- (disknode->prefix_size + val_size + meta_size);
+
+		/* compare prefix */
+		for (pi=0; pi<disknode->prefix_size; pi++) {
+			if ((sym >= end) || (prefix[pi] != *sym)) {
+				return 0;
+			}
+			sym++;
+		}
+
+		if (sym >= end) {
+			/* end of key */
+			if (!(disknode->type & TKVDB_NODE_VAL)) {
+				return 0;
+			}
+			val->data = prefix + disknode->prefix_size;
+			val->size = val_size;
+			if ((align > 1)
+				&& ((uintptr_t)val->data & (align - 1))) {
+
+				return -1;
+			}
+			return 1;
+		}
+
+		if (disknode->type & TKVDB_NODE_LEAF) {
+			return 0;
+		}
+
+		/* find subnode */
+		next = tkvdb_subnodes_find(subnodes, disknode->nsubnodes, off,
+			*sym);
+		if (next == 0) {
+			return 0;
+		}
+
+		off = next;
+		sym++;
+	}
+}
+
+/* nodes of database are in compressed frames, compression of new file is
+ * chosen by parameter */
+static int
+tkvdb_compressed(const tkvdb *db)
+{
+	if (db->info.filesize > 0) {
+		return db->info.footer.compression != TKVDB_COMPRESSION_NONE;
+	}
+	return db->params.compress;
+}
+
+/* file offset of node (or of its frame) */
+static uint64_t
+tkvdb_node_pos(const tkvdb *db, uint64_t off)
+{
+	return tkvdb_compressed(db) ? TKVDB_FRAME_POS(off) : off;
+}
+
+static TKVDB_RES
+tkvdb_frame_grow(uint8_t **buf, size_t *allocated, size_t size)
+{
+	uint8_t *tmp;
+
+	if (size <= *allocated) {
+		return TKVDB_OK;
+	}
+
+	tmp = realloc(*buf, size);
+	if (!tmp) {
+		return TKVDB_ENOMEM;
+	}
+	*buf = tmp;
+	*allocated = size;
+
+	return TKVDB_OK;
+}
+
+static void
+tkvdb_frames_reset(struct tkvdb_frames *fs)
+{
+	size_t i;
+
+	for (i=0; i<(fs->nsets * TKVDB_FRAME_WAYS); i++) {
+		fs->frames[i].off = 0;
+	}
+}
+
+static void
+tkvdb_frames_free(struct tkvdb_frames *fs)
+{
+	size_t i;
+
+	for (i=0; i<(fs->nsets * TKVDB_FRAME_WAYS); i++) {
+		free(fs->frames[i].data);
+	}
+	free(fs->frames);
+	free(fs->comp);
+}
+
+/* sets of frames for 'limit' bytes of decompressed frames (power of 2,
+ * at least one set) */
+static TKVDB_RES
+tkvdb_frames_init(struct tkvdb_frames *fs, size_t limit)
+{
+	size_t nsets = 1;
+
+	while ((nsets * 2 * TKVDB_FRAME_WAYS * TKVDB_FRAME_SIZE) <= limit) {
+		nsets *= 2;
+	}
+
+	fs->frames = calloc(nsets * TKVDB_FRAME_WAYS,
+		sizeof(struct tkvdb_frame));
+	if (!fs->frames) {
+		return TKVDB_ENOMEM;
+	}
+	fs->nsets = nsets;
+
+	return TKVDB_OK;
+}
+
+/* get node at 'off' from its frame, frame is read and decompressed only
+ * if it isn't one of recently used frames of its set */
+static TKVDB_RES
+tkvdb_frame_node(tkvdb *db, uint64_t off, struct tkvdb_disknode **disknode)
+{
+	struct tkvdb_frames *fs = &db->frames;
+	struct tkvdb_frame *f = NULL, *set;
+	struct tkvdb_frame_header header;
+	uint64_t frame_off = TKVDB_FRAME_POS(off);
+	size_t h, pos = off & (TKVDB_FRAME_SIZE - 1);
+	int i;
+
+	if (!fs->frames) {
+		TKVDB_EXEC( tkvdb_frames_init(fs, db->params.frame_cache) );
+	}
+
+	h = (size_t)((frame_off * 0x9E3779B97F4A7C15ULL) >> 32)
+		& (fs->nsets - 1);
+	set = &fs->frames[h * TKVDB_FRAME_WAYS];
+	for (i=0; i<TKVDB_FRAME_WAYS; i++) {
+		if (set[i].off == frame_off) {
+			f = &set[i];
+			break;
+		}
+		/* least recently used is replaced */
+		if (!f || (set[i].used < f->used)) {
+			f = &set[i];
+		}
+	}
+
+	if (f->off != frame_off) {
+		f->off = 0;
+
+		if (lseek(db->fd, frame_off, SEEK_SET) != (off_t)frame_off) {
+			return TKVDB_IO_ERROR;
+		}
+		if (!tkvdb_try_read_file(db->fd, &header, sizeof(header), 0)) {
+			return TKVDB_IO_ERROR;
+		}
+		if (header.comp_size > header.size) {
+			return TKVDB_CORRUPTED;
+		}
+
+		TKVDB_EXEC( tkvdb_frame_grow(&f->data, &f->allocated,
+			header.size) );
+		if (header.comp_size == header.size) {
+			if (!tkvdb_try_read_file(db->fd, f->data, header.size,
+				0)) {
+
+				return TKVDB_IO_ERROR;
+			}
+		} else {
+			TKVDB_EXEC( tkvdb_frame_grow(&fs->comp,
+				&fs->comp_allocated, header.comp_size) );
+			if (!tkvdb_try_read_file(db->fd, fs->comp,
+				header.comp_size, 0)) {
+
+				return TKVDB_IO_ERROR;
+			}
+			if (!tkvdb_lz_decompress(fs->comp, header.comp_size,
+				f->data, header.size)) {
+
+				return TKVDB_CORRUPTED;
+			}
+		}
+
+		f->size = header.size;
+		f->off = frame_off;
+	}
+	f->used = ++fs->tick;
+
+	if ((pos + sizeof(struct tkvdb_disknode) - 1) > f->size) {
+		return TKVDB_CORRUPTED;
+	}
+	*disknode = (struct tkvdb_disknode *)(f->data + pos);
+	if ((pos + (*disknode)->size) > f->size) {
+		return TKVDB_CORRUPTED;
+	}
+
+	return TKVDB_OK;
+}
+
+/* nodes in part of file [from, to) are overwritten or cut */
+static void
+tkvdb_invalidate(tkvdb *db, uint64_t from, uint64_t to)
+{
+	if (tkvdb_compressed(db)) {
+		from <<= TKVDB_FRAME_BITS;
+		to <<= TKVDB_FRAME_BITS;
+	}
+	tkvdb_cache_invalidate(&db->cache, from, to);
+	tkvdb_frames_reset(&db->frames);
+}
+
+/* arena for nodes, 'buf' is preallocated buffer (or NULL) */
+static void
+tkvdb_arena_init(struct tkvdb_arena *a, uint8_t *buf, size_t buf_size)
+{
+	memset(a, 0, sizeof(struct tkvdb_arena));
+
+	a->chunk_size = TKVDB_ARENA_CHUNK_MIN;
+	a->buf = buf;
+	a->buf_size = buf_size;
+	if (buf) {
+		a->ptr = (uint8_t *)(((uintptr_t)buf + TKVDB_ARENA_ALIGN - 1)
+			& -TKVDB_ARENA_ALIGN);
+		a->end = buf + buf_size;
+		if (a->ptr > a->end) {
+			a->ptr = a->end;
+		}
+		/* first block has reference 1, 0 is NULL */
+		a->base = (uintptr_t)a->ptr - TKVDB_ARENA_ALIGN;
+	}
+}
+
+/* size class of block, sets '*size' to size of block */
+static int
+tkvdb_arena_class(size_t *size)
+{
+	size_t p, step, k;
+	int c;
+
+	if (*size <= TKVDB_ARENA_SMALL) {
+		c = (int)((*size + TKVDB_ARENA_ALIGN - 1) / TKVDB_ARENA_ALIGN);
+		if (c == 0) {
+			c = 1;
+		}
+		*size = c * TKVDB_ARENA_ALIGN;
+		return c - 1;
+	}
+
+	if (*size > TKVDB_ARENA_BIG) {
+		*size = (*size + TKVDB_ARENA_ALIGN - 1) & -TKVDB_ARENA_ALIGN;
+		return TKVDB_ARENA_HUGE;
+	}
+
+	c = TKVDB_ARENA_SMALL / TKVDB_ARENA_ALIGN;
+	for (p=TKVDB_ARENA_SMALL; (p * 2) < *size; p*=2) {
+		c += 4;
+	}
+	step = p / 4;
+	k = (*size - p - 1) / step;
+	*size = p + (k + 1) * step;
+
+	return c + (int)k;
+}
+
+static size_t
+tkvdb_arena_class_size(int c)
+{
+	size_t p;
+
+	if (c < (TKVDB_ARENA_SMALL / TKVDB_ARENA_ALIGN)) {
+		return (c + 1) * TKVDB_ARENA_ALIGN;
+	}
+
+	c -= TKVDB_ARENA_SMALL / TKVDB_ARENA_ALIGN;
+	p = (size_t)TKVDB_ARENA_SMALL << (c / 4);
+	return p + (c % 4 + 1) * (p / 4);
+}
+
+/* put rest of current chunk to free lists */
+static void
+tkvdb_arena_spill(struct tkvdb_arena *a)
+{
+	struct tkvdb_arena_block *b;
+	size_t rest, size;
+	int c;
+
+	while ((size_t)(a->end - a->ptr) >= TKVDB_ARENA_ALIGN) {
+		rest = a->end - a->ptr;
+		size = rest;
+		c = tkvdb_arena_class(&size);
+		if ((c == TKVDB_ARENA_HUGE) || (size > rest)) {
+			/* biggest class that fits */
+			for (c=TKVDB_ARENA_CLASSES - 1;
+				tkvdb_arena_class_size(c) > rest; c--);
+			size = tkvdb_arena_class_size(c);
+		}
+
+		b = (struct tkvdb_arena_block *)a->ptr;
+		b->next = a->free[c];
+		a->free[c] = b;
+		a->ptr += size;
+	}
+}
+
+/* get chunk with at least 'size' bytes from system */
+static struct tkvdb_arena_chunk *
+tkvdb_arena_chunk_new(struct tkvdb_arena *a, size_t size)
+{
+	struct tkvdb_arena_chunk *chunk;
+	uint8_t *mem, *data;
+
+	mem = malloc(sizeof(struct tkvdb_arena_chunk) + TKVDB_ARENA_ALIGN - 1
+		+ size);
+	if (!mem) {
+		return NULL;
+	}
+
+	data = (uint8_t *)(((uintptr_t)mem + sizeof(struct tkvdb_arena_chunk)
+		+ TKVDB_ARENA_ALIGN - 1) & -TKVDB_ARENA_ALIGN);
+	chunk = (struct tkvdb_arena_chunk *)data - 1;
+	chunk->mem = mem;
+	chunk->size = size;
+
+	chunk->prev = NULL;
+	chunk->next = a->chunks;
+	if (a->chunks) {
+		a->chunks->prev = chunk;
+	}
+	a->chunks = chunk;
+
+	return chunk;
+}
+
+/* allocate block of at least '*size' bytes
+ * sets size class to '*aclass' and real size of block to '*size' */
+static void *
+tkvdb_arena_alloc(struct tkvdb_arena *a, size_t *size, uint8_t *aclass)
+{
+	struct tkvdb_arena_chunk *chunk;
+	struct tkvdb_arena_block *b;
+	size_t chunk_size;
+	void *p;
+	int c;
+
+	c = tkvdb_arena_class(size);
+	*aclass = (uint8_t)c;
+
+	if ((c != TKVDB_ARENA_HUGE) && a->free[c]) {
+		b = a->free[c];
+		a->free[c] = b->next;
+		return b;
+	}
+
+	if ((c == TKVDB_ARENA_HUGE) && !a->buf) {
+		/* always in chunk of its own, free() releases this chunk */
+		chunk = tkvdb_arena_chunk_new(a, *size);
+		return chunk ? (void *)(chunk + 1) : NULL;
+	}
+
+	if ((size_t)(a->end - a->ptr) < *size) {
+		if (a->buf) {
+			/* preallocated buffer is exhausted */
+			return NULL;
+		}
+
+		chunk_size = a->chunk_size;
+		chunk = tkvdb_arena_chunk_new(a, chunk_size);
+		if (!chunk) {
+			return NULL;
+		}
+		if (a->chunk_size < TKVDB_ARENA_CHUNK_MAX) {
+			a->chunk_size *= 2;
+		}
+
+		tkvdb_arena_spill(a);
+		a->ptr = (uint8_t *)(chunk + 1);
+		a->end = a->ptr + chunk_size;
+	}
+
+	p = a->ptr;
+	a->ptr += *size;
+
+	return p;
+}
+
+/* return block to arena, returns size of block that may be reused */
+static size_t
+tkvdb_arena_free(struct tkvdb_arena *a, void *p, int aclass)
+{
+	struct tkvdb_arena_chunk *chunk;
+	struct tkvdb_arena_block *b;
+	size_t size;
+
+	if (aclass != TKVDB_ARENA_HUGE) {
+		b = p;
+		b->next = a->free[aclass];
+		a->free[aclass] = b;
+		return tkvdb_arena_class_size(aclass);
+	}
+
+	if (a->buf) {
+		/* huge blocks of preallocated buffer are not reused */
+		return 0;
+	}
+
+	chunk = (struct tkvdb_arena_chunk *)p - 1;
+	if (chunk->prev) {
+		chunk->prev->next = chunk->next;
+	} else {
+		a->chunks = chunk->next;
+	}
+	if (chunk->next) {
+		chunk->next->prev = chunk->prev;
+	}
+
+	size = chunk->size;
+	free(chunk->mem);
+
+	return size;
+}
+
+/* release all blocks */
+static void
+tkvdb_arena_reset(struct tkvdb_arena *a)
+{
+	struct tkvdb_arena_chunk *next;
+
+	while (a->chunks) {
+		next = a->chunks->next;
+		free(a->chunks->mem);
+		a->chunks = next;
+	}
+
+	tkvdb_arena_init(a, a->buf, a->buf_size);
+}
+
+/* move all blocks of 'src' to 'dst', 'src' is empty after that */
+static void
+tkvdb_arena_move(struct tkvdb_arena *dst, struct tkvdb_arena *src)
+{
+	struct tkvdb_arena_chunk *last;
+	struct tkvdb_arena_block **pp;
+	int c;
+
+	if (src->chunks) {
+		for (last=src->chunks; last->next; last=last->next);
+		last->next = dst->chunks;
+		if (dst->chunks) {
+			dst->chunks->prev = last;
+		}
+		dst->chunks = src->chunks;
+	}
+
+	/* free space of source chunk is not lost */
+	tkvdb_arena_spill(src);
+	for (c=0; c<TKVDB_ARENA_CLASSES; c++) {
+		for (pp=&src->free[c]; *pp; pp=&(*pp)->next);
+		*pp = dst->free[c];
+		dst->free[c] = src->free[c];
+	}
+
+	tkvdb_arena_init(src, src->buf, src->buf_size);
+}
+
+/* 32-bit reference to block of preallocated buffer */
+static uint32_t
+tkvdb_arena_ptr_ref(const struct tkvdb_arena *a, const void *p)
+{
+	if (!p) {
+		return 0;
+	}
+	return (uint32_t)(((uintptr_t)p - a->base) >> TKVDB_ARENA_SHIFT);
+}
+
+static void *
+tkvdb_arena_ref_ptr(const struct tkvdb_arena *a, uint32_t ref)
+{
+	if (!ref) {
+		return NULL;
+	}
+	return (void *)(a->base + ((uintptr_t)ref << TKVDB_ARENA_SHIFT));
+}
+
+/* epoch-based reclamation */
+static struct tkvdb_ebr *
+tkvdb_ebr_create(size_t nreaders)
+{
+	struct tkvdb_ebr *ebr;
+
+	ebr = malloc(sizeof(struct tkvdb_ebr));
+	if (!ebr) {
+		return NULL;
+	}
+
+	ebr->readers = calloc(nreaders, sizeof(struct tkvdb_reader));
+	if (!ebr->readers) {
+		free(ebr);
+		return NULL;
+	}
+
+	ebr->nreaders = nreaders;
+	ebr->epoch = 1;
+	ebr->limbo = NULL;
+
+	return ebr;
+}
+
+/* try to advance global epoch, returns 0 if some reader is behind */
+static int
+tkvdb_ebr_try_advance(struct tkvdb_ebr *ebr)
+{
+	uint64_t epoch;
+	size_t i;
+
+	epoch = TKVDB_LOAD_SEQ(ebr->epoch);
+
+	for (i=0; i<ebr->nreaders; i++) {
+		uint64_t r = TKVDB_LOAD_SEQ(ebr->readers[i].epoch);
+
+		if ((r & TKVDB_EBR_ACTIVE) && ((r >> 1) != epoch)) {
+			return 0;
+		}
+	}
+
+	TKVDB_STORE_SEQ(ebr->epoch, epoch + 1);
+	return 1;
+}
+
+/* wait until all readers leave critical sections entered before call */
+static void
+tkvdb_ebr_synchronize(struct tkvdb_ebr *ebr)
+{
+	uint64_t target = TKVDB_LOAD_SEQ(ebr->epoch) + 2;
+
+	while (TKVDB_LOAD_SEQ(ebr->epoch) < target) {
+		tkvdb_ebr_try_advance(ebr);
+	}
+}
+
+/* add unlinked node to limbo list, returns 0 on allocation failure */
+static int
+tkvdb_ebr_retire(struct tkvdb_ebr *ebr, void *node, int subtree)
+{
+	struct tkvdb_ebr_node *en;
+
+	en = malloc(sizeof(struct tkvdb_ebr_node));
+	if (!en) {
+		return 0;
+	}
+
+	en->node = node;
+	en->subtree = subtree;
+	en->epoch = TKVDB_LOAD_SEQ(ebr->epoch);
+	en->next = ebr->limbo;
+	ebr->limbo = en;
+
+	return 1;
+}
+
+/* detach list of retired nodes that can be freed
+ * if 'all' is set all readers must be gone */
+static struct tkvdb_ebr_node *
+tkvdb_ebr_collect(struct tkvdb_ebr *ebr, int all)
+{
+	struct tkvdb_ebr_node **pp, *ready;
+	uint64_t epoch;
+
+	if (all) {
+		ready = ebr->limbo;
+		ebr->limbo = NULL;
+		return ready;
+	}
+
+	tkvdb_ebr_try_advance(ebr);
+	epoch = TKVDB_LOAD_SEQ(ebr->epoch);
+
+	/* list is sorted by epoch, newest first */
+	pp = &ebr->limbo;
+	while (*pp && (((*pp)->epoch + 2) > epoch)) {
+		pp = &(*pp)->next;
+	}
+	ready = *pp;
+	*pp = NULL;
+
+	return ready;
+}
+
+static void
+tkvdb_ebr_free(struct tkvdb_ebr *ebr)
+{
+	free(ebr->readers);
+	free(ebr);
+}
+
+/* optimistic locks */
+static unsigned int
+tkvdb_olc_read(unsigned int *version)
+{
+	unsigned int v;
+
+	/* wait while node is locked */
+	for (;;) {
+		v = TKVDB_LOAD_ACQ(*version);
+		if (!(v & TKVDB_OLC_LOCKED)) {
+			return v;
+		}
+	}
+}
+
+/* check that node was not changed since tkvdb_olc_read() */
+static int
+tkvdb_olc_check(unsigned int *version, unsigned int v)
+{
+	TKVDB_FENCE_ACQ();
+	return TKVDB_LOAD_ACQ(*version) == v;
+}
+
+/* lock node if it wasn't changed since tkvdb_olc_read() */
+static int
+tkvdb_olc_lock(unsigned int *version, unsigned int v)
+{
+	return TKVDB_CAS(*version, v, v + TKVDB_OLC_LOCKED);
+}
+
+/* unlock and increment counter */
+static void
+tkvdb_olc_unlock(unsigned int *version, int obsolete)
+{
+	unsigned int v = TKVDB_LOAD_ACQ(*version) + TKVDB_OLC_LOCKED;
+
+	if (obsolete) {
+		v |= TKVDB_OLC_OBSOLETE;
+	}
+	TKVDB_STORE_REL(*version, v);
+}
+
+/* save node deleted by one of concurrent writers
+ * node is leaked if there is no memory for list item */
+static void
+tkvdb_retire_concurrent(struct tkvdb_ebr_node **list, void *node)
+{
+	struct tkvdb_ebr_node *en;
+
+	en = malloc(sizeof(struct tkvdb_ebr_node));
+	if (!en) {
+		return;
+	}
+
+	en->node = node;
+	en->subtree = 1;
+	en->epoch = 0;
+	en->next = TKVDB_LOAD_ACQ(*list);
+	while (!TKVDB_CAS(*list, en->next, en)) {
+		/* en->next is updated by failed CAS */
+	}
+}
+
+tkvdb_reader *
+tkvdb_reader_create(tkvdb_tr *trns)
+{
+	tkvdb_tr_data *tr = trns->data;
+	size_t i;
+
+	if (!tr->ebr) {
+		return NULL;
+	}
+
+	for (i=0; i<tr->ebr->nreaders; i++) {
+		int expected = 0;
+
+		if (TKVDB_CAS(tr->ebr->readers[i].used, expected, 1)) {
+			return &tr->ebr->readers[i];
+		}
+	}
+
+	return NULL;
+}
+
+void
+tkvdb_reader_enter(tkvdb_reader *r, tkvdb_tr *trns)
+{
+	tkvdb_tr_data *tr = trns->data;
+	uint64_t epoch;
+
+	epoch = TKVDB_LOAD_SEQ(tr->ebr->epoch);
+	TKVDB_STORE_SEQ(r->epoch, (epoch << 1) | TKVDB_EBR_ACTIVE);
+}
+
+void
+tkvdb_reader_leave(tkvdb_reader *r)
+{
+	TKVDB_STORE_REL(r->epoch, 0);
+}
+
+void
+tkvdb_reader_free(tkvdb_reader *r)
+{
+	TKVDB_STORE_REL(r->epoch, 0);
+	TKVDB_STORE_REL(r->used, 0);
+}
+
+
+/* durability */
+static uint64_t
+tkvdb_time_ms(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	return (uint64_t)time(NULL) * 1000;
+#endif
+}
+
+/* flush file data (and size) to disk */
+static TKVDB_RES
+tkvdb_datasync(int fd)
+{
+#if defined(_WIN32)
+	if (_commit(fd) < 0) {
+#elif defined(__linux__)
+	if (fdatasync(fd) < 0) {
+#else
+	if (fsync(fd) < 0) {
+#endif
+		return TKVDB_IO_ERROR;
+	}
+
+	return TKVDB_OK;
+}
+
+#ifdef TKVDB_COMMIT_THREADS
+/* find group of handles of the same file (or create new one) */
+static void
+tkvdb_group_join(tkvdb *db)
+{
+	struct tkvdb_group *g;
+	struct stat st;
+
+	db->group = NULL;
+	if ((db->params.durability == TKVDB_DURABILITY_NONE)
+		&& (db->wal_fd < 0)) {
+
+		/* nothing to share */
+		return;
+	}
+	if (fstat(db->fd, &st) != 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&tkvdb_groups_mtx);
+	for (g=tkvdb_groups; g; g=g->next) {
+		if ((g->dev == st.st_dev) && (g->ino == st.st_ino)) {
+			break;
+		}
+	}
+	if (!g) {
+		g = malloc(sizeof(struct tkvdb_group));
+		if (!g) {
+			goto done;
+		}
+		memset(g, 0, sizeof(struct tkvdb_group));
+		if (pthread_mutex_init(&g->mtx, NULL) != 0) {
+			free(g);
+			goto done;
+		}
+		if (pthread_cond_init(&g->cond, NULL) != 0) {
+			pthread_mutex_destroy(&g->mtx);
+			free(g);
+			goto done;
+		}
+		g->dev = st.st_dev;
+		g->ino = st.st_ino;
+		g->next = tkvdb_groups;
+		tkvdb_groups = g;
+	}
+	g->refs++;
+	db->group = g;
+
+done:
+	pthread_mutex_unlock(&tkvdb_groups_mtx);
+}
+
+static void
+tkvdb_group_leave(tkvdb *db)
+{
+	struct tkvdb_group **pg, *g = db->group;
+
+	if (!g) {
+		return;
+	}
+
+	pthread_mutex_lock(&tkvdb_groups_mtx);
+	g->refs--;
+	if (g->refs == 0) {
+		for (pg=&tkvdb_groups; *pg != g; pg=&((*pg)->next))
+			;
+		*pg = g->next;
+		pthread_cond_destroy(&g->cond);
+		pthread_mutex_destroy(&g->mtx);
+		free(g);
+	}
+	pthread_mutex_unlock(&tkvdb_groups_mtx);
+
+	db->group = NULL;
+}
+#endif
+
+#ifdef TKVDB_COMMIT_THREADS
+/* handles of one file in process share fdatasync(): sync in progress may
+ * be started before data of caller was written, so caller waits for it
+ * and then starts the next one, which is shared by all commits that came
+ * during previous sync. Group of commits of many threads costs one sync
+ * and only one thread calls it */
+static TKVDB_RES
+tkvdb_group_fdsync(struct tkvdb_group *g, struct tkvdb_group_sync *s,
+	int fd)
+{
+	uint64_t target, gen;
+	TKVDB_RES r;
+
+	pthread_mutex_lock(&g->mtx);
+	target = s->started + 1;
+	while (s->done < target) {
+		if (s->started > s->done) {
+			/* wait for sync of other handle */
+			pthread_cond_wait(&g->cond, &g->mtx);
+			continue;
+		}
+
+		gen = ++s->started;
+		pthread_mutex_unlock(&g->mtx);
+		r = tkvdb_datasync(fd);
+		pthread_mutex_lock(&g->mtx);
+
+		s->done = gen;
+		if (r != TKVDB_OK) {
+			s->failed = gen;
+		}
+		pthread_cond_broadcast(&g->cond);
+	}
+	r = (s->failed >= target) ? TKVDB_IO_ERROR : TKVDB_OK;
+	pthread_mutex_unlock(&g->mtx);
+
+	return r;
+}
+#endif
+
+/* make data written to database file before the call durable */
+static TKVDB_RES
+tkvdb_group_sync(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	if (db->group) {
+		return tkvdb_group_fdsync(db->group, &db->group->file, db->fd);
+	}
+#endif
+	return tkvdb_datasync(db->fd);
+}
+
+/* and to log */
+static TKVDB_RES
+tkvdb_group_sync_log(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	if (db->group) {
+		return tkvdb_group_fdsync(db->group, &db->group->log,
+			db->wal_fd);
+	}
+#endif
+	return tkvdb_datasync(db->wal_fd);
+}
+
+/* database file and write-ahead log */
+static TKVDB_RES
+tkvdb_datasync_all(tkvdb *db)
+{
+	TKVDB_EXEC( tkvdb_group_sync(db) );
+	if (db->wal_fd >= 0) {
+		TKVDB_EXEC( tkvdb_group_sync_log(db) );
+	}
+
+	return TKVDB_OK;
+}
+
+static void
+tkvdb_syncer_lock(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	if (db->syncer.started) {
+		pthread_mutex_lock(&db->syncer.mtx);
+	}
+#else
+	(void)db;
+#endif
+}
+
+static void
+tkvdb_syncer_unlock(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	if (db->syncer.started) {
+		pthread_mutex_unlock(&db->syncer.mtx);
+	}
+#else
+	(void)db;
+#endif
+}
+
+#ifdef TKVDB_COMMIT_THREADS
+static void *
+tkvdb_syncer_thread(void *arg)
+{
+	tkvdb *db = arg;
+	struct tkvdb_syncer *s = &db->syncer;
+	uint64_t interval, unsynced, end, gen;
+	struct timespec ts;
+
+	interval = db->params.sync_interval ? db->params.sync_interval : 1;
+
+	pthread_mutex_lock(&s->mtx);
+	while (!s->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&s->cond, &s->mtx, &ts);
+
+		if ((s->unsynced == 0)
+			|| ((tkvdb_time_ms() - s->since) < interval)) {
+
+			/* group is synced by next commit */
+			continue;
+		}
+		unsynced = s->unsynced;
+		end = s->written_end;
+		gen = s->written_gen;
+		s->unsynced = 0;
+		s->file_dirty = 0;
+
+		pthread_mutex_unlock(&s->mtx);
+		if (tkvdb_datasync_all(db) != TKVDB_OK) {
+			/* tkvdb_close() will try again and report error */
+			pthread_mutex_lock(&s->mtx);
+			s->unsynced += unsynced;
+			s->file_dirty = 1;
+			continue;
+		}
+		pthread_mutex_lock(&s->mtx);
+		s->synced_end = end;
+		s->synced_gen = gen;
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	return NULL;
+}
+#endif
+
+static void
+tkvdb_syncer_start(tkvdb *db)
+{
+	memset(&db->syncer, 0, sizeof(struct tkvdb_syncer));
+
+#ifdef TKVDB_COMMIT_THREADS
+	if ((db->params.durability != TKVDB_DURABILITY_PERIODIC)
+		&& (db->params.durability != TKVDB_DURABILITY_GROUP)) {
+
+		return;
+	}
+
+	/* without thread commits are synced by time like group commits and
+	 * the last group is synced only by next commit */
+	if (pthread_mutex_init(&db->syncer.mtx, NULL) != 0) {
+		return;
+	}
+	if (pthread_cond_init(&db->syncer.cond, NULL) != 0) {
+		pthread_mutex_destroy(&db->syncer.mtx);
+		return;
+	}
+	if (pthread_create(&db->syncer.thread, NULL, &tkvdb_syncer_thread,
+		db) != 0) {
+
+		pthread_cond_destroy(&db->syncer.cond);
+		pthread_mutex_destroy(&db->syncer.mtx);
+		return;
+	}
+	db->syncer.started = 1;
+#endif
+}
+
+static void
+tkvdb_syncer_stop(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	if (!db->syncer.started) {
+		return;
+	}
+
+	pthread_mutex_lock(&db->syncer.mtx);
+	db->syncer.stop = 1;
+	pthread_cond_signal(&db->syncer.cond);
+	pthread_mutex_unlock(&db->syncer.mtx);
+
+	pthread_join(db->syncer.thread, NULL);
+	pthread_cond_destroy(&db->syncer.cond);
+	pthread_mutex_destroy(&db->syncer.mtx);
+	db->syncer.started = 0;
+#else
+	(void)db;
+#endif
+}
+
+/* commits of group and periodic modes are not synced one by one */
+static int
+tkvdb_syncer_window(const tkvdb *db)
+{
+	return (db->params.durability == TKVDB_DURABILITY_GROUP)
+		|| (db->params.durability == TKVDB_DURABILITY_PERIODIC);
+}
+
+/* nodes of commit are synced before its footer in commit mode, and in
+ * group and periodic modes when commit overwrites free space. Appended
+ * commits of window are checked by CRC of tail instead, see
+ * tkvdb_syncer_tail() */
+static int
+tkvdb_syncer_barrier(const tkvdb *db, int append)
+{
+	switch (db->params.durability) {
+		case TKVDB_DURABILITY_NONE:
+			return 0;
+		case TKVDB_DURABILITY_COMMIT:
+			return 1;
+		default:
+			return !append;
+	}
+}
+
+/* account 'size' bytes written by commit to database file ('file') or to
+ * log, returns 1 if file should be synced after footer of this commit */
+static int
+tkvdb_syncer_add(tkvdb *db, uint64_t size, int file)
+{
+	struct tkvdb_syncer *s = &db->syncer;
+	uint64_t now;
+	int dosync;
+
+	switch (db->params.durability) {
+		case TKVDB_DURABILITY_NONE:
+			return 0;
+		case TKVDB_DURABILITY_COMMIT:
+			return 1;
+		default:
+			break;
+	}
+
+	tkvdb_syncer_lock(db);
+	now = tkvdb_time_ms();
+	if (s->unsynced == 0) {
+		s->since = now;
+	}
+	s->unsynced += size;
+	s->file_dirty |= file;
+
+	if (db->params.durability == TKVDB_DURABILITY_GROUP) {
+		dosync = ((now - s->since) >= db->params.sync_interval)
+			|| (s->unsynced >= db->params.sync_bytes);
+	} else {
+		dosync = (now - s->since) >= db->params.sync_interval;
+	}
+#ifdef TKVDB_COMMIT_THREADS
+	if (s->started
+		&& (db->params.durability == TKVDB_DURABILITY_PERIODIC)) {
+
+		/* in background */
+		dosync = 0;
+	}
+#endif
+	tkvdb_syncer_unlock(db);
+
+	return dosync;
+}
+
+/* footers of transactions before 'id' are on disk */
+static void
+tkvdb_syncer_durable(tkvdb *db, uint64_t id)
+{
+	if (id > db->syncer.durable_id) {
+		db->syncer.durable_id = id;
+	}
+}
+
+/* the last footer written by handle, it's on disk after next sync */
+static void
+tkvdb_syncer_written(tkvdb *db, uint64_t *end, uint64_t *gen)
+{
+	tkvdb_syncer_lock(db);
+	*end = db->syncer.written_end;
+	*gen = db->syncer.written_gen;
+	tkvdb_syncer_unlock(db);
+}
+
+/* file was synced, all commits written before 'end' are durable */
+static void
+tkvdb_syncer_reset(tkvdb *db, uint64_t end, uint64_t gen)
+{
+	tkvdb_syncer_lock(db);
+	db->syncer.unsynced = 0;
+	db->syncer.file_dirty = 0;
+	db->syncer.synced_end = end;
+	db->syncer.synced_gen = gen;
+	tkvdb_syncer_unlock(db);
+}
+
+static TKVDB_RES
+tkvdb_syncer_sync(tkvdb *db)
+{
+	uint64_t end, gen;
+
+	tkvdb_syncer_written(db, &end, &gen);
+	TKVDB_EXEC( tkvdb_datasync_all(db) );
+	tkvdb_syncer_reset(db, end, gen);
+
+	return TKVDB_OK;
+}
+
+/* commit to free space overwrites nodes of older footers, so footer which
+ * freed this space ('oldest_id' of the last footer) must be on disk */
+static TKVDB_RES
+tkvdb_syncer_reuse(tkvdb *db, const struct tkvdb_tr_footer *last)
+{
+	if ((db->params.durability == TKVDB_DURABILITY_NONE)
+		|| (last->oldest_id < db->syncer.durable_id)) {
+
+		return TKVDB_OK;
+	}
+
+	TKVDB_EXEC( tkvdb_syncer_sync(db) );
+	tkvdb_syncer_durable(db, last->transaction_id + 1);
+
+	return TKVDB_OK;
+}
+
+/* CRC32C of file between 'off' and 'end' appended to 'crc' */
+static TKVDB_RES
+tkvdb_file_crc(int fd, uint64_t off, uint64_t end, uint32_t *crc)
+{
+	uint8_t *buf;
+	size_t size;
+	TKVDB_RES r = TKVDB_OK;
+
+	if (off >= end) {
+		return TKVDB_OK;
+	}
+
+	size = ((end - off) > TKVDB_VERIFY_READ) ? TKVDB_VERIFY_READ
+		: (size_t)(end - off);
+	buf = malloc(size);
+	if (!buf) {
+		return TKVDB_ENOMEM;
+	}
+	if (lseek(fd, off, SEEK_SET) != (off_t)off) {
+		r = TKVDB_IO_ERROR;
+		goto done;
+	}
+	while (off < end) {
+		size = ((end - off) > TKVDB_VERIFY_READ) ? TKVDB_VERIFY_READ
+			: (size_t)(end - off);
+		if (!tkvdb_try_read_file(fd, buf, size, 0)) {
+			r = TKVDB_IO_ERROR;
+			goto done;
+		}
+		*crc = tkvdb_crc32c(*crc, buf, size);
+		off += size;
+	}
+
+done:
+	free(buf);
+	return r;
+}
+
+/* fill 'synced_off' and 'tail_crc' of footer which is written after free
+ * extents 'fm' at 'nodes_end', 'prev' is the last footer of file.
+ * Commits of window are written without syncs, so after crash footer may
+ * be on disk while nodes of it (or of commits before it) are not. Footer
+ * keeps CRC32C of file after the last sync that handle knows about, open
+ * checks it and recovery goes back to older footer. 'ordered' - file
+ * before 'nodes_end' was synced or durability isn't required, only free
+ * extents are checked then */
+static TKVDB_RES
+tkvdb_syncer_tail(tkvdb *db, struct tkvdb_tr_footer *footer,
+	const struct tkvdb_freemap *fm, const struct tkvdb_db_info *prev,
+	uint64_t nodes_end, int ordered)
+{
+	struct tkvdb_syncer *s = &db->syncer;
+	uint64_t off = nodes_end, pos;
+	uint32_t crc = 0;
+
+	if (!ordered) {
+		off = (prev->filesize > 0) ? prev->footer.synced_off : 0;
+
+		/* sync of handle after the last footer, valid while free
+		 * space of file wasn't reused */
+		tkvdb_syncer_lock(db);
+		if ((s->synced_gen == prev->footer.free_gen)
+			&& (s->synced_end > off)
+			&& (s->synced_end <= (uint64_t)prev->filesize)) {
+
+			off = s->synced_end;
+		}
+		tkvdb_syncer_unlock(db);
+		if (off > nodes_end) {
+			off = nodes_end;
+		}
+	}
+
+	/* CRC of previous commits of window is continued */
+	pos = off;
+	if ((s->tail_off == off) && (s->tail_end >= off)
+		&& (s->tail_end <= nodes_end)) {
+
+		crc = s->tail_crc;
+		pos = s->tail_end;
+	}
+	TKVDB_EXEC( tkvdb_file_crc(db->fd, pos, nodes_end, &crc) );
+	s->tail_off = off;
+	s->tail_end = nodes_end;
+	s->tail_crc = crc;
+
+	footer->synced_off = off;
+	footer->tail_crc = tkvdb_crc32c(crc, fm->ext, tkvdb_freemap_size(fm));
+
+	tkvdb_syncer_lock(db);
+	s->written_end = nodes_end + tkvdb_freemap_size(fm) + TKVDB_TR_FTRSIZE;
+	s->written_gen = footer->free_gen;
+	tkvdb_syncer_unlock(db);
+
+	return TKVDB_OK;
+}
+
+/* open write-ahead log '<path>-wal' */
+static TKVDB_RES
+tkvdb_wal_open(tkvdb *db, const char *path)
+{
+	char *wal_path;
+
+	wal_path = malloc(strlen(path) + sizeof("-wal"));
+	if (!wal_path) {
+		return TKVDB_ENOMEM;
+	}
+	sprintf(wal_path, "%s-wal", path);
+
+	db->wal_fd = open(wal_path, db->params.flags, db->params.mode);
+	free(wal_path);
+	if (db->wal_fd < 0) {
+		/* database opened without O_CREAT, log is not created */
+		return (errno == ENOENT) ? TKVDB_OK : TKVDB_IO_ERROR;
+	}
+
+	return TKVDB_OK;
+}
+
+/* log is appended, truncated or scanned by one handle at a time */
+static void
+tkvdb_wal_lock(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	struct tkvdb_group *g = db->group;
+
+	if (g) {
+		pthread_mutex_lock(&g->mtx);
+		while (g->writing) {
+			pthread_cond_wait(&g->cond, &g->mtx);
+		}
+		g->writing = 1;
+		pthread_mutex_unlock(&g->mtx);
+	}
+#else
+	(void)db;
+#endif
+}
+
+static void
+tkvdb_wal_unlock(tkvdb *db)
+{
+#ifdef TKVDB_COMMIT_THREADS
+	struct tkvdb_group *g = db->group;
+
+	if (g) {
+		pthread_mutex_lock(&g->mtx);
+		g->writing = 0;
+		pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->mtx);
+	}
+#else
+	(void)db;
+#endif
+}
+
+/* drop write-ahead log after its records are merged into database file,
+ * caller holds log lock */
+static TKVDB_RES
+tkvdb_wal_reset(tkvdb *db)
+{
+	if (db->wal_fd < 0) {
+		return TKVDB_OK;
+	}
+
+	if (db->params.durability != TKVDB_DURABILITY_NONE) {
+		/* merged records must be on disk before log is truncated */
+		TKVDB_EXEC( tkvdb_group_sync(db) );
+	}
+	if (ftruncate(db->wal_fd, 0) != 0) {
+		return TKVDB_IO_ERROR;
+	}
+
+	return TKVDB_OK;
+}
+
+/* control page
+ * writer makes counter odd, updates page and makes counter even again.
+ * Reader copies page between two loads of the same even counter, if it
+ * wasn't changed since last read, copy is not needed. Counter is
+ * incremented from any value, so writer which crashed in the middle of
+ * update doesn't block others */
+static void
+tkvdb_ctl_publish(tkvdb *db, const struct tkvdb_db_info *info)
+{
+	struct tkvdb_ctl *ctl = db->ctl;
+	uint64_t seq;
+
+	if (!ctl) {
+		return;
+	}
+
+	seq = TKVDB_LOAD_ACQ(ctl->seq) | 1;
+	TKVDB_STORE_REL(ctl->seq, seq);
+	TKVDB_FENCE_REL();
+
+	ctl->info = *info;
+	TKVDB_STORE_REL(ctl->seq, seq + 1);
+}
+
+/* database info from control page (or from file) */
+static TKVDB_RES
+tkvdb_info_get(tkvdb *db, struct tkvdb_db_info *info)
+{
+	struct tkvdb_ctl *ctl = db->ctl;
+	uint64_t seq;
+	int i;
+
+	if (!ctl) {
+		return tkvdb_info_read(db->fd, info);
+	}
+
+	for (i=0; i<TKVDB_CTL_RETRIES; i++) {
+		seq = TKVDB_LOAD_ACQ(ctl->seq);
+		if (seq & 1) {
+			continue;
+		}
+		if (seq == db->ctl_seq) {
+			/* nothing was committed since last read */
+			*info = db->ctl_info;
+			return TKVDB_OK;
+		}
+
+		*info = ctl->info;
+		TKVDB_FENCE_ACQ();
+		if (TKVDB_LOAD_ACQ(ctl->seq) == seq) {
+			db->ctl_seq = seq;
+			db->ctl_info = *info;
+			return TKVDB_OK;
+		}
+	}
+
+	return tkvdb_info_read(db->fd, info);
+}
+
+/* publish footer written by this handle, its free extents are kept in
+ * db->freemap */
+static void
+tkvdb_ctl_commit(tkvdb *db, const struct tkvdb_db_info *info)
+{
+	if (!db->ctl) {
+		return;
+	}
+
+	tkvdb_ctl_publish(db, info);
+	db->ctl_seq = db->ctl_own = TKVDB_LOAD_ACQ(db->ctl->seq);
+	db->ctl_info = *info;
+	db->freemap_own = 1;
+}
+
+/* nothing was published since own commit */
+static int
+tkvdb_ctl_own(tkvdb *db)
+{
+	return db->ctl && (TKVDB_LOAD_ACQ(db->ctl->seq) == db->ctl_own);
+}
+
+/* writer checks page against file, it may be stale if other handle
+ * didn't update it. Page with own last commit is trusted */
+static TKVDB_RES
+tkvdb_ctl_check(tkvdb *db, const struct tkvdb_db_info *info)
+{
+	struct tkvdb_db_info finfo;
+
+	if (!db->ctl || tkvdb_ctl_own(db)) {
+		return TKVDB_OK;
+	}
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &finfo) );
+	if ((finfo.filesize != info->filesize)
+		|| ((finfo.filesize > 0) && (memcmp(&finfo.footer,
+			&info->footer, TKVDB_TR_FTRSIZE) != 0))) {
+
+		tkvdb_ctl_publish(db, &finfo);
+		return TKVDB_MODIFIED;
+	}
+
+	return TKVDB_OK;
+}
+
+/* free extents of the last footer to db->freemap, extents of own commit
+ * are not read again */
+static TKVDB_RES
+tkvdb_freemap_load(tkvdb *db, const struct tkvdb_db_info *info)
+{
+	if (db->freemap_own && tkvdb_ctl_own(db)) {
+		return TKVDB_OK;
+	}
+	db->freemap_own = 0;
+
+	return tkvdb_freemap_read(db->fd, info, &db->freemap);
+}
+
+/* map control page '<path>-ctl', page is filled from file if it's new or
+ * doesn't match file */
+static TKVDB_RES
+tkvdb_ctl_open(tkvdb *db, const char *path)
+{
+#ifndef _WIN32
+	char *ctl_path;
+	struct stat st;
+	void *addr;
+
+	ctl_path = malloc(strlen(path) + sizeof("-ctl"));
+	if (!ctl_path) {
+		return TKVDB_ENOMEM;
+	}
+	sprintf(ctl_path, "%s-ctl", path);
+
+	db->ctl_fd = open(ctl_path, db->params.flags, db->params.mode);
+	free(ctl_path);
+	if (db->ctl_fd < 0) {
+		/* database opened without O_CREAT, page is not used */
+		return (errno == ENOENT) ? TKVDB_OK : TKVDB_IO_ERROR;
+	}
+
+	if (fstat(db->ctl_fd, &st) != 0) {
+		return TKVDB_IO_ERROR;
+	}
+	if (((size_t)st.st_size < sizeof(struct tkvdb_ctl))
+		&& (ftruncate(db->ctl_fd, sizeof(struct tkvdb_ctl)) != 0)) {
+
+		return TKVDB_IO_ERROR;
+	}
+
+	addr = mmap(NULL, sizeof(struct tkvdb_ctl), PROT_READ | PROT_WRITE,
+		MAP_SHARED, db->ctl_fd, 0);
+	if (addr == MAP_FAILED) {
+		return TKVDB_IO_ERROR;
+	}
+	db->ctl = addr;
+
+	if (memcmp(db->ctl->signature, TKVDB_CTL_SIGNATURE,
+		sizeof(TKVDB_CTL_SIGNATURE) - 1) != 0) {
+
+		tkvdb_ctl_publish(db, &db->info);
+		memcpy(db->ctl->signature, TKVDB_CTL_SIGNATURE,
+			sizeof(TKVDB_CTL_SIGNATURE) - 1);
+	} else {
+		struct tkvdb_db_info info;
+		TKVDB_RES r;
+
+		TKVDB_EXEC( tkvdb_info_get(db, &info) );
+		r = tkvdb_ctl_check(db, &info);
+		if ((r != TKVDB_OK) && (r != TKVDB_MODIFIED)) {
+			return r;
+		}
+	}
+#else
+	(void)db;
+	(void)path;
+#endif
+	return TKVDB_OK;
+}
+
+static void
+tkvdb_ctl_close(tkvdb *db)
+{
+#ifndef _WIN32
+	if (db->ctl) {
+		munmap(db->ctl, sizeof(struct tkvdb_ctl));
+		db->ctl = NULL;
+	}
+#endif
+	if (db->ctl_fd >= 0) {
+		close(db->ctl_fd);
+		db->ctl_fd = -1;
+	}
+}
+
+/* fill tkvdb_params with default values */
+void
+tkvdb_params_init(tkvdb_params *params)
+{
+	params->write_buf_dynalloc = 1;
+	params->write_buf_limit = TKVDB_WRITE_BUF_SIZE;
+
+	params->tr_buf_dynalloc = 1;
+	params->tr_buf_limit = SIZE_MAX;
+
+	params->stack_dynalloc = 1;
+	params->stack_limit = SIZE_MAX / sizeof(struct tkvdb_visit_helper);
+
+	params->key_dynalloc = 1;
+	params->key_limit = SIZE_MAX;
+
+	params->mode = S_IRUSR | S_IWUSR;
+#ifndef _WIN32
+	params->flags = O_RDWR | O_CREAT;
+#else
+	params->flags = O_RDWR | O_CREAT | O_BINARY;
+#endif
+
+	params->alignval = 0;
+
+	params->autobegin = 0;
+
+	params->cache_limit = 0;
+	params->mmap = 0;
+
+	params->readers = 0;
+	params->tr_concurrent = 0;
+
+	params->commit_threads = 1;
+
+	params->durability = TKVDB_DURABILITY_NONE;
+	params->sync_interval = 100;
+	params->sync_bytes = 16 * 1024 * 1024;
+
+	params->wal_limit = 0;
+
+	params->compress = 0;
+
+	params->control = 0;
+
+	params->checksum = 0;
+
+	params->frame_cache = TKVDB_FRAME_CACHE;
+}
+
+/* check footer (in 'info') of file with size 'info->filesize', root
+ * node must be inside of data and checksums must match */
+static TKVDB_RES
+tkvdb_footer_check(tkvdb *db, const struct tkvdb_db_info *info)
+{
+	const struct tkvdb_tr_footer *footer = &info->footer;
+	struct tkvdb_disknode hdr;
+	uint64_t end;
+	uint8_t *node;
+	uint32_t crc;
+	int ok;
+
+	if ((footer->nextents > TKVDB_FREEMAP_MAX)
+		|| ((footer->transaction_size
+			+ footer->nextents * sizeof(struct tkvdb_extent))
+			> (uint64_t)(info->filesize - TKVDB_TR_FTRSIZE))) {
+
+		return TKVDB_CORRUPTED;
+	}
+	end = info->filesize - TKVDB_TR_FTRSIZE
+		- footer->nextents * sizeof(struct tkvdb_extent);
+
+	/* free extents and CRC32C of footer */
+	TKVDB_EXEC( tkvdb_freemap_read(db->fd, info, &db->freemap) );
+	if (footer->checksum
+		&& (tkvdb_footer_crc(footer, &db->freemap) != footer->crc)) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	/* file after the last sync, see tkvdb_syncer_tail() */
+	if (footer->synced_off > end) {
+		return TKVDB_CORRUPTED;
+	}
+	crc = 0;
+	TKVDB_EXEC( tkvdb_file_crc(db->fd, footer->synced_off,
+		info->filesize - TKVDB_TR_FTRSIZE, &crc) );
+	if (crc != footer->tail_crc) {
+		return TKVDB_CORRUPTED;
+	}
+
+	if (footer->compression != TKVDB_COMPRESSION_NONE) {
+		/* root is checked when its frame is read */
+		return (TKVDB_FRAME_POS(footer->root_off) < end)
+			? TKVDB_OK : TKVDB_CORRUPTED;
+	}
+
+	if ((footer->root_off + sizeof(struct tkvdb_disknode) - 1) > end) {
+		return TKVDB_CORRUPTED;
+	}
+	if ((lseek(db->fd, footer->root_off, SEEK_SET)
+		!= (off_t)footer->root_off)
+		|| !tkvdb_try_read_file(db->fd, &hdr,
+			sizeof(struct tkvdb_disknode) - 1, 0)) {
+
+		return TKVDB_IO_ERROR;
+	}
+	if ((hdr.size < (sizeof(struct tkvdb_disknode) - 1))
+		|| ((footer->root_off + hdr.size) > end)) {
+
+		return TKVDB_CORRUPTED;
+	}
+	if (!footer->checksum) {
+		return TKVDB_OK;
+	}
+
+	/* nodes may be lost even if footer was written */
+	node = malloc(hdr.size);
+	if (!node) {
+		return TKVDB_ENOMEM;
+	}
+	ok = (lseek(db->fd, footer->root_off, SEEK_SET)
+		== (off_t)footer->root_off)
+		&& tkvdb_try_read_file(db->fd, node, hdr.size, 0);
+	if (ok && !tkvdb_node_crc_ok((struct tkvdb_disknode *)node)) {
+		free(node);
+		return TKVDB_CORRUPTED;
+	}
+	free(node);
+
+	return ok ? TKVDB_OK : TKVDB_IO_ERROR;
+}
+
+/* tail of file is torn by crash during commit: file is searched backwards
+ * for the last valid footer and truncated after it */
+static TKVDB_RES
+tkvdb_recover(tkvdb *db)
+{
+	struct stat st;
+	struct tkvdb_db_info info;
+	uint8_t *buf, *p;
+	uint64_t start, end, pos;
+	size_t i, size;
+	TKVDB_RES r = TKVDB_CORRUPTED;
+
+	if ((db->params.flags & O_ACCMODE) == O_RDONLY) {
+		/* can't be fixed */
+		return TKVDB_CORRUPTED;
+	}
+	if (fstat(db->fd, &st) != 0) {
+		return TKVDB_IO_ERROR;
+	}
+
+	buf = malloc(TKVDB_VERIFY_READ);
+	if (!buf) {
+		return TKVDB_ENOMEM;
+	}
+
+	/* chunks overlap, so footer is always inside of one of them */
+	end = st.st_size;
+	while (end > TKVDB_TR_FTRSIZE) {
+		start = (end > TKVDB_VERIFY_READ) ? (end - TKVDB_VERIFY_READ)
+			: 0;
+		size = end - start;
+		if ((lseek(db->fd, start, SEEK_SET) != (off_t)start)
+			|| !tkvdb_try_read_file(db->fd, buf, size, 0)) {
+
+			r = TKVDB_IO_ERROR;
+			goto done;
+		}
+
+		for (i=size - TKVDB_TR_FTRSIZE + 1; i-- > 0; ) {
+			pos = start + i;
+			if (pos == 0) {
+				break;
+			}
+			p = buf + i;
+			if ((p[0] != TKVDB_BLOCKTYPE_FOOTER)
+				|| (memcmp(p + 1, TKVDB_SIGNATURE,
+					sizeof(TKVDB_SIGNATURE) - 1) != 0)) {
+
+				continue;
+			}
+
+			memcpy(&info.footer, p, TKVDB_TR_FTRSIZE);
+			info.filesize = pos + TKVDB_TR_FTRSIZE;
+			r = tkvdb_footer_check(db, &info);
+			if (r == TKVDB_OK) {
+				goto found;
+			}
+			if (r != TKVDB_CORRUPTED) {
+				goto done;
+			}
+		}
+
+		if (start == 0) {
+			break;
+		}
+		end = start + TKVDB_TR_FTRSIZE - 1;
+	}
+	r = TKVDB_CORRUPTED;
+	goto done;
+
+found:
+	if (ftruncate(db->fd, info.filesize) != 0) {
+		r = TKVDB_IO_ERROR;
+		goto done;
+	}
+	r = tkvdb_info_read(db->fd, &db->info);
+
+done:
+	free(buf);
+	return r;
+}
+
+/* open database file */
+tkvdb *
+tkvdb_open(const char *path, tkvdb_params *user_params)
+{
+	tkvdb *db;
+	TKVDB_RES r;
+
+	db = malloc(sizeof(tkvdb));
+	if (!db) {
+		goto fail;
+	}
+
+	if (user_params) {
+		db->params = *user_params;
+	} else {
+		tkvdb_params_init(&db->params);
+	}
+
+	tkvdb_crc32c_init();
+
+	db->wal_fd = -1;
+	db->ctl_fd = -1;
+	db->group = NULL;
+	db->ctl = NULL;
+	db->ctl_seq = 1;
+	db->ctl_own = 0;
+	db->freemap_own = 0;
+	db->fd = open(path, db->params.flags, db->params.mode);
+	if (db->fd < 0) {
+		goto fail_free;
+	}
+
+	r = tkvdb_info_read(db->fd, &(db->info));
+	if ((r == TKVDB_OK) && (db->info.filesize > 0)) {
+		/* footer, root or unsynced tail may be torn */
+		r = tkvdb_footer_check(db, &(db->info));
+	}
+	if (r == TKVDB_CORRUPTED) {
+		r = tkvdb_recover(db);
+	}
+	if (r != TKVDB_OK) {
+		/* error */
+		goto fail_close;
+	}
+
+	if ((db->params.wal_limit > 0)
+		&& (tkvdb_wal_open(db, path) != TKVDB_OK)) {
+
+		goto fail_close;
+	}
+	if (db->params.control && (tkvdb_ctl_open(db, path) != TKVDB_OK)) {
+		goto fail_close;
+	}
+	db->written = db->wal_written = 0;
+
+	/* init params */
+	if (db->params.write_buf_limit < TKVDB_WRITE_BUF_MIN) {
+		db->params.write_buf_limit = TKVDB_WRITE_BUF_MIN;
+	}
+	if (tkvdb_writer_init(&db->writer, db->fd, db->params.write_buf_limit,
+		db->params.write_buf_dynalloc) != TKVDB_OK) {
+
+		goto fail_close;
+	}
+
+	tkvdb_cache_init(&db->cache, db->params.cache_limit);
+	memset(&db->frames, 0, sizeof(struct tkvdb_frames));
+	memset(&db->vacuum, 0, sizeof(struct tkvdb_vacuum_cursor));
+
+	db->map = NULL;
+	tkvdb_map_update(db);
+
+#ifdef TKVDB_COMMIT_THREADS
+	tkvdb_group_join(db);
+#endif
+	tkvdb_syncer_start(db);
+
+	return db;
+
+fail_close:
+	if (db->wal_fd >= 0) {
+		close(db->wal_fd);
+	}
+	tkvdb_ctl_close(db);
+	close(db->fd);
+fail_free:
+	free(db);
+fail:
+	return NULL;
+}
+
+/* close database and free data */
+TKVDB_RES
+tkvdb_close(tkvdb *db)
+{
+	TKVDB_RES r = TKVDB_OK;
+
+	if (!db) {
+		return TKVDB_OK;
+	}
+
+	/* last group of commits */
+	tkvdb_syncer_stop(db);
+	if ((db->syncer.unsynced > 0)
+		&& (tkvdb_datasync_all(db) != TKVDB_OK)) {
+
+		r = TKVDB_IO_ERROR;
+	}
+#ifdef TKVDB_COMMIT_THREADS
+	tkvdb_group_leave(db);
+#endif
+
+	if (close(db->fd) < 0) {
+		r = TKVDB_IO_ERROR;
+	}
+	if ((db->wal_fd >= 0) && (close(db->wal_fd) < 0)) {
+		r = TKVDB_IO_ERROR;
+	}
+	tkvdb_ctl_close(db);
+
+	tkvdb_writer_free(&db->writer);
+	tkvdb_cache_free(&db->cache);
+	tkvdb_frames_free(&db->frames);
+	tkvdb_map_free(db);
+	free(db->vacuum.key);
+
+	free(db);
+	return r;
+}
+
+TKVDB_RES
+tkvdb_sync(tkvdb *db)
+{
+	uint64_t end, gen;
+
+	tkvdb_syncer_written(db, &end, &gen);
+#ifndef _WIN32
+	if ((fsync(db->fd) < 0)
+		|| ((db->wal_fd >= 0) && (fsync(db->wal_fd) < 0))) {
+#else
+	if ((_commit(db->fd) < 0)
+		|| ((db->wal_fd >= 0) && (_commit(db->wal_fd) < 0))) {
+#endif
+		return TKVDB_IO_ERROR;
+	}
+	tkvdb_syncer_reset(db, end, gen);
+
+	return TKVDB_OK;
+}
+
+
+tkvdb_params *
+tkvdb_params_create(void)
+{
+	tkvdb_params *params;
+
+	params = malloc(sizeof(tkvdb_params));
+	if (!params) {
+		return NULL;
+	}
+
+	tkvdb_params_init(params);
+
+	return params;
+}
+
+void
+tkvdb_params_free(tkvdb_params *params)
+{
+	free(params);
+}
+
+void
+tkvdb_param_set(tkvdb_params *params, TKVDB_PARAM p, int64_t val)
+{
+	switch (p) {
+		case TKVDB_PARAM_TR_DYNALLOC:
+			params->tr_buf_dynalloc = (int)val;
+			break;
+		case TKVDB_PARAM_TR_LIMIT:
+			params->tr_buf_limit = (size_t)val;
+			break;
+		case TKVDB_PARAM_ALIGNVAL:
+			params->alignval = (int)val;
+			break;
+		case TKVDB_PARAM_AUTOBEGIN:
+			params->autobegin = (int)val;
+			break;
+
+		case TKVDB_PARAM_CURSOR_STACK_DYNALLOC:
+			params->stack_dynalloc = (int)val;
+			break;
+		case TKVDB_PARAM_CURSOR_STACK_LIMIT:
+			/* bytes to number of items */
+			params->stack_limit = (size_t)val
+				/ sizeof(struct tkvdb_visit_helper);
+			break;
+
+		case TKVDB_PARAM_CURSOR_KEY_DYNALLOC:
+			params->key_dynalloc = (int)val;
+			break;
+		case TKVDB_PARAM_CURSOR_KEY_LIMIT:
+			params->key_limit = (size_t)val;
+			break;
+
+		case TKVDB_PARAM_DBFILE_OPEN_FLAGS:
+			params->flags = val;
+			break;
+
+		case TKVDB_PARAM_CACHE_SIZE:
+			params->cache_limit = (size_t)val;
+			break;
+		case TKVDB_PARAM_MMAP:
+			params->mmap = (int)val;
+			break;
+
+		case TKVDB_PARAM_READERS:
+			params->readers = (size_t)val;
+			break;
+
+		case TKVDB_PARAM_TR_CONCURRENT:
+			params->tr_concurrent = (int)val;
+			break;
+
+		case TKVDB_PARAM_WRITE_BUF_LIMIT:
+			params->write_buf_limit = (size_t)val;
+			break;
+		case TKVDB_PARAM_COMMIT_THREADS:
+			params->commit_threads = (int)val;
+			break;
+		case TKVDB_PARAM_DURABILITY:
+			params->durability = (int)val;
+			break;
+		case TKVDB_PARAM_SYNC_INTERVAL:
+			params->sync_interval = val;
+			break;
+		case TKVDB_PARAM_SYNC_BYTES:
+			params->sync_bytes = val;
+			break;
+		case TKVDB_PARAM_WAL_LIMIT:
+			params->wal_limit = val;
+			break;
+		case TKVDB_PARAM_COMPRESS:
+			params->compress = (int)val;
+			break;
+		case TKVDB_PARAM_CONTROL:
+			params->control = (int)val;
+			break;
+		case TKVDB_PARAM_CHECKSUM:
+			params->checksum = (int)val;
+			break;
+		case TKVDB_PARAM_FRAME_CACHE:
+			params->frame_cache = (size_t)val;
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* cursors */
+static void
+tkvdb_cursor_free(tkvdb_cursor *c)
+{
+	tkvdb_cursor_data *cdata;
+
+	cdata = c->data;
+
+	free(cdata->prefix);
+	cdata->prefix_size = 0;
+	cdata->key_allocated = 0;
+
+	cdata->val_size = 0;
+	cdata->val = NULL;
+
+	free(cdata->stack);
+	cdata->stack = NULL;
+	cdata->stack_size = 0;
+	cdata->stack_allocated = 0;
+
+	free(cdata);
+	c->data = NULL;
+	free(c);
+}
+
+
+static void *
+tkvdb_cursor_key(tkvdb_cursor *c)
+{
+	tkvdb_cursor_data *cdata = c->data;
+	return cdata->prefix;
+}
+
+static size_t
+tkvdb_cursor_keysize(tkvdb_cursor *c)
+{
+	tkvdb_cursor_data *cdata = c->data;
+	return cdata->prefix_size;
+}
+
+static void *
+tkvdb_cursor_val(tkvdb_cursor *c)
+{
+	tkvdb_cursor_data *cdata = c->data;
+	return cdata->val;
+}
+
+static size_t
+tkvdb_cursor_valsize(tkvdb_cursor *c)
+{
+	tkvdb_cursor_data *cdata = c->data;
+	return cdata->val_size;
+}
+
+static tkvdb_datum
+tkvdb_cursor_key_datum(tkvdb_cursor *c)
+{
+	tkvdb_datum dat;
+	tkvdb_cursor_data *cdata = c->data;
+
+	dat.data = cdata->prefix;
+	dat.size = cdata->prefix_size;
+
+	return dat;
+}
+
+static tkvdb_datum
+tkvdb_cursor_val_datum(tkvdb_cursor *c)
+{
+	tkvdb_datum dat;
+	tkvdb_cursor_data *cdata = c->data;
+
+	dat.data = cdata->val;
+	dat.size = cdata->val_size;
+
+	return dat;
+}
+
+static int
+tkvdb_cursor_resize_prefix(tkvdb_cursor *c, size_t n, int grow)
+{
+	tkvdb_cursor_data *cdata = c->data;
+
+	if (n == 0) {
+		/* underflow? */
+		return TKVDB_OK;
+	}
+
+	if (!grow) {
+		/* don't need to reallocate */
+		return TKVDB_OK;
+	}
+
+	if ((cdata->prefix_size + n) > cdata->key_allocated) {
+		unsigned char *tmp_pfx;
+
+		/* need more memory */
+		if (!cdata->key_dynalloc) {
+			/* and no dynamic reallocation allowed */
+			return TKVDB_ENOMEM;
+		}
+
+		tmp_pfx = realloc(cdata->prefix, cdata->prefix_size + n);
+		if (!tmp_pfx) {
+			return TKVDB_ENOMEM;
+		}
+		cdata->prefix = tmp_pfx;
+		cdata->key_allocated = cdata->prefix_size + n;
+	}
+
+	return TKVDB_OK;
+}
+
+static void
+tkvdb_cursor_reset(tkvdb_cursor *c)
+{
+	tkvdb_cursor_data *cdata = c->data;
+
+	cdata->stack_size = 0;
+	cdata->prefix_size = 0;
+
+	cdata->val_size = 0;
+	cdata->val = NULL;
+}
+
+
+/* make room for 'n' more bytes in growing buffer */
+static TKVDB_RES
+tkvdb_buf_reserve(uint8_t **buf, size_t size, size_t *allocated,
+	size_t n)
+{
+	uint8_t *tmp;
+
+	if ((size + n) <= *allocated) {
+		return TKVDB_OK;
+	}
+
+	tmp = realloc(*buf, (size + n) * 2 + 64);
+	if (!tmp) {
+		return TKVDB_ENOMEM;
+	}
+	*buf = tmp;
+	*allocated = (size + n) * 2 + 64;
+
+	return TKVDB_OK;
+}
+
+/* push pair of subtrees, key prefix of pair is prefix of last pair taken
+ * from stack + 'prefix' + 'sym' (if sym >= 0) */
+static TKVDB_RES
+tkvdb_merge_push(struct tkvdb_merge_stack *st, void *dst, void *src,
+	const uint8_t *prefix, size_t prefix_size, int sym)
+{
+	size_t off = st->path_size;
+
+	TKVDB_EXEC( tkvdb_buf_reserve(&st->path, st->path_size,
+		&st->path_allocated, st->cur_size + prefix_size + 1) );
+
+	memcpy(st->path + off, st->path + st->cur_off, st->cur_size);
+	memcpy(st->path + off + st->cur_size, prefix, prefix_size);
+	st->path[off + st->cur_size + prefix_size] = (uint8_t)sym;
+
+	if (st->size >= st->allocated) {
+		struct tkvdb_merge_pair *tmp;
+		size_t n = st->allocated * 2 + 16;
+
+		tmp = realloc(st->pairs, n * sizeof(struct tkvdb_merge_pair));
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		st->pairs = tmp;
+		st->allocated = n;
+	}
+
+	st->pairs[st->size].dst = dst;
+	st->pairs[st->size].src = src;
+	st->pairs[st->size].path_off = off;
+	st->pairs[st->size].path_size = st->cur_size + prefix_size
+		+ (sym >= 0);
+	st->size++;
+	st->path_size = off + st->pairs[st->size - 1].path_size;
+
+	return TKVDB_OK;
+}
+
+/* read size and subnodes of node at 'off' without loading node to
+ * transaction, prefix of node is appended to 'key' */
+static TKVDB_RES
+tkvdb_vacuum_read(tkvdb *db, uint64_t off, struct tkvdb_vacuum_level *lvl,
+	uint8_t **key, size_t *key_size, size_t *key_allocated)
+{
+	uint8_t buf[TKVDB_READ_SIZE];
+	struct tkvdb_disknode *disknode;
+	struct tkvdb_cache_node *cached;
+	const uint8_t *ptr;
+	size_t avail, head;
+
+	/* subnodes are always in first TKVDB_READ_SIZE bytes of node */
+	disknode = tkvdb_map_node(db, off);
+	avail = disknode ? disknode->size : 0;
+	if (!disknode) {
+		cached = tkvdb_cache_get(&db->cache, off);
+		if (cached) {
+			disknode = (struct tkvdb_disknode *)cached->data;
+			avail = cached->size;
+		} else if (tkvdb_compressed(db)) {
+			TKVDB_EXEC( tkvdb_frame_node(db, off, &disknode) );
+			avail = disknode->size;
+		} else {
+			if (lseek(db->fd, off, SEEK_SET) != (off_t)off) {
+				return TKVDB_IO_ERROR;
+			}
+			if (!tkvdb_try_read_file(db->fd, buf, TKVDB_READ_SIZE,
+				1)) {
+
+				return TKVDB_IO_ERROR;
+			}
+			disknode = (struct tkvdb_disknode *)buf;
+			avail = TKVDB_READ_SIZE;
+		}
+	}
+
+	lvl->size = disknode->size;
+	lvl->nsubnodes = 0;
+	lvl->pos = 0;
+
+	ptr = disknode->data;
+	if (disknode->type & TKVDB_NODE_VAL) {
+		ptr += sizeof(uint32_t);
+	}
+	if (disknode->type & TKVDB_NODE_META) {
+		ptr += sizeof(uint32_t);
+	}
+
+	if (!(disknode->type & TKVDB_NODE_LEAF)) {
+		lvl->nsubnodes = disknode->nsubnodes;
+		ptr = tkvdb_subnodes_get(ptr, lvl->nsubnodes, off, lvl->syms,
+			lvl->offs);
+	}
+
+	/* prefix follows subnodes */
+	if (disknode->prefix_size == 0) {
+		return TKVDB_OK;
+	}
+	TKVDB_EXEC( tkvdb_buf_reserve(key, *key_size, key_allocated,
+		disknode->prefix_size) );
+	head = ptr - (const uint8_t *)disknode;
+	if ((head + disknode->prefix_size) <= avail) {
+		memcpy(*key + *key_size, ptr, disknode->prefix_size);
+	} else {
+		/* long prefix of node which is not in memory */
+		off += head;
+		if (lseek(db->fd, off, SEEK_SET) != (off_t)off) {
+			return TKVDB_IO_ERROR;
+		}
+		if (!tkvdb_try_read_file(db->fd, *key + *key_size,
+			disknode->prefix_size, 0)) {
+
+			return TKVDB_IO_ERROR;
+		}
+	}
+	*key_size += disknode->prefix_size;
+
+	return TKVDB_OK;
+}
+
+/* free extent at the end of data is cut: new free extents and footer are
+ * written at the beginning of this extent first, so if file is not
+ * truncated (crash), the last footer is still valid. If there is no such
+ * extent (or it's too small), they are appended to file. Next pass of
+ * vacuum starts from the beginning of file */
+static TKVDB_RES
+tkvdb_vacuum_truncate(tkvdb *db, struct tkvdb_db_info *info,
+	struct tkvdb_freemap *fm)
+{
+	struct tkvdb_writer *w = &db->writer;
+	struct tkvdb_tr_footer footer;
+	struct tkvdb_extent *tail;
+	uint64_t end, off, size;
+
+	footer = info->footer;
+	footer.transaction_id += 1;
+	footer.vacuum_pos = 0;
+	footer.vacuum_end = 0;
+	footer.free_gen += 1;
+	/* older snapshots may be in freed space */
+	footer.prev_footer = 0;
+	footer.oldest_id = footer.transaction_id;
+
+	end = info->filesize - TKVDB_TR_FTRSIZE
+		- info->footer.nextents * sizeof(struct tkvdb_extent);
+	off = info->filesize;
+	tail = fm->n > 0 ? &fm->ext[fm->n - 1] : NULL;
+	if (tail && ((tail->off + tail->size) == end)
+		&& (tail->size >= TKVDB_TR_FTRSIZE)) {
+
+		off = tail->off;
+		fm->n--;
+		tkvdb_freemap_trim(fm, (end - off - TKVDB_TR_FTRSIZE)
+			/ sizeof(struct tkvdb_extent));
+	}
+	size = tkvdb_freemap_size(fm) + TKVDB_TR_FTRSIZE;
+	if (off < info->filesize) {
+		TKVDB_EXEC( tkvdb_syncer_reuse(db, &info->footer) );
+	}
+	/* file before footer in free space is synced by reuse */
+	TKVDB_EXEC( tkvdb_syncer_tail(db, &footer, fm, info, off,
+		(off < info->filesize) || !tkvdb_syncer_window(db)) );
+
+	tkvdb_writer_seek(w, off);
+	if ((tkvdb_writer_put_footer(w, &footer, fm) != TKVDB_OK)
+		|| (tkvdb_writer_flush(w) != TKVDB_OK)) {
+
+		tkvdb_writer_seek(w, 0);
+		return TKVDB_IO_ERROR;
+	}
+	if ((off < info->filesize) && (ftruncate(db->fd, off + size) != 0)) {
+		return TKVDB_IO_ERROR;
+	}
+	if (tkvdb_syncer_add(db, size, 1)) {
+		TKVDB_EXEC( tkvdb_syncer_sync(db) );
+	}
+
+	/* offsets after end of file may be reused by next transactions */
+	tkvdb_invalidate(db, off, info->filesize);
+
+	info->footer = footer;
+	info->filesize = off + size;
+	db->info = *info;
+	tkvdb_ctl_commit(db, info);
+
+	return TKVDB_OK;
+}
+
+/* snapshots
+ * footers of transactions are linked to previous ones. Root of each
+ * footer after the last vacuum commit ('oldest_id') is still intact:
+ * commits write only to space which was free before it */
+
+/* root of transaction on disk, 0 if file is empty */
+static uint64_t
+tkvdb_root_off(const tkvdb_tr_data *tr)
+{
+	if (tr->snapshot) {
+		return tr->root_off;
+	}
+
+	return (tr->db->info.filesize > 0) ? tr->db->info.footer.root_off : 0;
+}
+
+/* read footer of previous transaction */
+static TKVDB_RES
+tkvdb_footer_prev(int fd, uint64_t oldest_id, struct tkvdb_tr_footer *footer)
+{
+	uint64_t id = footer->transaction_id;
+	off_t off = footer->prev_footer;
+
+	if ((id == 0) || ((id - 1) < oldest_id) || (off == 0)) {
+		return TKVDB_NOT_FOUND;
+	}
+
+	if (lseek(fd, off, SEEK_SET) != off) {
+		return TKVDB_IO_ERROR;
+	}
+	if (!tkvdb_try_read_file(fd, footer, TKVDB_TR_FTRSIZE, 0)) {
+		return TKVDB_IO_ERROR;
+	}
+
+	if ((footer->type != TKVDB_BLOCKTYPE_FOOTER)
+		|| (memcmp(footer->signature, TKVDB_SIGNATURE,
+			sizeof(TKVDB_SIGNATURE) - 1) != 0)
+		|| (footer->transaction_id != (id - 1))) {
+
+		return TKVDB_CORRUPTED;
+	}
+
+	return TKVDB_OK;
+}
+
+/* check if commits after 'hi' wrote only footers: transactions which are
+ * not appended are written to free extents before 'hi', so root of each
+ * footer after 'hi' is before it. Not more than 'max_bytes' of footers
+ * are read */
+static TKVDB_RES
+tkvdb_vacuum_tail_used(tkvdb *db, const struct tkvdb_db_info *info,
+	uint64_t hi, size_t max_bytes, int *used)
+{
+	struct tkvdb_tr_footer footer = info->footer;
+	uint64_t off, nread = 0;
+	TKVDB_RES r;
+
+	*used = 1;
+	while (tkvdb_node_pos(db, footer.root_off) < hi) {
+		off = footer.prev_footer;
+		if (off < hi) {
+			/* footer is in processed range or chain ends */
+			*used = (off == 0);
+			break;
+		}
+		nread += TKVDB_TR_FTRSIZE;
+		if ((max_bytes > 0) && (nread > max_bytes)) {
+			break;
+		}
+		/* older footers may be overwritten */
+		r = tkvdb_footer_prev(db->fd, info->footer.oldest_id, &footer);
+		if (r == TKVDB_NOT_FOUND) {
+			break;
+		} else if (r != TKVDB_OK) {
+			return r;
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+/* find footer of transaction 'id' */
+static TKVDB_RES
+tkvdb_snapshot_footer(tkvdb *db, uint64_t id, struct tkvdb_tr_footer *footer)
+{
+	struct tkvdb_db_info info;
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	if (info.filesize == 0) {
+		return TKVDB_EMPTY;
+	}
+
+	*footer = info.footer;
+	while (footer->transaction_id > id) {
+		TKVDB_EXEC( tkvdb_footer_prev(db->fd, info.footer.oldest_id,
+			footer) );
+	}
+
+	return (footer->transaction_id == id) ? TKVDB_OK : TKVDB_NOT_FOUND;
+}
+
+/* the oldest pinned snapshot, UINT64_MAX if there are no pins */
+static uint64_t
+tkvdb_pins_oldest(const struct tkvdb_tr_footer *footer)
+{
+	uint64_t oldest = UINT64_MAX;
+	size_t i;
+
+	for (i=0; i<TKVDB_PINS; i++) {
+		if ((footer->pins[i] != 0) && ((footer->pins[i] - 1) < oldest)) {
+			oldest = footer->pins[i] - 1;
+		}
+	}
+
+	return oldest;
+}
+
+/* append footer with pin of snapshot 'id' added or removed (all pins are
+ * removed if 'id' is TKVDB_PINS_ALL) */
+static TKVDB_RES
+tkvdb_snapshot_pins(tkvdb *db, uint64_t id, int pin)
+{
+	struct tkvdb_db_info info;
+	struct tkvdb_tr_footer footer;
+	struct tkvdb_writer *w = &db->writer;
+	struct tkvdb_freemap *fm = &db->freemap;
+	uint64_t size;
+	size_t i, n = 0;
+
+	if (pin) {
+		TKVDB_EXEC( tkvdb_snapshot_footer(db, id, &footer) );
+	}
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	if (info.filesize == 0) {
+		return TKVDB_EMPTY;
+	}
+
+	footer = info.footer;
+	for (i=0; i<TKVDB_PINS; i++) {
+		if (pin && (footer.pins[i] == 0)) {
+			footer.pins[i] = id + 1;
+			n++;
+			break;
+		}
+		if (!pin && (footer.pins[i] != 0) && ((id == TKVDB_PINS_ALL)
+			|| (footer.pins[i] == (id + 1)))) {
+
+			footer.pins[i] = 0;
+			n++;
+			if (id != TKVDB_PINS_ALL) {
+				break;
+			}
+		}
+	}
+	if (n == 0) {
+		/* all slots are used or snapshot is not pinned */
+		return pin ? TKVDB_ENOMEM : TKVDB_NOT_FOUND;
+	}
+	TKVDB_EXEC( tkvdb_freemap_load(db, &info) );
+
+	footer.transaction_id += 1;
+	footer.transaction_size = 0;
+	footer.prev_footer = info.filesize - TKVDB_TR_FTRSIZE;
+	size = tkvdb_freemap_size(fm) + TKVDB_TR_FTRSIZE;
+	TKVDB_EXEC( tkvdb_syncer_tail(db, &footer, fm, &info, info.filesize,
+		!tkvdb_syncer_window(db)) );
+
+	tkvdb_writer_seek(w, info.filesize);
+	if ((tkvdb_writer_put_footer(w, &footer, fm) != TKVDB_OK)
+		|| (tkvdb_writer_flush(w) != TKVDB_OK)) {
+
+		tkvdb_writer_seek(w, 0);
+		return TKVDB_IO_ERROR;
+	}
+	info.footer = footer;
+	info.filesize += size;
+	tkvdb_ctl_commit(db, &info);
+	if (tkvdb_syncer_add(db, size, 1)) {
+		TKVDB_EXEC( tkvdb_syncer_sync(db) );
+	}
+	db->written += size;
+
+	return TKVDB_OK;
+}
+
+/* grow stack of visited nodes to 'size' items */
+static TKVDB_RES
+tkvdb_visit_stack_grow(struct tkvdb_visit_helper **stack, size_t *allocated,
+	size_t size, int dynalloc)
+{
+	struct tkvdb_visit_helper *tmpstack;
+
+	if (size <= *allocated) {
+		return TKVDB_OK;
+	}
+	if (!dynalloc) {
+		return TKVDB_ENOMEM;
+	}
+
+	tmpstack = realloc(*stack, size * sizeof(struct tkvdb_visit_helper));
+	if (!tmpstack) {
+		return TKVDB_ENOMEM;
+	}
+	*stack = tmpstack;
+	*allocated = size;
+
+	return TKVDB_OK;
+}
+
+#ifdef TKVDB_COMMIT_THREADS
+/* run commit workers, current thread is the first one. If thread can't be
+ * created, its work is done by others */
+static TKVDB_RES
+tkvdb_commit_run(struct tkvdb_commit_worker *wrk, int nthreads,
+	void *(*func)(void *))
+{
+	int i, started;
+	TKVDB_RES r = TKVDB_OK;
+
+	for (i=1; i<nthreads; i++) {
+		if (pthread_create(&wrk[i].thread, NULL, func, &wrk[i]) != 0) {
+			break;
+		}
+	}
+	started = i;
+
+	func(&wrk[0]);
+
+	for (i=1; i<started; i++) {
+		pthread_join(wrk[i].thread, NULL);
+	}
+	for (i=0; i<nthreads; i++) {
+		if (wrk[i].r != TKVDB_OK) {
+			r = wrk[i].r;
+		}
+	}
+
+	return r;
+}
+#endif
+
+static TKVDB_RES tkvdb_begin_db(tkvdb_tr *trns);
+
+/* generated implementation of tkvdb_* functions () */
+#include "tkvdb_generated.inc"
+
+TKVDB_RES
+tkvdb_dbinfo(tkvdb *db, uint64_t *root_off,
+	uint64_t *gap_begin, uint64_t *gap_end)
+{
+	struct tkvdb_db_info info;
+	struct tkvdb_freemap fm;
+	size_t i;
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	TKVDB_EXEC( tkvdb_freemap_read(db->fd, &info, &fm) );
+
+	*root_off = info.footer.root_off;
+
+	/* the largest free extent */
+	*gap_begin = *gap_end = 0;
+	for (i=0; i<fm.n; i++) {
+		if (fm.ext[i].size > (*gap_end - *gap_begin)) {
+			*gap_begin = fm.ext[i].off;
+			*gap_end = fm.ext[i].off + fm.ext[i].size;
+		}
+	}
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_cache_info(tkvdb *db, uint64_t *hits, uint64_t *misses, size_t *size)
+{
+	*hits = db->cache.hits;
+	*misses = db->cache.misses;
+	*size = db->cache.used;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_write_info(tkvdb *db, uint64_t *db_bytes, uint64_t *wal_bytes)
+{
+	*db_bytes = db->written;
+	*wal_bytes = db->wal_written;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_format_info(tkvdb *db, int *compress, int *checksum)
+{
+	*compress = tkvdb_compressed(db);
+	*checksum = tkvdb_node_tail(db) > 0;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_last_commit(tkvdb *db, uint64_t *transaction_id)
+{
+	struct tkvdb_db_info info;
+
+	TKVDB_EXEC( tkvdb_info_get(db, &info) );
+	if (info.filesize == 0) {
+		return TKVDB_EMPTY;
+	}
+	*transaction_id = info.footer.transaction_id;
+
+	return TKVDB_OK;
+}
+
+/* verify
+ * tree is walked level by level, nodes of level are read in order of
+ * their offsets through window of TKVDB_VERIFY_READ bytes, so file is read
+ * mostly sequentially */
+struct tkvdb_verify_win
+{
+	uint8_t *buf;
+	uint64_t off;
+	size_t size;
+
+	uint8_t *big;           /* node which doesn't fit in window */
+	size_t big_allocated;
+};
+
+static int
+tkvdb_off_cmp(const void *a, const void *b)
+{
+	uint64_t x = *((const uint64_t *)a), y = *((const uint64_t *)b);
+
+	return (x > y) - (x < y);
+}
+
+static TKVDB_RES
+tkvdb_verify_fill(tkvdb *db, struct tkvdb_verify_win *win, uint64_t off,
+	uint64_t end)
+{
+	win->off = off;
+	win->size = ((end - off) > TKVDB_VERIFY_READ) ? TKVDB_VERIFY_READ
+		: (end - off);
+
+	if ((lseek(db->fd, off, SEEK_SET) != (off_t)off)
+		|| !tkvdb_try_read_file(db->fd, win->buf, win->size, 0)) {
+
+		win->size = 0;
+		return TKVDB_IO_ERROR;
+	}
+
+	return TKVDB_OK;
+}
+
+/* get whole node at 'off' of not compressed file with data before 'end' */
+static TKVDB_RES
+tkvdb_verify_read(tkvdb *db, struct tkvdb_verify_win *win, uint64_t off,
+	uint64_t end, struct tkvdb_disknode **disknode)
+{
+	const size_t hdr_size = sizeof(struct tkvdb_disknode) - 1;
+	uint32_t size;
+
+	if ((off + hdr_size) > end) {
+		return TKVDB_CORRUPTED;
+	}
+	if ((off < win->off) || ((off + hdr_size) > (win->off + win->size))) {
+		TKVDB_EXEC( tkvdb_verify_fill(db, win, off, end) );
+	}
+
+	size = ((struct tkvdb_disknode *)(win->buf + (off - win->off)))->size;
+	if ((size < hdr_size) || ((off + size) > end)) {
+		return TKVDB_CORRUPTED;
+	}
+
+	if ((off + size) > (win->off + win->size)) {
+		if (size <= TKVDB_VERIFY_READ) {
+			TKVDB_EXEC( tkvdb_verify_fill(db, win, off, end) );
+		} else {
+			TKVDB_EXEC( tkvdb_frame_grow(&win->big,
+				&win->big_allocated, size) );
+			if ((lseek(db->fd, off, SEEK_SET) != (off_t)off)
+				|| !tkvdb_try_read_file(db->fd, win->big,
+					size, 0)) {
+
+				return TKVDB_IO_ERROR;
+			}
+			*disknode = (struct tkvdb_disknode *)win->big;
+			return TKVDB_OK;
+		}
+	}
+
+	*disknode = (struct tkvdb_disknode *)(win->buf + (off - win->off));
+	return TKVDB_OK;
+}
+
+/* check layout and checksum of node at 'off', offsets of subnodes are
+ * appended to 'next' (which has space for 256 more) */
+static TKVDB_RES
+tkvdb_verify_node(const struct tkvdb_db_info *info, uint64_t off,
+	const struct tkvdb_disknode *disknode, uint64_t end,
+	uint64_t *next, size_t *n)
+{
+	/* the rest of buffer is for decoding of damaged subnodes */
+	uint8_t hdr[TKVDB_READ_SIZE * 2], syms[256];
+	const uint8_t *ptr;
+	uint32_t v32;
+	uint64_t size, pos;
+	size_t tail = info->footer.checksum ? TKVDB_CRC_SIZE : 0;
+	unsigned int i, nsubnodes = 0;
+
+	if ((disknode->size < (sizeof(struct tkvdb_disknode) - 1 + tail))
+		|| (disknode->nsubnodes > 256)) {
+
+		return TKVDB_CORRUPTED;
+	}
+	if (tail && !tkvdb_node_crc_ok(disknode)) {
+		return TKVDB_CORRUPTED;
+	}
+
+	/* subnodes are always in first TKVDB_READ_SIZE bytes of node */
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, disknode, (disknode->size < TKVDB_READ_SIZE)
+		? disknode->size : TKVDB_READ_SIZE);
+
+	size = disknode->prefix_size + tail;
+	ptr = ((struct tkvdb_disknode *)hdr)->data;
+	if (disknode->type & TKVDB_NODE_VAL) {
+		memcpy(&v32, ptr, sizeof(uint32_t));
+		ptr += sizeof(uint32_t);
+		size += v32;
+	}
+	if (disknode->type & TKVDB_NODE_META) {
+		memcpy(&v32, ptr, sizeof(uint32_t));
+		ptr += sizeof(uint32_t);
+		size += v32;
+	}
+
+	if (!(disknode->type & TKVDB_NODE_LEAF)) {
+		nsubnodes = disknode->nsubnodes;
+	}
+	if (nsubnodes > TKVDB_SUBNODES_THR) {
+		/* width of offsets */
+		v32 = ptr[TKVDB_BITMAP_SIZE];
+		if ((v32 != 1) && (v32 != 2) && (v32 != 4) && (v32 != 8)) {
+			return TKVDB_CORRUPTED;
+		}
+	}
+	ptr = tkvdb_subnodes_get(ptr, nsubnodes, off, syms, next + *n);
+
+	if ((size + (ptr - hdr)) != disknode->size) {
+		return TKVDB_CORRUPTED;
+	}
+
+	for (i=0; i<nsubnodes; i++) {
+		pos = next[*n + i];
+		if (info->footer.compression != TKVDB_COMPRESSION_NONE) {
+			pos = TKVDB_FRAME_POS(pos);
+		}
+		if (pos >= end) {
+			return TKVDB_CORRUPTED;
+		}
+	}
+	*n += nsubnodes;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_verify(tkvdb *db)
+{
+	struct tkvdb_db_info info;
+	struct tkvdb_verify_win win;
+	struct tkvdb_disknode *disknode;
+	uint64_t *level = NULL, *next = NULL, *tmp, end, max, total = 0;
+	size_t i, n, nnext, allocated = 0, next_allocated = 0;
+	int compressed;
+	TKVDB_RES r;
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	if (info.filesize == 0) {
+		return TKVDB_EMPTY;
+	}
+	TKVDB_EXEC( tkvdb_footer_check(db, &info) );
+
+	end = info.filesize - TKVDB_TR_FTRSIZE
+		- info.footer.nextents * sizeof(struct tkvdb_extent);
+	compressed = (info.footer.compression != TKVDB_COMPRESSION_NONE);
+
+	/* each node is counted once, so loop in tree can't be endless */
+	max = compressed
+		? (end / sizeof(struct tkvdb_frame_header)) * TKVDB_FRAME_SIZE
+		: end;
+	max /= sizeof(struct tkvdb_disknode) - 1;
+
+	memset(&win, 0, sizeof(struct tkvdb_verify_win));
+	win.buf = malloc(TKVDB_VERIFY_READ);
+	level = malloc(sizeof(uint64_t));
+	if (!win.buf || !level) {
+		r = TKVDB_ENOMEM;
+		goto done;
+	}
+	allocated = 1;
+	level[0] = info.footer.root_off;
+	n = 1;
+
+	while (n > 0) {
+		total += n;
+		if (total > max) {
+			r = TKVDB_CORRUPTED;
+			goto done;
+		}
+
+		qsort(level, n, sizeof(uint64_t), tkvdb_off_cmp);
+		nnext = 0;
+		for (i=0; i<n; i++) {
+			if ((i > 0) && (level[i] == level[i - 1])) {
+				/* node has two parents */
+				r = TKVDB_CORRUPTED;
+				goto done;
+			}
+
+			if ((nnext + 256) > next_allocated) {
+				next_allocated = next_allocated * 2 + 256;
+				tmp = realloc(next,
+					next_allocated * sizeof(uint64_t));
+				if (!tmp) {
+					r = TKVDB_ENOMEM;
+					goto done;
+				}
+				next = tmp;
+			}
+
+			if (compressed) {
+				r = tkvdb_frame_node(db, level[i], &disknode);
+			} else {
+				r = tkvdb_verify_read(db, &win, level[i], end,
+					&disknode);
+			}
+			if (r != TKVDB_OK) {
+				goto done;
+			}
+
+			r = tkvdb_verify_node(&info, level[i], disknode, end,
+				next, &nnext);
+			if (r != TKVDB_OK) {
+				goto done;
+			}
+		}
+
+		/* next level */
+		tmp = level;
+		level = next;
+		next = tmp;
+		i = allocated;
+		allocated = next_allocated;
+		next_allocated = i;
+		n = nnext;
+	}
+	r = TKVDB_OK;
+
+done:
+	free(level);
+	free(next);
+	free(win.buf);
+	free(win.big);
+	return r;
+}
+
+TKVDB_RES
+tkvdb_snapshots(tkvdb *db, tkvdb_snapshot *snaps, size_t *n)
+{
+	struct tkvdb_db_info info;
+	struct tkvdb_tr_footer footer;
+	size_t i = 0, j;
+	TKVDB_RES r;
+
+	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	if (info.filesize == 0) {
+		*n = 0;
+		return TKVDB_OK;
+	}
+
+	/* newest first */
+	footer = info.footer;
+	while (i < *n) {
+		snaps[i].transaction_id = footer.transaction_id;
+		snaps[i].root_off = footer.root_off;
+		snaps[i].pinned = 0;
+		for (j=0; j<TKVDB_PINS; j++) {
+			if (info.footer.pins[j] == (footer.transaction_id + 1)) {
+				snaps[i].pinned++;
+			}
+		}
+		i++;
+		if (i == *n) {
+			break;
+		}
+
+		r = tkvdb_footer_prev(db->fd, info.footer.oldest_id, &footer);
+		if (r == TKVDB_NOT_FOUND) {
+			break;
+		} else if (r != TKVDB_OK) {
+			return r;
+		}
+	}
+	*n = i;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_tr_snapshot(tkvdb_tr *trns, uint64_t transaction_id)
+{
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_footer footer;
+	TKVDB_RES r;
+
+	if (!tr->db) {
+		return TKVDB_EMPTY;
+	}
+	if (tr->started) {
+		return TKVDB_LOCKED;
+	}
+	if (tr->root) {
+		/* tree of write-ahead log kept by commit */
+		TKVDB_EXEC( trns->rollback(trns) );
+	}
+
+	/* cache is checked against changes of free space */
+	TKVDB_EXEC( tkvdb_begin_db(trns) );
+
+	r = tkvdb_snapshot_footer(tr->db, transaction_id, &footer);
+	if (r != TKVDB_OK) {
+		TKVDB_STORE_REL(tr->started, 0);
+		return r;
+	}
+
+	tr->root_off = footer.root_off;
+	tr->snapshot = 1;
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_snapshot_pin(tkvdb *db, uint64_t transaction_id)
+{
+	return tkvdb_snapshot_pins(db, transaction_id, 1);
+}
 
-	params->stack_dynalloc = 1;
-	params->stack_limit = SIZE_MAX / sizeof(struct tkvdb_visit_helper);
+TKVDB_RES
+tkvdb_snapshot_unpin(tkvdb *db, uint64_t transaction_id)
+{
+	return tkvdb_snapshot_pins(db, transaction_id, 0);
+}
 
-	params->key_dynalloc = 1;
-	params->key_limit = SIZE_MAX;
+TKVDB_RES
+tkvdb_tr_merge(tkvdb_tr *dst, tkvdb_tr *src, tkvdb_merge_func merge,
+	void *userdata)
+{
+	tkvdb_tr_data *d = dst->data, *s = src->data;
 
-	params->mode = S_IRUSR | S_IWUSR;
-#ifndef _WIN32
-	params->flags = O_RDWR | O_CREAT;
-#else
-	params->flags = O_RDWR | O_CREAT | O_BINARY;
-#endif
+	if (!TKVDB_LOAD_ACQ(d->started) || !TKVDB_LOAD_ACQ(s->started)) {
+		return TKVDB_NOT_STARTED;
+	}
 
-	params->alignval = 0;
+	/* nodes are moved from one transaction to another, so both must be
+	   RAM-only, use malloc()'ed nodes with the same layout and have only
+	   one writer */
+	if (d->db || s->db
+		|| !d->params.tr_buf_dynalloc || !s->params.tr_buf_dynalloc
+		|| d->params.tr_concurrent || s->params.tr_concurrent
+		|| (((d->params.alignval > 1) || (s->params.alignval > 1))
+			&& (d->params.alignval != s->params.alignval))) {
 
-	params->autobegin = 0;
+		return TKVDB_NOT_SUPPORTED;
+	}
+
+	if (d->params.alignval > 1) {
+		return tkvdb_merge_alignval_nodb(dst, src, merge, userdata);
+	}
+	return tkvdb_merge_generic_nodb(dst, src, merge, userdata);
 }
 
-/* open database file */
-tkvdb *
-tkvdb_open(const char *path, tkvdb_params *user_params)
+TKVDB_RES
+tkvdb_vacuum(tkvdb_tr *vac, size_t max_bytes, tkvdb_vacuum_stat *stat)
+{
+	tkvdb_tr_data *tr = vac->data;
+
+	if (!tr->db) {
+		/* nothing to vacuum */
+		return TKVDB_NOT_SUPPORTED;
+	}
+
+	if (tr->params.alignval > 1) {
+		return tkvdb_vacuum_alignval(vac, max_bytes, stat);
+	}
+	return tkvdb_vacuum_generic(vac, max_bytes, stat);
+}
+
+/* bulk loader
+ * keys are added in sorted order, so only nodes on path of last key can
+ * change. Node is written to disk as soon as next key leaves its subtree,
+ * subnodes are always written before parent, root is written last */
+
+/* size of loader write buffer */
+#define TKVDB_LOADER_BUF_SIZE (1024 * 1024)
+
+/* node on path of last added key */
+struct tkvdb_loader_node
+{
+	size_t start;                   /* position of prefix in key */
+	size_t prefix_size;
+
+	int has_val;
+	uint8_t *val;
+	size_t val_size, val_allocated;
+
+	/* written subnodes, in ascending order */
+	unsigned int nsubnodes;
+	uint8_t syms[256];
+	uint64_t offs[256];
+};
+
+struct tkvdb_loader
 {
 	tkvdb *db;
+
+	/* path of last added key, root is first */
+	struct tkvdb_loader_node *path;
+	size_t depth, path_allocated;
+
+	uint8_t *key;                   /* last added key */
+	size_t key_size, key_allocated;
+
+	uint64_t transaction_off;
+	uint64_t root_off;
+
+	struct tkvdb_writer w;
+
+	TKVDB_RES error;                /* loader is unusable after error */
+};
+
+/* serialize node (in the same format as commit() does), prefix is taken
+ * from 'key' */
+static TKVDB_RES
+tkvdb_loader_write_node(tkvdb_loader *ldr, struct tkvdb_loader_node *n,
+	const uint8_t *key, uint64_t *off)
+{
+	struct tkvdb_disknode *disknode;
+	uint8_t *ptr;
+	size_t size, hdr_size, tail = tkvdb_node_tail(ldr->db);
+	unsigned int i;
+	int fits;
+	struct tkvdb_subnodes sub;
+	uint32_t crc;
+
+	/* subnodes are written before node, so position of node is known,
+	 * node which doesn't fit in compressed frame starts next one */
+	sub.n = n->nsubnodes;
+	memcpy(sub.syms, n->syms, n->nsubnodes);
+	do {
+		*off = tkvdb_writer_pos(&ldr->w);
+		for (i=0; i<n->nsubnodes; i++) {
+			sub.vals[i] = TKVDB_SUBNODE_REL(*off, n->offs[i]);
+		}
+
+		hdr_size = sizeof(struct tkvdb_disknode) - 1
+			+ tkvdb_subnodes_size(&sub);
+		if (n->has_val) {
+			hdr_size += sizeof(uint32_t);
+		}
+		size = hdr_size + n->prefix_size
+			+ (n->has_val ? n->val_size : 0) + tail;
+
+		fits = tkvdb_writer_fits(&ldr->w, size);
+		if (!fits) {
+			TKVDB_EXEC( tkvdb_writer_frame_end(&ldr->w) );
+		}
+	} while (!fits);
+
+	/* header and subnodes are smaller than TKVDB_WRITE_BUF_MIN */
+	TKVDB_EXEC( tkvdb_writer_reserve(&ldr->w, hdr_size, &ptr) );
+
+	disknode = (struct tkvdb_disknode *)ptr;
+	disknode->size = size;
+	disknode->type = 0;
+	if (n->has_val) {
+		disknode->type |= TKVDB_NODE_VAL;
+	}
+	if (n->nsubnodes == 0) {
+		disknode->type |= TKVDB_NODE_LEAF;
+	}
+	disknode->nsubnodes = n->nsubnodes;
+	disknode->prefix_size = n->prefix_size;
+
+	ptr = disknode->data;
+	if (n->has_val) {
+		*((uint32_t *)ptr) = n->val_size;
+		ptr += sizeof(uint32_t);
+	}
+
+	tkvdb_subnodes_put(ptr, &sub);
+	crc = tkvdb_crc32c(0, disknode, hdr_size);
+
+	TKVDB_EXEC( tkvdb_writer_put(&ldr->w, key + n->start,
+		n->prefix_size) );
+	crc = tkvdb_crc32c(crc, key + n->start, n->prefix_size);
+	if (n->has_val) {
+		TKVDB_EXEC( tkvdb_writer_put(&ldr->w, n->val, n->val_size) );
+		crc = tkvdb_crc32c(crc, n->val, n->val_size);
+	}
+	if (tail) {
+		TKVDB_EXEC( tkvdb_writer_put(&ldr->w, &crc, TKVDB_CRC_SIZE) );
+	}
+
+	return TKVDB_OK;
+}
+
+/* write last node of path and add it to parent */
+static TKVDB_RES
+tkvdb_loader_pop(tkvdb_loader *ldr)
+{
+	struct tkvdb_loader_node *n, *parent;
+	uint64_t off;
+
+	n = &ldr->path[ldr->depth - 1];
+	TKVDB_EXEC( tkvdb_loader_write_node(ldr, n, ldr->key, &off) );
+	ldr->depth--;
+
+	if (ldr->depth == 0) {
+		ldr->root_off = off;
+		return TKVDB_OK;
+	}
+
+	parent = &ldr->path[ldr->depth - 1];
+	parent->syms[parent->nsubnodes] = ldr->key[n->start - 1];
+	parent->offs[parent->nsubnodes] = off;
+	parent->nsubnodes++;
+
+	return TKVDB_OK;
+}
+
+/* add node for rest of key starting from 'start' */
+static TKVDB_RES
+tkvdb_loader_push(tkvdb_loader *ldr, const tkvdb_datum *key,
+	const tkvdb_datum *val, size_t start)
+{
+	struct tkvdb_loader_node *n;
+
+	if (ldr->depth >= ldr->path_allocated) {
+		size_t new_size = ldr->path_allocated * 2 + 16;
+		struct tkvdb_loader_node *tmp;
+
+		tmp = realloc(ldr->path,
+			new_size * sizeof(struct tkvdb_loader_node));
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		/* values buffers are reused */
+		memset(tmp + ldr->path_allocated, 0,
+			(new_size - ldr->path_allocated)
+			* sizeof(struct tkvdb_loader_node));
+		ldr->path = tmp;
+		ldr->path_allocated = new_size;
+	}
+
+	n = &ldr->path[ldr->depth];
+	if (val->size > n->val_allocated) {
+		uint8_t *tmp;
+
+		tmp = realloc(n->val, val->size);
+		if (!tmp) {
+			return TKVDB_ENOMEM;
+		}
+		n->val = tmp;
+		n->val_allocated = val->size;
+	}
+
+	n->start = start;
+	n->prefix_size = key->size - start;
+	n->has_val = 1;
+	if (val->size > 0) {
+		memcpy(n->val, val->data, val->size);
+	}
+	n->val_size = val->size;
+	n->nsubnodes = 0;
+
+	ldr->depth++;
+
+	return TKVDB_OK;
+}
+
+tkvdb_loader *
+tkvdb_loader_create(tkvdb *db)
+{
+	tkvdb_loader *ldr;
+	struct tkvdb_tr_header header;
+
+	ldr = malloc(sizeof(tkvdb_loader));
+	if (!ldr) {
+		goto fail;
+	}
+
+	ldr->db = db;
+	ldr->path = NULL;
+	ldr->depth = ldr->path_allocated = 0;
+	ldr->key = NULL;
+	ldr->key_size = ldr->key_allocated = 0;
+	ldr->error = TKVDB_OK;
+
+	if (tkvdb_info_read(db->fd, &db->info) != TKVDB_OK) {
+		goto fail_info;
+	}
+
+	if (tkvdb_writer_init(&ldr->w, db->fd, TKVDB_LOADER_BUF_SIZE, 0)
+		!= TKVDB_OK) {
+
+		goto fail_info;
+	}
+
+	/* new transaction is appended to file, footer_off in header is
+	   written when all nodes are known */
+	ldr->transaction_off = db->info.filesize;
+	tkvdb_writer_seek(&ldr->w, ldr->transaction_off);
+
+	header.type = TKVDB_BLOCKTYPE_TRANSACTION;
+	header.footer_off = 0;
+	if ((tkvdb_writer_put(&ldr->w, &header, sizeof(header)) != TKVDB_OK)
+		|| (tkvdb_compressed(db)
+		&& (tkvdb_writer_compress(&ldr->w, 1) != TKVDB_OK))) {
+
+		goto fail_writer;
+	}
+
+	return ldr;
+
+fail_writer:
+	tkvdb_writer_free(&ldr->w);
+fail_info:
+	free(ldr);
+fail:
+	return NULL;
+}
+
+TKVDB_RES
+tkvdb_loader_add(tkvdb_loader *ldr, const tkvdb_datum *key,
+	const tkvdb_datum *val)
+{
+	struct tkvdb_loader_node *n;
+	const uint8_t *k = key->data;
+	size_t l, end;
 	TKVDB_RES r;
 
-	db = malloc(sizeof(tkvdb));
-	if (!db) {
+	if (ldr->error != TKVDB_OK) {
+		return ldr->error;
+	}
+
+	if (ldr->depth == 0) {
+		/* first key */
+		l = 0;
+		goto push;
+	}
+
+	/* common prefix with previous key */
+	for (l=0; (l < key->size) && (l < ldr->key_size)
+		&& (k[l] == ldr->key[l]); l++);
+
+	if ((l == key->size) || ((l < ldr->key_size) && (k[l] < ldr->key[l]))) {
+		/* key is equal to or less than previous */
+		return TKVDB_CORRUPTED;
+	}
+
+	/* subtrees of nodes below common prefix are complete */
+	while (ldr->path[ldr->depth - 1].start > l) {
+		if ((r = tkvdb_loader_pop(ldr)) != TKVDB_OK) {
+			goto fail;
+		}
+	}
+
+	n = &ldr->path[ldr->depth - 1];
+	end = n->start + n->prefix_size;
+	if (l < end) {
+		/* key differs inside of node prefix, tail of node becomes
+		   subnode, node itself has only common part of prefix */
+		struct tkvdb_loader_node tail;
+		uint64_t off;
+
+		tail = *n;
+		tail.start = l + 1;
+		tail.prefix_size = end - l - 1;
+		r = tkvdb_loader_write_node(ldr, &tail, ldr->key, &off);
+		if (r != TKVDB_OK) {
+			goto fail;
+		}
+
+		n->prefix_size = l - n->start;
+		n->has_val = 0;
+		n->syms[0] = ldr->key[l];
+		n->offs[0] = off;
+		n->nsubnodes = 1;
+	}
+
+	/* rest of key is a subnode 'k[l]' of node */
+	l++;
+
+push:
+	if (key->size > ldr->key_allocated) {
+		uint8_t *tmp;
+
+		tmp = realloc(ldr->key, key->size);
+		if (!tmp) {
+			r = TKVDB_ENOMEM;
+			goto fail;
+		}
+		ldr->key = tmp;
+		ldr->key_allocated = key->size;
+	}
+	memcpy(ldr->key, k, key->size);
+	ldr->key_size = key->size;
+
+	if ((r = tkvdb_loader_push(ldr, key, val, l)) != TKVDB_OK) {
 		goto fail;
 	}
 
-	if (user_params) {
-		db->params = *user_params;
+	return TKVDB_OK;
+
+fail:
+	ldr->error = r;
+	return r;
+}
+
+TKVDB_RES
+tkvdb_loader_finish(tkvdb_loader *ldr)
+{
+	tkvdb *db = ldr->db;
+	struct tkvdb_tr_header header;
+	struct tkvdb_tr_footer footer;
+	struct tkvdb_freemap *fm = &db->freemap;
+	uint64_t nodes_end, footer_off;
+	int dosync;
+	TKVDB_RES r;
+
+	if (ldr->error != TKVDB_OK) {
+		return ldr->error;
+	}
+
+	if (ldr->depth == 0) {
+		/* nothing to write */
+		return TKVDB_EMPTY;
+	}
+
+	while (ldr->depth > 0) {
+		if ((r = tkvdb_loader_pop(ldr)) != TKVDB_OK) {
+			goto fail;
+		}
+	}
+	if (((r = tkvdb_writer_compress(&ldr->w, 0)) != TKVDB_OK)
+		|| ((r = tkvdb_writer_flush(&ldr->w)) != TKVDB_OK)) {
+
+		goto fail;
+	}
+	nodes_end = tkvdb_writer_pos(&ldr->w);
+
+	/* free extents are kept */
+	if ((r = tkvdb_freemap_load(db, &db->info)) != TKVDB_OK) {
+		goto fail;
+	}
+	footer_off = nodes_end + tkvdb_freemap_size(fm);
+
+	dosync = tkvdb_syncer_add(db, nodes_end - ldr->transaction_off, 1);
+
+	/* fix header */
+	r = TKVDB_IO_ERROR;
+	header.type = TKVDB_BLOCKTYPE_TRANSACTION;
+	header.footer_off = footer_off;
+	if (lseek(db->fd, ldr->transaction_off, SEEK_SET)
+		!= (off_t)ldr->transaction_off) {
+		goto fail;
+	}
+	if (!tkvdb_try_write_file(db->fd, &header, sizeof(header))) {
+		goto fail;
+	}
+	if (tkvdb_syncer_barrier(db, 1)
+		&& ((r = tkvdb_group_sync(db)) != TKVDB_OK)) {
+
+		/* nodes must be on disk before footer */
+		goto fail;
+	}
+
+	/* and write extents and footer after nodes */
+	if (db->info.filesize == 0) {
+		memset(&footer, 0, sizeof(footer));
+		memcpy(footer.signature, TKVDB_SIGNATURE,
+			sizeof(TKVDB_SIGNATURE) - 1);
+		footer.compression = db->params.compress
+			? TKVDB_COMPRESSION_LZ : TKVDB_COMPRESSION_NONE;
+		footer.checksum = db->params.checksum ? 1 : 0;
 	} else {
-		tkvdb_params_init(&db->params);
+		footer = db->info.footer;
+		footer.transaction_id += 1;
+		footer.prev_footer = db->info.filesize - TKVDB_TR_FTRSIZE;
 	}
+	footer.type = TKVDB_BLOCKTYPE_FOOTER;
+	footer.root_off = ldr->root_off;
+	footer.transaction_size = nodes_end - ldr->transaction_off;
+	footer.data_gen += 1;
 
-	db->fd = open(path, db->params.flags, db->params.mode);
-	if (db->fd < 0) {
-		goto fail_free;
+	if (((r = tkvdb_syncer_tail(db, &footer, fm, &db->info, nodes_end,
+		!tkvdb_syncer_window(db))) != TKVDB_OK)
+		|| ((r = tkvdb_writer_put_footer(&ldr->w, &footer, fm))
+			!= TKVDB_OK)
+		|| ((r = tkvdb_writer_flush(&ldr->w)) != TKVDB_OK)) {
+
+		goto fail;
+	}
+	if (dosync && ((r = tkvdb_syncer_sync(db)) != TKVDB_OK)) {
+		goto fail;
 	}
 
-	r = tkvdb_info_read(db->fd, &(db->info));
+	db->info.footer = footer;
+	db->info.filesize = footer_off + TKVDB_TR_FTRSIZE;
+	db->written += footer_off + TKVDB_TR_FTRSIZE - ldr->transaction_off;
+	tkvdb_ctl_commit(db, &db->info);
+
+	/* log records are older than loaded data */
+	tkvdb_wal_lock(db);
+	r = tkvdb_wal_reset(db);
+	tkvdb_wal_unlock(db);
 	if (r != TKVDB_OK) {
-		/* error */
-		goto fail_close;
+		goto fail;
+	}
+
+	return TKVDB_OK;
+
+fail:
+	ldr->error = r;
+	return r;
+}
+
+void
+tkvdb_loader_free(tkvdb_loader *ldr)
+{
+	size_t i;
+
+	for (i=0; i<ldr->path_allocated; i++) {
+		free(ldr->path[i].val);
+	}
+	free(ldr->path);
+	free(ldr->key);
+	tkvdb_writer_free(&ldr->w);
+	free(ldr);
+}
+
+static TKVDB_RES
+tkvdb_begin_db(tkvdb_tr *trns)
+{
+	uint64_t prev_filesize, prev_free_gen;
+	tkvdb_tr_data *tr = trns->data;
+
+	if (tr->started) {
+		/* ignore if transaction is already started */
+		return TKVDB_OK;
+	}
+
+	if (!tr->db) {
+		/* no underlying database file */
+		TKVDB_STORE_REL(tr->started, 1);
+		return TKVDB_OK;
+	}
+
+	/* read database info to find root node */
+	prev_filesize = tr->db->info.filesize;
+	prev_free_gen = tr->db->info.footer.free_gen;
+	TKVDB_EXEC( tkvdb_info_get(tr->db, &(tr->db->info)) );
+
+	if (tr->db->info.filesize < prev_filesize) {
+		/* file was truncated outside, cached nodes may be stale */
+		tkvdb_cache_clear(&tr->db->cache);
+		tkvdb_frames_reset(&tr->db->frames);
+	} else if ((prev_filesize > 0)
+		&& (tr->db->info.footer.free_gen != prev_free_gen)) {
+
+		/* free space was reused by other handle, its nodes may be
+		 * overwritten */
+		tkvdb_cache_clear(&tr->db->cache);
+		tkvdb_frames_reset(&tr->db->frames);
+	}
+
+	tkvdb_map_update(tr->db);
+
+	if (tr->db->info.filesize == 0) {
+		memset(&(tr->db->info.footer),
+			0, sizeof(struct tkvdb_tr_footer));
+	} else {
+		/* increase transaction number */
+		tr->db->info.footer.transaction_id += 1;
+	}
+
+	tr->started = 1;
+
+	return TKVDB_OK;
+}
+
+/* write-ahead log
+ *
+ * put() and del() of transaction are logged, small commit appends log
+ * records to '<path>-wal' and keeps transaction in memory, transaction
+ * is merged into database file (checkpoint) when log grows over limit.
+ * begin() replays log to transaction on top of database file. Header
+ * of log keeps generation of data in file, log left by checkpoint which
+ * was interrupted before truncation of log is older than file, it's not
+ * replayed over newer data and dropped */
+struct tkvdb_tr_wal
+{
+	tkvdb_tr impl;              /* functions of underlying transaction */
+
+	uint8_t *buf;               /* records of current transaction */
+	size_t used, allocated;
+	int full;                   /* transaction can't be logged */
+
+	int loaded;                 /* transaction is log + database file */
+	uint64_t applied;           /* size of replayed and appended log */
+	uint64_t trie_id;           /* database transaction under log */
+};
+
+static void
+tkvdb_wal_log(tkvdb_tr *trns, uint8_t type, const tkvdb_datum *key,
+	const tkvdb_datum *val)
+{
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal = tr->wal;
+	struct tkvdb_wal_rec rec;
+	size_t val_size, size;
+
+	if (wal->full) {
+		return;
+	}
+
+	val_size = val ? val->size : 0;
+	size = sizeof(struct tkvdb_wal_rec) + key->size + val_size;
+	if ((key->size > UINT32_MAX) || (val_size > UINT32_MAX)
+		|| ((wal->used + size) > tr->db->params.wal_limit)) {
+
+		/* too large for log */
+		wal->full = 1;
+		return;
 	}
 
-	/* init params */
-	if (db->params.write_buf_dynalloc) {
-		db->write_buf = NULL;
-		db->write_buf_allocated = 0;
-	} else {
-		db->write_buf = malloc(db->params.write_buf_limit);
-		if (!db->write_buf) {
-			goto fail_close;
+	if ((wal->used + size) > wal->allocated) {
+		uint8_t *tmp;
+		size_t new_size = (wal->used + size) * 2;
+
+		if (new_size > tr->db->params.wal_limit) {
+			new_size = tr->db->params.wal_limit;
 		}
-		db->write_buf_allocated = db->params.write_buf_limit;
+		tmp = realloc(wal->buf, new_size);
+		if (!tmp) {
+			wal->full = 1;
+			return;
+		}
+		wal->buf = tmp;
+		wal->allocated = new_size;
 	}
 
-	return db;
-
-fail_close:
-	close(db->fd);
-fail_free:
-	free(db);
-fail:
-	return NULL;
+	rec.type = type;
+	rec.key_size = (uint32_t)key->size;
+	rec.val_size = (uint32_t)val_size;
+	memcpy(wal->buf + wal->used, &rec, sizeof(struct tkvdb_wal_rec));
+	wal->used += sizeof(struct tkvdb_wal_rec);
+	memcpy(wal->buf + wal->used, key->data, key->size);
+	wal->used += key->size;
+	if (val_size > 0) {
+		memcpy(wal->buf + wal->used, val->data, val_size);
+		wal->used += val_size;
+	}
 }
 
-/* close database and free data */
-TKVDB_RES
-tkvdb_close(tkvdb *db)
+/* replay committed records of log to transaction */
+static TKVDB_RES
+tkvdb_wal_load(tkvdb_tr *trns)
 {
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal = tr->wal;
+	tkvdb *db = tr->db;
+	struct stat st;
+	struct tkvdb_wal_header hdr;
+	struct tkvdb_wal_rec rec;
+	tkvdb_datum key, val;
+	uint8_t *buf = NULL, *ptr, *end, *start, *valid_end;
+	uint32_t crc;
 	TKVDB_RES r = TKVDB_OK;
 
-	if (!db) {
-		return TKVDB_OK;
-	}
+	wal->used = 0;
+	wal->full = 0;
 
-	if (close(db->fd) < 0) {
+	/* records of other handles may be appended in the meantime, they
+	 * are not torn tail */
+	tkvdb_wal_lock(db);
+	if (fstat(db->wal_fd, &st) < 0) {
 		r = TKVDB_IO_ERROR;
+		goto unlock;
 	}
 
-	free(db->write_buf);
-
-	free(db);
-	return r;
-}
+	if (wal->loaded && (wal->trie_id == db->info.footer.transaction_id)
+		&& (wal->applied == (uint64_t)st.st_size)) {
 
+		/* transaction is already on top of current log */
+		goto unlock;
+	}
 
-tkvdb_params *
-tkvdb_params_create(void)
-{
-	tkvdb_params *params;
+	if ((r = wal->impl.rollback(trns)) != TKVDB_OK) {
+		goto unlock;
+	}
+	TKVDB_STORE_REL(tr->started, 1);
+	wal->loaded = 0;
+	wal->applied = 0;
 
-	params = malloc(sizeof(tkvdb_params));
-	if (!params) {
-		return NULL;
+	if ((size_t)st.st_size <= sizeof(struct tkvdb_wal_header)) {
+		/* empty log */
+		goto truncate;
 	}
 
-	tkvdb_params_init(params);
+	buf = malloc(st.st_size);
+	if (!buf) {
+		r = TKVDB_ENOMEM;
+		goto unlock;
+	}
+	if ((lseek(db->wal_fd, 0, SEEK_SET) != 0)
+		|| !tkvdb_try_read_file(db->wal_fd, buf, st.st_size, 0)) {
 
-	return params;
-}
+		r = TKVDB_IO_ERROR;
+		goto unlock;
+	}
 
-void
-tkvdb_params_free(tkvdb_params *params)
-{
-	free(params);
-}
+	end = buf + st.st_size;
+	valid_end = buf;
+	memcpy(&hdr, buf, sizeof(struct tkvdb_wal_header));
+	if (memcmp(hdr.signature, TKVDB_WAL_SIGNATURE,
+		sizeof(TKVDB_WAL_SIGNATURE) - 1) != 0) {
 
-void
-tkvdb_param_set(tkvdb_params *params, TKVDB_PARAM p, int64_t val)
-{
-	switch (p) {
-		case TKVDB_PARAM_TR_DYNALLOC:
-			params->tr_buf_dynalloc = (int)val;
-			break;
-		case TKVDB_PARAM_TR_LIMIT:
-			params->tr_buf_limit = (size_t)val;
-			break;
-		case TKVDB_PARAM_ALIGNVAL:
-			params->alignval = (int)val;
-			break;
-		case TKVDB_PARAM_AUTOBEGIN:
-			params->autobegin = (int)val;
-			break;
+		/* not a log, dropped */
+		goto truncate;
+	}
+	if (hdr.data_gen < db->info.footer.data_gen) {
+		/* records are already merged, file may have newer data */
+		goto truncate;
+	}
+	if (hdr.data_gen > db->info.footer.data_gen) {
+		/* log of newer data, file was changed by other handle after
+		 * begin(), commit returns TKVDB_MODIFIED */
+		tkvdb_wal_unlock(db);
+		free(buf);
+		return TKVDB_OK;
+	}
 
-		case TKVDB_PARAM_CURSOR_STACK_DYNALLOC:
-			params->stack_dynalloc = (int)val;
-			break;
-		case TKVDB_PARAM_CURSOR_STACK_LIMIT:
-			/* bytes to number of items */
-			params->stack_limit = (size_t)val
-				/ sizeof(struct tkvdb_visit_helper);
-			break;
+	/* find last complete transaction, log isn't synced between records
+	 * and commit mark, so mark keeps CRC32C of records before it */
+	start = ptr = buf + sizeof(struct tkvdb_wal_header);
+	while ((size_t)(end - ptr) >= sizeof(struct tkvdb_wal_rec)) {
+		memcpy(&rec, ptr, sizeof(struct tkvdb_wal_rec));
+		ptr += sizeof(struct tkvdb_wal_rec);
+		if ((size_t)(end - ptr)
+			< ((size_t)rec.key_size + rec.val_size)) {
 
-		case TKVDB_PARAM_CURSOR_KEY_DYNALLOC:
-			params->key_dynalloc = (int)val;
-			break;
-		case TKVDB_PARAM_CURSOR_KEY_LIMIT:
-			params->key_limit = (size_t)val;
 			break;
+		}
+		if (rec.type == TKVDB_WAL_COMMIT) {
+			if (rec.val_size != TKVDB_CRC_SIZE) {
+				break;
+			}
+			memcpy(&crc, ptr + rec.key_size, TKVDB_CRC_SIZE);
+			if (crc != tkvdb_crc32c(0, start, ptr - start
+				- sizeof(struct tkvdb_wal_rec))) {
 
-		case TKVDB_PARAM_DBFILE_OPEN_FLAGS:
-			params->flags = val;
-			break;
-		default:
-			break;
+				break;
+			}
+			start = valid_end = ptr + rec.key_size + rec.val_size;
+		}
+		ptr += (size_t)rec.key_size + rec.val_size;
 	}
-}
+	wal->applied = valid_end - buf;
+
+truncate:
+	if ((uint64_t)st.st_size > wal->applied) {
+		/* torn tail of interrupted commit */
+		if (ftruncate(db->wal_fd, wal->applied) != 0) {
+			/* read-only database, log can't be appended */
+			wal->full = 1;
+		}
+	}
+	tkvdb_wal_unlock(db);
+
+	/* and replay records before it */
+	for (ptr = buf + sizeof(struct tkvdb_wal_header);
+		buf && (ptr < (buf + wal->applied)); ) {
+
+		memcpy(&rec, ptr, sizeof(struct tkvdb_wal_rec));
+		ptr += sizeof(struct tkvdb_wal_rec);
+		key.data = ptr;
+		key.size = rec.key_size;
+		ptr += rec.key_size;
+		val.data = ptr;
+		val.size = rec.val_size;
+		ptr += rec.val_size;
+
+		switch (rec.type) {
+			case TKVDB_WAL_PUT:
+				r = wal->impl.put(trns, &key, &val);
+				break;
+			case TKVDB_WAL_DEL:
+			case TKVDB_WAL_DEL_PFX:
+				r = wal->impl.del(trns, &key,
+					rec.type == TKVDB_WAL_DEL_PFX);
+				if (r == TKVDB_NOT_FOUND) {
+					r = TKVDB_OK;
+				}
+				break;
+			default:
+				break;
+		}
+		if (r != TKVDB_OK) {
+			free(buf);
+			return r;
+		}
+	}
+	free(buf);
 
+	wal->trie_id = db->info.footer.transaction_id;
+	wal->loaded = 1;
 
-/* cursors */
+	return TKVDB_OK;
+
+unlock:
+	tkvdb_wal_unlock(db);
+	free(buf);
+	return r;
+}
+
+/* result of write or sync for requests which were not rejected */
 static void
-tkvdb_cursor_free(tkvdb_cursor *c)
+tkvdb_wal_result(struct tkvdb_wal_req *reqs, TKVDB_RES r)
 {
-	tkvdb_cursor_data *cdata;
+	struct tkvdb_wal_req *req;
 
-	cdata = c->data;
+	for (req=reqs; req; req=req->next) {
+		if (req->r == TKVDB_OK) {
+			req->r = r;
+		}
+	}
+}
 
-	free(cdata->prefix);
-	cdata->prefix_size = 0;
-	cdata->key_allocated = 0;
+/* append records of requests 'reqs' to log with one write, caller holds
+ * log lock. Returns 1 if log should be synced for them */
+static int
+tkvdb_wal_write(tkvdb *db, struct tkvdb_wal_req *reqs)
+{
+	struct tkvdb_wal_header hdr;
+	struct tkvdb_db_info info;
+	struct tkvdb_wal_req *req;
+	struct stat st;
+	uint8_t *buf = NULL, *ptr;
+	uint64_t off;
+	size_t size = 0;
+	int n = 0, dosync = 0;
+	TKVDB_RES r = TKVDB_IO_ERROR;
+
+	if (fstat(db->wal_fd, &st) < 0) {
+		goto done;
+	}
+	off = st.st_size;
+	if ((off >= sizeof(hdr))
+		&& ((lseek(db->wal_fd, 0, SEEK_SET) != 0)
+			|| !tkvdb_try_read_file(db->wal_fd, &hdr,
+				sizeof(hdr), 0))) {
 
-	cdata->val_size = 0;
-	cdata->val = NULL;
+		goto done;
+	}
+	if ((off < sizeof(hdr)) || (memcmp(hdr.signature,
+		TKVDB_WAL_SIGNATURE, sizeof(TKVDB_WAL_SIGNATURE) - 1) != 0)) {
 
-	free(cdata->stack);
-	cdata->stack = NULL;
-	cdata->stack_size = 0;
-	cdata->stack_allocated = 0;
+		/* records are on top of current data of file */
+		if ((r = tkvdb_info_get(db, &info)) != TKVDB_OK) {
+			goto done;
+		}
+		memcpy(hdr.signature, TKVDB_WAL_SIGNATURE,
+			sizeof(TKVDB_WAL_SIGNATURE) - 1);
+		hdr.data_gen = (info.filesize > 0) ? info.footer.data_gen : 0;
+		off = 0;
+		size = sizeof(hdr);
+	}
 
-	free(cdata);
-	c->data = NULL;
-	free(c);
-}
+	for (req=reqs; req; req=req->next) {
+		if (req->data_gen != hdr.data_gen) {
+			/* log was merged into file by other handle */
+			req->r = TKVDB_MODIFIED;
+			continue;
+		}
+		size += req->size + sizeof(req->mark);
+		dosync |= req->dosync;
+		n++;
+	}
+	if (n == 0) {
+		return 0;
+	}
 
+	buf = malloc(size);
+	if (!buf) {
+		r = TKVDB_ENOMEM;
+		goto done;
+	}
+	ptr = buf;
+	if (off == 0) {
+		memcpy(ptr, &hdr, sizeof(hdr));
+		ptr += sizeof(hdr);
+	}
+	for (req=reqs; req; req=req->next) {
+		if (req->r != TKVDB_OK) {
+			continue;
+		}
+		/* header of new log is written by the first request */
+		req->written = req->size + sizeof(req->mark)
+			+ ((ptr == buf + sizeof(hdr)) && (off == 0)
+				? sizeof(hdr) : 0);
+		req->off = off + (ptr - buf);
+		memcpy(ptr, req->buf, req->size);
+		ptr += req->size;
+		memcpy(ptr, req->mark, sizeof(req->mark));
+		ptr += sizeof(req->mark);
+	}
 
-static void *
-tkvdb_cursor_key(tkvdb_cursor *c)
-{
-	tkvdb_cursor_data *cdata = c->data;
-	return cdata->prefix;
-}
+	r = TKVDB_IO_ERROR;
+	if ((off == 0) && (ftruncate(db->wal_fd, 0) != 0)) {
+		goto done;
+	}
+	if (!tkvdb_try_pwrite_file(db->wal_fd, buf, ptr - buf, off)) {
+		goto done;
+	}
+	r = TKVDB_OK;
 
-static size_t
-tkvdb_cursor_keysize(tkvdb_cursor *c)
-{
-	tkvdb_cursor_data *cdata = c->data;
-	return cdata->prefix_size;
-}
+done:
+	free(buf);
+	tkvdb_wal_result(reqs, r);
 
-static void *
-tkvdb_cursor_val(tkvdb_cursor *c)
-{
-	tkvdb_cursor_data *cdata = c->data;
-	return cdata->val;
+	return (r == TKVDB_OK) && dosync;
 }
 
-static size_t
-tkvdb_cursor_valsize(tkvdb_cursor *c)
+/* requests of handles of one file are combined: the first one writes
+ * records of all requests that came during previous write and syncs log
+ * for them, others wait. Log isn't locked during sync, next batch is
+ * written meanwhile and shares the next sync */
+static void
+tkvdb_wal_submit(tkvdb *db, struct tkvdb_wal_req *req)
 {
-	tkvdb_cursor_data *cdata = c->data;
-	return cdata->val_size;
-}
+#ifdef TKVDB_COMMIT_THREADS
+	struct tkvdb_group *g = db->group;
+	struct tkvdb_wal_req *batch, *next;
+	int dosync;
+
+	req->next = NULL;
+	req->taken = req->done = 0;
+	if (g) {
+		pthread_mutex_lock(&g->mtx);
+		if (g->queue_last) {
+			g->queue_last->next = req;
+		} else {
+			g->queue = req;
+		}
+		g->queue_last = req;
 
-static tkvdb_datum
-tkvdb_cursor_key_datum(tkvdb_cursor *c)
-{
-	tkvdb_datum dat;
-	tkvdb_cursor_data *cdata = c->data;
+		while (!req->done) {
+			if (req->taken || g->writing) {
+				pthread_cond_wait(&g->cond, &g->mtx);
+				continue;
+			}
 
-	dat.data = cdata->prefix;
-	dat.size = cdata->prefix_size;
+			batch = g->queue;
+			g->queue = g->queue_last = NULL;
+			for (next=batch; next; next=next->next) {
+				next->taken = 1;
+			}
+			g->writing = 1;
+			pthread_mutex_unlock(&g->mtx);
+
+			dosync = tkvdb_wal_write(db, batch);
+			tkvdb_wal_unlock(db);
+			if (dosync) {
+				tkvdb_wal_result(batch,
+					tkvdb_group_sync_log(db));
+			}
 
-	return dat;
+			pthread_mutex_lock(&g->mtx);
+			for (; batch; batch=next) {
+				next = batch->next;
+				batch->done = 1;
+			}
+			pthread_cond_broadcast(&g->cond);
+		}
+		pthread_mutex_unlock(&g->mtx);
+
+		return;
+	}
+#endif
+	req->next = NULL;
+	if (tkvdb_wal_write(db, req)) {
+		tkvdb_wal_result(req, tkvdb_datasync(db->wal_fd));
+	}
 }
 
-static tkvdb_datum
-tkvdb_cursor_val_datum(tkvdb_cursor *c)
+/* append logged records and commit mark */
+static TKVDB_RES
+tkvdb_wal_append(tkvdb_tr *trns)
 {
-	tkvdb_datum dat;
-	tkvdb_cursor_data *cdata = c->data;
-
-	dat.data = cdata->val;
-	dat.size = cdata->val_size;
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal = tr->wal;
+	tkvdb *db = tr->db;
+	struct tkvdb_wal_req req;
+	struct tkvdb_wal_rec rec;
+	uint64_t end, gen;
+	uint32_t crc;
+	int file_dirty;
+
+	rec.type = TKVDB_WAL_COMMIT;
+	rec.key_size = 0;
+	rec.val_size = TKVDB_CRC_SIZE;
+	crc = tkvdb_crc32c(0, wal->buf, wal->used);
+	memcpy(req.mark, &rec, sizeof(struct tkvdb_wal_rec));
+	memcpy(req.mark + sizeof(struct tkvdb_wal_rec), &crc,
+		TKVDB_CRC_SIZE);
+
+	req.buf = wal->buf;
+	req.size = wal->used;
+	req.data_gen = db->info.footer.data_gen;
+	req.dosync = tkvdb_syncer_add(db, wal->used + sizeof(req.mark), 0);
+	req.off = req.written = 0;
+	req.r = TKVDB_OK;
+
+	tkvdb_wal_submit(db, &req);
+	TKVDB_EXEC( req.r );
+
+	if (req.off != (wal->applied ? wal->applied
+		: sizeof(struct tkvdb_wal_header))) {
+
+		/* records of other handles are before ours */
+		wal->loaded = 0;
+	}
+	db->wal_written += req.written;
+	wal->applied = req.off + req.size + sizeof(req.mark);
+	wal->used = 0;
+
+	if (req.dosync) {
+		/* log was synced by writer of request */
+		tkvdb_syncer_lock(db);
+		file_dirty = db->syncer.file_dirty;
+		tkvdb_syncer_unlock(db);
+		if (file_dirty) {
+			TKVDB_EXEC( tkvdb_syncer_sync(db) );
+		} else {
+			tkvdb_syncer_written(db, &end, &gen);
+			tkvdb_syncer_reset(db, end, gen);
+		}
+	}
 
-	return dat;
+	return TKVDB_OK;
 }
 
-static int
-tkvdb_cursor_resize_prefix(tkvdb_cursor *c, size_t n, int grow)
+static TKVDB_RES
+tkvdb_wal_put(tkvdb_tr *trns, const tkvdb_datum *key,
+	const tkvdb_datum *val)
 {
-	tkvdb_cursor_data *cdata = c->data;
-
-	if (n == 0) {
-		/* underflow? */
-		return TKVDB_OK;
-	}
+	tkvdb_tr_data *tr = trns->data;
 
-	if (!grow) {
-		/* don't need to reallocate */
-		return TKVDB_OK;
-	}
+	TKVDB_EXEC( tr->wal->impl.put(trns, key, val) );
+	tkvdb_wal_log(trns, TKVDB_WAL_PUT, key, val);
 
-	if ((cdata->prefix_size + n) > cdata->key_allocated) {
-		unsigned char *tmp_pfx;
+	return TKVDB_OK;
+}
 
-		/* need more memory */
-		if (!cdata->key_dynalloc) {
-			/* and no dynamic reallocation allowed */
-			return TKVDB_ENOMEM;
-		}
+static TKVDB_RES
+tkvdb_wal_del(tkvdb_tr *trns, const tkvdb_datum *key, int del_pfx)
+{
+	tkvdb_tr_data *tr = trns->data;
 
-		tmp_pfx = realloc(cdata->prefix, cdata->prefix_size + n);
-		if (!tmp_pfx) {
-			return TKVDB_ENOMEM;
-		}
-		cdata->prefix = tmp_pfx;
-		cdata->key_allocated = cdata->prefix_size + n;
-	}
+	TKVDB_EXEC( tr->wal->impl.del(trns, key, del_pfx) );
+	tkvdb_wal_log(trns, del_pfx ? TKVDB_WAL_DEL_PFX : TKVDB_WAL_DEL,
+		key, NULL);
 
 	return TKVDB_OK;
 }
 
-static void
-tkvdb_cursor_reset(tkvdb_cursor *c)
+/* triggers may change metadata, such transaction is merged to database */
+static TKVDB_RES
+tkvdb_wal_putx(tkvdb_tr *trns, const tkvdb_datum *key,
+	const tkvdb_datum *val, tkvdb_triggers *triggers)
 {
-	tkvdb_cursor_data *cdata = c->data;
+	tkvdb_tr_data *tr = trns->data;
 
-	cdata->stack_size = 0;
-	cdata->prefix_size = 0;
+	tr->wal->full = 1;
+	return tr->wal->impl.putx(trns, key, val, triggers);
+}
 
-	cdata->val_size = 0;
-	cdata->val = NULL;
+static TKVDB_RES
+tkvdb_wal_delx(tkvdb_tr *trns, const tkvdb_datum *key, int del_pfx,
+	tkvdb_triggers *triggers)
+{
+	tkvdb_tr_data *tr = trns->data;
+
+	tr->wal->full = 1;
+	return tr->wal->impl.delx(trns, key, del_pfx, triggers);
 }
 
-/* reallocate transaction write buffer */
 static TKVDB_RES
-tkvdb_writebuf_realloc(tkvdb *db, size_t new_size)
+tkvdb_wal_commit(tkvdb_tr *trns)
 {
-	if (new_size > db->params.write_buf_limit) {
-		/* not enough space for node in buffer */
-		return TKVDB_ENOMEM;
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal = tr->wal;
+	struct stat st;
+	TKVDB_RES r;
+
+	if (!tr->started) {
+		return TKVDB_NOT_STARTED;
+	}
+
+	if (tr->snapshot) {
+		/* read-only, nothing is logged */
+		return wal->impl.commit(trns);
 	}
-	if (new_size > db->write_buf_allocated) {
-		uint8_t *tmp;
 
-		if (!db->params.write_buf_dynalloc) {
-			return TKVDB_ENOMEM;
+	if ((wal->used == 0) && !wal->full) {
+		/* nothing changed, transaction is kept for next begin() */
+		if (!tr->params.autobegin) {
+			TKVDB_STORE_REL(tr->started, 0);
 		}
+		return TKVDB_OK;
+	}
 
-		tmp = realloc(db->write_buf, new_size);
-		if (!tmp) {
-			return TKVDB_ENOMEM;
+	if (wal->full
+		|| ((wal->applied + wal->used + sizeof(struct tkvdb_wal_rec)
+			+ TKVDB_CRC_SIZE) > tr->db->params.wal_limit)
+		|| (tr->tr_buf_allocated > (tr->params.tr_buf_limit / 2))) {
+
+		/* checkpoint, log isn't appended until it's truncated */
+		tkvdb_wal_lock(tr->db);
+		if (fstat(tr->db->wal_fd, &st) < 0) {
+			r = TKVDB_IO_ERROR;
+		} else if ((uint64_t)st.st_size != wal->applied) {
+			/* records of other handle are not in transaction */
+			r = TKVDB_MODIFIED;
+		} else {
+			r = wal->impl.commit(trns);
+			if (r == TKVDB_OK) {
+				wal->loaded = 0;
+				r = tkvdb_wal_reset(tr->db);
+			}
 		}
+		tkvdb_wal_unlock(tr->db);
 
-		db->write_buf = tmp;
-		db->write_buf_allocated = new_size;
+		if ((r == TKVDB_OK) && tr->params.autobegin) {
+			r = tkvdb_wal_load(trns);
+		}
+		return r;
+	}
+
+	/* records are blind writes, they are appended after records of
+	 * other handles */
+	TKVDB_EXEC( tkvdb_wal_append(trns) );
+	if (!tr->params.autobegin) {
+		TKVDB_STORE_REL(tr->started, 0);
+	} else if (!wal->loaded) {
+		return tkvdb_wal_load(trns);
 	}
 
 	return TKVDB_OK;
 }
 
-
-/* generated implementation of tkvdb_* functions () */
-#include "tkvdb_generated.inc"
-
-TKVDB_RES
-tkvdb_dbinfo(tkvdb *db, uint64_t *root_off,
-	uint64_t *gap_begin, uint64_t *gap_end)
+static TKVDB_RES
+tkvdb_wal_rollback(tkvdb_tr *trns)
 {
-	struct tkvdb_db_info info;
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal = tr->wal;
 
-	TKVDB_EXEC( tkvdb_info_read(db->fd, &info) );
+	TKVDB_EXEC( wal->impl.rollback(trns) );
+	wal->used = 0;
+	wal->full = 0;
+	wal->loaded = 0;
 
-	*root_off = info.footer.root_off;
+	if (tr->params.autobegin) {
+		return tkvdb_wal_load(trns);
+	}
+	return TKVDB_OK;
+}
 
-	*gap_begin = info.footer.gap_begin;
-	*gap_end = info.footer.gap_end;
+static void
+tkvdb_wal_free(tkvdb_tr *trns)
+{
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal = tr->wal;
 
-	return TKVDB_OK;
+	free(wal->buf);
+	tr->wal = NULL;
+	wal->impl.free(trns);
+	free(wal);
 }
 
 static TKVDB_RES
 tkvdb_begin(tkvdb_tr *trns)
 {
 	tkvdb_tr_data *tr = trns->data;
+	TKVDB_RES r;
 
-	if (tr->started) {
-		/* ignore if transaction is already started */
-		return TKVDB_OK;
+	if (tr->started || !tr->wal) {
+		return tkvdb_begin_db(trns);
 	}
 
-	if (!tr->db) {
-		/* no underlying database file */
-		tr->started = 1;
-		return TKVDB_OK;
+	TKVDB_EXEC( tkvdb_begin_db(trns) );
+	r = tkvdb_wal_load(trns);
+	if (r != TKVDB_OK) {
+		tkvdb_wal_rollback(trns);
 	}
 
-	/* read database info to find root node */
-	TKVDB_EXEC( tkvdb_info_read(tr->db->fd, &(tr->db->info)) );
+	return r;
+}
 
-	if (tr->db->info.filesize == 0) {
-		memset(&(tr->db->info.footer),
-			0, sizeof(struct tkvdb_tr_footer));
-	} else {
-		/* increase transaction number */
-		tr->db->info.footer.transaction_id += 1;
+/* wrap functions of transaction with write-ahead log */
+static TKVDB_RES
+tkvdb_wal_attach(tkvdb_tr *trns)
+{
+	tkvdb_tr_data *tr = trns->data;
+	struct tkvdb_tr_wal *wal;
+
+	wal = malloc(sizeof(struct tkvdb_tr_wal));
+	if (!wal) {
+		return TKVDB_ENOMEM;
 	}
 
-	tr->started = 1;
+	wal->impl = *trns;
+	wal->buf = NULL;
+	wal->used = wal->allocated = 0;
+	wal->full = 0;
+	wal->loaded = 0;
+	wal->applied = 0;
+	wal->trie_id = 0;
+	tr->wal = wal;
+
+	trns->commit = &tkvdb_wal_commit;
+	trns->rollback = &tkvdb_wal_rollback;
+	trns->put = &tkvdb_wal_put;
+	trns->del = &tkvdb_wal_del;
+	trns->free = &tkvdb_wal_free;
+	trns->putx = &tkvdb_wal_putx;
+	trns->delx = &tkvdb_wal_delx;
+
+	if (tr->params.autobegin) {
+		/* begin() is never called */
+		return tkvdb_wal_load(trns);
+	}
 
 	return TKVDB_OK;
 }
@@ -711,6 +6515,17 @@ tkvdb_tr_mem(tkvdb_tr *trns)
 	return tr->tr_buf_allocated;
 }
 
+/* RAM-only transaction with all nodes in preallocated buffer, subnodes
+ * may be referenced by 32-bit offsets */
+static int
+tkvdb_tr_ref32(const tkvdb_tr_data *tr)
+{
+	return !tr->db && !tr->params.tr_buf_dynalloc
+		&& !tr->params.tr_concurrent
+		&& ((tr->params.tr_buf_limit >> TKVDB_ARENA_SHIFT)
+			< UINT32_MAX);
+}
+
 tkvdb_tr *
 tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 {
@@ -723,7 +6538,7 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 	}
 
 	trdata = malloc(sizeof(tkvdb_tr_data));
-	if (!tr) {
+	if (!trdata) {
 		goto fail_trdata;
 	}
 
@@ -731,6 +6546,8 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 
 	trdata->db = db;
 	trdata->root = NULL;
+	trdata->root_off = 0;
+	trdata->snapshot = 0;
 
 	/* setup params */
 	if (user_params) {
@@ -743,15 +6560,28 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 		}
 	}
 
+	if (trdata->params.tr_concurrent) {
+		if (db) {
+			/* only RAM-only transactions */
+			goto fail_buf;
+		}
+		/* nodes are allocated by many threads */
+		trdata->params.tr_buf_dynalloc = 1;
+		/* and never freed before rollback */
+		trdata->params.readers = 0;
+	}
+	trdata->retired = NULL;
+
 	if (!trdata->params.tr_buf_dynalloc) {
-		trdata->tr_buf = malloc(trdata->params.tr_buf_limit);
-		if (!trdata->tr_buf) {
+		uint8_t *buf = malloc(trdata->params.tr_buf_limit);
+
+		if (!buf) {
 			goto fail_buf;
 		}
-		trdata->tr_buf_ptr = trdata->tr_buf;
+		tkvdb_arena_init(&trdata->arena, buf,
+			trdata->params.tr_buf_limit);
 	} else {
-		trdata->tr_buf = NULL;
-		trdata->tr_buf_ptr = NULL;
+		tkvdb_arena_init(&trdata->arena, NULL, 0);
 	}
 	trdata->tr_buf_allocated = 0;
 
@@ -774,6 +6604,17 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 		trdata->stack_allocated = trdata->params.stack_limit;
 	}
 
+	trdata->wal = NULL;
+
+	/* concurrent readers, only for RAM-only transactions */
+	trdata->ebr = NULL;
+	if ((trdata->params.readers > 0) && !db) {
+		trdata->ebr = tkvdb_ebr_create(trdata->params.readers);
+		if (!trdata->ebr) {
+			goto fail_ebr;
+		}
+	}
+
 	/* setup functions */
 	tr->begin = &tkvdb_begin;
 	tr->mem = &tkvdb_tr_mem;
@@ -785,6 +6626,7 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 
 			tr->put = &tkvdb_put_alignval;
 			tr->get = &tkvdb_get_alignval;
+			tr->mget = &tkvdb_mget_alignval;
 			tr->del = &tkvdb_del_alignval;
 
 			tr->free = &tkvdb_tr_free_alignval;
@@ -792,6 +6634,21 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 			tr->putx = &tkvdb_put_alignvalx;
 			tr->delx = &tkvdb_del_alignvalx;
 			tr->subnode = &tkvdb_subnode_alignval;
+		} else if (tkvdb_tr_ref32(trdata)) {
+			/* RAM-only, compact references */
+			tr->commit = &tkvdb_commit_alignval_nodb_ref32;
+			tr->rollback = &tkvdb_rollback_alignval_nodb_ref32;
+
+			tr->put = &tkvdb_put_alignval_nodb_ref32;
+			tr->get = &tkvdb_get_alignval_nodb_ref32;
+			tr->mget = &tkvdb_mget_alignval_nodb_ref32;
+			tr->del = &tkvdb_del_alignval_nodb_ref32;
+
+			tr->free = &tkvdb_tr_free_alignval_nodb_ref32;
+
+			tr->putx = &tkvdb_put_alignval_nodb_ref32x;
+			tr->delx = &tkvdb_del_alignval_nodb_ref32x;
+			tr->subnode = &tkvdb_subnode_alignval_nodb_ref32;
 		} else {
 			/* RAM-only */
 			tr->commit = &tkvdb_commit_alignval_nodb;
@@ -799,6 +6656,7 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 
 			tr->put = &tkvdb_put_alignval_nodb;
 			tr->get = &tkvdb_get_alignval_nodb;
+			tr->mget = &tkvdb_mget_alignval_nodb;
 			tr->del = &tkvdb_del_alignval_nodb;
 
 			tr->free = &tkvdb_tr_free_alignval_nodb;
@@ -814,6 +6672,7 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 
 			tr->put = &tkvdb_put_generic;
 			tr->get = &tkvdb_get_generic;
+			tr->mget = &tkvdb_mget_generic;
 			tr->del = &tkvdb_del_generic;
 
 			tr->free = &tkvdb_tr_free_generic;
@@ -821,12 +6680,27 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 			tr->putx = &tkvdb_put_genericx;
 			tr->delx = &tkvdb_del_genericx;
 			tr->subnode = &tkvdb_subnode_generic;
+		} else if (tkvdb_tr_ref32(trdata)) {
+			tr->commit = &tkvdb_commit_generic_nodb_ref32;
+			tr->rollback = &tkvdb_rollback_generic_nodb_ref32;
+
+			tr->put = &tkvdb_put_generic_nodb_ref32;
+			tr->get = &tkvdb_get_generic_nodb_ref32;
+			tr->mget = &tkvdb_mget_generic_nodb_ref32;
+			tr->del = &tkvdb_del_generic_nodb_ref32;
+
+			tr->free = &tkvdb_tr_free_generic_nodb_ref32;
+
+			tr->putx = &tkvdb_put_generic_nodb_ref32x;
+			tr->delx = &tkvdb_del_generic_nodb_ref32x;
+			tr->subnode = &tkvdb_subnode_generic_nodb_ref32;
 		} else {
 			tr->commit = &tkvdb_commit_generic_nodb;
 			tr->rollback = &tkvdb_rollback_generic_nodb;
 
 			tr->put = &tkvdb_put_generic_nodb;
 			tr->get = &tkvdb_get_generic_nodb;
+			tr->mget = &tkvdb_mget_generic_nodb;
 			tr->del = &tkvdb_del_generic_nodb;
 
 			tr->free = &tkvdb_tr_free_generic_nodb;
@@ -837,11 +6711,20 @@ tkvdb_tr_create(tkvdb *db, tkvdb_params *user_params)
 		}
 	}
 
+	if (db && (db->params.wal_limit > 0) && (db->wal_fd >= 0)
+		&& (tkvdb_wal_attach(tr) != TKVDB_OK)) {
+
+		tr->free(tr);
+		return NULL;
+	}
+
 	return tr;
 
 	/* errors */
+fail_ebr:
+	free(trdata->stack);
 fail_stack:
-	free(trdata->tr_buf);
+	free(trdata->arena.buf);
 fail_buf:
 	free(trdata);
 fail_trdata:
@@ -932,6 +6815,13 @@ tkvdb_cursor_create(tkvdb_tr *tr)
 
 			c->next = &tkvdb_next_alignval;
 			c->prev = &tkvdb_prev_alignval;
+		} else if (tkvdb_tr_ref32(trdata)) {
+			c->seek = &tkvdb_seek_alignval_nodb_ref32;
+			c->first = &tkvdb_first_alignval_nodb_ref32;
+			c->last = &tkvdb_last_alignval_nodb_ref32;
+
+			c->next = &tkvdb_next_alignval_nodb_ref32;
+			c->prev = &tkvdb_prev_alignval_nodb_ref32;
 		} else {
 			/* RAM-only */
 			c->seek = &tkvdb_seek_alignval_nodb;
@@ -949,6 +6839,13 @@ tkvdb_cursor_create(tkvdb_tr *tr)
 
 			c->next = &tkvdb_next_generic;
 			c->prev = &tkvdb_prev_generic;
+		} else if (tkvdb_tr_ref32(trdata)) {
+			c->seek = &tkvdb_seek_generic_nodb_ref32;
+			c->first = &tkvdb_first_generic_nodb_ref32;
+			c->last = &tkvdb_last_generic_nodb_ref32;
+
+			c->next = &tkvdb_next_generic_nodb_ref32;
+			c->prev = &tkvdb_prev_generic_nodb_ref32;
 		} else {
 			c->seek = &tkvdb_seek_generic_nodb;
 			c->first = &tkvdb_first_generic_nodb;
@@ -1033,3 +6930,397 @@ tkvdb_triggers_free(tkvdb_triggers *triggers)
 	free(triggers);
 }
 
+
+/* asynchronous commit
+ * keys are added to one of two RAM-only buffers, when it's full, buffer
+ * is handed off to writer thread and next keys go to other buffer.
+ * Writer puts keys of buffer to database file using its own handle and
+ * transaction. Buffer is kept until next hand-off, so reads see data of
+ * both buffers and data of database file read with separate handle.
+ * Buffer which failed to commit is kept and handed off again */
+struct tkvdb_async
+{
+	tkvdb *wdb, *rdb;           /* handles of writer and reader */
+	tkvdb_tr *wtr, *rtr;        /* database transactions */
+
+	tkvdb_tr *buf[2];           /* RAM-only buffers */
+	tkvdb_cursor *c[2];         /* cursors for writer */
+	int cur;                    /* buffer for new keys */
+	int dirty;                  /* current buffer is not empty */
+	int held;                   /* other buffer is handed off */
+
+	int busy;                   /* writer is committing other buffer */
+	TKVDB_RES r;                /* result of last commit */
+
+	tkvdb_async_func done;
+	void *userdata;
+
+#ifdef TKVDB_COMMIT_THREADS
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int thread_started;
+	int stop;
+#endif
+};
+
+/* put all pairs of buffer 'n' to database, buffer which doesn't fit to
+ * transaction is committed in several parts */
+static TKVDB_RES
+tkvdb_async_apply(tkvdb_async *a, int n)
+{
+	tkvdb_tr *tr = a->wtr;
+	tkvdb_cursor *c = a->c[n];
+	tkvdb_datum key, val;
+	TKVDB_RES r;
+
+	TKVDB_EXEC( tr->begin(tr) );
+
+	for (r = c->first(c); r == TKVDB_OK; r = c->next(c)) {
+		key = c->key_datum(c);
+		val = c->val_datum(c);
+
+		r = tr->put(tr, &key, &val);
+		if (r == TKVDB_ENOMEM) {
+			/* transaction buffer is full, flush it */
+			r = tr->commit(tr);
+			if (r != TKVDB_OK) {
+				break;
+			}
+			r = tr->begin(tr);
+			if (r != TKVDB_OK) {
+				return r;
+			}
+
+			r = tr->put(tr, &key, &val);
+		}
+		if (r != TKVDB_OK) {
+			break;
+		}
+	}
+
+	if ((r != TKVDB_NOT_FOUND) && (r != TKVDB_EMPTY)) {
+		/* error */
+		tr->rollback(tr);
+		return r;
+	}
+
+	r = tr->commit(tr);
+	if (r != TKVDB_OK) {
+		/* buffer is applied again by next hand-off */
+		tr->rollback(tr);
+	}
+
+	return r;
+}
+
+#ifdef TKVDB_COMMIT_THREADS
+static void *
+tkvdb_async_thread(void *arg)
+{
+	tkvdb_async *a = arg;
+	TKVDB_RES r;
+	int n;
+
+	pthread_mutex_lock(&a->mtx);
+	for (;;) {
+		while (!a->busy && !a->stop) {
+			pthread_cond_wait(&a->cond, &a->mtx);
+		}
+		if (!a->busy) {
+			break;
+		}
+		n = !a->cur;
+		pthread_mutex_unlock(&a->mtx);
+
+		r = tkvdb_async_apply(a, n);
+		if (a->done) {
+			a->done(r, a->userdata);
+		}
+
+		pthread_mutex_lock(&a->mtx);
+		a->r = r;
+		a->busy = 0;
+		pthread_cond_broadcast(&a->cond);
+	}
+	pthread_mutex_unlock(&a->mtx);
+
+	return NULL;
+}
+#endif
+
+/* give buffer which is not current to writer */
+static void
+tkvdb_async_handoff(tkvdb_async *a)
+{
+	a->held = 1;
+
+#ifdef TKVDB_COMMIT_THREADS
+	pthread_mutex_lock(&a->mtx);
+	a->r = TKVDB_OK;
+	a->busy = 1;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->mtx);
+#else
+	/* no threads, commit in place */
+	a->r = tkvdb_async_apply(a, !a->cur);
+	if (a->done) {
+		a->done(a->r, a->userdata);
+	}
+#endif
+}
+
+/* wait for writer and drop handed off buffer if its data is in database,
+ * otherwise buffer is kept for retry */
+static TKVDB_RES
+tkvdb_async_retire(tkvdb_async *a)
+{
+	tkvdb_tr *old;
+
+	TKVDB_EXEC( tkvdb_async_wait(a) );
+
+	if (a->held) {
+		old = a->buf[!a->cur];
+		old->rollback(old);
+		old->begin(old);
+		a->held = 0;
+	}
+
+	/* reader sees new state of database */
+	a->rtr->rollback(a->rtr);
+	return a->rtr->begin(a->rtr);
+}
+
+static void
+tkvdb_async_free_data(tkvdb_async *a)
+{
+	int i;
+
+#ifdef TKVDB_COMMIT_THREADS
+	if (a->thread_started) {
+		pthread_mutex_lock(&a->mtx);
+		a->stop = 1;
+		pthread_cond_broadcast(&a->cond);
+		pthread_mutex_unlock(&a->mtx);
+
+		pthread_join(a->thread, NULL);
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->mtx);
+	}
+#endif
+
+	for (i=0; i<2; i++) {
+		if (a->c[i]) {
+			a->c[i]->free(a->c[i]);
+		}
+		if (a->buf[i]) {
+			a->buf[i]->free(a->buf[i]);
+		}
+	}
+	if (a->wtr) {
+		a->wtr->free(a->wtr);
+	}
+	if (a->rtr) {
+		a->rtr->free(a->rtr);
+	}
+	if (a->wdb) {
+		tkvdb_close(a->wdb);
+	}
+	if (a->rdb) {
+		tkvdb_close(a->rdb);
+	}
+
+	free(a);
+}
+
+tkvdb_async *
+tkvdb_async_open(const char *path, tkvdb_params *params,
+	tkvdb_async_func done, void *userdata)
+{
+	tkvdb_async *a;
+	int i;
+
+	a = malloc(sizeof(tkvdb_async));
+	if (!a) {
+		return NULL;
+	}
+	memset(a, 0, sizeof(tkvdb_async));
+
+	a->done = done;
+	a->userdata = userdata;
+	a->r = TKVDB_OK;
+
+	a->wdb = tkvdb_open(path, params);
+	if (!a->wdb) {
+		goto fail;
+	}
+	a->rdb = tkvdb_open(path, params);
+	if (!a->rdb) {
+		goto fail;
+	}
+
+	a->wtr = tkvdb_tr_create(a->wdb, params);
+	a->rtr = tkvdb_tr_create(a->rdb, params);
+	if (!a->wtr || !a->rtr) {
+		goto fail;
+	}
+	if (a->rtr->begin(a->rtr) != TKVDB_OK) {
+		goto fail;
+	}
+
+	for (i=0; i<2; i++) {
+		a->buf[i] = tkvdb_tr_create(NULL, params);
+		if (!a->buf[i]) {
+			goto fail;
+		}
+		a->c[i] = tkvdb_cursor_create(a->buf[i]);
+		if (!a->c[i]) {
+			goto fail;
+		}
+		a->buf[i]->begin(a->buf[i]);
+	}
+
+#ifdef TKVDB_COMMIT_THREADS
+	if (pthread_mutex_init(&a->mtx, NULL) != 0) {
+		goto fail;
+	}
+	if (pthread_cond_init(&a->cond, NULL) != 0) {
+		pthread_mutex_destroy(&a->mtx);
+		goto fail;
+	}
+	if (pthread_create(&a->thread, NULL, &tkvdb_async_thread, a) != 0) {
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->mtx);
+		goto fail;
+	}
+	a->thread_started = 1;
+#endif
+
+	return a;
+
+fail:
+	tkvdb_async_free_data(a);
+	return NULL;
+}
+
+TKVDB_RES
+tkvdb_async_put(tkvdb_async *a, const tkvdb_datum *key,
+	const tkvdb_datum *val)
+{
+	tkvdb_tr *tr = a->buf[a->cur];
+	TKVDB_RES r;
+
+	r = tr->put(tr, key, val);
+	if (r == TKVDB_ENOMEM) {
+		/* buffer is full, continue in other one */
+		TKVDB_EXEC( tkvdb_async_commit(a) );
+
+		tr = a->buf[a->cur];
+		r = tr->put(tr, key, val);
+	}
+
+	if (r == TKVDB_OK) {
+		a->dirty = 1;
+	}
+
+	return r;
+}
+
+TKVDB_RES
+tkvdb_async_get(tkvdb_async *a, const tkvdb_datum *key, tkvdb_datum *val)
+{
+	tkvdb_tr *tr;
+	TKVDB_RES r;
+
+	/* newest data first */
+	tr = a->buf[a->cur];
+	r = tr->get(tr, key, val);
+	if ((r != TKVDB_NOT_FOUND) && (r != TKVDB_EMPTY)) {
+		return r;
+	}
+
+	if (a->held) {
+		/* buffer is read by writer too, but nobody modifies it */
+		tr = a->buf[!a->cur];
+		r = tr->get(tr, key, val);
+		if ((r != TKVDB_NOT_FOUND) && (r != TKVDB_EMPTY)) {
+			return r;
+		}
+	}
+
+	r = a->rtr->get(a->rtr, key, val);
+	if (r == TKVDB_ENOMEM) {
+		/* too many nodes loaded, start reader again */
+		TKVDB_EXEC( tkvdb_async_retire(a) );
+		r = a->rtr->get(a->rtr, key, val);
+	}
+
+	return (r == TKVDB_EMPTY) ? TKVDB_NOT_FOUND : r;
+}
+
+TKVDB_RES
+tkvdb_async_commit(tkvdb_async *a)
+{
+	TKVDB_RES r;
+
+	/* wait until writer is done with previous buffer */
+	r = tkvdb_async_retire(a);
+	if ((r != TKVDB_OK) && a->held) {
+		/* previous buffer is written again, current one waits */
+		tkvdb_async_handoff(a);
+		return r;
+	} else if (r != TKVDB_OK) {
+		return r;
+	}
+
+	if (!a->dirty) {
+		return TKVDB_OK;
+	}
+
+	a->cur = !a->cur;
+	a->dirty = 0;
+	tkvdb_async_handoff(a);
+
+	return TKVDB_OK;
+}
+
+TKVDB_RES
+tkvdb_async_wait(tkvdb_async *a)
+{
+	TKVDB_RES r;
+
+#ifdef TKVDB_COMMIT_THREADS
+	pthread_mutex_lock(&a->mtx);
+	while (a->busy) {
+		pthread_cond_wait(&a->cond, &a->mtx);
+	}
+	r = a->r;
+	pthread_mutex_unlock(&a->mtx);
+#else
+	r = a->r;
+#endif
+
+	return r;
+}
+
+TKVDB_RES
+tkvdb_async_close(tkvdb_async *a)
+{
+	TKVDB_RES r;
+
+	r = tkvdb_async_commit(a);
+	if ((r != TKVDB_OK) && a->held) {
+		/* failed buffer is handed off again, then the rest */
+		r = tkvdb_async_wait(a);
+		if (r == TKVDB_OK) {
+			r = tkvdb_async_commit(a);
+		}
+	}
+	if (r == TKVDB_OK) {
+		r = tkvdb_async_wait(a);
+	}
+
+	tkvdb_async_free_data(a);
+
+	return r;
+}
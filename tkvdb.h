@@ -8,6 +8,9 @@
 typedef struct tkvdb tkvdb;
 typedef struct tkvdb_params tkvdb_params;
 typedef struct tkvdb_triggers tkvdb_triggers;
+typedef struct tkvdb_reader tkvdb_reader;
+typedef struct tkvdb_loader tkvdb_loader;
+typedef struct tkvdb_async tkvdb_async;
 
 typedef enum TKVDB_RES
 {
@@ -19,7 +22,9 @@ typedef enum TKVDB_RES
 	TKVDB_ENOMEM,
 	TKVDB_CORRUPTED,
 	TKVDB_NOT_STARTED,
-	TKVDB_MODIFIED
+	TKVDB_MODIFIED,
+	TKVDB_NOT_SUPPORTED  /* operation can't be done with these parameters
+	                        of transaction or database */
 } TKVDB_RES;
 
 typedef enum TKVDB_SEEK
@@ -29,11 +34,20 @@ typedef enum TKVDB_SEEK
 	TKVDB_SEEK_GE
 } TKVDB_SEEK;
 
+/* when commit() calls fsync(), see TKVDB_PARAM_DURABILITY */
+typedef enum TKVDB_DURABILITY
+{
+	TKVDB_DURABILITY_NONE,      /* never, only tkvdb_sync() */
+	TKVDB_DURABILITY_COMMIT,    /* each commit */
+	TKVDB_DURABILITY_GROUP,     /* once for commits in time/size window */
+	TKVDB_DURABILITY_PERIODIC   /* by timer in background */
+} TKVDB_DURABILITY;
+
 /* database (or transaction) parameters */
 typedef enum TKVDB_PARAM
 {
-	/* dynamically allocate space for nodes (using system malloc() for
-	   each node) */
+	/* dynamically allocate space for nodes (in growable arena, chunks are
+	   taken from system using malloc()) */
 	TKVDB_PARAM_TR_DYNALLOC,
 
 	/* transaction size limit, default SIZE_MAX, e.g. no limit */
@@ -59,7 +73,64 @@ typedef enum TKVDB_PARAM
 	TKVDB_PARAM_CURSOR_KEY_LIMIT,
 
 	/* flags passed to open() function */
-	TKVDB_PARAM_DBFILE_OPEN_FLAGS
+	TKVDB_PARAM_DBFILE_OPEN_FLAGS,
+
+	/* size of database nodes cache shared by transactions (in bytes),
+	 * 0 (default) means no cache */
+	TKVDB_PARAM_CACHE_SIZE,
+
+	/* map database file to memory and read nodes directly from it */
+	TKVDB_PARAM_MMAP,
+
+	/* max number of readers working with RAM-only transaction in other
+	 * threads, 0 (default) disables concurrent readers */
+	TKVDB_PARAM_READERS,
+
+	/* put(), get() and del() of RAM-only transaction may be called from
+	 * many threads simultaneously, default 0 */
+	TKVDB_PARAM_TR_CONCURRENT,
+
+	/* size of database write buffer, commit writes nodes to file in
+	 * chunks of this size, default 4M */
+	TKVDB_PARAM_WRITE_BUF_LIMIT,
+
+	/* number of threads used by commit() to write subtrees of root,
+	 * default 1 */
+	TKVDB_PARAM_COMMIT_THREADS,
+
+	/* one of TKVDB_DURABILITY_*, default TKVDB_DURABILITY_NONE. In all
+	 * modes except NONE nodes of commit are synced before its footer */
+	TKVDB_PARAM_DURABILITY,
+
+	/* time window of group commit and period of periodic sync (in
+	 * milliseconds), default 100 */
+	TKVDB_PARAM_SYNC_INTERVAL,
+
+	/* size window of group commit (in bytes), default 16M */
+	TKVDB_PARAM_SYNC_BYTES,
+
+	/* maximum size of write-ahead log '<path>-wal' (in bytes), small
+	 * commits are appended to log and merged into database file when
+	 * log grows over this limit, default 0 (no log) */
+	TKVDB_PARAM_WAL_LIMIT,
+
+	/* compress nodes of new database file in 64K frames, used only
+	 * when file is created, default 0 */
+	TKVDB_PARAM_COMPRESS,
+
+	/* share the last footer of database file between handles and
+	 * processes through mapped page '<path>-ctl', begin() doesn't read
+	 * file, and commit after own commit doesn't read it too. All writers
+	 * of database must use it, default 0 */
+	TKVDB_PARAM_CONTROL,
+
+	/* CRC32C of each node and footer of new database file, used only
+	 * when file is created, default 0 */
+	TKVDB_PARAM_CHECKSUM,
+
+	/* memory for decompressed 64K frames of compressed database file (in
+	 * bytes), default 4M */
+	TKVDB_PARAM_FRAME_CACHE
 } TKVDB_PARAM;
 
 typedef struct tkvdb_datum
@@ -99,6 +170,10 @@ struct tkvdb_tr
 
 	TKVDB_RES (*subnode)(tkvdb_tr *tr, void *node, int n, void **subnode,
 		tkvdb_datum *prefix, tkvdb_datum *val, tkvdb_datum *meta);
+
+	/* get values of 'n' keys, result of each lookup is in 'results' */
+	TKVDB_RES (*mget)(tkvdb_tr *tr, const tkvdb_datum *keys,
+		tkvdb_datum *vals, TKVDB_RES *results, size_t n);
 };
 
 typedef struct tkvdb_cursor tkvdb_cursor;
@@ -165,6 +240,33 @@ typedef struct tkvdb_trigger_info
 
 typedef TKVDB_RES (*tkvdb_trigger_func)(tkvdb_trigger_info *info);
 
+/* progress of vacuum, see tkvdb_vacuum() */
+typedef struct tkvdb_vacuum_stat
+{
+	uint64_t pos;        /* file before this offset is processed */
+	uint64_t end;        /* end of data in file (position of footer) */
+	uint64_t moved;      /* bytes of live nodes copied by step */
+	uint64_t reclaimed;  /* bytes of free space found by step */
+	int done;            /* pass is finished, file is truncated */
+} tkvdb_vacuum_stat;
+
+/* state of database after commit, see tkvdb_snapshots() */
+typedef struct tkvdb_snapshot
+{
+	uint64_t transaction_id;
+	uint64_t root_off;   /* offset of root node */
+	int pinned;          /* number of pins, see tkvdb_snapshot_pin() */
+} tkvdb_snapshot;
+
+/* merge of values with the same key, see tkvdb_tr_merge()
+ * 'val' is value in destination transaction, function may modify it in
+ * place or set 'val' to new value (it will be copied) */
+typedef TKVDB_RES (*tkvdb_merge_func)(tkvdb_datum *val,
+	const tkvdb_datum *src_val, void *userdata);
+
+/* called by writer of tkvdb_async when handed off buffer is committed */
+typedef void (*tkvdb_async_func)(TKVDB_RES r, void *userdata);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -179,7 +281,7 @@ void tkvdb_params_free(tkvdb_params *params);
 /* database */
 tkvdb    *tkvdb_open(const char *path, tkvdb_params *params);
 TKVDB_RES tkvdb_close(tkvdb *db);
-/* fsync() db file */
+/* fsync() db file, commits which were not synced yet become durable */
 TKVDB_RES tkvdb_sync(tkvdb *db);
 
 /* in-memory transaction */
@@ -188,13 +290,100 @@ tkvdb_tr *tkvdb_tr_create(tkvdb *db, tkvdb_params *params);
 /* cursors */
 tkvdb_cursor *tkvdb_cursor_create(tkvdb_tr *tr);
 
-/* vacuum */
-TKVDB_RES tkvdb_vacuum(tkvdb_tr *tr, tkvdb_tr *vac, tkvdb_tr *tres,
-	tkvdb_cursor *c);
-/* get database file information */
+/* vacuum
+ * one step walks about 'max_bytes' of tree (0 - whole tree) and moves
+ * live nodes from the rest of file to free space or to the end of file
+ * using transaction 'vac'. Processed part of file becomes free space (gap)
+ * when walk of pass is finished. TKVDB_NOT_SUPPORTED if 'vac' is RAM-only
+ * transaction */
+TKVDB_RES tkvdb_vacuum(tkvdb_tr *vac, size_t max_bytes,
+	tkvdb_vacuum_stat *stat);
+/* get database file information, [gap_begin, gap_end) is the largest
+ * free extent of file */
 TKVDB_RES tkvdb_dbinfo(tkvdb *db, uint64_t *root_off,
 	uint64_t *gap_begin, uint64_t *gap_end);
-
+/* get nodes cache statistics */
+TKVDB_RES tkvdb_cache_info(tkvdb *db, uint64_t *hits, uint64_t *misses,
+	size_t *size);
+/* get number of bytes written to database file and to write-ahead log */
+TKVDB_RES tkvdb_write_info(tkvdb *db, uint64_t *db_bytes,
+	uint64_t *wal_bytes);
+/* get format of database file: nodes are compressed, nodes and footers
+ * have checksums (for empty file - values of parameters) */
+TKVDB_RES tkvdb_format_info(tkvdb *db, int *compress, int *checksum);
+/* get id of the last commit to database file, with TKVDB_PARAM_CONTROL
+ * it's one load from shared memory, so other processes may poll it */
+TKVDB_RES tkvdb_last_commit(tkvdb *db, uint64_t *transaction_id);
+/* check the whole tree of the last commit: layout of nodes and their
+ * checksums (if database has them, see TKVDB_PARAM_CHECKSUM), returns
+ * TKVDB_CORRUPTED on error */
+TKVDB_RES tkvdb_verify(tkvdb *db);
+
+/* snapshots
+ * list states of database which can be read (newest first), up to '*n'
+ * items, '*n' is set to number of returned snapshots. Snapshots before
+ * the last pass of vacuum are not kept, except pinned ones and newer */
+TKVDB_RES tkvdb_snapshots(tkvdb *db, tkvdb_snapshot *snaps, size_t *n);
+/* begin read-only transaction at snapshot, changes are not committed
+ * (commit() returns TKVDB_MODIFIED). Write-ahead log is not applied */
+TKVDB_RES tkvdb_tr_snapshot(tkvdb_tr *tr, uint64_t transaction_id);
+/* keep snapshot from vacuum, pass doesn't free its range until older
+ * snapshots are unpinned (vacuum returns TKVDB_LOCKED). Pins are stored in
+ * database file, up to 4 at once (TKVDB_ENOMEM if all are used) */
+TKVDB_RES tkvdb_snapshot_pin(tkvdb *db, uint64_t transaction_id);
+/* release pin of snapshot, TKVDB_PINS_ALL releases all pins (of crashed
+ * processes), TKVDB_NOT_FOUND if snapshot isn't pinned */
+#define TKVDB_PINS_ALL UINT64_MAX
+TKVDB_RES tkvdb_snapshot_unpin(tkvdb *db, uint64_t transaction_id);
+
+
+/* move all keys of RAM-only transaction 'src' to 'dst'
+ * values of keys present in both transactions are merged with 'merge'
+ * (or replaced with value from 'src' if 'merge' is NULL)
+ * 'src' is empty after merge, if merge failed in the middle, keys that
+ * were not moved yet are put back to 'src'. Both transactions must be
+ * RAM-only, with dynamic allocation, without TKVDB_PARAM_TR_CONCURRENT
+ * and with the same alignment of values, otherwise TKVDB_NOT_SUPPORTED
+ * is returned */
+TKVDB_RES tkvdb_tr_merge(tkvdb_tr *dst, tkvdb_tr *src, tkvdb_merge_func merge,
+	void *userdata);
+
+/* bulk loader, builds new tree from keys in ascending (memcmp) order
+ * and appends it to database as new transaction, previous contents of
+ * database are replaced. Memory usage depends only on length of keys
+ * no other writers should be used while loader is active */
+tkvdb_loader *tkvdb_loader_create(tkvdb *db);
+TKVDB_RES tkvdb_loader_add(tkvdb_loader *l, const tkvdb_datum *key,
+	const tkvdb_datum *val);
+TKVDB_RES tkvdb_loader_finish(tkvdb_loader *l);
+void tkvdb_loader_free(tkvdb_loader *l);
+
+/* concurrent readers of RAM-only transaction */
+tkvdb_reader *tkvdb_reader_create(tkvdb_tr *tr);
+void tkvdb_reader_enter(tkvdb_reader *r, tkvdb_tr *tr);
+void tkvdb_reader_leave(tkvdb_reader *r);
+void tkvdb_reader_free(tkvdb_reader *r);
+
+/* asynchronous commit
+ * pairs are added to one of two in-memory buffers, full buffer is
+ * committed to database file by background thread while next pairs go
+ * to other buffer. put() waits only if both buffers are full. get()
+ * sees pairs of both buffers and database. Keys can't be deleted.
+ * Errors of background commit are returned by next calls, failed buffer
+ * is kept and handed off again by next commit. Hand-off is not atomic:
+ * buffer may be written in several transactions */
+tkvdb_async *tkvdb_async_open(const char *path, tkvdb_params *params,
+	tkvdb_async_func done, void *userdata);
+TKVDB_RES tkvdb_async_put(tkvdb_async *a, const tkvdb_datum *key,
+	const tkvdb_datum *val);
+TKVDB_RES tkvdb_async_get(tkvdb_async *a, const tkvdb_datum *key,
+	tkvdb_datum *val);
+/* hand off current buffer to writer (waits for previous commit) */
+TKVDB_RES tkvdb_async_commit(tkvdb_async *a);
+/* wait for background commit, returns its result */
+TKVDB_RES tkvdb_async_wait(tkvdb_async *a);
+/* commit rest of pairs, wait and free */
+TKVDB_RES tkvdb_async_close(tkvdb_async *a);
 
 /* triggers */
 tkvdb_triggers *tkvdb_triggers_create(size_t stack_limit);
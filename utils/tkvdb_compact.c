@@ -0,0 +1,377 @@
+/*
+ * tkvdb-compact
+ *
+ * Copyright (c) 2019, Vladimir Misyurov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "tkvdb.h"
+
+/* min transaction buffer size */
+#define MIN_TR_SIZE 100000
+
+/* transaction size, 100M by default */
+#define DEF_TR_SIZE (100 * 1024 * 1024)
+static size_t trsize = DEF_TR_SIZE;
+
+static uint64_t
+file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		return 0;
+	}
+	return st.st_size;
+}
+
+static void
+print_usage(char *progname)
+{
+	fprintf(stderr,
+		"Usage:\n %s [-o out_file] [-s size] db.tkvdb\n",
+		progname);
+	fprintf(stderr, " %s -h\n", progname);
+	fprintf(stderr, "    out_file - name of output file "\
+		"(default to replace db.tkvdb)\n");
+	fprintf(stderr, "    size - size of transaction buffer in bytes "\
+		"(default %lu, min %d)\n",
+		(unsigned long int)DEF_TR_SIZE, MIN_TR_SIZE);
+	fprintf(stderr, "    -h - print this message\n");
+	fprintf(stderr, "Only keys and values are copied, metadata of keys "\
+		"and older snapshots\nare not preserved. Compression and "\
+		"checksums are kept as in db.tkvdb\n");
+}
+
+/* make rename() durable */
+static int
+sync_dir(const char *path)
+{
+#ifndef _WIN32
+	char *dir, *slash;
+	int fd, ret = 0;
+
+	dir = strdup(path);
+	if (!dir) {
+		return -1;
+	}
+	slash = strrchr(dir, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+
+	fd = open(dir, O_RDONLY);
+	if ((fd < 0) || (fsync(fd) != 0)) {
+		ret = -1;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(dir);
+
+	return ret;
+#else
+	(void)path;
+	return 0;
+#endif
+}
+
+/* copy all pairs from cursor to loader */
+static TKVDB_RES
+copy_pairs(tkvdb_tr *tr, tkvdb_cursor *c, tkvdb_loader *ldr,
+	uint64_t *npairs)
+{
+	TKVDB_RES rc;
+	tkvdb_datum dtk, dtv;
+	uint8_t *last_key = NULL;
+	size_t last_key_size = 0;
+
+	dtk.size = 0;
+	dtk.data = NULL;
+
+	rc = c->first(c);
+	for (;;) {
+		while (rc == TKVDB_OK) {
+			dtk.data = c->key(c);
+			dtk.size = c->keysize(c);
+			dtv.data = c->val(c);
+			dtv.size = c->valsize(c);
+
+			rc = tkvdb_loader_add(ldr, &dtk, &dtv);
+			if (rc != TKVDB_OK) {
+				fprintf(stderr, "tkvdb_loader_add() failed "\
+					"with code %d\n", rc);
+				goto done;
+			}
+			(*npairs)++;
+
+			/* save last key */
+			if (last_key_size < dtk.size) {
+				uint8_t *tmp;
+
+				tmp = realloc(last_key, dtk.size);
+				if (!tmp) {
+					fprintf(stderr, "realloc() failed\n");
+					rc = TKVDB_ENOMEM;
+					goto done;
+				}
+				last_key = tmp;
+				last_key_size = dtk.size;
+			}
+			memcpy(last_key, dtk.data, dtk.size);
+			dtk.data = last_key;
+
+			rc = c->next(c);
+		}
+
+		if (rc == TKVDB_ENOMEM) {
+			/* transaction buffer overflow, nodes loaded from
+			   disk are dropped and we continue from last key */
+			tr->rollback(tr);
+			tr->begin(tr);
+
+			rc = c->seek(c, &dtk, TKVDB_SEEK_EQ);
+			if (rc != TKVDB_OK) {
+				fprintf(stderr,
+					"seek() failed with code %d\n", rc);
+				goto done;
+			}
+
+			rc = c->next(c);
+		} else if ((rc == TKVDB_NOT_FOUND) || (rc == TKVDB_EMPTY)) {
+			/* end of data or empty database */
+			rc = TKVDB_OK;
+			break;
+		} else {
+			fprintf(stderr, "Error occured during reading,"\
+				" code %d\n", rc);
+			goto done;
+		}
+	}
+
+done:
+	free(last_key);
+	return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+	tkvdb *db, *outdb;
+	tkvdb_tr *tr;
+	TKVDB_RES rc;
+	tkvdb_params *params;
+	int compress, checksum;
+	tkvdb_cursor *c;
+	tkvdb_loader *ldr;
+
+	int opt;
+	char *outfile = NULL, *tmpfile = NULL;
+	char *db_file;
+	int ret = EXIT_FAILURE;
+
+	struct timespec ts_before, ts_after;
+	double sec;
+	uint64_t insize, outsize, npairs = 0;
+
+	while ((opt = getopt(argc, argv, "ho:s:")) != -1) {
+		switch (opt) {
+			case 'o':
+				outfile = optarg;
+				break;
+			case 's':
+				trsize = atoll(optarg);
+				break;
+
+			case 'h':
+			default:
+				print_usage(argv[0]);
+				return EXIT_SUCCESS;
+		}
+	}
+
+	if (trsize < MIN_TR_SIZE) {
+		print_usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	if ((argc - optind) != 1) {
+		/* only one non-option argument */
+		print_usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	db_file = argv[optind];
+
+	/* write to temporary file near the target, rename() is atomic
+	   only inside of one filesystem */
+	if (!outfile) {
+		outfile = db_file;
+	}
+	tmpfile = malloc(strlen(outfile) + sizeof(".compact"));
+	if (!tmpfile) {
+		fprintf(stderr, "malloc() failed\n");
+		goto fail_tmpname;
+	}
+	sprintf(tmpfile, "%s.compact", outfile);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_before);
+	insize = file_size(db_file);
+
+	/* init database parameters */
+	params = tkvdb_params_create();
+	if (!params) {
+		fprintf(stderr, "Can't create database parameters\n");
+		goto fail_params;
+	}
+
+	/* no dynamic reallocation of transaction buffer */
+	tkvdb_param_set(params, TKVDB_PARAM_TR_DYNALLOC, 0);
+	/* buffer size */
+	tkvdb_param_set(params, TKVDB_PARAM_TR_LIMIT, trsize);
+	/* open source read-only */
+#ifndef _WIN32
+	tkvdb_param_set(params, TKVDB_PARAM_DBFILE_OPEN_FLAGS, O_RDONLY);
+#else
+	tkvdb_param_set(params, TKVDB_PARAM_DBFILE_OPEN_FLAGS,
+		O_RDONLY | O_BINARY);
+#endif
+
+	db = tkvdb_open(db_file, params);
+	if (!db) {
+		int err = errno;
+		fprintf(stderr, "Can't open db file '%s': %s\n",
+			db_file, err ? strerror(err): "corrupted database");
+		tkvdb_params_free(params);
+		goto fail_dbopen;
+	}
+
+	/* the same format as source */
+	tkvdb_format_info(db, &compress, &checksum);
+	tkvdb_param_set(params, TKVDB_PARAM_COMPRESS, compress);
+	tkvdb_param_set(params, TKVDB_PARAM_CHECKSUM, checksum);
+
+	/* output file is always created from scratch */
+#ifndef _WIN32
+	tkvdb_param_set(params, TKVDB_PARAM_DBFILE_OPEN_FLAGS,
+		O_RDWR | O_CREAT | O_TRUNC);
+#else
+	tkvdb_param_set(params, TKVDB_PARAM_DBFILE_OPEN_FLAGS,
+		O_RDWR | O_CREAT | O_TRUNC | O_BINARY);
+#endif
+	outdb = tkvdb_open(tmpfile, params);
+	tkvdb_params_free(params);
+	if (!outdb) {
+		fprintf(stderr, "Can't open output file '%s': %s\n",
+			tmpfile, strerror(errno));
+		goto fail_outdbopen;
+	}
+
+	tr = tkvdb_tr_create(db, NULL);
+	if (!tr) {
+		fprintf(stderr, "Can't create transaction\n");
+		goto fail_tr;
+	}
+	tr->begin(tr);
+
+	c = tkvdb_cursor_create(tr);
+	if (!c) {
+		fprintf(stderr, "Can't create cursor\n");
+		goto fail_cursor;
+	}
+
+	ldr = tkvdb_loader_create(outdb);
+	if (!ldr) {
+		fprintf(stderr, "Can't create loader\n");
+		goto fail_loader;
+	}
+
+	/* cursor returns keys in sorted order, so tree may be written
+	   bottom-up without transaction buffer */
+	if (copy_pairs(tr, c, ldr, &npairs) != TKVDB_OK) {
+		goto fail_copy;
+	}
+
+	rc = tkvdb_loader_finish(ldr);
+	if ((rc != TKVDB_OK) && (rc != TKVDB_EMPTY)) {
+		fprintf(stderr, "tkvdb_loader_finish() failed with code %d\n",
+			rc);
+		goto fail_copy;
+	}
+
+	rc = tkvdb_sync(outdb);
+	if (rc != TKVDB_OK) {
+		fprintf(stderr, "tkvdb_sync() failed with code %d\n", rc);
+		goto fail_copy;
+	}
+
+	ret = EXIT_SUCCESS;
+
+fail_copy:
+	tkvdb_loader_free(ldr);
+fail_loader:
+	c->free(c);
+fail_cursor:
+	tr->free(tr);
+fail_tr:
+	tkvdb_close(outdb);
+fail_outdbopen:
+	tkvdb_close(db);
+fail_dbopen:
+	if (ret == EXIT_SUCCESS) {
+		outsize = file_size(tmpfile);
+		if (rename(tmpfile, outfile) != 0) {
+			fprintf(stderr, "Can't rename '%s' to '%s': %s\n",
+				tmpfile, outfile, strerror(errno));
+			ret = EXIT_FAILURE;
+		} else if (sync_dir(outfile) != 0) {
+			/* file is renamed, but rename may be lost on crash */
+			fprintf(stderr, "Can't sync directory of '%s': %s\n",
+				outfile, strerror(errno));
+			ret = EXIT_FAILURE;
+			goto fail_params;
+		}
+	}
+	if (ret != EXIT_SUCCESS) {
+		unlink(tmpfile);
+		goto fail_params;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_after);
+	sec = (ts_after.tv_sec - ts_before.tv_sec)
+		+ (ts_after.tv_nsec - ts_before.tv_nsec) / 1e9;
+
+	fprintf(stderr, "%" PRIu64 " pairs, %" PRIu64 " -> %" PRIu64
+		" bytes, %.2f sec, %.2f MB/s\n", npairs, insize, outsize,
+		sec, (sec > 0) ? (insize / sec / (1024.0 * 1024.0)) : 0.0);
+
+fail_params:
+	free(tmpfile);
+fail_tmpname:
+	return ret;
+}
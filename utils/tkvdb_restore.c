@@ -178,7 +178,7 @@ again:
 }
 
 static int
-add_pair(struct input *in, tkvdb_tr *tr)
+add_pair(struct input *in, tkvdb_tr *tr, tkvdb_loader *ldr)
 {
 	enum TOKEN token;
 	uint8_t *key, *val;
@@ -224,6 +224,20 @@ add_pair(struct input *in, tkvdb_tr *tr)
 	dtv.data = val;
 	dtv.size = valsize;
 
+	if (ldr) {
+		rc = tkvdb_loader_add(ldr, &dtk, &dtv);
+		if (rc == TKVDB_CORRUPTED) {
+			fprintf(stderr, "Key is not in ascending order "\
+				"at line %lu\n", (unsigned long int)in->line);
+			return 0;
+		} else if (rc != TKVDB_OK) {
+			fprintf(stderr, "tkvdb_loader_add() failed with "\
+				"code %d\n", rc);
+			return 0;
+		}
+		goto done;
+	}
+
 	rc = tr->put(tr, &dtk, &dtv);
 	if (rc == TKVDB_ENOMEM) {
 		rc = tr->commit(tr);
@@ -242,6 +256,7 @@ add_pair(struct input *in, tkvdb_tr *tr)
 		return 0;
 	}
 
+done:
 	in->error = 0;
 	/* reset input token */
 	in->toksize = 0;
@@ -253,7 +268,7 @@ static void
 print_usage(char *progname)
 {
 	fprintf(stderr,
-		"Usage:\n %s [-i in_file] [-s size] db.tkvdb\n",
+		"Usage:\n %s [-i in_file] [-s size] [-b] db.tkvdb\n",
 		progname);
 	fprintf(stderr, " %s -h\n", progname);
 	fprintf(stderr, "    in_file - name of input dump file "\
@@ -261,6 +276,8 @@ print_usage(char *progname)
 	fprintf(stderr, "    size - size of transaction buffer in bytes "\
 		"(default %lu, min %d)\n",
 		(unsigned long int)DEF_TR_SIZE, MIN_TR_SIZE);
+	fprintf(stderr, "    -b - bulk load of sorted dump, replaces "\
+		"contents of database\n");
 	fprintf(stderr, "    -h - print this message\n");
 }
 
@@ -269,9 +286,10 @@ main(int argc, char *argv[])
 {
 	tkvdb *db;
 	tkvdb_tr *tr;
+	tkvdb_loader *ldr = NULL;
 	tkvdb_params *params;
 
-	int opt;
+	int opt, bulk = 0;
 	char *infile = NULL;
 	char *db_file;
 	int ret = EXIT_FAILURE;
@@ -284,7 +302,7 @@ main(int argc, char *argv[])
 	in.toksize = in.tokallocated = 0;
 	in.error = 0;
 
-	while ((opt = getopt(argc, argv, "hi:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "hbi:s:")) != -1) {
 		switch (opt) {
 			case 'i':
 				infile = optarg;
@@ -292,6 +310,9 @@ main(int argc, char *argv[])
 			case 's':
 				trsize = atoll(optarg);
 				break;
+			case 'b':
+				bulk = 1;
+				break;
 
 			case 'h':
 			default:
@@ -357,14 +378,38 @@ main(int argc, char *argv[])
 		goto fail_tr;
 	}
 
-	tr->begin(tr);
+	if (bulk) {
+		/* dump is sorted, so tree can be written directly to file */
+		ldr = tkvdb_loader_create(db);
+		if (!ldr) {
+			fprintf(stderr, "Can't create bulk loader\n");
+			goto fail_loader;
+		}
+	} else {
+		tr->begin(tr);
+	}
 
-	while (add_pair(&in, tr)) {};
+	while (add_pair(&in, tr, ldr)) {};
 
-	tr->commit(tr);
+	if (ldr) {
+		TKVDB_RES rc = tkvdb_loader_finish(ldr);
+
+		if ((rc != TKVDB_OK) && (rc != TKVDB_EMPTY)) {
+			fprintf(stderr, "tkvdb_loader_finish() failed with "\
+				"code %d\n", rc);
+			goto fail_finish;
+		}
+	} else {
+		tr->commit(tr);
+	}
 
 	ret = EXIT_SUCCESS;
 
+fail_finish:
+	if (ldr) {
+		tkvdb_loader_free(ldr);
+	}
+fail_loader:
 	free(in.strtoken);
 	tr->free(tr);
 fail_tr: